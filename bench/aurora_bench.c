@@ -0,0 +1,798 @@
+/**
+ * file:        aurora_bench.c
+ * description: Aurora load-test driver, calling pam_sm_authenticate from
+ *              concurrent sessions and reading the codes back from the fake
+ *              SMTP server mailboxes
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+
+/* The largest amount of module data per session */
+#define AURORA_BENCH_DATA_MAX 16
+
+/* The mailbox polling period (microseconds) */
+#define AURORA_BENCH_POLL 200
+
+/* The soak test: the logins done before the memory is measured, the memory
+   growth allowed after it (percent), and the progress period (seconds) */
+#define AURORA_BENCH_SOAK_WARMUP 10
+#define AURORA_BENCH_SOAK_GROWTH 10
+#define AURORA_BENCH_SOAK_PERIOD 10
+
+
+/**
+ * A module data entry (pam_set_data)
+ **/
+struct aurora_bench_data
+{
+    const char *name;
+    void *data;
+    void (*cleanup)(pam_handle_t *, void *, int);
+};
+
+
+/**
+ * The PAM handle seen by the module
+ **/
+struct pam_handle
+{
+    /* The PAM items */
+    const char *service;
+    const char *user;
+    const char *rhost;
+    const char *tty;
+    struct pam_conv conv;
+
+    /* The module data */
+    struct aurora_bench_data data[AURORA_BENCH_DATA_MAX];
+    int data_count;
+};
+
+
+/**
+ * The scripted conversation state
+ **/
+struct aurora_bench_conv
+{
+    /* The mailbox to read the code from */
+    char mailbox[4096];
+
+    /* The code wait timeout (milliseconds) */
+    int timeout;
+
+    /* The wrong codes to answer first, and the prompts of the login */
+    int wrong;
+    int prompts;
+
+    /* Print the module messages */
+    int verbose;
+};
+
+
+/**
+ * A login measure
+ **/
+struct aurora_bench_result
+{
+    /* The login latency (microseconds) */
+    uint32_t latency;
+
+    /* The PAM return code */
+    int32_t status;
+};
+
+
+/**
+ * The load test settings, shared by the sessions
+ **/
+struct aurora_bench_run
+{
+    /* The module entry point and arguments */
+    int (*authenticate)(pam_handle_t *, int, int, const char **);
+    const char **module_argv;
+    int module_argc;
+
+    /* The logins */
+    const char *maildir;
+    int sessions;
+    int logins;
+    int users;
+    int rhosts;
+    int timeout;
+    int wrong;
+    int verbose;
+
+    /* The results, by login, and the logins done */
+    struct aurora_bench_result *results;
+    int completed;
+};
+
+
+/**
+ * A session, run in its own process or thread
+ **/
+struct aurora_bench_session
+{
+    struct aurora_bench_run *run;
+    int session;
+    pthread_t thread;
+};
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in microseconds
+ */
+static uint64_t
+aurora_bench_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/**
+ * PAM item accessor, for the module
+ * @see man 3 pam_get_item
+ */
+int
+pam_get_item(const pam_handle_t *pam_handle, int item_type, const void **item)
+{
+    switch(item_type)
+    {
+        case PAM_SERVICE: *item = pam_handle->service; break;
+        case PAM_USER: *item = pam_handle->user; break;
+        case PAM_RHOST: *item = pam_handle->rhost; break;
+        case PAM_TTY: *item = pam_handle->tty; break;
+        case PAM_CONV: *item = &pam_handle->conv; break;
+        default: *item = NULL; return PAM_SYSTEM_ERR;
+    }
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM item setter, for the module
+ * @see man 3 pam_set_item
+ */
+int
+pam_set_item(pam_handle_t *pam_handle, int item_type, const void *item)
+{
+    switch(item_type)
+    {
+        case PAM_USER: pam_handle->user = item; break;
+        case PAM_RHOST: pam_handle->rhost = item; break;
+        case PAM_TTY: pam_handle->tty = item; break;
+        default: return PAM_SYSTEM_ERR;
+    }
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM user accessor, for the module (the user is always set)
+ * @see man 3 pam_get_user
+ */
+int
+pam_get_user(pam_handle_t *pam_handle, const char **user, const char *prompt)
+{
+    *user = pam_handle->user;
+
+    return *user != NULL? PAM_SUCCESS: PAM_USER_UNKNOWN;
+}
+
+
+/**
+ * PAM module data setter, for the module
+ * @see man 3 pam_set_data
+ */
+int
+pam_set_data(pam_handle_t *pam_handle, const char *name, void *data,
+void (*cleanup)(pam_handle_t *, void *, int))
+{
+    /* The data index */
+    int i;
+
+    for(i = 0; i < pam_handle->data_count; i++)
+    {
+        if(strcmp(pam_handle->data[i].name, name) != 0)
+            continue;
+
+        /* Replace the data */
+        if(pam_handle->data[i].cleanup != NULL)
+            pam_handle->data[i].cleanup(pam_handle, pam_handle->data[i].data,
+                0);
+
+        pam_handle->data[i].data = data;
+        pam_handle->data[i].cleanup = cleanup;
+        return PAM_SUCCESS;
+    }
+
+    if(pam_handle->data_count == AURORA_BENCH_DATA_MAX)
+        return PAM_BUF_ERR;
+
+    pam_handle->data[i].name = name;
+    pam_handle->data[i].data = data;
+    pam_handle->data[i].cleanup = cleanup;
+    pam_handle->data_count++;
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM module data accessor, for the module
+ * @see man 3 pam_get_data
+ */
+int
+pam_get_data(const pam_handle_t *pam_handle, const char *name,
+const void **data)
+{
+    /* The data index */
+    int i;
+
+    for(i = 0; i < pam_handle->data_count; i++)
+    {
+        if(strcmp(pam_handle->data[i].name, name) == 0)
+        {
+            *data = pam_handle->data[i].data;
+            return PAM_SUCCESS;
+        }
+    }
+
+    return PAM_NO_MODULE_DATA;
+}
+
+
+/**
+ * This function ends a PAM transaction, as pam_end does
+ * @param pam_handle The PAM handle
+ * @param pam_status The transaction status
+ */
+static void
+aurora_bench_end(pam_handle_t *pam_handle, int pam_status)
+{
+    /* The data index */
+    int i;
+
+    for(i = 0; i < pam_handle->data_count; i++)
+        if(pam_handle->data[i].cleanup != NULL)
+            pam_handle->data[i].cleanup(pam_handle, pam_handle->data[i].data,
+                pam_status);
+
+    pam_handle->data_count = 0;
+}
+
+
+/**
+ * This function waits for the code email and extracts the code
+ * @param conv The conversation state
+ * @return The code (to free), NULL on timeout
+ */
+static char *
+aurora_bench_read_code(const struct aurora_bench_conv *conv)
+{
+    /* The mailbox */
+    FILE *mailbox;
+    char line[1024];
+    char *code;
+    size_t code_length;
+
+    /* The deadline */
+    uint64_t deadline = aurora_bench_now() + (uint64_t) conv->timeout * 1000;
+
+    do
+    {
+        /* The fake server publishes each email atomically */
+        if((mailbox = fopen(conv->mailbox, "r")) != NULL)
+        {
+            while(fgets(line, sizeof(line), mailbox) != NULL)
+            {
+                if((code = strstr(line, "code is ")) == NULL)
+                    continue;
+
+                code += 8;
+                code_length = strcspn(code, ". \r\n");
+                fclose(mailbox);
+
+                return strndup(code, code_length);
+            }
+
+            fclose(mailbox);
+        }
+
+        usleep(AURORA_BENCH_POLL);
+    }
+    while(aurora_bench_now() < deadline);
+
+    return NULL;
+}
+
+
+/**
+ * The scripted conversation: prompts are answered with the emailed code
+ * @see man 3 pam_conv
+ */
+static int
+aurora_bench_converse(int count, const struct pam_message **messages,
+struct pam_response **responses, void *conv_ptr)
+{
+    /* The conversation state */
+    struct aurora_bench_conv *conv = conv_ptr;
+    int i;
+
+    if((*responses = calloc((size_t) count, sizeof(**responses))) == NULL)
+        return PAM_BUF_ERR;
+
+    for(i = 0; i < count; i++)
+    {
+        switch(messages[i]->msg_style)
+        {
+            case PAM_PROMPT_ECHO_ON:
+            case PAM_PROMPT_ECHO_OFF:
+                /* Answer with a wrong code, to exercise the retries */
+                if(conv->prompts++ < conv->wrong)
+                {
+                    (*responses)[i].resp = strdup("wrong");
+                    break;
+                }
+
+                /* Answer with the received code */
+                if(((*responses)[i].resp = aurora_bench_read_code(conv))
+                    == NULL && conv->verbose)
+                    fprintf(stderr, "aurora-bench: no code in %s\n",
+                        conv->mailbox);
+                break;
+
+            default:
+                if(conv->verbose)
+                    fprintf(stderr, "aurora-bench: %s\n", messages[i]->msg);
+                break;
+        }
+    }
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * This function compares two latencies (qsort)
+ */
+static int
+aurora_bench_compare(const void *first, const void *second)
+{
+    uint32_t a = *(const uint32_t *) first;
+    uint32_t b = *(const uint32_t *) second;
+
+    return a < b? -1: a > b;
+}
+
+
+/**
+ * This function measures the resident memory of the process
+ * @return The resident memory (kB), 0 when unknown
+ */
+static long
+aurora_bench_rss(void)
+{
+    /* The memory status */
+    FILE *statm;
+    long pages = 0;
+
+    if((statm = fopen("/proc/self/statm", "r")) == NULL)
+        return 0;
+
+    if(fscanf(statm, "%*s %ld", &pages) != 1)
+        pages = 0;
+
+    fclose(statm);
+
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/**
+ * This function counts the open descriptors of the process
+ * @return The descriptors count, -1 when unknown
+ */
+static int
+aurora_bench_fds(void)
+{
+    /* The descriptors directory */
+    DIR *fds;
+    struct dirent *entry;
+    int count = 0;
+
+    if((fds = opendir("/proc/self/fd")) == NULL)
+        return -1;
+
+    while((entry = readdir(fds)) != NULL)
+        if(entry->d_name[0] != '.')
+            count++;
+
+    closedir(fds);
+
+    /* Without the directory itself */
+    return count - 1;
+}
+
+
+/**
+ * This function runs the logins of a session
+ * @param session_ptr The session
+ * @return NULL
+ */
+static void *
+aurora_bench_session(void *session_ptr)
+{
+    /* The session */
+    const struct aurora_bench_session *session = session_ptr;
+    struct aurora_bench_run *run = session->run;
+    struct aurora_bench_result *result;
+
+    /* The session state */
+    struct pam_handle pam_handle;
+    struct aurora_bench_conv conv;
+    char user[64];
+    char rhost[64];
+    int login;
+    int index;
+
+    memset(&pam_handle, 0, sizeof(pam_handle));
+    memset(&conv, 0, sizeof(conv));
+    pam_handle.service = "aurora-bench";
+    pam_handle.conv.conv = aurora_bench_converse;
+    pam_handle.conv.appdata_ptr = &conv;
+    conv.timeout = run->timeout;
+    conv.wrong = run->wrong;
+    conv.verbose = run->verbose;
+
+    for(login = 0; login < run->logins; login++)
+    {
+        /* Spread the sessions over the directory (when the users are a
+           multiple of the sessions, no two sessions share a user) */
+        index = session->session * run->logins + login;
+        result = &run->results[index];
+        snprintf(user, sizeof(user), "bench%d", (int) (((long) login
+            * run->sessions + session->session) % run->users));
+        snprintf(conv.mailbox, sizeof(conv.mailbox), "%s/%s@bench.invalid",
+            run->maildir, user);
+        conv.prompts = 0;
+        pam_handle.user = user;
+
+        if(run->rhosts > 0)
+        {
+            snprintf(rhost, sizeof(rhost), "192.0.2.%d",
+                index % run->rhosts + 1);
+            pam_handle.rhost = rhost;
+        }
+
+        /* Authenticate */
+        result->latency = (uint32_t) aurora_bench_now();
+        result->status = run->authenticate(&pam_handle, 0, run->module_argc,
+            run->module_argv);
+        result->latency = (uint32_t) aurora_bench_now() - result->latency;
+
+        aurora_bench_end(&pam_handle, result->status);
+
+        /* The code is used, but a code left pending by a failed login is
+           asked again (without a new email) */
+        if(result->status == PAM_SUCCESS)
+            unlink(conv.mailbox);
+
+        __atomic_add_fetch(&run->completed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_bench_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s -c config -D directory -M maildir "
+        "[-m module] [-s sessions]\n"
+        "       [-n logins] [-u users] [-r rhosts] [-w ms] [-a arg] [-t] "
+        "[-S] [-v]\n"
+        "Drive pam_sm_authenticate from concurrent sessions\n"
+        "  -m module     The module to load (default: "
+        "bin/pam_aurora_email.so)\n"
+        "  -c config     The module configuration (config= argument)\n"
+        "  -D directory  The user directory (directory= argument)\n"
+        "  -M maildir    The fake SMTP server mailboxes\n"
+        "  -s sessions   The concurrent sessions (default: 8)\n"
+        "  -n logins     The logins per session (default: 100)\n"
+        "  -u users      The directory users, bench0 to benchN-1 "
+        "(default: 1000)\n"
+        "  -r rhosts     The remote hosts to log in from (default: 0, none)\n"
+        "  -w ms         The time to wait for each code (default: 5000)\n"
+        "  -e wrong      The wrong codes entered before each code "
+        "(default: 0)\n"
+        "  -a arg        An extra module argument (repeatable)\n"
+        "  -t            Run the sessions as threads of one process, as a "
+        "multithreaded\n"
+        "                authentication server does (default: a process "
+        "each)\n"
+        "  -S            Soak test: run the sessions as threads and fail "
+        "when the\n"
+        "                memory or the descriptors of the process grow\n"
+        "  -v            Print the module messages\n", program);
+}
+
+
+/**
+ * The load-test driver entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *module_path = "bin/pam_aurora_email.so";
+    const char *config_path = NULL;
+    const char *directory_path = NULL;
+    int sessions = 8;
+    int threads = 0;
+    int soak = 0;
+    int opt;
+
+    /* The module */
+    void *module;
+    const char *module_argv[32];
+    char config_arg[4096];
+    char directory_arg[4096];
+
+    /* The sessions */
+    struct aurora_bench_run run = {
+        NULL, module_argv, 2, NULL, 0, 100, 1000, 0, 5000, 0, 0, NULL, 0
+    };
+    struct aurora_bench_session *session_list;
+    uint64_t start;
+    int session;
+    int index;
+    pid_t pid;
+
+    /* The soak measures */
+    long rss_warm = 0;
+    long rss_end = 0;
+    long rss_max = 0;
+    int fds_start;
+    int fds_end;
+    int completed;
+    int reported = 0;
+    int grew = 0;
+
+    /* The results */
+    size_t results_size;
+    uint32_t *latencies;
+    int total;
+    int succeeded = 0;
+    uint64_t elapsed;
+    uint64_t latency_sum = 0;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "m:c:D:M:s:n:u:r:w:e:a:tSvh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm': module_path = optarg; break;
+            case 'c': config_path = optarg; break;
+            case 'D': directory_path = optarg; break;
+            case 'M': run.maildir = optarg; break;
+            case 's': sessions = atoi(optarg); break;
+            case 'n': run.logins = atoi(optarg); break;
+            case 'u': run.users = atoi(optarg); break;
+            case 'r': run.rhosts = atoi(optarg); break;
+            case 'w': run.timeout = atoi(optarg); break;
+            case 'e': run.wrong = atoi(optarg); break;
+            case 't': threads = 1; break;
+            case 'S': threads = soak = 1; break;
+            case 'v': run.verbose = 1; break;
+
+            case 'a':
+                if(run.module_argc < 32)
+                    module_argv[run.module_argc++] = optarg;
+                break;
+
+            default:
+                aurora_bench_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(config_path == NULL || directory_path == NULL || run.maildir == NULL
+        || sessions <= 0 || run.logins <= 0 || run.users <= 0)
+    {
+        aurora_bench_usage(argv[0]);
+        return 1;
+    }
+
+    run.sessions = sessions;
+
+    /* Load the module */
+    if((module = dlopen(module_path, RTLD_NOW)) == NULL
+        || (run.authenticate = (int (*)(pam_handle_t *, int, int,
+        const char **)) dlsym(module, "pam_sm_authenticate")) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+        return 1;
+    }
+
+    snprintf(config_arg, sizeof(config_arg), "config=%s", config_path);
+    snprintf(directory_arg, sizeof(directory_arg), "directory=%s",
+        directory_path);
+    module_argv[0] = config_arg;
+    module_argv[1] = directory_arg;
+
+    /* Share the results with the sessions */
+    total = sessions * run.logins;
+    results_size = (size_t) total * sizeof(*run.results);
+    run.results = mmap(NULL, results_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(run.results == MAP_FAILED
+        || (session_list = calloc((size_t) sessions, sizeof(*session_list)))
+            == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    /* Touch the results, so that they do not look like a leak */
+    memset(run.results, 0, results_size);
+    fds_start = aurora_bench_fds();
+
+    /* Run each session in its own process, as sshd does, or in its own
+       thread */
+    start = aurora_bench_now();
+
+    for(session = 0; session < sessions; session++)
+    {
+        session_list[session].run = &run;
+        session_list[session].session = session;
+
+        if(threads)
+        {
+            if((errno = pthread_create(&session_list[session].thread, NULL,
+                aurora_bench_session, &session_list[session])) != 0)
+            {
+                fprintf(stderr, "%s: pthread_create: %s\n", argv[0],
+                    strerror(errno));
+                return 1;
+            }
+
+            continue;
+        }
+
+        if((pid = fork()) < 0)
+        {
+            fprintf(stderr, "%s: fork: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+
+        if(pid > 0)
+            continue;
+
+        aurora_bench_session(&session_list[session]);
+        _exit(0);
+    }
+
+    /* Measure the memory once warm, then watch it */
+    while(soak && (completed = __atomic_load_n(&run.completed,
+        __ATOMIC_RELAXED)) < total)
+    {
+        sleep(1);
+
+        if(rss_warm == 0 && completed >= total / 100
+            * AURORA_BENCH_SOAK_WARMUP)
+            rss_warm = aurora_bench_rss();
+
+        if((rss_end = aurora_bench_rss()) > rss_max)
+            rss_max = rss_end;
+
+        if(++reported % AURORA_BENCH_SOAK_PERIOD == 0)
+            fprintf(stderr, "soak: %d logins, rss %ld kB, %d fds\n",
+                completed, rss_end, aurora_bench_fds());
+    }
+
+    for(session = 0; threads && session < sessions; session++)
+        pthread_join(session_list[session].thread, NULL);
+
+    while(wait(NULL) > 0);
+    elapsed = aurora_bench_now() - start;
+
+    /* Gather the successful logins latencies */
+    if((latencies = malloc((size_t) total * sizeof(*latencies))) == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    for(index = 0; index < total; index++)
+    {
+        if(run.results[index].status != PAM_SUCCESS)
+            continue;
+
+        latency_sum += run.results[index].latency;
+        latencies[succeeded++] = run.results[index].latency;
+    }
+
+    qsort(latencies, (size_t) succeeded, sizeof(*latencies),
+        aurora_bench_compare);
+
+    /* Print the report */
+    printf("sessions:    %d%s\n", sessions, threads? " (threads)": "");
+    printf("logins:      %d (%d failed)\n", total, total - succeeded);
+    printf("elapsed:     %.3f s\n", elapsed / 1e6);
+    printf("throughput:  %.1f logins/s\n", succeeded * 1e6 / elapsed);
+
+    if(succeeded > 0)
+    {
+        printf("latency avg: %.3f ms\n", latency_sum / 1e3 / succeeded);
+        printf("latency p50: %.3f ms\n",
+            latencies[(size_t) (succeeded - 1) * 50 / 100] / 1e3);
+        printf("latency p99: %.3f ms\n",
+            latencies[(size_t) (succeeded - 1) * 99 / 100] / 1e3);
+        printf("latency p999: %.3f ms\n",
+            latencies[(size_t) (succeeded - 1) * 999 / 1000] / 1e3);
+        printf("latency max: %.3f ms\n", latencies[succeeded - 1] / 1e3);
+    }
+
+    /* Check that the process did not grow (a short run may end warm) */
+    if(soak)
+    {
+        fds_end = aurora_bench_fds();
+        rss_end = aurora_bench_rss();
+
+        if(rss_warm == 0)
+            rss_warm = rss_end;
+
+        printf("rss warm:    %ld kB\n", rss_warm);
+        printf("rss end:     %ld kB (max %ld kB)\n", rss_end,
+            rss_end > rss_max? rss_end: rss_max);
+        printf("fds:         %d -> %d\n", fds_start, fds_end);
+
+        if(fds_end > fds_start || rss_end > rss_warm
+            + rss_warm * AURORA_BENCH_SOAK_GROWTH / 100)
+        {
+            fprintf(stderr, "%s: the process grew during the soak test\n",
+                argv[0]);
+            grew = 1;
+        }
+    }
+
+    /* Free memory */
+    free(latencies);
+    free(session_list);
+    munmap(run.results, results_size);
+    dlclose(module);
+
+    return grew? 3: succeeded == total? 0: 2;
+}
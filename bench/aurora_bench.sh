@@ -0,0 +1,191 @@
+#!/bin/sh
+# file:        aurora_bench.sh
+# description: Aurora load test, run by "make bench"
+# authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+#
+# The settings come from the environment:
+#   BENCH_SESSIONS  The concurrent sessions (default: 8)
+#   BENCH_LOGINS    The logins per session (default: 100)
+#   BENCH_USERS     The directory users (default: 1000)
+#   BENCH_LATENCY   The fake server delay before each reply, in ms (default: 0)
+#   BENCH_FAILURES  The emails refused by the fake server, in % (default: 0)
+#   BENCH_TLS       Use STARTTLS with a self-signed certificate, and report
+#                   the handshake times (default: 1, "mail_tls_cache = 0;"
+#                   in BENCH_CONFIG disables the session resumption)
+#   BENCH_HOST      The fake server host name in the mail server URLs
+#                   (default: 127.0.0.1, "localhost" goes through the
+#                   addresses cache)
+#   BENCH_PORT      The fake server port (default: 2525)
+#   BENCH_CONNECTIONS
+#                   The concurrent sessions each fake server serves, the
+#                   next ones are refused with a 421, as an overloaded relay
+#                   does (default: 0 for no limit)
+#   BENCH_RELAYS    The fake servers, on the ports following BENCH_PORT
+#                   (default: 1)
+#   BENCH_RELAY_LATENCY
+#                   The delay of the servers after the first one, in ms
+#                   (default: BENCH_LATENCY)
+#   BENCH_DELIVERY  The delivery mode: "smtp", "spool" through an
+#                   aurora-flusher, "local" to a fake server on a unix socket
+#                   (LMTP, or SMTP with "local_protocol = \"smtp\";" in
+#                   BENCH_CONFIG), or "sendmail" to a stand-in sendmail
+#                   command (default: smtp)
+#   BENCH_THREADS   Run the sessions as threads of one aurora-bench process
+#                   rather than a process each (default: 0)
+#   BENCH_SOAK      Soak test: run the sessions as threads, and fail when
+#                   the memory or the descriptors of the process grow
+#                   (default: 0, "make soak" runs 10^6 logins)
+#   BENCH_MODULE    The module to load (default: bin/pam_aurora_email.so)
+#   BENCH_DRIVER    The aurora-bench binary (default: bin/aurora-bench), the
+#                   module and the driver are built with ThreadSanitizer by
+#                   "make stress"
+#   BENCH_CONFIG    Extra email.conf settings, appended to the generated file
+#   BENCH_ARGS      Extra aurora-bench arguments
+
+set -e
+
+BIN=${BIN:-bin}
+SESSIONS=${BENCH_SESSIONS:-8}
+LOGINS=${BENCH_LOGINS:-100}
+USERS=${BENCH_USERS:-1000}
+LATENCY=${BENCH_LATENCY:-0}
+FAILURES=${BENCH_FAILURES:-0}
+TLS=${BENCH_TLS:-1}
+HOST=${BENCH_HOST:-127.0.0.1}
+PORT=${BENCH_PORT:-2525}
+CONNECTIONS=${BENCH_CONNECTIONS:-0}
+RELAYS=${BENCH_RELAYS:-1}
+RELAY_LATENCY=${BENCH_RELAY_LATENCY:-$LATENCY}
+DELIVERY=${BENCH_DELIVERY:-smtp}
+MODULE=${BENCH_MODULE:-$BIN/pam_aurora_email.so}
+DRIVER=${BENCH_DRIVER:-$BIN/aurora-bench}
+
+[ "${BENCH_THREADS:-0}" != 0 ] && BENCH_ARGS="$BENCH_ARGS -t"
+[ "${BENCH_SOAK:-0}" != 0 ] && BENCH_ARGS="$BENCH_ARGS -S"
+
+# Work in a temporary directory, never in /etc
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/aurora-bench.XXXXXX")
+SMTPD_PIDS=
+FLUSHER_PID=
+
+cleanup()
+{
+    [ -n "$SMTPD_PIDS" ] && kill $SMTPD_PIDS 2>/dev/null
+    [ -n "$FLUSHER_PID" ] && kill $FLUSHER_PID 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+mkdir "$WORK/maildir"
+
+# Generate the user directory and its index
+{
+    echo "emails:"
+    echo "{"
+    i=0
+    while [ $i -lt "$USERS" ]; do
+        echo "    bench$i = \"bench$i@bench.invalid\";"
+        i=$((i + 1))
+    done
+    echo "};"
+} > "$WORK/directory.conf"
+
+"$BIN/aurora-dirc" "$WORK/directory.conf" > /dev/null
+
+# Generate the configuration
+{
+    echo "code_length = 8;"
+    echo "permit_bypass = 0;"
+    i=0
+    printf 'mail_server_host = ['
+    while [ $i -lt "$RELAYS" ]; do
+        [ $i -gt 0 ] && printf ', '
+        printf '"smtp://%s:%d"' "$HOST" $((PORT + i))
+        i=$((i + 1))
+    done
+    echo '];'
+    echo "mail_server_user = \"bench@bench.invalid\";"
+    echo "mail_server_pass = \"bench\";"
+    echo "mail_server_tls = $TLS;"
+    echo "delivery = \"$DELIVERY\";"
+    echo "spool_dir = \"$WORK/spool\";"
+    echo "local_socket = \"$WORK/lmtp.sock\";"
+    echo "sendmail_path = \"$WORK/sendmail\";"
+} > "$WORK/email.conf"
+
+# The stand-in sendmail command stores the email like the fake server
+cat > "$WORK/sendmail" << END
+#!/bin/sh
+while [ \$# -gt 0 ] && [ "\$1" != -- ]; do shift; done
+cat > "$WORK/maildir/\$2.\$\$.tmp" &&
+    mv "$WORK/maildir/\$2.\$\$.tmp" "$WORK/maildir/\$2" &&
+    echo "\$2" >> "$WORK/maildir/.journal"
+END
+chmod 755 "$WORK/sendmail"
+
+SMTPD_ARGS="-m $WORK/maildir -f $FAILURES"
+
+if [ "$TLS" != 0 ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=127.0.0.1 \
+        -addext "subjectAltName=IP:127.0.0.1,DNS:$HOST" \
+        -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2> /dev/null
+    echo "mail_server_cainfo = \"$WORK/cert.pem\";" >> "$WORK/email.conf"
+    SMTPD_ARGS="$SMTPD_ARGS -t $WORK/cert.pem -k $WORK/key.pem"
+    BENCH_ARGS="$BENCH_ARGS -a trace=$WORK/trace.log"
+fi
+
+[ -n "$BENCH_CONFIG" ] && echo "$BENCH_CONFIG" >> "$WORK/email.conf"
+
+# Start the fake SMTP servers, or the fake local MTA
+i=0
+if [ "$DELIVERY" = local ]; then
+    "$BIN/aurora-fake-smtpd" -m "$WORK/maildir" -f "$FAILURES" \
+        -c "$CONNECTIONS" -u "$WORK/lmtp.sock" -l "$LATENCY" &
+    SMTPD_PIDS=$!
+    i=$RELAYS
+fi
+while [ $i -lt "$RELAYS" ]; do
+    [ $i -gt 0 ] && LATENCY=$RELAY_LATENCY
+    "$BIN/aurora-fake-smtpd" $SMTPD_ARGS -c "$CONNECTIONS" -p $((PORT + i)) \
+        -l "$LATENCY" &
+    SMTPD_PIDS="$SMTPD_PIDS $!"
+    i=$((i + 1))
+done
+sleep 0.2
+
+# Start the spool flusher
+if [ "$DELIVERY" = spool ]; then
+    "$BIN/aurora-flusher" -c "$WORK/email.conf" 2> /dev/null &
+    FLUSHER_PID=$!
+fi
+
+# Run the load test
+STATUS=0
+"$DRIVER" -m "$MODULE" -c "$WORK/email.conf" \
+    -D "$WORK/directory.conf" -M "$WORK/maildir" -s "$SESSIONS" \
+    -n "$LOGINS" -u "$USERS" $BENCH_ARGS || STATUS=$?
+
+# The emails stored by the servers (more than the logins means duplicates)
+echo "emails:      $(cat "$WORK/maildir/.journal" 2>/dev/null | wc -l)"
+
+# The SMTP sessions the emails took
+echo "smtp sessions: $(cat "$WORK/maildir/.sessions" 2>/dev/null | wc -l)"
+
+# The spool left behind
+[ "$DELIVERY" = spool ] && "$BIN/aurora-flusher" -c "$WORK/email.conf" -s \
+    | sed 's/^\([a-z]*\) /spool \1: /'
+
+# The STARTTLS handshakes (from the connection to the end of the handshake)
+if [ -f "$WORK/trace.log" ]; then
+    sed -n 's/.* smtp_connect=\([0-9]*\) smtp_tls=\([0-9]*\) .*/\1 \2/p' \
+        "$WORK/trace.log" | awk '$2 > 0 { print $2 - $1 }' | sort -n | awk '
+        { t[NR] = $1; sum += $1 }
+        END {
+            if(NR == 0) exit
+            printf "handshake avg: %.3f ms\n", sum / NR / 1000
+            printf "handshake p50: %.3f ms\n", t[int(NR * 0.50) + 1] / 1000
+            printf "handshake p99: %.3f ms\n", t[int(NR * 0.99) + 1] / 1000
+        }'
+fi
+
+exit $STATUS
@@ -0,0 +1,628 @@
+/**
+ * file:        aurora_fake_smtpd.c
+ * description: Local SMTP stand-in for the Aurora benchmarks, storing the
+ *              received emails in a directory (one file per recipient)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+
+/* The largest accepted line and message */
+#define FAKE_SMTPD_LINE_MAX 2048
+#define FAKE_SMTPD_MESSAGE_MAX (256 * 1024)
+
+
+/**
+ * The server settings
+ **/
+struct fake_smtpd_settings
+{
+    /* The directory to store the emails in */
+    const char *maildir;
+
+    /* The delay before the banner and before each reply (milliseconds) */
+    int banner_delay;
+    int reply_delay;
+
+    /* The failures to inject (percents) */
+    int data_failures;
+    int drop_failures;
+
+    /* The concurrent sessions served (0 for no limit, the next ones are
+       refused with a 421, as an overloaded relay does), and the sessions
+       open */
+    int session_limit;
+    int sessions;
+
+    /* The STARTTLS context (NULL when disabled) */
+    SSL_CTX *tls;
+};
+
+
+/**
+ * A client session
+ **/
+struct fake_smtpd_session
+{
+    /* The client socket and TLS layer */
+    int fd;
+    SSL *ssl;
+
+    /* The input buffer */
+    char buffer[FAKE_SMTPD_LINE_MAX];
+    size_t start;
+    size_t length;
+
+    /* The current transaction recipient */
+    char rcpt[FAKE_SMTPD_LINE_MAX];
+
+    /* The per session random state */
+    unsigned int seed;
+};
+
+
+/* The server settings */
+static struct fake_smtpd_settings fake_smtpd;
+
+
+/**
+ * This function sleeps for some milliseconds
+ * @param delay The delay (milliseconds)
+ */
+static void
+fake_smtpd_sleep(int delay)
+{
+    /* The delay */
+    struct timespec duration;
+
+    if(delay <= 0)
+        return;
+
+    duration.tv_sec = delay / 1000;
+    duration.tv_nsec = (delay % 1000) * 1000000L;
+    nanosleep(&duration, NULL);
+}
+
+
+/**
+ * This function sends a reply to the client
+ * @param session The client session
+ * @param reply The reply, with its CRLF
+ * @return 0 on success, -1 otherwise
+ */
+static int
+fake_smtpd_reply(struct fake_smtpd_session *session, const char *reply)
+{
+    /* The reply length */
+    int length = (int) strlen(reply);
+
+    /* Simulate the network and server latency */
+    fake_smtpd_sleep(fake_smtpd.reply_delay);
+
+    if(session->ssl != NULL)
+        return SSL_write(session->ssl, reply, length) == length? 0: -1;
+
+    return write(session->fd, reply, (size_t) length) == length? 0: -1;
+}
+
+
+/**
+ * This function reads a line from the client
+ * @param session The client session
+ * @param line The line destination (FAKE_SMTPD_LINE_MAX bytes), without
+ *             its CRLF
+ * @return 0 on success, -1 on end of session
+ */
+static int
+fake_smtpd_readline(struct fake_smtpd_session *session, char *line)
+{
+    /* The line end */
+    char *end;
+    size_t line_length;
+    int received;
+
+    for(;;)
+    {
+        /* Look for a complete line */
+        if((end = memchr(session->buffer + session->start, '\n',
+            session->length - session->start)) != NULL)
+        {
+            line_length = (size_t) (end - session->buffer) - session->start;
+            memcpy(line, session->buffer + session->start, line_length);
+
+            if(line_length > 0 && line[line_length - 1] == '\r')
+                line_length--;
+
+            line[line_length] = '\0';
+            session->start = (size_t) (end - session->buffer) + 1;
+            return 0;
+        }
+
+        /* Make room for more data */
+        memmove(session->buffer, session->buffer + session->start,
+            session->length - session->start);
+        session->length -= session->start;
+        session->start = 0;
+
+        if(session->length == sizeof(session->buffer))
+            return -1;
+
+        /* Receive more data */
+        if(session->ssl != NULL)
+            received = SSL_read(session->ssl, session->buffer
+                + session->length, (int) (sizeof(session->buffer)
+                - session->length));
+        else
+            received = (int) read(session->fd, session->buffer
+                + session->length, sizeof(session->buffer)
+                - session->length);
+
+        if(received <= 0)
+            return -1;
+
+        session->length += (size_t) received;
+    }
+}
+
+
+/**
+ * This function stores a received email, atomically replacing the previous
+ * email of the recipient
+ * @param rcpt The recipient
+ * @param message The email
+ * @param length The email length
+ * @return 0 on success, -1 otherwise
+ */
+static int
+fake_smtpd_store(const char *rcpt, const char *message, size_t length)
+{
+    /* The mailbox paths */
+    char path[4096];
+    char tmp_path[4096 + 32];
+    FILE *mailbox;
+    const char *address;
+    size_t address_length;
+    int journal_fd;
+
+    /* Keep the bare address */
+    address = rcpt[0] == '<'? rcpt + 1: rcpt;
+    address_length = strcspn(address, ">/ ");
+
+    snprintf(path, sizeof(path), "%s/%.*s", fake_smtpd.maildir,
+        (int) address_length, address);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path,
+        (unsigned long) pthread_self());
+
+    /* Write then publish the email */
+    if((mailbox = fopen(tmp_path, "w")) == NULL)
+        return -1;
+
+    if(fwrite(message, 1, length, mailbox) != length)
+    {
+        fclose(mailbox);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    fclose(mailbox);
+
+    if(rename(tmp_path, path) != 0)
+        return -1;
+
+    /* Count the email in the journal (one line per email) */
+    snprintf(path, sizeof(path), "%s/.journal", fake_smtpd.maildir);
+
+    if((journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) >= 0)
+    {
+        snprintf(tmp_path, sizeof(tmp_path), "%.*s\n", (int) address_length,
+            address);
+
+        if(write(journal_fd, tmp_path, strlen(tmp_path)) < 0)
+            perror("journal");
+
+        close(journal_fd);
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function receives the DATA section of an email
+ * @param session The client session
+ * @param message The email destination (FAKE_SMTPD_MESSAGE_MAX bytes)
+ * @param length The email length destination
+ * @return 0 on success, -1 on end of session
+ */
+static int
+fake_smtpd_data(struct fake_smtpd_session *session, char *message,
+size_t *length)
+{
+    /* The current line */
+    char line[FAKE_SMTPD_LINE_MAX];
+    const char *content;
+    size_t line_length;
+
+    *length = 0;
+
+    while(fake_smtpd_readline(session, line) == 0)
+    {
+        /* The end of data */
+        if(strcmp(line, ".") == 0)
+            return 0;
+
+        /* Remove the dot stuffing */
+        content = line[0] == '.'? line + 1: line;
+        line_length = strlen(content);
+
+        if(*length + line_length + 2 < FAKE_SMTPD_MESSAGE_MAX)
+        {
+            memcpy(message + *length, content, line_length);
+            memcpy(message + *length + line_length, "\r\n", 2);
+            *length += line_length + 2;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * This function counts a session in maildir/.sessions (one line per session)
+ */
+static void
+fake_smtpd_count_session(void)
+{
+    /* The sessions journal */
+    char path[4096];
+    int sessions_fd;
+
+    snprintf(path, sizeof(path), "%s/.sessions", fake_smtpd.maildir);
+
+    if((sessions_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) >= 0)
+    {
+        if(write(sessions_fd, "session\n", 8) < 0)
+            perror("sessions");
+
+        close(sessions_fd);
+    }
+}
+
+
+/**
+ * The client session thread
+ * @param fd_ptr The client socket
+ * @return NULL
+ */
+static void *
+fake_smtpd_session_run(void *fd_ptr)
+{
+    /* The session */
+    struct fake_smtpd_session session;
+    char line[FAKE_SMTPD_LINE_MAX];
+    char *message;
+    size_t length;
+    int auth_step = 0;
+    int status = 0;
+
+    memset(&session, 0, sizeof(session));
+    session.fd = (int) (long) fd_ptr;
+    session.seed = (unsigned int) time(NULL) ^ (unsigned int) session.fd
+        ^ (unsigned int) (unsigned long) pthread_self();
+
+    if((message = malloc(FAKE_SMTPD_MESSAGE_MAX)) == NULL)
+    {
+        close(session.fd);
+        return NULL;
+    }
+
+    /* Refuse the sessions over the limit */
+    if(__atomic_add_fetch(&fake_smtpd.sessions, 1, __ATOMIC_RELAXED)
+        > fake_smtpd.session_limit && fake_smtpd.session_limit > 0)
+    {
+        fake_smtpd_reply(&session, "421 4.7.0 Too many connections\r\n");
+        status = -1;
+    }
+
+    /* Greet the client */
+    else
+    {
+        fake_smtpd_count_session();
+        fake_smtpd_sleep(fake_smtpd.banner_delay);
+
+        if(fake_smtpd_reply(&session, "220 localhost Aurora fake SMTP\r\n")
+            != 0)
+            status = -1;
+    }
+
+    while(status == 0 && fake_smtpd_readline(&session, line) == 0)
+    {
+        /* The AUTH LOGIN continuations */
+        if(auth_step > 0)
+        {
+            status = fake_smtpd_reply(&session, --auth_step > 0?
+                "334 UGFzc3dvcmQ6\r\n": "235 2.7.0 Authenticated\r\n");
+        }
+        else if(strncasecmp(line, "EHLO", 4) == 0
+            || strncasecmp(line, "LHLO", 4) == 0)
+        {
+            status = fake_smtpd_reply(&session, fake_smtpd.tls != NULL
+                && session.ssl == NULL?
+                "250-localhost\r\n250-PIPELINING\r\n250-AUTH PLAIN LOGIN\r\n"
+                "250-STARTTLS\r\n250 8BITMIME\r\n":
+                "250-localhost\r\n250-PIPELINING\r\n250-AUTH PLAIN LOGIN\r\n"
+                "250 8BITMIME\r\n");
+        }
+        else if(strncasecmp(line, "HELO", 4) == 0)
+            status = fake_smtpd_reply(&session, "250 localhost\r\n");
+        else if(strncasecmp(line, "STARTTLS", 8) == 0
+            && fake_smtpd.tls != NULL && session.ssl == NULL)
+        {
+            if((status = fake_smtpd_reply(&session, "220 2.0.0 Ready\r\n"))
+                != 0)
+                break;
+
+            /* Switch the session to TLS */
+            session.ssl = SSL_new(fake_smtpd.tls);
+            SSL_set_fd(session.ssl, session.fd);
+            session.start = session.length = 0;
+
+            if(SSL_accept(session.ssl) != 1)
+                status = -1;
+        }
+        else if(strncasecmp(line, "AUTH PLAIN", 10) == 0)
+        {
+            if(line[10] == '\0')
+                auth_step = 1;
+
+            status = fake_smtpd_reply(&session, auth_step > 0? "334 \r\n":
+                "235 2.7.0 Authenticated\r\n");
+        }
+        else if(strncasecmp(line, "AUTH LOGIN", 10) == 0)
+        {
+            auth_step = 2;
+            status = fake_smtpd_reply(&session, "334 VXNlcm5hbWU6\r\n");
+        }
+        else if(strncasecmp(line, "MAIL", 4) == 0)
+        {
+            /* Inject connection drops */
+            if(fake_smtpd.drop_failures > 0 && (int) (rand_r(&session.seed)
+                % 100) < fake_smtpd.drop_failures)
+                break;
+
+            session.rcpt[0] = '\0';
+            status = fake_smtpd_reply(&session, "250 2.1.0 Ok\r\n");
+        }
+        else if(strncasecmp(line, "RCPT TO:", 8) == 0)
+        {
+            snprintf(session.rcpt, sizeof(session.rcpt), "%s", line + 8);
+            status = fake_smtpd_reply(&session, "250 2.1.5 Ok\r\n");
+        }
+        else if(strncasecmp(line, "DATA", 4) == 0)
+        {
+            if((status = fake_smtpd_reply(&session,
+                "354 End data with <CR><LF>.<CR><LF>\r\n")) != 0
+                || (status = fake_smtpd_data(&session, message, &length))
+                != 0)
+                break;
+
+            /* Inject delivery failures */
+            if(fake_smtpd.data_failures > 0 && (int) (rand_r(&session.seed)
+                % 100) < fake_smtpd.data_failures)
+                status = fake_smtpd_reply(&session,
+                    "451 4.3.0 Injected failure\r\n");
+            else if(fake_smtpd_store(session.rcpt, message, length) != 0)
+                status = fake_smtpd_reply(&session,
+                    "452 4.3.1 Unable to store\r\n");
+            else
+                status = fake_smtpd_reply(&session,
+                    "250 2.0.0 Ok: queued\r\n");
+        }
+        else if(strncasecmp(line, "QUIT", 4) == 0)
+        {
+            fake_smtpd_reply(&session, "221 2.0.0 Bye\r\n");
+            break;
+        }
+        else if(strncasecmp(line, "RSET", 4) == 0
+            || strncasecmp(line, "NOOP", 4) == 0)
+            status = fake_smtpd_reply(&session, "250 2.0.0 Ok\r\n");
+        else
+            status = fake_smtpd_reply(&session,
+                "502 5.5.2 Command not recognized\r\n");
+    }
+
+    /* Close the session */
+    if(session.ssl != NULL)
+    {
+        SSL_shutdown(session.ssl);
+        SSL_free(session.ssl);
+    }
+
+    close(session.fd);
+    free(message);
+    __atomic_sub_fetch(&fake_smtpd.sessions, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+fake_smtpd_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s -p port | -u socket -m maildir [-b ms] "
+        "[-l ms] [-f percent]\n"
+        "       [-x percent] [-c sessions] [-t cert -k key]\n"
+        "Local SMTP stand-in storing each email in maildir/<recipient>, and\n"
+        "counting them in maildir/.journal (and the sessions in "
+        "maildir/.sessions)\n"
+        "  -p port      The port to listen on (127.0.0.1)\n"
+        "  -u socket    The unix socket to listen on instead, as a local "
+        "MTA (SMTP or\n"
+        "               LMTP)\n"
+        "  -m maildir   The directory to store the emails in\n"
+        "  -b ms        The delay before the banner\n"
+        "  -l ms        The delay before each reply\n"
+        "  -f percent   The emails to refuse at the end of DATA\n"
+        "  -x percent   The connections to drop at MAIL FROM\n"
+        "  -c sessions  The concurrent sessions served, the next ones are "
+        "refused\n"
+        "               with a 421 (default: no limit)\n"
+        "  -t cert      The certificate enabling STARTTLS (PEM)\n"
+        "  -k key       The certificate key (PEM)\n", program);
+}
+
+
+/**
+ * The fake SMTP server entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *cert_path = NULL;
+    const char *key_path = NULL;
+    const char *socket_path = NULL;
+    int port = 0;
+    int opt;
+
+    /* The listening socket */
+    struct sockaddr_in listen_addr;
+    struct sockaddr_un local_addr;
+    int listen_fd;
+    int client_fd;
+    int enable = 1;
+
+    /* The session threads */
+    pthread_attr_t session_attr;
+    pthread_t session;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "p:u:m:b:l:f:x:c:t:k:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': port = atoi(optarg); break;
+            case 'u': socket_path = optarg; break;
+            case 'm': fake_smtpd.maildir = optarg; break;
+            case 'b': fake_smtpd.banner_delay = atoi(optarg); break;
+            case 'l': fake_smtpd.reply_delay = atoi(optarg); break;
+            case 'f': fake_smtpd.data_failures = atoi(optarg); break;
+            case 'x': fake_smtpd.drop_failures = atoi(optarg); break;
+            case 'c': fake_smtpd.session_limit = atoi(optarg); break;
+            case 't': cert_path = optarg; break;
+            case 'k': key_path = optarg; break;
+
+            default:
+                fake_smtpd_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if((port <= 0 && socket_path == NULL) || fake_smtpd.maildir == NULL
+        || (socket_path != NULL
+            && strlen(socket_path) >= sizeof(local_addr.sun_path)))
+    {
+        fake_smtpd_usage(argv[0]);
+        return 1;
+    }
+
+    /* Init STARTTLS */
+    if(cert_path != NULL)
+    {
+        if((fake_smtpd.tls = SSL_CTX_new(TLS_server_method())) == NULL
+            || SSL_CTX_use_certificate_chain_file(fake_smtpd.tls, cert_path)
+            != 1 || SSL_CTX_use_PrivateKey_file(fake_smtpd.tls,
+            key_path? key_path: cert_path, SSL_FILETYPE_PEM) != 1)
+        {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Listen on the unix socket */
+    if(socket_path != NULL)
+    {
+        if((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return 1;
+
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        strcpy(local_addr.sun_path, socket_path);
+        unlink(socket_path);
+
+        if(bind(listen_fd, (struct sockaddr *) &local_addr,
+            sizeof(local_addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+        {
+            fprintf(stderr, "%s: unable to listen on %s: %s\n", argv[0],
+                socket_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    /* Listen on the loopback */
+    else
+    {
+        if((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return 1;
+
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable,
+            sizeof(enable));
+        memset(&listen_addr, 0, sizeof(listen_addr));
+        listen_addr.sin_family = AF_INET;
+        listen_addr.sin_port = htons((uint16_t) port);
+        listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if(bind(listen_fd, (struct sockaddr *) &listen_addr,
+            sizeof(listen_addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+        {
+            fprintf(stderr, "%s: unable to listen on port %d: %s\n",
+                argv[0], port, strerror(errno));
+            return 1;
+        }
+    }
+
+    /* Serve each client in its own thread */
+    pthread_attr_init(&session_attr);
+    pthread_attr_setdetachstate(&session_attr, PTHREAD_CREATE_DETACHED);
+
+    for(;;)
+    {
+        if((client_fd = accept(listen_fd, NULL, NULL)) < 0)
+            continue;
+
+        /* Replies are small and must not wait for delayed acks */
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable,
+            sizeof(enable));
+
+        if(pthread_create(&session, &session_attr, fake_smtpd_session_run,
+            (void *) (long) client_fd) != 0)
+            close(client_fd);
+    }
+
+    return 0;
+}
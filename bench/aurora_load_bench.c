@@ -0,0 +1,447 @@
+/**
+ * file:        aurora_load_bench.c
+ * description: Aurora module load benchmark, timing the dlopen of the module
+ *              and its first pam_sm_authenticate call in fresh processes, as
+ *              each sshd preauth child does
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+
+/* The libraries looked for in the process mappings */
+#define AURORA_LOAD_BENCH_LIBRARIES 4
+
+static const char *aurora_load_bench_libraries[AURORA_LOAD_BENCH_LIBRARIES] = {
+    "libcurl", "libssl", "libuuid", "libconfig"
+};
+
+
+/**
+ * The PAM handle seen by the module
+ **/
+struct pam_handle
+{
+    /* The PAM items */
+    const char *service;
+    const char *user;
+    struct pam_conv conv;
+};
+
+
+/**
+ * A sample, measured by a child process
+ **/
+struct aurora_load_bench_sample
+{
+    /* The dlopen and first call durations (microseconds) */
+    uint32_t load;
+    uint32_t call;
+
+    /* The PAM return code */
+    int32_t status;
+
+    /* The shared objects the module mapped */
+    int32_t objects;
+
+    /* The libraries found in the mappings, by bit */
+    uint32_t libraries;
+};
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in microseconds
+ */
+static uint64_t
+aurora_load_bench_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/**
+ * PAM item accessor, for the module
+ * @see man 3 pam_get_item
+ */
+int
+pam_get_item(const pam_handle_t *pam_handle, int item_type, const void **item)
+{
+    switch(item_type)
+    {
+        case PAM_SERVICE: *item = pam_handle->service; break;
+        case PAM_USER: *item = pam_handle->user; break;
+        case PAM_CONV: *item = &pam_handle->conv; break;
+        default: *item = NULL; break;
+    }
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM item setter, for the module
+ * @see man 3 pam_set_item
+ */
+int
+pam_set_item(pam_handle_t *pam_handle, int item_type, const void *item)
+{
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM user accessor, for the module (the user is always set)
+ * @see man 3 pam_get_user
+ */
+int
+pam_get_user(pam_handle_t *pam_handle, const char **user, const char *prompt)
+{
+    *user = pam_handle->user;
+
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM module data setter, for the module (the data is dropped with the
+ * process)
+ * @see man 3 pam_set_data
+ */
+int
+pam_set_data(pam_handle_t *pam_handle, const char *name, void *data,
+void (*cleanup)(pam_handle_t *, void *, int))
+{
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * PAM module data accessor, for the module
+ * @see man 3 pam_get_data
+ */
+int
+pam_get_data(const pam_handle_t *pam_handle, const char *name,
+const void **data)
+{
+    return PAM_NO_MODULE_DATA;
+}
+
+
+/**
+ * Conversation function, answering nothing
+ * @see man 3 pam_conv
+ */
+static int
+aurora_load_bench_conv(int count, const struct pam_message **messages,
+struct pam_response **responses, void *data)
+{
+    return (*responses = calloc((size_t) count, sizeof(**responses))) != NULL?
+        PAM_SUCCESS: PAM_BUF_ERR;
+}
+
+
+/**
+ * This function counts the shared objects mapped by the process, and finds
+ * the libraries looked for
+ * @param libraries The libraries found destination, by bit
+ * @return The shared objects count, -1 on error
+ */
+static int
+aurora_load_bench_maps(uint32_t *libraries)
+{
+    /* The mappings */
+    FILE *maps;
+    char line[4096];
+    char last[4096] = "";
+    char *path;
+    int objects = 0;
+    int i;
+
+    if((maps = fopen("/proc/self/maps", "r")) == NULL)
+        return -1;
+
+    *libraries = 0;
+
+    while(fgets(line, sizeof(line), maps) != NULL)
+    {
+        /* The mappings of an object follow each other */
+        if((path = strchr(line, '/')) == NULL || strstr(path, ".so") == NULL
+            || strcmp(path, last) == 0)
+            continue;
+
+        snprintf(last, sizeof(last), "%s", path);
+        objects++;
+
+        for(i = 0; i < AURORA_LOAD_BENCH_LIBRARIES; i++)
+            if(strstr(path, aurora_load_bench_libraries[i]) != NULL)
+                *libraries |= 1u << i;
+    }
+
+    fclose(maps);
+
+    return objects;
+}
+
+
+/**
+ * This function loads the module and calls it once, in a child process
+ * @param module_path The module path
+ * @param module_argc The module arguments count
+ * @param module_argv The module arguments
+ * @param user The user to authenticate
+ * @param sample The sample destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_load_bench_sample(const char *module_path, int module_argc,
+const char **module_argv, const char *user,
+struct aurora_load_bench_sample *sample)
+{
+    /* The PAM handle */
+    struct pam_handle pam_handle = {
+        "aurora-load-bench", user, { aurora_load_bench_conv, NULL }
+    };
+
+    /* The module */
+    void *module;
+    int (*authenticate)(pam_handle_t *, int, int, const char **);
+    uint32_t libraries;
+    int objects;
+    uint64_t start;
+    uint64_t loaded;
+
+    if((objects = aurora_load_bench_maps(&libraries)) < 0)
+        return -1;
+
+    start = aurora_load_bench_now();
+
+    if((module = dlopen(module_path, RTLD_NOW)) == NULL
+        || (authenticate = (int (*)(pam_handle_t *, int, int,
+        const char **)) dlsym(module, "pam_sm_authenticate")) == NULL)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    loaded = aurora_load_bench_now();
+    sample->status = authenticate(&pam_handle, PAM_SILENT, module_argc,
+        module_argv);
+    sample->call = (uint32_t) (aurora_load_bench_now() - loaded);
+    sample->load = (uint32_t) (loaded - start);
+
+    if((sample->objects = aurora_load_bench_maps(&sample->libraries)) < 0)
+        return -1;
+
+    sample->objects -= objects;
+
+    return 0;
+}
+
+
+/**
+ * Sort comparator, for the durations
+ */
+static int
+aurora_load_bench_compare(const void *first, const void *second)
+{
+    uint32_t a = *(const uint32_t *) first;
+    uint32_t b = *(const uint32_t *) second;
+
+    return a < b? -1: a > b;
+}
+
+
+/**
+ * This function prints the distribution of a duration
+ * @param name The duration name
+ * @param values The durations (sorted in place)
+ * @param count The durations count
+ */
+static void
+aurora_load_bench_report(const char *name, uint32_t *values, int count)
+{
+    qsort(values, (size_t) count, sizeof(*values), aurora_load_bench_compare);
+
+    printf("%-6s p50: %.3f ms  p90: %.3f ms  min: %.3f ms  max: %.3f ms\n",
+        name, values[(count - 1) * 50 / 100] / 1e3,
+        values[(count - 1) * 90 / 100] / 1e3, values[0] / 1e3,
+        values[count - 1] / 1e3);
+}
+
+
+/**
+ * This function prints the usage
+ * @param program The program name
+ */
+static void
+aurora_load_bench_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-m module] [-c config] [-D directory] "
+        "[-u user] [-n samples]\n"
+        "Time the module load and its first call, each in a new process\n"
+        "  -m module     The module to load (default: "
+        "bin/pam_aurora_email.so)\n"
+        "  -c config     The module configuration (default: "
+        "etc/aurora/email.conf)\n"
+        "  -D directory  The user directory (default: "
+        "etc/aurora/directory.conf)\n"
+        "  -u user       The user to log in, rejected when unknown "
+        "(default: aurora-load-bench)\n"
+        "  -n samples    The processes to measure (default: 200)\n",
+        program);
+}
+
+
+/**
+ * The module load benchmark entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *module_path = "bin/pam_aurora_email.so";
+    const char *config_path = "etc/aurora/email.conf";
+    const char *directory_path = "etc/aurora/directory.conf";
+    const char *user = "aurora-load-bench";
+    int count = 200;
+    int opt;
+
+    /* The module arguments */
+    const char *module_argv[2];
+    char config_arg[4096];
+    char directory_arg[4096];
+
+    /* The samples */
+    struct aurora_load_bench_sample sample;
+    uint32_t *loads;
+    uint32_t *calls;
+    uint32_t *totals;
+    int objects = 0;
+    int found[AURORA_LOAD_BENCH_LIBRARIES] = { 0 };
+    int status = -1;
+    int channel[2];
+    int wstatus;
+    pid_t pid;
+    int i;
+    int j;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "m:c:D:u:n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm': module_path = optarg; break;
+            case 'c': config_path = optarg; break;
+            case 'D': directory_path = optarg; break;
+            case 'u': user = optarg; break;
+            case 'n': count = atoi(optarg); break;
+
+            default:
+                aurora_load_bench_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(count <= 0)
+    {
+        aurora_load_bench_usage(argv[0]);
+        return 1;
+    }
+
+    snprintf(config_arg, sizeof(config_arg), "config=%s", config_path);
+    snprintf(directory_arg, sizeof(directory_arg), "directory=%s",
+        directory_path);
+    module_argv[0] = config_arg;
+    module_argv[1] = directory_arg;
+
+    loads = calloc((size_t) count, sizeof(*loads));
+    calls = calloc((size_t) count, sizeof(*calls));
+    totals = calloc((size_t) count, sizeof(*totals));
+
+    if(loads == NULL || calls == NULL || totals == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+
+    /* Measure each sample in a new process, which never loaded the module */
+    for(i = 0; i < count; i++)
+    {
+        if(pipe(channel) != 0 || (pid = fork()) < 0)
+        {
+            fprintf(stderr, "%s: fork: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+
+        if(pid == 0)
+        {
+            close(channel[0]);
+
+            if(aurora_load_bench_sample(module_path, 2, module_argv, user,
+                &sample) != 0
+                || write(channel[1], &sample, sizeof(sample))
+                    != sizeof(sample))
+                _exit(1);
+
+            _exit(0);
+        }
+
+        close(channel[1]);
+
+        if(read(channel[0], &sample, sizeof(sample)) != sizeof(sample))
+        {
+            fprintf(stderr, "%s: sample %d failed\n", argv[0], i);
+            return 1;
+        }
+
+        close(channel[0]);
+        waitpid(pid, &wstatus, 0);
+
+        loads[i] = sample.load;
+        calls[i] = sample.call;
+        totals[i] = sample.load + sample.call;
+        objects = sample.objects;
+        status = sample.status;
+
+        for(j = 0; j < AURORA_LOAD_BENCH_LIBRARIES; j++)
+            if(sample.libraries & (1u << j))
+                found[j]++;
+    }
+
+    /* Print the report */
+    printf("samples: %d (pam status %d: %s)\n", count, status,
+        status == PAM_SUCCESS? "success": "rejected");
+    aurora_load_bench_report("dlopen", loads, count);
+    aurora_load_bench_report("call", calls, count);
+    aurora_load_bench_report("total", totals, count);
+    printf("shared objects loaded: %d\n", objects);
+
+    for(j = 0; j < AURORA_LOAD_BENCH_LIBRARIES; j++)
+        printf("%s mapped: %d/%d\n", aurora_load_bench_libraries[j],
+            found[j], count);
+
+    free(loads);
+    free(calls);
+    free(totals);
+
+    return 0;
+}
@@ -0,0 +1,871 @@
+/**
+ * file:        aurora_microbench.c
+ * description: Aurora microbenchmarks of the module internals (directory
+ *              lookups, configuration loading, code generation, email and
+ *              prompt rendering), with machine-readable results and a
+ *              regression check against a baseline
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_directory.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_prompt.h"
+#include "pam_aurora_random.h"
+
+
+/* The logins looked up in turn */
+#define AURORA_MICROBENCH_LOGINS 1024
+
+/* The most benchmark cases and directory sizes */
+#define AURORA_MICROBENCH_CASES 64
+#define AURORA_MICROBENCH_SIZES 8
+
+/* The most measured runs of a case */
+#define AURORA_MICROBENCH_RUNS_MAX 64
+
+
+/**
+ * The fixtures shared by the cases
+ **/
+struct aurora_microbench_fixture
+{
+    /* The work directory */
+    char work[1024];
+
+    /* The directory of the case (source and index) and its users */
+    char directory[4096];
+    char index[4096];
+    long users;
+
+    /* The logins looked up: existing, unknown or derived by a rule */
+    char *logins[AURORA_MICROBENCH_LOGINS];
+    char *unknown[AURORA_MICROBENCH_LOGINS];
+    char *derived[AURORA_MICROBENCH_LOGINS];
+
+    /* Two identical configurations, loaded alternately */
+    char config[2][4096];
+
+    /* The email rendering */
+    const struct pam_aurora_config *snapshot;
+    struct pam_email_ctx email_ctx;
+};
+
+
+/**
+ * A benchmark case
+ **/
+struct aurora_microbench_case
+{
+    /* The case name and parameter (the directory users, or 0) */
+    const char *name;
+    long param;
+
+    /* The measured function: runs iterations operations, 0 on success */
+    int (*run)(struct aurora_microbench_fixture *fixture, long iterations);
+};
+
+
+/**
+ * A benchmark result
+ **/
+struct aurora_microbench_result
+{
+    const char *name;
+    long param;
+    long iterations;
+    int runs;
+
+    /* The time per operation (nanoseconds) */
+    double median;
+    double min;
+    double max;
+};
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in nanoseconds
+ */
+static double
+aurora_microbench_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_microbench_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-d aurora-dirc] [-u users,...] [-t ms] "
+        "[-r runs] [-f tsv|json]\n"
+        "          [-o results] [-b baseline] [-x percent] [-k] [case ...]\n"
+        "Measure the module internals, each case being timed over several "
+        "runs\n"
+        "  -d path      The aurora-dirc binary (default: bin/aurora-dirc)\n"
+        "  -u users     The directory sizes (default: 1000,100000,1000000)\n"
+        "  -t ms        The least duration of a run (default: 200)\n"
+        "  -r runs      The measured runs of each case (default: 5)\n"
+        "  -f format    The results format (default: tsv)\n"
+        "  -o results   The results file (default: the standard output)\n"
+        "  -b baseline  Compare the medians with earlier tsv results\n"
+        "  -x percent   The slowdown reported as a regression (default: 10)\n"
+        "  -k           Keep the fixtures directory\n"
+        "  case         Only run the cases with these names\n",
+        program);
+}
+
+
+/**
+ * This function writes a directory of generated users (bench<i>)
+ * @param path The directory source path
+ * @param users The users count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_write_directory(const char *path, long users)
+{
+    /* The directory source */
+    FILE *directory;
+    long i;
+
+    if((directory = fopen(path, "w")) == NULL)
+        return -1;
+
+    fprintf(directory, "emails:\n{\n");
+
+    for(i = 0; i < users; i++)
+        fprintf(directory, "    bench%ld = \"bench%ld@bench.invalid\";\n", i,
+            i);
+
+    fprintf(directory, "};\n");
+
+    /* A few derivation rules, the last one matching the derived logins */
+    fprintf(directory, "rules = (\n"
+        "    { prefix = \"ext-\"; email = \"%%r@partners.bench.invalid\"; },\n"
+        "    { suffix = \"-ops\"; email = \"ops+%%r@bench.invalid\"; },\n"
+        "    { glob = \"adm?-*\"; email = \"%%r.admin@bench.invalid\"; },\n"
+        "    { glob = \"guest*\"; email = \"%%u@bench.invalid\"; }\n"
+        ");\n");
+
+    return fclose(directory) == 0? 0: -1;
+}
+
+
+/**
+ * This function compiles a directory index with aurora-dirc
+ * @param dirc The aurora-dirc binary
+ * @param source The directory source path
+ * @param index The index path
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_compile(const char *dirc, const char *source,
+const char *index)
+{
+    /* The compiler process */
+    pid_t pid;
+    int status;
+
+    if((pid = fork()) < 0)
+        return -1;
+
+    /* Its report goes with the errors, not with the results */
+    if(pid == 0)
+    {
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execl(dirc, dirc, "-o", index, source, (char *) NULL);
+        _exit(127);
+    }
+
+    if(waitpid(pid, &status, 0) != pid || ! WIFEXITED(status)
+        || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * This function prepares the directory of a given size, once
+ * @param fixture The fixtures
+ * @param dirc The aurora-dirc binary
+ * @param users The users count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_directory(struct aurora_microbench_fixture *fixture,
+const char *dirc, long users)
+{
+    /* The logins */
+    unsigned int seed = 42;
+    char login[64];
+    int i;
+
+    snprintf(fixture->directory, sizeof(fixture->directory),
+        "%s/directory-%ld.conf", fixture->work, users);
+    snprintf(fixture->index, sizeof(fixture->index), "%s/directory-%ld.idx",
+        fixture->work, users);
+    fixture->users = users;
+
+    if(access(fixture->index, R_OK) != 0
+        && (aurora_microbench_write_directory(fixture->directory, users) != 0
+            || aurora_microbench_compile(dirc, fixture->directory,
+                fixture->index) != 0))
+        return -1;
+
+    /* Spread the lookups over the whole directory */
+    for(i = 0; i < AURORA_MICROBENCH_LOGINS; i++)
+    {
+        free(fixture->logins[i]);
+        free(fixture->unknown[i]);
+        free(fixture->derived[i]);
+
+        snprintf(login, sizeof(login), "bench%ld", (long) (rand_r(&seed)
+            % users));
+        fixture->logins[i] = strdup(login);
+        snprintf(login, sizeof(login), "nobody%d", i);
+        fixture->unknown[i] = strdup(login);
+        snprintf(login, sizeof(login), "guest%d", i);
+        fixture->derived[i] = strdup(login);
+
+        if(fixture->logins[i] == NULL || fixture->unknown[i] == NULL
+            || fixture->derived[i] == NULL)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Case: the indexed lookup of an existing user
+ * @param fixture The fixtures
+ * @param iterations The lookups count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_index_hit(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char email[PAM_AURORA_EMAIL_MAX + 1];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_directory_index_lookup(fixture->index, fixture->directory,
+            fixture->logins[i % AURORA_MICROBENCH_LOGINS], email)
+            != PAM_AURORA_DIR_FOUND)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the indexed lookup of an unknown user
+ * @param fixture The fixtures
+ * @param iterations The lookups count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_index_miss(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char email[PAM_AURORA_EMAIL_MAX + 1];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_directory_index_lookup(fixture->index, fixture->directory,
+            fixture->unknown[i % AURORA_MICROBENCH_LOGINS], email)
+            != PAM_AURORA_DIR_NOT_FOUND)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the indexed lookup of a user without an entry, derived by the last
+ * rule
+ * @param fixture The fixtures
+ * @param iterations The lookups count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_rule_hit(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char email[PAM_AURORA_EMAIL_MAX + 1];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_directory_index_lookup(fixture->index, fixture->directory,
+            fixture->derived[i % AURORA_MICROBENCH_LOGINS], email)
+            != PAM_AURORA_DIR_FOUND)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the lookup of an existing user in the directory source (parsed at
+ * each lookup, as without an index)
+ * @param fixture The fixtures
+ * @param iterations The lookups count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_text_hit(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char email[PAM_AURORA_EMAIL_MAX + 1];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_directory_text_lookup(fixture->directory,
+            fixture->logins[i % AURORA_MICROBENCH_LOGINS], email)
+            != PAM_AURORA_DIR_FOUND)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the parsing of email.conf (two files loaded alternately, so every
+ * call parses)
+ * @param fixture The fixtures
+ * @param iterations The loads count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_config_parse(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    const struct pam_aurora_config *config;
+    long i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        if(pam_config_acquire(fixture->config[i & 1], &config)
+            != PAM_AURORA_CONFIG_OK)
+            return -1;
+
+        pam_config_release(config);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Case: the configuration of a login when email.conf is unchanged
+ * @param fixture The fixtures
+ * @param iterations The loads count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_config_cached(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    const struct pam_aurora_config *config;
+    long i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        if(pam_config_acquire(fixture->config[0], &config)
+            != PAM_AURORA_CONFIG_OK)
+            return -1;
+
+        pam_config_release(config);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Case: the code generation
+ * @param fixture The fixtures
+ * @param iterations The codes count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_code(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char code[PAM_AURORA_CODE_MAX + 1];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_random_code(PAM_AURORA_CODE_ALPHABET, 8, code) != 0)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the compilation of the email template
+ * @param fixture The fixtures
+ * @param iterations The compilations count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_template(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    struct pam_mail_template *mail_template;
+    long i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        if((mail_template = pam_mail_template_compile(PAM_AURORA_MAIL_SUBJECT,
+            PAM_AURORA_MAIL_BODY)) == NULL)
+            return -1;
+
+        free(mail_template);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Case: the email rendering
+ * @param fixture The fixtures
+ * @param iterations The emails count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_email(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    char message[PAM_AURORA_MESSAGE_MAX];
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        if(pam_mail_render(fixture->snapshot->mail_template,
+            &fixture->email_ctx, message, sizeof(message)) == 0)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Case: the prompt rendering (in a transaction arena)
+ * @param fixture The fixtures
+ * @param iterations The prompts count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_microbench_prompt(struct aurora_microbench_fixture *fixture,
+long iterations)
+{
+    struct pam_arena arena;
+    long i;
+
+    pam_arena_init(&arena);
+
+    for(i = 0; i < iterations; i++)
+    {
+        if(pam_prompt_render(&arena, fixture->email_ctx.user, (int) (i & 1),
+            300) == NULL)
+            return -1;
+
+        pam_arena_release(&arena);
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function compares two times per operation
+ * @param a The first time
+ * @param b The second time
+ * @return The times order
+ */
+static int
+aurora_microbench_compare(const void *a, const void *b)
+{
+    double first = *(const double *) a;
+    double second = *(const double *) b;
+
+    return first < second? -1: first > second;
+}
+
+
+/**
+ * This function measures a case: the iterations are doubled until a run
+ * lasts the least duration, then the runs are timed
+ * @param fixture The fixtures
+ * @param bench_case The case
+ * @param min_time The least duration of a run (nanoseconds)
+ * @param runs The measured runs
+ * @param result The result destination
+ * @return 0 on success, -1 when the case failed
+ */
+static int
+aurora_microbench_measure(struct aurora_microbench_fixture *fixture,
+const struct aurora_microbench_case *bench_case, double min_time, int runs,
+struct aurora_microbench_result *result)
+{
+    /* The measures */
+    double times[AURORA_MICROBENCH_RUNS_MAX];
+    double start;
+    double elapsed;
+    long iterations = 1;
+    int i;
+
+    /* Calibrate (and warm the caches) */
+    while(1)
+    {
+        start = aurora_microbench_now();
+
+        if(bench_case->run(fixture, iterations) != 0)
+            return -1;
+
+        if((elapsed = aurora_microbench_now() - start) >= min_time
+            || iterations >= (1L << 40))
+            break;
+
+        iterations = elapsed > min_time / 100? (long) (iterations * min_time
+            / elapsed * 1.1) + 1: iterations * 100;
+    }
+
+    for(i = 0; i < runs; i++)
+    {
+        start = aurora_microbench_now();
+
+        if(bench_case->run(fixture, iterations) != 0)
+            return -1;
+
+        times[i] = (aurora_microbench_now() - start) / iterations;
+    }
+
+    qsort(times, (size_t) runs, sizeof(*times), aurora_microbench_compare);
+
+    result->name = bench_case->name;
+    result->param = bench_case->param;
+    result->iterations = iterations;
+    result->runs = runs;
+    result->median = times[runs / 2];
+    result->min = times[0];
+    result->max = times[runs - 1];
+
+    return 0;
+}
+
+
+/**
+ * This function prints a result
+ * @param output The results file
+ * @param result The result
+ * @param json Whether to print a JSON line rather than a tsv one
+ */
+static void
+aurora_microbench_print(FILE *output,
+const struct aurora_microbench_result *result, int json)
+{
+    if(json)
+        fprintf(output, "{\"name\": \"%s\", \"param\": %ld, "
+            "\"iterations\": %ld, \"runs\": %d, \"ns_median\": %.1f, "
+            "\"ns_min\": %.1f, \"ns_max\": %.1f, \"ops_per_sec\": %.0f}\n",
+            result->name, result->param, result->iterations, result->runs,
+            result->median, result->min, result->max, 1e9 / result->median);
+    else
+        fprintf(output, "%s\t%ld\t%ld\t%d\t%.1f\t%.1f\t%.1f\t%.0f\n",
+            result->name, result->param, result->iterations, result->runs,
+            result->median, result->min, result->max, 1e9 / result->median);
+
+    fflush(output);
+}
+
+
+/**
+ * This function compares results with a baseline
+ * @param path The baseline (tsv results)
+ * @param results The results
+ * @param count The results count
+ * @param tolerance The slowdown reported as a regression (percent)
+ * @return The regressions count, or -1 when the baseline is unreadable
+ */
+static int
+aurora_microbench_check(const char *path,
+const struct aurora_microbench_result *results, int count, double tolerance)
+{
+    /* The baseline */
+    FILE *baseline;
+    char line[512];
+    char name[128];
+    long param;
+    double median;
+    int regressions = 0;
+    int i;
+
+    if((baseline = fopen(path, "r")) == NULL)
+        return -1;
+
+    while(fgets(line, sizeof(line), baseline) != NULL)
+    {
+        if(line[0] == '#' || sscanf(line, "%127s %ld %*d %*d %lf", name,
+            &param, &median) != 3)
+            continue;
+
+        for(i = 0; i < count; i++)
+        {
+            if(strcmp(results[i].name, name) != 0
+                || results[i].param != param)
+                continue;
+
+            if(results[i].median > median * (1 + tolerance / 100))
+            {
+                fprintf(stderr, "regression: %s %ld: %.1f ns -> %.1f ns "
+                    "(+%.0f%%)\n", name, param, median, results[i].median,
+                    (results[i].median / median - 1) * 100);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(baseline);
+
+    return regressions;
+}
+
+
+/**
+ * The microbenchmark entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status (2 on regressions)
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *dirc = "bin/aurora-dirc";
+    const char *sizes = "1000,100000,1000000";
+    const char *output_path = NULL;
+    const char *baseline = NULL;
+    double min_time = 200e6;
+    double tolerance = 10;
+    int runs = 5;
+    int json = 0;
+    int keep = 0;
+    int opt;
+
+    /* The cases */
+    struct aurora_microbench_case cases[AURORA_MICROBENCH_CASES];
+    struct aurora_microbench_result results[AURORA_MICROBENCH_CASES];
+    long users[AURORA_MICROBENCH_SIZES];
+    int users_count = 0;
+    int count = 0;
+    int done = 0;
+    int selected;
+    char *cursor;
+    int status = 0;
+    int i;
+    int j;
+
+    /* The fixtures */
+    static struct aurora_microbench_fixture fixture;
+    FILE *output = stdout;
+    FILE *config;
+    char command[sizeof(fixture.work) + 16];
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "d:u:t:r:f:o:b:x:kh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd': dirc = optarg; break;
+            case 'u': sizes = optarg; break;
+            case 't': min_time = atof(optarg) * 1e6; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'f': json = strcmp(optarg, "json") == 0; break;
+            case 'o': output_path = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 'x': tolerance = atof(optarg); break;
+            case 'k': keep = 1; break;
+
+            default:
+                aurora_microbench_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    for(cursor = (char *) sizes; *cursor != '\0'
+        && users_count < AURORA_MICROBENCH_SIZES; users_count++)
+    {
+        if((users[users_count] = strtol(cursor, &cursor, 10)) < 1)
+            break;
+
+        if(*cursor == ',')
+            cursor++;
+    }
+
+    if(runs < 1 || runs > AURORA_MICROBENCH_RUNS_MAX || min_time <= 0
+        || users_count == 0 || *cursor != '\0')
+    {
+        aurora_microbench_usage(argv[0]);
+        return 1;
+    }
+
+    /* The cases, the directory ones for each size */
+    for(i = 0; i < users_count; i++)
+    {
+        cases[count++] = (struct aurora_microbench_case) {
+            "directory_index_hit", users[i], aurora_microbench_index_hit };
+        cases[count++] = (struct aurora_microbench_case) {
+            "directory_index_miss", users[i], aurora_microbench_index_miss };
+        cases[count++] = (struct aurora_microbench_case) {
+            "directory_rule_hit", users[i], aurora_microbench_rule_hit };
+        cases[count++] = (struct aurora_microbench_case) {
+            "directory_text_hit", users[i], aurora_microbench_text_hit };
+    }
+
+    cases[count++] = (struct aurora_microbench_case) {
+        "config_parse", 0, aurora_microbench_config_parse };
+    cases[count++] = (struct aurora_microbench_case) {
+        "config_cached", 0, aurora_microbench_config_cached };
+    cases[count++] = (struct aurora_microbench_case) {
+        "code_generate", 0, aurora_microbench_code };
+    cases[count++] = (struct aurora_microbench_case) {
+        "template_compile", 0, aurora_microbench_template };
+    cases[count++] = (struct aurora_microbench_case) {
+        "email_render", 0, aurora_microbench_email };
+    cases[count++] = (struct aurora_microbench_case) {
+        "prompt_render", 0, aurora_microbench_prompt };
+
+    /* Prepare the fixtures, never in /etc */
+    snprintf(fixture.work, sizeof(fixture.work), "%s/aurora-microbench.XXXXXX",
+        getenv("TMPDIR") != NULL? getenv("TMPDIR"): "/tmp");
+
+    if(mkdtemp(fixture.work) == NULL)
+    {
+        fprintf(stderr, "%s: unable to create the fixtures: %s\n", argv[0],
+            strerror(errno));
+        return 1;
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        snprintf(fixture.config[i], sizeof(fixture.config[i]),
+            "%s/email-%d.conf", fixture.work, i);
+
+        if((config = fopen(fixture.config[i], "w")) == NULL)
+            return 1;
+
+        fprintf(config, "code_length = 8;\n"
+            "mail_server_host = [\"smtp://smtp1.bench.invalid:587\", "
+            "\"smtp://smtp2.bench.invalid:587\"];\n"
+            "mail_server_user = \"bench@bench.invalid\";\n"
+            "mail_server_pass = \"bench\";\n"
+            "state_dir = \"%s\";\n", fixture.work);
+        fclose(config);
+    }
+
+    if(pam_config_acquire(fixture.config[0], &fixture.snapshot)
+        != PAM_AURORA_CONFIG_OK)
+        return 1;
+
+    fixture.email_ctx.from = "bench@bench.invalid";
+    fixture.email_ctx.to = "bench42@bench.invalid";
+    fixture.email_ctx.user = "bench42";
+    fixture.email_ctx.code = "Xk4Qz9Tb";
+    fixture.email_ctx.uuid = "8f6c1d3e-5b7a-4e2f-9c0d-1a2b3c4d5e6f";
+
+    if(output_path != NULL && (output = fopen(output_path, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: unable to write %s\n", argv[0], output_path);
+        return 1;
+    }
+
+    if(! json)
+        fprintf(output, "# name\tparam\titerations\truns\tns_median\tns_min\t"
+            "ns_max\tops_per_sec\n");
+
+    /* Run the cases */
+    for(i = 0; i < count; i++)
+    {
+        /* Only the selected cases */
+        for(selected = optind == argc, j = optind; j < argc; j++)
+            selected |= strcmp(argv[j], cases[i].name) == 0;
+
+        if(! selected)
+            continue;
+
+        if(cases[i].param > 0 && cases[i].param != fixture.users
+            && aurora_microbench_directory(&fixture, dirc, cases[i].param)
+                != 0)
+        {
+            fprintf(stderr, "%s: unable to prepare a directory of %ld users "
+                "(with %s)\n", argv[0], cases[i].param, dirc);
+            status = 1;
+            break;
+        }
+
+        if(aurora_microbench_measure(&fixture, &cases[i], min_time, runs,
+            &results[done]) != 0)
+        {
+            fprintf(stderr, "%s: case %s %ld failed\n", argv[0],
+                cases[i].name, cases[i].param);
+            status = 1;
+            continue;
+        }
+
+        aurora_microbench_print(output, &results[done++], json);
+    }
+
+    if(output != stdout)
+        fclose(output);
+
+    /* Compare with the baseline */
+    if(status == 0 && baseline != NULL)
+    {
+        if((i = aurora_microbench_check(baseline, results, done, tolerance))
+            < 0)
+        {
+            fprintf(stderr, "%s: unable to read %s\n", argv[0], baseline);
+            status = 1;
+        }
+        else if(i > 0)
+            status = 2;
+    }
+
+    /* Remove the fixtures */
+    pam_config_release(fixture.snapshot);
+
+    if(! keep)
+    {
+        snprintf(command, sizeof(command), "rm -rf '%s'", fixture.work);
+
+        if(system(command) != 0)
+            status = status != 0? status: 1;
+    }
+    else
+        fprintf(stderr, "fixtures kept in %s\n", fixture.work);
+
+    return status;
+}
@@ -0,0 +1,127 @@
+/**
+ * file:        aurora_random_bench.c
+ * description: Aurora code generator microbenchmark
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pam_aurora_random.h"
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in seconds
+ */
+static double
+aurora_random_bench_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/**
+ * This function draws a code as the module did before the DRBG: a stdio
+ * read of an int from /dev/urandom, printed in decimal
+ * @param length The code length
+ * @param code The code destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_random_bench_legacy(int length, char *code)
+{
+    /* The random stream */
+    FILE *urandom_fd;
+    unsigned int random;
+
+    if((urandom_fd = fopen("/dev/urandom", "r")) == NULL)
+        return -1;
+
+    if(fread(&random, sizeof(random), 1, urandom_fd) != 1)
+    {
+        fclose(urandom_fd);
+        return -1;
+    }
+
+    fclose(urandom_fd);
+    snprintf(code, (size_t) length + 1, "%u", random);
+
+    return 0;
+}
+
+
+/**
+ * The code generator microbenchmark entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The settings */
+    int count = argc > 1? atoi(argv[1]): 1000000;
+    int length = argc > 2? atoi(argv[2]): 8;
+    const char *alphabet = argc > 3? argv[3]: PAM_AURORA_CODE_ALPHABET;
+
+    /* The measures */
+    char code[PAM_AURORA_CODE_MAX + 1];
+    struct pam_random_stats stats;
+    double start;
+    double elapsed;
+    int legacy_count;
+    int i;
+
+    if(count <= 0 || length < 1 || length > PAM_AURORA_CODE_MAX)
+    {
+        fprintf(stderr, "Usage: %s [count] [length] [alphabet]\n", argv[0]);
+        return 1;
+    }
+
+    /* The buffered DRBG */
+    start = aurora_random_bench_now();
+
+    for(i = 0; i < count; i++)
+    {
+        if(pam_random_code(alphabet, length, code) != 0)
+        {
+            fprintf(stderr, "%s: generator unavailable\n", argv[0]);
+            return 1;
+        }
+    }
+
+    elapsed = aurora_random_bench_now() - start;
+    pam_random_stats(&stats);
+
+    printf("drbg:   %d codes of %d chars in %.3f s, %.0f codes/s, "
+        "%.6f syscalls/code\n", count, length, elapsed, count / elapsed,
+        (double) stats.reseeds / count);
+
+    /* The former generator (openat, fstat, read and close per code) */
+    legacy_count = count > 100000? 100000: count;
+    start = aurora_random_bench_now();
+
+    for(i = 0; i < legacy_count; i++)
+    {
+        if(aurora_random_bench_legacy(length, code) != 0)
+        {
+            fprintf(stderr, "%s: /dev/urandom unavailable\n", argv[0]);
+            return 1;
+        }
+    }
+
+    elapsed = aurora_random_bench_now() - start;
+
+    printf("legacy: %d codes of %d chars in %.3f s, %.0f codes/s, "
+        "4 syscalls/code (%zu digits, biased)\n", legacy_count, length,
+        elapsed, legacy_count / elapsed, strlen(code));
+
+    return 0;
+}
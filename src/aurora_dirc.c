@@ -0,0 +1,1491 @@
+/**
+ * file:        aurora_dirc.c
+ * description: Aurora directory compiler (directory.conf to directory.idx),
+ *              and directory change log writer and compactor
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libconfig.h>
+#include "pam_aurora_directory.h"
+
+
+/**
+ * An index entry (no email for a removed login)
+ **/
+struct aurora_dirc_entry
+{
+    /* The login and email, not NUL terminated */
+    const char *login;
+    size_t login_length;
+    const char *email;
+    size_t email_length;
+};
+
+
+/**
+ * The entries to index, by login
+ **/
+struct aurora_dirc_table
+{
+    /* The entries, by open addressing (a free one has no login) */
+    struct aurora_dirc_entry *entries;
+    size_t capacity;
+    size_t count;
+};
+
+
+/**
+ * The change log, read under its lock, or the compacted changes
+ **/
+struct aurora_dirc_log
+{
+    /* The locked log file (-1 for the compacted changes, read at once) */
+    int fd;
+
+    /* The log content, its size and the end of its valid records */
+    unsigned char *data;
+    size_t size;
+    size_t end;
+
+    /* The valid records count */
+    size_t count;
+};
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_dirc_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-o index] [-a [-m records] | -c | -d | -p] "
+        "[directory]\n"
+        "Compile the Aurora user directory into a hash-indexed file, or "
+        "update it\n"
+        "  -o index     The index to write (default: the directory path "
+        "with the .idx\n"
+        "               extension, or %s)\n"
+        "  -a           Append the changes read on the standard input to "
+        "the change log,\n"
+        "               one \"login email\" line per changed user, or "
+        "\"login\" alone for\n"
+        "               a removed one\n"
+        "  -m records   Compact the change log in background once it holds "
+        "records\n"
+        "               records (default: %d, 0 to never)\n"
+        "  -c           Compact the change log now\n"
+        "  -d           Drop the changes, once reported in the directory "
+        "source, and\n"
+        "               compile it alone\n"
+        "  -p           Print the changes, in the -a format\n"
+        "  directory    The directory source (default: %s)\n",
+        program, PAM_AURORA_DIRECTORY_INDEX_PATH, PAM_AURORA_LOG_COMPACT,
+        PAM_AURORA_DIRECTORY_PATH);
+}
+
+
+/**
+ * This function writes a buffer to a temporary file and atomically moves
+ * it to its destination
+ * @param path The destination path
+ * @param buffer The buffer
+ * @param size The buffer size
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_write(const char *path, const void *buffer, size_t size)
+{
+    /* The temporary file */
+    char *tmp_path;
+    int tmp_fd;
+
+    /* The written bytes */
+    const char *cursor = buffer;
+    ssize_t written;
+
+    /* Build the temporary path next to the destination */
+    if((tmp_path = malloc(strlen(path) + 8)) == NULL)
+        return -1;
+
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    if((tmp_fd = mkstemp(tmp_path)) < 0)
+    {
+        free(tmp_path);
+        return -1;
+    }
+
+    /* Write the whole buffer */
+    while(size > 0)
+    {
+        if((written = write(tmp_fd, cursor, size)) < 0)
+            goto aurora_dirc_write_error;
+
+        cursor += written;
+        size -= (size_t) written;
+    }
+
+    /* Make the file durable and world readable before publishing it */
+    if(fchmod(tmp_fd, 0644) != 0 || fsync(tmp_fd) != 0)
+        goto aurora_dirc_write_error;
+
+    close(tmp_fd);
+
+    if(rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    /* Free memory */
+    free(tmp_path);
+
+    /* Index published */
+    return 0;
+
+aurora_dirc_write_error:
+    close(tmp_fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return -1;
+}
+
+
+/**
+ * This function allocates an entries table
+ * @param table The table to initialize
+ * @param count The maximum entries count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_table_init(struct aurora_dirc_table *table, size_t count)
+{
+    /* Keep a load factor of at most one half */
+    for(table->capacity = 16; table->capacity < count * 2;
+        table->capacity <<= 1);
+
+    table->count = 0;
+    table->entries = calloc(table->capacity, sizeof(*table->entries));
+
+    return table->entries != NULL? 0: -1;
+}
+
+
+/**
+ * This function sets the entry of a login, replacing its previous one
+ * @param table The table
+ * @param entry The entry
+ */
+static void
+aurora_dirc_table_set(struct aurora_dirc_table *table,
+const struct aurora_dirc_entry *entry)
+{
+    /* The probed entries */
+    size_t mask = table->capacity - 1;
+    size_t probe = (size_t) pam_directory_hash(entry->login,
+        entry->login_length) & mask;
+    struct aurora_dirc_entry *current;
+
+    for(;; probe = (probe + 1) & mask)
+    {
+        current = &table->entries[probe];
+
+        if(current->login == NULL)
+        {
+            table->count++;
+            break;
+        }
+
+        if(current->login_length == entry->login_length
+            && memcmp(current->login, entry->login, entry->login_length) == 0)
+            break;
+    }
+
+    *current = *entry;
+}
+
+
+/**
+ * This function writes an index from an entries table
+ * @param program The program name
+ * @param index_path The index path
+ * @param table The entries (the removed logins are kept without email, so
+ *        that they are not derived)
+ * @param rules The derivation rules
+ * @param rule_count The derivation rules count
+ * @param source The directory source state (in an index header)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_build(const char *program, const char *index_path,
+const struct aurora_dirc_table *table, const struct pam_directory_rule *rules,
+int rule_count, const struct pam_directory_index_header *source)
+{
+    /* The index */
+    unsigned char *index;
+    size_t index_size;
+    struct pam_directory_index_header *header;
+    struct pam_directory_index_slot *slots;
+    struct pam_directory_index_record *record;
+    struct pam_directory_index_rule *rule_record;
+    uint32_t bucket_count;
+    size_t offset;
+
+    /* The entries */
+    const struct aurora_dirc_entry *entry;
+    size_t entry_count = 0;
+    uint64_t hash;
+    uint32_t probe;
+    size_t i;
+
+    for(i = 0; i < table->capacity; i++)
+        if(table->entries[i].login != NULL)
+            entry_count++;
+
+    /* Size the table with a load factor of at most one half */
+    for(bucket_count = 16; bucket_count < entry_count * 2;
+        bucket_count <<= 1);
+
+    index_size = sizeof(*header) + bucket_count * sizeof(*slots);
+
+    for(i = 0; i < table->capacity; i++)
+        if(table->entries[i].login != NULL)
+            index_size += sizeof(*record) + table->entries[i].login_length
+                + table->entries[i].email_length + 1;
+
+    for(i = 0; i < (size_t) rule_count; i++)
+        index_size += sizeof(*rule_record) + rules[i].pattern_length
+            + rules[i].email_length;
+
+    if(index_size > UINT32_MAX)
+    {
+        fprintf(stderr, "%s: directory too large\n", program);
+        return -1;
+    }
+
+    /* Build the index */
+    if((index = calloc(1, index_size)) == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        return -1;
+    }
+
+    header = (struct pam_directory_index_header *) index;
+    slots = (struct pam_directory_index_slot *) (header + 1);
+    offset = sizeof(*header) + bucket_count * sizeof(*slots);
+
+    for(i = 0; i < table->capacity; i++)
+    {
+        entry = &table->entries[i];
+
+        if(entry->login == NULL)
+            continue;
+
+        /* Write the record (without email for a removed login) */
+        record = (struct pam_directory_index_record *) (index + offset);
+        record->login_length = (uint16_t) entry->login_length;
+        record->email_length = entry->email != NULL?
+            (uint16_t) entry->email_length: 0;
+        memcpy(record + 1, entry->login, entry->login_length);
+
+        if(entry->email != NULL)
+            memcpy((char *) (record + 1) + entry->login_length, entry->email,
+                entry->email_length);
+
+        /* Insert it in the first free slot */
+        hash = pam_directory_hash(entry->login, entry->login_length);
+
+        for(probe = (uint32_t) hash & (bucket_count - 1);
+            slots[probe].offset != 0; probe = (probe + 1) & (bucket_count - 1));
+
+        slots[probe].hash = (uint32_t) (hash >> 32);
+        slots[probe].offset = (uint32_t) offset;
+
+        offset += sizeof(*record) + entry->login_length
+            + record->email_length + 1;
+    }
+
+    /* Write the rules */
+    header->rules_offset = offset;
+
+    for(i = 0; i < (size_t) rule_count; i++)
+    {
+        rule_record = (struct pam_directory_index_rule *) (index + offset);
+        rule_record->kind = (uint16_t) rules[i].kind;
+        rule_record->pattern_length = (uint16_t) rules[i].pattern_length;
+        rule_record->email_length = (uint16_t) rules[i].email_length;
+        memcpy(rule_record + 1, rules[i].pattern, rules[i].pattern_length);
+        memcpy((char *) (rule_record + 1) + rules[i].pattern_length,
+            rules[i].email, rules[i].email_length);
+
+        offset += sizeof(*rule_record) + rules[i].pattern_length
+            + rules[i].email_length;
+    }
+
+    /* Fill the header */
+    memcpy(header->magic, PAM_AURORA_INDEX_MAGIC, 8);
+    header->version = PAM_AURORA_INDEX_VERSION;
+    header->bucket_count = bucket_count;
+    header->entry_count = (uint32_t) entry_count;
+    header->rule_count = (uint32_t) rule_count;
+    header->file_size = offset;
+    header->source_mtime_sec = source->source_mtime_sec;
+    header->source_mtime_nsec = source->source_mtime_nsec;
+    header->source_size = source->source_size;
+    header->source_inode = source->source_inode;
+
+    /* Publish the index */
+    if(aurora_dirc_write(index_path, index, offset) != 0)
+    {
+        fprintf(stderr, "%s: unable to write %s\n", program, index_path);
+        free(index);
+        return -1;
+    }
+
+    /* Free memory */
+    free(index);
+
+    /* Index built */
+    return 0;
+}
+
+
+/**
+ * This function reads the directory source entries and derivation rules
+ * @param program The program name
+ * @param source_path The directory source path
+ * @param directory The parsed source destination, holding the entries
+ *        strings (to destroy)
+ * @param source The source state destination (in an index header)
+ * @param table The entries destination (to free)
+ * @param extra The entries to leave room for
+ * @param rules The derivation rules destination (to free)
+ * @param rule_count The derivation rules count destination
+ * @return 0 on success, -1 otherwise (the entries and rules are freed and
+ *         reset)
+ */
+static int
+aurora_dirc_source_read(const char *program, const char *source_path,
+config_t *directory, struct pam_directory_index_header *source,
+struct aurora_dirc_table *table, size_t extra,
+struct pam_directory_rule **rules, int *rule_count)
+{
+    /* The directory source */
+    FILE *directory_fd;
+    struct stat directory_stat;
+    config_setting_t *directory_emails;
+    config_setting_t *directory_rules;
+    config_setting_t *setting;
+
+    /* The entries */
+    struct aurora_dirc_entry entry;
+    const char *email;
+    int count;
+    int i;
+
+    /* Read the directory source */
+    if((directory_fd = fopen(source_path, "r")) == NULL)
+    {
+        fprintf(stderr, "%s: unable to open %s\n", program, source_path);
+        return -1;
+    }
+
+    if(fstat(fileno(directory_fd), &directory_stat) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s\n", program, source_path);
+        fclose(directory_fd);
+        return -1;
+    }
+
+    config_init(directory);
+
+    if(config_read(directory, directory_fd) == CONFIG_FALSE)
+    {
+        fprintf(stderr, "%s: %s:%d: %s\n", program, source_path,
+            config_error_line(directory), config_error_text(directory));
+        config_destroy(directory);
+        fclose(directory_fd);
+        return -1;
+    }
+
+    fclose(directory_fd);
+
+    memset(source, 0, sizeof(*source));
+    source->source_mtime_sec = (uint64_t) directory_stat.st_mtim.tv_sec;
+    source->source_mtime_nsec = (uint64_t) directory_stat.st_mtim.tv_nsec;
+    source->source_size = (uint64_t) directory_stat.st_size;
+    source->source_inode = (uint64_t) directory_stat.st_ino;
+
+    /* Get the emails collection */
+    directory_emails = config_lookup(directory, "emails");
+    count = directory_emails? config_setting_length(directory_emails): 0;
+    *rules = NULL;
+
+    if(aurora_dirc_table_init(table, (size_t) count + extra) != 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        config_destroy(directory);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        setting = config_setting_get_elem(directory_emails, i);
+        entry.login = config_setting_name(setting);
+
+        /* Skip invalid entries */
+        if((email = config_setting_get_string(setting)) == NULL)
+        {
+            fprintf(stderr, "%s: %s: %s is not a string, skipped\n",
+                program, source_path, entry.login);
+            continue;
+        }
+
+        entry.login_length = strlen(entry.login);
+        entry.email = email;
+        entry.email_length = strlen(email);
+
+        if(entry.login_length > PAM_AURORA_LOGIN_MAX
+            || entry.email_length > UINT16_MAX)
+        {
+            fprintf(stderr, "%s: %s: %s is too long, skipped\n",
+                program, source_path, entry.login);
+            continue;
+        }
+
+        if(entry.email_length > PAM_AURORA_EMAIL_MAX)
+            fprintf(stderr, "%s: %s: warning: email of %s exceeds %d "
+                "chars\n", program, source_path, entry.login,
+                PAM_AURORA_EMAIL_MAX);
+
+        aurora_dirc_table_set(table, &entry);
+    }
+
+    /* Check the derivation rules, kept in order after the records */
+    directory_rules = config_lookup(directory, "rules");
+    *rule_count = directory_rules? config_setting_length(directory_rules): 0;
+
+    if(*rule_count > 0
+        && (*rules = calloc((size_t) *rule_count, sizeof(**rules))) == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        goto aurora_dirc_source_read_error;
+    }
+
+    for(i = 0; i < *rule_count; i++)
+    {
+        if(pam_directory_rule_parse(config_setting_get_elem(directory_rules,
+            (unsigned int) i), &(*rules)[i]) != 0)
+        {
+            fprintf(stderr, "%s: %s: rule %d is invalid\n", program,
+                source_path, i + 1);
+            goto aurora_dirc_source_read_error;
+        }
+    }
+
+    /* Source read */
+    return 0;
+
+aurora_dirc_source_read_error:
+    free(*rules);
+    free(table->entries);
+    *rules = NULL;
+    table->entries = NULL;
+    config_destroy(directory);
+    return -1;
+}
+
+
+/**
+ * This function reads the entries and derivation rules of a mapped index
+ * @param program The program name
+ * @param index_path The index path
+ * @param index_map The index mapping (checked by pam_directory_index_valid)
+ * @param index_size The index size
+ * @param table The entries destination, pointing to the mapping (to free)
+ * @param extra The entries to leave room for
+ * @param rules The derivation rules destination, pointing to the mapping
+ *        (to free)
+ * @param rule_count The derivation rules count destination
+ * @return 0 on success, -1 otherwise (the entries and rules are freed and
+ *         reset)
+ */
+static int
+aurora_dirc_index_read(const char *program, const char *index_path,
+const unsigned char *index_map, size_t index_size,
+struct aurora_dirc_table *table, size_t extra,
+struct pam_directory_rule **rules, int *rule_count)
+{
+    /* The index structures */
+    const struct pam_directory_index_header *header =
+        (const struct pam_directory_index_header *) index_map;
+    const struct pam_directory_index_slot *slots =
+        (const struct pam_directory_index_slot *) (header + 1);
+    const struct pam_directory_index_record *record;
+    const struct pam_directory_index_rule *rule_record;
+    struct aurora_dirc_entry entry;
+    uint64_t offset;
+    uint32_t i;
+
+    *rules = NULL;
+    *rule_count = (int) header->rule_count;
+
+    if(aurora_dirc_table_init(table, header->entry_count + extra) != 0
+        || (*rule_count > 0 && (*rules = calloc((size_t) *rule_count,
+            sizeof(**rules))) == NULL))
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        free(table->entries);
+        table->entries = NULL;
+        return -1;
+    }
+
+    /* The records, by slot */
+    for(i = 0; i < header->bucket_count; i++)
+    {
+        if(slots[i].offset == 0)
+            continue;
+
+        record = (const struct pam_directory_index_record *)
+            (index_map + slots[i].offset);
+
+        if(slots[i].offset > index_size - sizeof(*record)
+            || index_size - slots[i].offset - sizeof(*record)
+                < (size_t) record->login_length + record->email_length + 1)
+            goto aurora_dirc_index_read_error;
+
+        entry.login = (const char *) (record + 1);
+        entry.login_length = record->login_length;
+        entry.email = record->email_length > 0?
+            entry.login + entry.login_length: NULL;
+        entry.email_length = record->email_length;
+        aurora_dirc_table_set(table, &entry);
+    }
+
+    /* The rules, in order */
+    for(i = 0, offset = header->rules_offset; i < header->rule_count; i++)
+    {
+        rule_record = (const struct pam_directory_index_rule *)
+            (index_map + offset);
+
+        if(offset > index_size - sizeof(*rule_record)
+            || offset + sizeof(*rule_record) + rule_record->pattern_length
+                + rule_record->email_length > index_size)
+            goto aurora_dirc_index_read_error;
+
+        (*rules)[i].kind = rule_record->kind;
+        (*rules)[i].pattern = (const char *) (rule_record + 1);
+        (*rules)[i].pattern_length = rule_record->pattern_length;
+        (*rules)[i].email = (*rules)[i].pattern + rule_record->pattern_length;
+        (*rules)[i].email_length = rule_record->email_length;
+
+        offset += sizeof(*rule_record) + rule_record->pattern_length
+            + rule_record->email_length;
+    }
+
+    /* Index read */
+    return 0;
+
+aurora_dirc_index_read_error:
+    fprintf(stderr, "%s: %s is invalid\n", program, index_path);
+    free(*rules);
+    free(table->entries);
+    *rules = NULL;
+    table->entries = NULL;
+    return -1;
+}
+
+
+/**
+ * This function empties the change log, by replacing it
+ * @param program The program name
+ * @param log_path The change log path
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_log_reset(const char *program, const char *log_path)
+{
+    /* The empty log */
+    struct pam_directory_log_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PAM_AURORA_LOG_MAGIC, 8);
+    header.version = PAM_AURORA_LOG_VERSION;
+
+    if(aurora_dirc_write(log_path, &header, sizeof(header)) != 0)
+    {
+        fprintf(stderr, "%s: unable to write %s\n", program, log_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function reads a change log file and finds its valid records
+ * @param log The log, with its file and size
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_log_read(struct aurora_dirc_log *log)
+{
+    /* The log records */
+    const struct pam_directory_log_record *record;
+    size_t offset;
+    ssize_t length;
+
+    if((log->data = malloc(log->size > 0? log->size: 1)) == NULL)
+        return -1;
+
+    for(offset = 0; offset < log->size; offset += (size_t) length)
+    {
+        if((length = pread(log->fd, log->data + offset, log->size - offset,
+            (off_t) offset)) <= 0)
+            return -1;
+    }
+
+    /* Refuse a file which is not a change log */
+    if(log->size < sizeof(struct pam_directory_log_header)
+        || memcmp(log->data, PAM_AURORA_LOG_MAGIC, 8) != 0
+        || ((const struct pam_directory_log_header *) log->data)->version
+            != PAM_AURORA_LOG_VERSION)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Find the end of the valid records */
+    offset = sizeof(struct pam_directory_log_header);
+    log->end = offset;
+
+    while((record = pam_directory_log_next(log->data, log->size, &offset))
+        != NULL && pam_directory_log_checksum(record) == record->checksum)
+    {
+        log->end = offset;
+        log->count++;
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function opens and locks the change log, creating it when needed,
+ * and reads its valid records
+ * @param log_path The change log path
+ * @param log The log destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_log_open(const char *log_path, struct aurora_dirc_log *log)
+{
+    /* The log header */
+    struct pam_directory_log_header header;
+    struct stat fd_stat;
+    struct stat path_stat;
+
+    memset(log, 0, sizeof(*log));
+
+    /* Lock the log file still at the path (a compaction replaces it) */
+    for(;;)
+    {
+        if((log->fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+            return -1;
+
+        if(flock(log->fd, LOCK_EX) != 0 || fstat(log->fd, &fd_stat) != 0)
+            goto aurora_dirc_log_open_error;
+
+        if(stat(log_path, &path_stat) == 0 && path_stat.st_ino == fd_stat.st_ino
+            && path_stat.st_dev == fd_stat.st_dev)
+            break;
+
+        close(log->fd);
+    }
+
+    /* Start a new log */
+    if(fd_stat.st_size == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PAM_AURORA_LOG_MAGIC, 8);
+        header.version = PAM_AURORA_LOG_VERSION;
+
+        if(pwrite(log->fd, &header, sizeof(header), 0)
+            != (ssize_t) sizeof(header) || fchmod(log->fd, 0644) != 0
+            || fsync(log->fd) != 0)
+            goto aurora_dirc_log_open_error;
+
+        fd_stat.st_size = sizeof(header);
+    }
+
+    /* Read the whole log */
+    log->size = (size_t) fd_stat.st_size;
+
+    if(aurora_dirc_log_read(log) != 0)
+        goto aurora_dirc_log_open_error;
+
+    /* Log locked */
+    return 0;
+
+aurora_dirc_log_open_error:
+    free(log->data);
+    close(log->fd);
+    return -1;
+}
+
+
+/**
+ * This function reads the compacted changes, which are only replaced under
+ * the change log lock
+ * @param changes_path The compacted changes path
+ * @param changes The changes destination (empty when there is no file)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_changes_read(const char *changes_path,
+struct aurora_dirc_log *changes)
+{
+    /* The changes file */
+    struct stat fd_stat;
+    int status;
+
+    memset(changes, 0, sizeof(*changes));
+
+    if((changes->fd = open(changes_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return errno == ENOENT? 0: -1;
+
+    if(fstat(changes->fd, &fd_stat) != 0)
+    {
+        close(changes->fd);
+        changes->fd = -1;
+        return -1;
+    }
+
+    /* Read the whole file */
+    changes->size = (size_t) fd_stat.st_size;
+    status = changes->size > 0? aurora_dirc_log_read(changes): 0;
+
+    close(changes->fd);
+    changes->fd = -1;
+
+    if(status != 0)
+    {
+        free(changes->data);
+        changes->data = NULL;
+    }
+
+    return status;
+}
+
+
+/**
+ * This function unlocks and closes the change log
+ * @param log The log
+ */
+static void
+aurora_dirc_log_close(struct aurora_dirc_log *log)
+{
+    /* Free memory */
+    free(log->data);
+
+    /* Closing the file releases the lock */
+    if(log->fd >= 0)
+        close(log->fd);
+}
+
+
+/**
+ * This function applies the valid records of a change log to entries, in
+ * order
+ * @param table The entries, with room for the records
+ * @param log The log
+ */
+static void
+aurora_dirc_log_replay(struct aurora_dirc_table *table,
+const struct aurora_dirc_log *log)
+{
+    /* The records */
+    const struct pam_directory_log_record *record;
+    struct aurora_dirc_entry entry;
+    size_t offset = sizeof(struct pam_directory_log_header);
+
+    if(log->data == NULL)
+        return;
+
+    while(offset < log->end && (record = pam_directory_log_next(log->data,
+        log->end, &offset)) != NULL)
+    {
+        entry.login = (const char *) (record + 1);
+        entry.login_length = record->login_length;
+        entry.email = record->email_length > 0?
+            entry.login + entry.login_length: NULL;
+        entry.email_length = record->email_length;
+        aurora_dirc_table_set(table, &entry);
+    }
+}
+
+
+/**
+ * This function folds the change log into the compacted changes, keeping
+ * the last change of each login
+ * @param program The program name
+ * @param changes_path The compacted changes path
+ * @param changes The compacted changes
+ * @param log The change log
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_changes_write(const char *program, const char *changes_path,
+const struct aurora_dirc_log *changes, const struct aurora_dirc_log *log)
+{
+    /* The last changes */
+    struct aurora_dirc_table table;
+    const struct aurora_dirc_entry *entry;
+    struct pam_directory_log_header *header;
+    struct pam_directory_log_record *record;
+    unsigned char *data;
+    size_t size = sizeof(*header);
+    size_t i;
+    int status;
+
+    if(aurora_dirc_table_init(&table, changes->count + log->count) != 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        return -1;
+    }
+
+    aurora_dirc_log_replay(&table, changes);
+    aurora_dirc_log_replay(&table, log);
+
+    for(i = 0; i < table.capacity; i++)
+        if(table.entries[i].login != NULL)
+            size += sizeof(*record) + table.entries[i].login_length
+                + table.entries[i].email_length;
+
+    if((data = calloc(1, size)) == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", program);
+        free(table.entries);
+        return -1;
+    }
+
+    /* Write a record per login */
+    header = (struct pam_directory_log_header *) data;
+    memcpy(header->magic, PAM_AURORA_LOG_MAGIC, 8);
+    header->version = PAM_AURORA_LOG_VERSION;
+    size = sizeof(*header);
+
+    for(i = 0; i < table.capacity; i++)
+    {
+        entry = &table.entries[i];
+
+        if(entry->login == NULL)
+            continue;
+
+        record = (struct pam_directory_log_record *) (data + size);
+        record->hash = (uint32_t) (pam_directory_hash(entry->login,
+            entry->login_length) >> 32);
+        record->login_length = (uint16_t) entry->login_length;
+        record->email_length = (uint16_t) entry->email_length;
+        memcpy(record + 1, entry->login, entry->login_length);
+
+        if(entry->email != NULL)
+            memcpy((char *) (record + 1) + entry->login_length, entry->email,
+                entry->email_length);
+
+        record->checksum = pam_directory_log_checksum(record);
+        size += sizeof(*record) + entry->login_length + entry->email_length;
+    }
+
+    if((status = aurora_dirc_write(changes_path, data, size)) != 0)
+        fprintf(stderr, "%s: unable to write %s\n", program, changes_path);
+
+    /* Free memory */
+    free(data);
+    free(table.entries);
+
+    return status;
+}
+
+
+/**
+ * This function prints the records of a change log, in the -a format
+ * @param log The log
+ */
+static void
+aurora_dirc_log_print(const struct aurora_dirc_log *log)
+{
+    /* The records */
+    const struct pam_directory_log_record *record;
+    size_t offset = sizeof(struct pam_directory_log_header);
+
+    if(log->data == NULL)
+        return;
+
+    while(offset < log->end && (record = pam_directory_log_next(log->data,
+        log->end, &offset)) != NULL)
+    {
+        if(record->email_length > 0)
+            printf("%.*s %.*s\n", (int) record->login_length,
+                (const char *) (record + 1), (int) record->email_length,
+                (const char *) (record + 1) + record->login_length);
+        else
+            printf("%.*s\n", (int) record->login_length,
+                (const char *) (record + 1));
+    }
+}
+
+
+/**
+ * This function prints the compacted changes, then the change log, in the
+ * -a format: applied again in order, they give the same directory
+ * @param program The program name
+ * @param log_path The change log path
+ * @param changes_path The compacted changes path
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_print(const char *program, const char *log_path,
+const char *changes_path)
+{
+    /* The changes */
+    struct aurora_dirc_log log;
+    struct aurora_dirc_log changes;
+
+    /* Lock the log, so that no compaction runs meanwhile */
+    if(aurora_dirc_log_open(log_path, &log) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", program, log_path,
+            strerror(errno));
+        return -1;
+    }
+
+    if(aurora_dirc_changes_read(changes_path, &changes) != 0)
+    {
+        fprintf(stderr, "%s: unable to read %s\n", program, changes_path);
+        aurora_dirc_log_close(&log);
+        return -1;
+    }
+
+    aurora_dirc_log_print(&changes);
+    aurora_dirc_log_print(&log);
+
+    /* Free memory, and unlock the log */
+    aurora_dirc_log_close(&changes);
+    aurora_dirc_log_close(&log);
+
+    return 0;
+}
+
+
+/**
+ * This function appends the changes read on a stream to the change log
+ * @param program The program name
+ * @param log_path The change log path
+ * @param input The changes stream
+ * @param records The log records count destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_append(const char *program, const char *log_path, FILE *input,
+size_t *records)
+{
+    /* The change lines */
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_length;
+    unsigned int line_number = 0;
+    char *login;
+    char *email;
+    char *extra;
+
+    /* The batch of records */
+    unsigned char *batch = NULL;
+    unsigned char *grown;
+    size_t batch_size = 0;
+    size_t batch_capacity = 0;
+    size_t batch_count = 0;
+    struct pam_directory_log_record *record;
+    size_t login_length;
+    size_t email_length;
+
+    /* The log */
+    struct aurora_dirc_log log;
+    int status = -1;
+
+    /* Check the whole batch before writing anything */
+    while((line_length = getline(&line, &line_size, input)) >= 0)
+    {
+        line_number++;
+
+        if((login = strtok(line, " \t\r\n")) == NULL || login[0] == '#')
+            continue;
+
+        email = strtok(NULL, " \t\r\n");
+        extra = strtok(NULL, " \t\r\n");
+        login_length = strlen(login);
+        email_length = email != NULL? strlen(email): 0;
+
+        if(extra != NULL || login_length > PAM_AURORA_LOGIN_MAX
+            || email_length > PAM_AURORA_EMAIL_MAX)
+        {
+            fprintf(stderr, "%s: line %u is invalid, no change applied\n",
+                program, line_number);
+            goto aurora_dirc_append_end;
+        }
+
+        /* Add the record to the batch */
+        if(batch_size + sizeof(*record) + login_length + email_length
+            > batch_capacity)
+        {
+            batch_capacity = batch_capacity * 2 + sizeof(*record)
+                + login_length + email_length;
+
+            if((grown = realloc(batch, batch_capacity)) == NULL)
+            {
+                fprintf(stderr, "%s: out of memory\n", program);
+                goto aurora_dirc_append_end;
+            }
+
+            batch = grown;
+        }
+
+        record = (struct pam_directory_log_record *) (batch + batch_size);
+        record->hash = (uint32_t) (pam_directory_hash(login, login_length)
+            >> 32);
+        record->login_length = (uint16_t) login_length;
+        record->email_length = (uint16_t) email_length;
+        memcpy(record + 1, login, login_length);
+
+        if(email != NULL)
+            memcpy((char *) (record + 1) + login_length, email, email_length);
+
+        record->checksum = pam_directory_log_checksum(record);
+
+        batch_size += sizeof(*record) + login_length + email_length;
+        batch_count++;
+    }
+
+    if(ferror(input))
+    {
+        fprintf(stderr, "%s: unable to read the changes\n", program);
+        goto aurora_dirc_append_end;
+    }
+
+    /* Lock the log, appenders and compaction are serialized */
+    if(aurora_dirc_log_open(log_path, &log) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", program, log_path,
+            strerror(errno));
+        goto aurora_dirc_append_end;
+    }
+
+    /* Drop the torn tail of an interrupted update, then append the batch
+       at once: the readers only see complete and checksummed records */
+    if(batch_size > 0 && ((log.end < log.size
+        && ftruncate(log.fd, (off_t) log.end) != 0)
+        || pwrite(log.fd, batch, batch_size, (off_t) log.end)
+            != (ssize_t) batch_size || fsync(log.fd) != 0))
+    {
+        fprintf(stderr, "%s: unable to write %s: %s\n", program, log_path,
+            strerror(errno));
+
+        if(ftruncate(log.fd, (off_t) log.end) != 0)
+            fprintf(stderr, "%s: %s may end with a torn record\n", program,
+                log_path);
+
+        aurora_dirc_log_close(&log);
+        goto aurora_dirc_append_end;
+    }
+
+    *records = log.count + batch_count;
+    aurora_dirc_log_close(&log);
+
+    printf("%s: %zu changes appended to %s\n", program, batch_count,
+        log_path);
+    status = 0;
+
+aurora_dirc_append_end:
+    /* Free memory */
+    free(line);
+    free(batch);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function compiles the directory source into the index
+ *
+ * The compacted changes and the change log are applied over the source, and
+ * the log is folded into the compacted changes, unless they are dropped.
+ * @param program The program name
+ * @param source_path The directory source path
+ * @param index_path The index path
+ * @param log_path The change log path
+ * @param changes_path The compacted changes path
+ * @param drop Whether the changes are dropped (once reported in the source)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_compile(const char *program, const char *source_path,
+const char *index_path, const char *log_path, const char *changes_path,
+int drop)
+{
+    /* The directory source */
+    config_t directory;
+    struct pam_directory_index_header source;
+
+    /* The entries and derivation rules */
+    struct aurora_dirc_table table;
+    struct pam_directory_rule *rules;
+    int rule_count;
+
+    /* The changes */
+    struct aurora_dirc_log log;
+    struct aurora_dirc_log changes;
+    int status = -1;
+
+    /* Lock the log, so that no change is appended meanwhile */
+    if(aurora_dirc_log_open(log_path, &log) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", program, log_path,
+            strerror(errno));
+        return -1;
+    }
+
+    if(aurora_dirc_changes_read(changes_path, &changes) != 0)
+    {
+        fprintf(stderr, "%s: unable to read %s\n", program, changes_path);
+        aurora_dirc_log_close(&log);
+        return -1;
+    }
+
+    if(aurora_dirc_source_read(program, source_path, &directory, &source,
+        &table, drop? 0: changes.count + log.count, &rules, &rule_count) != 0)
+    {
+        aurora_dirc_log_close(&changes);
+        aurora_dirc_log_close(&log);
+        return -1;
+    }
+
+    /* The changes override the source */
+    if(! drop)
+    {
+        aurora_dirc_log_replay(&table, &changes);
+        aurora_dirc_log_replay(&table, &log);
+    }
+
+    /* Publish the index before folding or emptying the log */
+    if(aurora_dirc_build(program, index_path, &table, rules, rule_count,
+        &source) != 0)
+        goto aurora_dirc_compile_end;
+
+    if(drop)
+    {
+        if((changes.count > 0 && aurora_dirc_log_reset(program,
+            changes_path) != 0) || (log.count > 0
+            && aurora_dirc_log_reset(program, log_path) != 0))
+            goto aurora_dirc_compile_end;
+    }
+    else if(log.count > 0 && (aurora_dirc_changes_write(program,
+        changes_path, &changes, &log) != 0
+        || aurora_dirc_log_reset(program, log_path) != 0))
+        goto aurora_dirc_compile_end;
+
+    printf("%s: %zu entries and %d rules compiled into %s\n", program,
+        table.count, rule_count, index_path);
+
+    if(changes.count + log.count > 0)
+        printf("%s: %zu changes %s\n", program, changes.count + log.count,
+            drop? "dropped": "applied again");
+
+    status = 0;
+
+aurora_dirc_compile_end:
+    /* Free memory */
+    free(rules);
+    free(table.entries);
+    config_destroy(&directory);
+    aurora_dirc_log_close(&changes);
+
+    /* Unlock the log */
+    aurora_dirc_log_close(&log);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function folds the change log into a new index and into the
+ * compacted changes, and empties it
+ *
+ * The changes are applied over the index, or over the directory source and
+ * the compacted changes when the index is missing or older than the source.
+ * @param program The program name
+ * @param source_path The directory source path
+ * @param index_path The index path
+ * @param log_path The change log path
+ * @param changes_path The compacted changes path
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_dirc_compact(const char *program, const char *source_path,
+const char *index_path, const char *log_path, const char *changes_path)
+{
+    /* The changes */
+    struct aurora_dirc_log log;
+    struct aurora_dirc_log changes;
+
+    /* The previous index */
+    int index_fd;
+    struct stat index_stat;
+    const unsigned char *index_map = NULL;
+    size_t index_size = 0;
+
+    /* The directory source */
+    config_t directory;
+    struct pam_directory_index_header source;
+    int source_read = 0;
+
+    /* The merged entries and derivation rules */
+    struct aurora_dirc_table table = { NULL, 0, 0 };
+    struct pam_directory_rule *rules = NULL;
+    int rule_count;
+    int status = -1;
+
+    /* Lock the log until it is emptied */
+    if(aurora_dirc_log_open(log_path, &log) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", program, log_path,
+            strerror(errno));
+        return -1;
+    }
+
+    if(log.count == 0)
+    {
+        printf("%s: no change to compact in %s\n", program, log_path);
+        aurora_dirc_log_close(&log);
+        return 0;
+    }
+
+    if(aurora_dirc_changes_read(changes_path, &changes) != 0)
+    {
+        fprintf(stderr, "%s: unable to read %s\n", program, changes_path);
+        aurora_dirc_log_close(&log);
+        return -1;
+    }
+
+    /* Map the previous index, if any */
+    if((index_fd = open(index_path, O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        if(fstat(index_fd, &index_stat) == 0 && index_stat.st_size > 0)
+        {
+            index_size = (size_t) index_stat.st_size;
+            index_map = mmap(NULL, index_size, PROT_READ, MAP_SHARED,
+                index_fd, 0);
+
+            if(index_map == MAP_FAILED)
+                index_map = NULL;
+        }
+
+        close(index_fd);
+    }
+
+    /* Start from the index, which holds the compacted changes, or from the
+       source it no longer matches */
+    if(index_map != NULL && pam_directory_index_valid(index_map, index_size)
+        && pam_directory_index_fresh((const struct
+            pam_directory_index_header *) index_map, source_path))
+    {
+        source = *(const struct pam_directory_index_header *) index_map;
+
+        if(aurora_dirc_index_read(program, index_path, index_map, index_size,
+            &table, log.count, &rules, &rule_count) != 0)
+            goto aurora_dirc_compact_end;
+    }
+    else
+    {
+        if(aurora_dirc_source_read(program, source_path, &directory, &source,
+            &table, changes.count + log.count, &rules, &rule_count) != 0)
+            goto aurora_dirc_compact_end;
+
+        source_read = 1;
+        aurora_dirc_log_replay(&table, &changes);
+    }
+
+    /* Replay the log over them, in order */
+    aurora_dirc_log_replay(&table, &log);
+
+    /* Keep the changes, then publish the index, before emptying the log: a
+       reader sees each change in one of them at least */
+    if(aurora_dirc_changes_write(program, changes_path, &changes, &log) != 0
+        || aurora_dirc_build(program, index_path, &table, rules, rule_count,
+            &source) != 0 || aurora_dirc_log_reset(program, log_path) != 0)
+        goto aurora_dirc_compact_end;
+
+    printf("%s: %zu changes compacted into %s\n", program, log.count,
+        index_path);
+    status = 0;
+
+aurora_dirc_compact_end:
+    /* Free memory */
+    free(rules);
+    free(table.entries);
+    aurora_dirc_log_close(&changes);
+
+    if(source_read)
+        config_destroy(&directory);
+
+    /* Properly unmap the previous index */
+    if(index_map != NULL)
+        munmap((void *) index_map, index_size);
+
+    /* Unlock the log */
+    aurora_dirc_log_close(&log);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * The directory compiler entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The paths */
+    const char *source_path = PAM_AURORA_DIRECTORY_PATH;
+    const char *index_path = NULL;
+    char index_buffer[4096];
+    char log_path[4096];
+    char changes_path[4096];
+
+    /* The options */
+    int append = 0;
+    int compact = 0;
+    int drop = 0;
+    int print = 0;
+    long threshold = PAM_AURORA_LOG_COMPACT;
+    size_t records;
+    int opt;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "o:acdm:ph")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o':
+                index_path = optarg;
+                break;
+
+            case 'a':
+                append = 1;
+                break;
+
+            case 'c':
+                compact = 1;
+                break;
+
+            case 'd':
+                drop = 1;
+                break;
+
+            case 'p':
+                print = 1;
+                break;
+
+            case 'm':
+                threshold = atol(optarg);
+                break;
+
+            default:
+                aurora_dirc_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(append + compact + drop + print > 1 || threshold < 0
+        || optind + 1 < argc)
+    {
+        aurora_dirc_usage(argv[0]);
+        return 1;
+    }
+
+    if(optind < argc)
+        source_path = argv[optind];
+
+    /* The index defaults to the source path with the ".idx" extension */
+    if(index_path == NULL)
+    {
+        if(optind >= argc)
+            index_path = PAM_AURORA_DIRECTORY_INDEX_PATH;
+        else if(pam_directory_index_path(source_path, index_buffer,
+            sizeof(index_buffer)) == 0)
+            index_path = index_buffer;
+        else
+        {
+            fprintf(stderr, "%s: path too long\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* The change log and the compacted changes live next to the index */
+    if(pam_directory_sibling_path(index_path, PAM_AURORA_LOG_EXTENSION,
+        log_path, sizeof(log_path)) != 0 || pam_directory_sibling_path(
+        index_path, PAM_AURORA_CHANGES_EXTENSION, changes_path,
+        sizeof(changes_path)) != 0)
+    {
+        fprintf(stderr, "%s: path too long\n", argv[0]);
+        return 1;
+    }
+
+    /* Compile the whole directory */
+    if(! append && ! compact && ! print)
+        return aurora_dirc_compile(argv[0], source_path, index_path,
+            log_path, changes_path, drop) == 0? 0: 1;
+
+    if(compact)
+        return aurora_dirc_compact(argv[0], source_path, index_path,
+            log_path, changes_path) == 0? 0: 1;
+
+    if(print)
+        return aurora_dirc_print(argv[0], log_path, changes_path) == 0? 0: 1;
+
+    if(aurora_dirc_append(argv[0], log_path, stdin, &records) != 0)
+        return 1;
+
+    /* Compact a long log in background, the changes are already durable */
+    if(threshold > 0 && records >= (size_t) threshold)
+    {
+        fflush(stdout);
+
+        if(daemon(1, 0) == 0)
+            return aurora_dirc_compact(argv[0], source_path, index_path,
+                log_path, changes_path) == 0? 0: 1;
+
+        fprintf(stderr, "%s: unable to start the compaction\n", argv[0]);
+    }
+
+    /* Changes appended */
+    return 0;
+}
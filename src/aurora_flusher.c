@@ -0,0 +1,866 @@
+/**
+ * file:        aurora_flusher.c
+ * description: Aurora spool flusher, delivering the spooled codes of
+ *              pam_aurora_email.so over few SMTP sessions
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_relay.h"
+#include "pam_aurora_smtp.h"
+#include "pam_aurora_spool.h"
+
+
+/* The wait for new messages between two spool scans (milliseconds) */
+#define AURORA_FLUSHER_POLL 1000
+
+/* The bounds of the wait before a deferred message is retried (seconds):
+   it is retried after as long as it has been spooled */
+#define AURORA_FLUSHER_RETRY_MIN 5
+#define AURORA_FLUSHER_RETRY_MAX 60
+
+
+/**
+ * The spooled messages names
+ **/
+struct aurora_flusher_names
+{
+    /* The names, sorted by queuing time */
+    char **names;
+    int count;
+    int capacity;
+};
+
+
+/**
+ * A flusher worker, delivering batches over its own session
+ **/
+struct aurora_flusher_worker
+{
+    /* The worker thread, while it runs */
+    pthread_t thread;
+    int started;
+
+    /* The configuration, and the spool new directory */
+    const struct pam_aurora_config *config;
+    int new_fd;
+
+    /* The batches of the scan: batch messages from the first one, every
+       stride messages */
+    char **names;
+    int count;
+    int first;
+    int stride;
+    int batch;
+
+    /* The session, its mail server and its last use */
+    struct pam_smtp smtp;
+    int connected;
+    const char *url;
+    time_t used;
+
+    /* Whether a batch could not be delivered, and the messages removed
+       from the spool */
+    int failed;
+    int unspooled;
+
+    /* The batch storage */
+    struct pam_spool_message *messages;
+    struct pam_smtp_email *emails;
+};
+
+
+/* The daemon state */
+static const char *aurora_flusher_config_path = PAM_AURORA_CONFIG_PATH;
+static volatile sig_atomic_t aurora_flusher_stopping = 0;
+
+
+/**
+ * This function handles the termination signals
+ * @param signal The signal number
+ */
+static void
+aurora_flusher_stop(int signal)
+{
+    aurora_flusher_stopping = 1;
+}
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_flusher_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-c config] [-b batch] [-w sessions] "
+        "[-i idle] [-d] [-s]\n"
+        "Deliver the codes spooled by pam_aurora_email.so, many per SMTP "
+        "session\n"
+        "  -c config    The configuration (default: %s)\n"
+        "  -b batch     The emails pipelined at once (default: 64)\n"
+        "  -w sessions  The parallel SMTP sessions (default: 4)\n"
+        "  -i idle      The idle session lifetime, seconds (default: 10)\n"
+        "  -d           Detach from the terminal\n"
+        "  -s           Print the spool depth and age, then exit\n",
+        program, PAM_AURORA_CONFIG_PATH);
+}
+
+
+/**
+ * This function compares two messages names
+ * @param a The first name
+ * @param b The second name
+ * @return The names order
+ */
+static int
+aurora_flusher_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/**
+ * This function releases the messages names
+ * @param names The names
+ */
+static void
+aurora_flusher_names_free(struct aurora_flusher_names *names)
+{
+    int i;
+
+    /* Free memory */
+    for(i = 0; i < names->count; i++)
+        free(names->names[i]);
+
+    names->count = 0;
+}
+
+
+/**
+ * This function lists the messages of a spool directory, oldest first
+ * @param dir_fd The spool directory
+ * @param names The names destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_flusher_scan(int dir_fd, struct aurora_flusher_names *names)
+{
+    /* The directory */
+    DIR *dir;
+    struct dirent *entry;
+    char **grown;
+    int status = 0;
+
+    aurora_flusher_names_free(names);
+
+    if((dir_fd = dup(dir_fd)) < 0 || (dir = fdopendir(dir_fd)) == NULL)
+    {
+        if(dir_fd >= 0)
+            close(dir_fd);
+
+        return -1;
+    }
+
+    rewinddir(dir);
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+
+        if(names->count == names->capacity)
+        {
+            if((grown = realloc(names->names, (size_t) (names->capacity * 2
+                + 64) * sizeof(*grown))) == NULL)
+            {
+                status = -1;
+                break;
+            }
+
+            names->names = grown;
+            names->capacity = names->capacity * 2 + 64;
+        }
+
+        if((names->names[names->count] = strdup(entry->d_name)) == NULL)
+        {
+            status = -1;
+            break;
+        }
+
+        names->count++;
+    }
+
+    closedir(dir);
+
+    qsort(names->names, (size_t) names->count, sizeof(*names->names),
+        aurora_flusher_compare);
+
+    return status;
+}
+
+
+/**
+ * This function leaves out the deferred messages whose next attempt is not
+ * due yet
+ * @param dir_fd The spool new directory
+ * @param names The messages names
+ */
+static void
+aurora_flusher_due(int dir_fd, struct aurora_flusher_names *names)
+{
+    /* The messages */
+    struct stat message_stat;
+    time_t now = time(NULL);
+    int due = 0;
+    int i;
+
+    for(i = 0; i < names->count; i++)
+    {
+        if(fstatat(dir_fd, names->names[i], &message_stat,
+            AT_SYMLINK_NOFOLLOW) == 0 && message_stat.st_mtime > now)
+        {
+            free(names->names[i]);
+            continue;
+        }
+
+        names->names[due++] = names->names[i];
+    }
+
+    names->count = due;
+}
+
+
+/**
+ * This function opens a spool subdirectory, creating the spool on first
+ * use
+ * @param spool_dir The spool directory
+ * @param name The subdirectory name
+ * @return The subdirectory descriptor, or -1 on error
+ */
+static int
+aurora_flusher_open(const char *spool_dir, const char *name)
+{
+    /* The subdirectory path */
+    char path[4096];
+
+    if(snprintf(path, sizeof(path), "%s/%s", spool_dir, name)
+        >= (int) sizeof(path))
+        return -1;
+
+    mkdir(spool_dir, 0700);
+    mkdir(path, 0700);
+
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+
+/**
+ * This function prints the spool depth and the age of its oldest message
+ * @param config The configuration
+ * @return The exit status
+ */
+static int
+aurora_flusher_status(const struct pam_aurora_config *config)
+{
+    /* The spool */
+    struct aurora_flusher_names names = { NULL, 0, 0 };
+    int new_fd;
+    int64_t oldest = 0;
+
+    if((new_fd = aurora_flusher_open(config->spool_dir,
+        PAM_AURORA_SPOOL_NEW)) < 0 || aurora_flusher_scan(new_fd, &names) != 0)
+    {
+        fprintf(stderr, "unable to read %s: %s\n", config->spool_dir,
+            strerror(errno));
+        return 1;
+    }
+
+    if(names.count > 0)
+        oldest = (int64_t) time(NULL) - strtoll(names.names[0], NULL, 10);
+
+    printf("depth %d\noldest %lld\n", names.count, (long long) oldest);
+
+    /* Free memory */
+    aurora_flusher_names_free(&names);
+    free(names.names);
+    close(new_fd);
+
+    return 0;
+}
+
+
+/**
+ * This function removes the messages left behind by writers that died
+ * @param config The configuration
+ * @param tmp_fd The spool tmp directory
+ */
+static void
+aurora_flusher_clean(const struct pam_aurora_config *config, int tmp_fd)
+{
+    /* The abandoned messages */
+    struct aurora_flusher_names names = { NULL, 0, 0 };
+    struct stat message_stat;
+    time_t now = time(NULL);
+    int i;
+
+    if(aurora_flusher_scan(tmp_fd, &names) != 0)
+        return;
+
+    for(i = 0; i < names.count; i++)
+        if(fstatat(tmp_fd, names.names[i], &message_stat,
+            AT_SYMLINK_NOFOLLOW) == 0
+            && message_stat.st_mtime + config->spool_max_age < now)
+            unlinkat(tmp_fd, names.names[i], 0);
+
+    /* Free memory */
+    aurora_flusher_names_free(&names);
+    free(names.names);
+}
+
+
+/**
+ * This function opens a session with the healthiest mail server
+ * @param smtp The session destination
+ * @param config The configuration
+ * @param url The mail server URL destination
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_flusher_connect(struct pam_smtp *smtp,
+const struct pam_aurora_config *config, const char **url)
+{
+    /* The mail servers */
+    struct pam_shm relays;
+    int order[PAM_AURORA_RELAY_MAX];
+    int64_t probes[PAM_AURORA_RELAY_MAX];
+    int count;
+    int i;
+    int j;
+
+    pam_relay_open(&relays, config);
+    count = pam_relay_order(&relays, config, order, probes);
+
+    for(i = 0; i < count; i++)
+    {
+        *url = config->mail_servers[order[i]];
+
+        if(pam_smtp_open(smtp, config, *url, config->mail_connect_timeout)
+            == 0)
+            break;
+
+        syslog(LOG_ERR, "unable to open a session with %s", *url);
+        pam_relay_record(&relays, *url, PAM_AURORA_RELAY_FAILED, 0);
+    }
+
+    /* Let another session probe the mail servers not tried */
+    for(j = i + 1; j < count; j++)
+        pam_relay_release(&relays, config->mail_servers[order[j]],
+            probes[order[j]]);
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&relays);
+
+    return i < count? 0: -1;
+}
+
+
+/**
+ * This function defers a spooled message: its modification time, in the
+ * future, is the time of its next attempt
+ * @param new_fd The spool new directory
+ * @param message The message
+ * @param now The current time (seconds since the epoch)
+ */
+static void
+aurora_flusher_defer(int new_fd, const struct pam_spool_message *message,
+int64_t now)
+{
+    /* The next attempt */
+    struct timespec times[2];
+    int64_t delay = now - message->queued;
+
+    if(delay < AURORA_FLUSHER_RETRY_MIN)
+        delay = AURORA_FLUSHER_RETRY_MIN;
+    else if(delay > AURORA_FLUSHER_RETRY_MAX)
+        delay = AURORA_FLUSHER_RETRY_MAX;
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = (time_t) (now + delay);
+    times[1].tv_nsec = 0;
+
+    utimensat(new_fd, message->name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+
+/**
+ * This function delivers a batch of spooled messages
+ * @param worker The worker
+ * @param names The messages names
+ * @param count The messages count
+ * @return The messages left in the spool, or -1 when the session failed
+ */
+static int
+aurora_flusher_send(struct aurora_flusher_worker *worker, char **names,
+int count)
+{
+    /* The batch */
+    const struct pam_aurora_config *config = worker->config;
+    struct pam_spool_message *messages = worker->messages;
+    struct pam_smtp_email *emails = worker->emails;
+    int64_t now = (int64_t) time(NULL);
+    int64_t start;
+    int loaded = 0;
+    int delivered = 0;
+    int left = 0;
+    int status;
+    int i;
+
+    /* The mail servers */
+    struct pam_shm relays;
+
+    for(i = 0; i < count; i++)
+    {
+        errno = 0;
+
+        /* Another flusher sent it, or it is torn (the writer died before
+           the sync) */
+        if(pam_spool_load(worker->new_fd, names[i], &messages[loaded]) != 0)
+        {
+            if(errno != ENOENT && unlinkat(worker->new_fd, names[i], 0) == 0)
+            {
+                syslog(LOG_ERR, "torn message %s dropped", names[i]);
+                worker->unspooled++;
+            }
+
+            continue;
+        }
+
+        /* The code has expired */
+        if(messages[loaded].queued + config->spool_max_age < now)
+        {
+            syslog(LOG_ERR, "code for %s dropped after %llds in the spool",
+                messages[loaded].to, (long long) (now
+                    - messages[loaded].queued));
+            unlinkat(worker->new_fd, names[i], 0);
+            worker->unspooled++;
+            continue;
+        }
+
+        emails[loaded].from = messages[loaded].from;
+        emails[loaded].to = messages[loaded].to;
+        emails[loaded].data = messages[loaded].email;
+        emails[loaded].length = messages[loaded].email_length;
+        loaded++;
+    }
+
+    if(loaded == 0)
+        return 0;
+
+    start = pam_mail_now();
+    status = pam_smtp_send(&worker->smtp, emails, loaded);
+
+    /* Unspool the delivered and rejected emails */
+    for(i = 0; i < loaded; i++)
+    {
+        if(emails[i].status / 100 == 2)
+            delivered++;
+        else if(emails[i].status / 100 == 5)
+            syslog(LOG_ERR, "code for %s rejected (%d)", emails[i].to,
+                emails[i].status);
+        else
+        {
+            /* Deferred by the mail server (a failed session retries the
+               batch at once) */
+            if(status == 0)
+                aurora_flusher_defer(worker->new_fd, &messages[i], now);
+
+            left++;
+            continue;
+        }
+
+        unlinkat(worker->new_fd, messages[i].name, 0);
+        worker->unspooled++;
+    }
+
+    /* Record the mail server health */
+    pam_relay_open(&relays, config);
+    pam_relay_record(&relays, worker->url, status == 0?
+        PAM_AURORA_RELAY_DELIVERED: PAM_AURORA_RELAY_FAILED,
+        (uint32_t) ((pam_mail_now() - start) * 1000 / loaded));
+    pam_shm_unmap(&relays);
+
+    if(delivered > 0)
+        syslog(LOG_DEBUG, "%d codes delivered through %s", delivered,
+            worker->url);
+
+    return status == 0? left: -1;
+}
+
+
+/**
+ * The worker thread, delivering its batches of the spool scan over its
+ * session
+ * @param worker_ptr The worker
+ * @return NULL
+ */
+static void *
+aurora_flusher_work(void *worker_ptr)
+{
+    /* The worker */
+    struct aurora_flusher_worker *worker = worker_ptr;
+    int offset;
+    int count;
+    int reused;
+
+    worker->failed = 0;
+    worker->unspooled = 0;
+
+    for(offset = worker->first; offset < worker->count
+        && ! aurora_flusher_stopping; offset += worker->stride)
+    {
+        count = worker->count - offset < worker->batch? worker->count - offset:
+            worker->batch;
+
+        /* Reuse the session, or open one */
+        if(! (reused = worker->connected))
+        {
+            if(aurora_flusher_connect(&worker->smtp, worker->config,
+                &worker->url) != 0)
+            {
+                worker->failed = 1;
+                break;
+            }
+
+            worker->connected = 1;
+        }
+
+        worker->used = time(NULL);
+
+        if(aurora_flusher_send(worker, worker->names + offset, count) >= 0)
+            continue;
+
+        /* The session failed: an idle one may have been closed by the
+           server, so the batch is retried once with a fresh one */
+        syslog(reused? LOG_DEBUG: LOG_ERR, "session with %s failed",
+            worker->url);
+        pam_smtp_close(&worker->smtp, 0);
+        worker->connected = 0;
+
+        if(! reused)
+        {
+            worker->failed = 1;
+            break;
+        }
+
+        offset -= worker->stride;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * This function closes the idle sessions, then waits for new messages
+ * @param workers The workers
+ * @param workers_count The workers count
+ * @param idle The idle session lifetime (seconds)
+ * @param watch The spool new directory watch
+ */
+static void
+aurora_flusher_idle(struct aurora_flusher_worker *workers, int workers_count,
+int idle, struct pollfd *watch)
+{
+    /* The watch events */
+    char events[4096];
+    int i;
+
+    /* Close the idle sessions */
+    for(i = 0; i < workers_count; i++)
+        if(workers[i].connected && workers[i].used + idle <= time(NULL))
+        {
+            pam_smtp_close(&workers[i].smtp, 1);
+            workers[i].connected = 0;
+        }
+
+    /* Wait for new messages */
+    if(poll(watch, 1, AURORA_FLUSHER_POLL) > 0)
+        while(read(watch->fd, events, sizeof(events)) > 0);
+}
+
+
+/**
+ * The spool flusher entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    int batch = 64;
+    int idle = 10;
+    int workers_count = 4;
+    int detach = 0;
+    int status_only = 0;
+    int opt;
+
+    /* The configuration */
+    const struct pam_aurora_config *config;
+    const struct pam_aurora_config *current;
+
+    /* The spool */
+    struct aurora_flusher_names names = { NULL, 0, 0 };
+    char path[4096];
+    int new_fd;
+    int tmp_fd;
+    int watch_fd;
+    time_t cleaned = 0;
+
+    /* The workers, each with its session */
+    struct aurora_flusher_worker *workers;
+    int chunk;
+    int running;
+    int failed;
+    int unspooled;
+    int i;
+
+    /* The event loop */
+    struct sigaction action;
+    struct pollfd watch;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "c:b:i:w:dsh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                aurora_flusher_config_path = optarg;
+                break;
+
+            case 'b':
+                batch = atoi(optarg);
+                break;
+
+            case 'i':
+                idle = atoi(optarg);
+                break;
+
+            case 'w':
+                workers_count = atoi(optarg);
+                break;
+
+            case 'd':
+                detach = 1;
+                break;
+
+            case 's':
+                status_only = 1;
+                break;
+
+            default:
+                aurora_flusher_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(batch < 1 || idle < 0 || workers_count < 1)
+    {
+        aurora_flusher_usage(argv[0]);
+        return 1;
+    }
+
+    /* Load the configuration */
+    if(pam_config_acquire(aurora_flusher_config_path, &config)
+        != PAM_AURORA_CONFIG_OK)
+    {
+        fprintf(stderr, "%s: unable to load %s\n", argv[0],
+            aurora_flusher_config_path);
+        return 1;
+    }
+
+    if(status_only)
+        return aurora_flusher_status(config);
+
+    /* Open the spool */
+    if((new_fd = aurora_flusher_open(config->spool_dir,
+        PAM_AURORA_SPOOL_NEW)) < 0
+        || (tmp_fd = aurora_flusher_open(config->spool_dir,
+            PAM_AURORA_SPOOL_TMP)) < 0
+        || snprintf(path, sizeof(path), "%s/%s", config->spool_dir,
+            PAM_AURORA_SPOOL_NEW) >= (int) sizeof(path)
+        || (watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+        || inotify_add_watch(watch_fd, path, IN_MOVED_TO) < 0)
+    {
+        fprintf(stderr, "%s: unable to open %s: %s\n", argv[0],
+            config->spool_dir, strerror(errno));
+        return 1;
+    }
+
+    /* Allocate the workers */
+    if((workers = calloc((size_t) workers_count, sizeof(*workers))) == NULL)
+        return 1;
+
+    for(i = 0; i < workers_count; i++)
+    {
+        workers[i].new_fd = new_fd;
+
+        if((workers[i].messages = malloc((size_t) batch
+            * sizeof(*workers[i].messages))) == NULL
+            || (workers[i].emails = malloc((size_t) batch
+                * sizeof(*workers[i].emails))) == NULL)
+            return 1;
+    }
+
+    if(detach && daemon(0, 0) != 0)
+    {
+        fprintf(stderr, "%s: unable to detach\n", argv[0]);
+        return 1;
+    }
+
+    openlog("aurora-flusher", LOG_PID | (detach? 0: LOG_PERROR), LOG_MAIL);
+
+    /* Handle signals */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = aurora_flusher_stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    syslog(LOG_INFO, "flushing %s with %d sessions", config->spool_dir,
+        workers_count);
+
+    watch.fd = watch_fd;
+    watch.events = POLLIN;
+
+    while(! aurora_flusher_stopping)
+    {
+        /* Follow the configuration changes, with new sessions */
+        if(pam_config_acquire(aurora_flusher_config_path, &current)
+            == PAM_AURORA_CONFIG_OK)
+        {
+            for(i = 0; i < workers_count && current != config; i++)
+                if(workers[i].connected)
+                {
+                    pam_smtp_close(&workers[i].smtp, 1);
+                    workers[i].connected = 0;
+                }
+
+            pam_config_release(config);
+            config = current;
+        }
+
+        /* Remove the messages of the writers that died, from time to time */
+        if(cleaned + config->spool_max_age < time(NULL))
+        {
+            aurora_flusher_clean(config, tmp_fd);
+            cleaned = time(NULL);
+        }
+
+        /* Drain the spool, oldest first, but the deferred messages */
+        if(aurora_flusher_scan(new_fd, &names) != 0)
+            aurora_flusher_names_free(&names);
+        else
+            aurora_flusher_due(new_fd, &names);
+
+        if(names.count == 0)
+        {
+            aurora_flusher_idle(workers, workers_count, idle, &watch);
+            continue;
+        }
+
+        /* Share the messages between the sessions, the warm ones first,
+           by batches of at most batch messages */
+        chunk = (names.count + workers_count - 1) / workers_count;
+
+        if(chunk > batch)
+            chunk = batch;
+
+        running = (names.count + chunk - 1) / chunk;
+
+        if(running > workers_count)
+            running = workers_count;
+
+        for(i = 0; i < running; i++)
+        {
+            workers[i].config = config;
+            workers[i].names = names.names;
+            workers[i].count = names.count;
+            workers[i].batch = chunk;
+            workers[i].first = i * chunk;
+            workers[i].stride = running * chunk;
+
+            if(pthread_create(&workers[i].thread, NULL, aurora_flusher_work,
+                &workers[i]) != 0)
+                aurora_flusher_work(&workers[i]);
+            else
+                workers[i].started = 1;
+        }
+
+        failed = 0;
+        unspooled = 0;
+
+        for(i = 0; i < running; i++)
+        {
+            if(workers[i].started)
+                pthread_join(workers[i].thread, NULL);
+
+            workers[i].started = 0;
+            failed |= workers[i].failed;
+            unspooled += workers[i].unspooled;
+        }
+
+        /* Let a failing mail server rest */
+        if(failed && ! aurora_flusher_stopping)
+            poll(NULL, 0, AURORA_FLUSHER_POLL);
+
+        /* Only deferred messages are left: wait for new ones, or for the
+           next attempts */
+        else if(unspooled == 0)
+            aurora_flusher_idle(workers, workers_count, idle, &watch);
+    }
+
+    syslog(LOG_INFO, "stopping");
+
+    /* Properly close the sessions */
+    for(i = 0; i < workers_count; i++)
+    {
+        if(workers[i].connected)
+            pam_smtp_close(&workers[i].smtp, 1);
+
+        /* Free memory */
+        free(workers[i].messages);
+        free(workers[i].emails);
+    }
+
+    /* Free memory */
+    free(workers);
+    aurora_flusher_names_free(&names);
+    free(names.names);
+    close(watch_fd);
+    close(tmp_fd);
+    close(new_fd);
+    pam_config_release(config);
+    closelog();
+
+    return 0;
+}
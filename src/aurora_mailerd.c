@@ -0,0 +1,660 @@
+/**
+ * file:        aurora_mailerd.c
+ * description: Aurora mail daemon, delivering codes over warm SMTP
+ *              connections on behalf of pam_aurora_email.so
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <curl/curl.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_mailer.h"
+
+
+/* The largest request */
+#define AURORA_MAILERD_REQUEST_MAX (sizeof(struct pam_mailer_request) \
+    + PAM_AURORA_MAILER_FIELDS * PAM_AURORA_MAILER_FIELD_MAX)
+
+/* The event loop batch size */
+#define AURORA_MAILERD_EVENTS 64
+
+
+/**
+ * A delivery job
+ **/
+struct aurora_mailerd_job
+{
+    /* Next job in the queue */
+    struct aurora_mailerd_job *next;
+
+    /* The configuration snapshot the job has been accepted with */
+    const struct pam_aurora_config *config;
+
+    /* The delivery deadline (see pam_mail_now, 0 for none): the code is
+       useless once the authentication gave up */
+    int64_t deadline;
+
+    /* The NUL terminated fields */
+    char *field[PAM_AURORA_MAILER_FIELDS];
+
+    /* The fields storage */
+    char data[];
+};
+
+
+/**
+ * The jobs queue shared by the workers
+ **/
+struct aurora_mailerd_queue
+{
+    /* Queue lock and condition */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+    /* Queued jobs */
+    struct aurora_mailerd_job *head;
+    struct aurora_mailerd_job *tail;
+    int length;
+    int capacity;
+
+    /* Shutdown flag */
+    int stopping;
+};
+
+
+/**
+ * A client connection
+ **/
+struct aurora_mailerd_client
+{
+    /* Client socket */
+    int fd;
+
+    /* Received bytes */
+    size_t length;
+    unsigned char buffer[AURORA_MAILERD_REQUEST_MAX];
+};
+
+
+/* The daemon state */
+static struct aurora_mailerd_queue aurora_mailerd_jobs = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0
+};
+static const char *aurora_mailerd_config_path = PAM_AURORA_CONFIG_PATH;
+static volatile sig_atomic_t aurora_mailerd_stopping = 0;
+
+
+/**
+ * This function handles the termination signals
+ * @param signal The signal number
+ */
+static void
+aurora_mailerd_stop(int signal)
+{
+    aurora_mailerd_stopping = 1;
+}
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_mailerd_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-c config] [-s socket] [-w workers] "
+        "[-q queue] [-d]\n"
+        "Deliver pam_aurora_email.so codes over persistent SMTP "
+        "connections\n"
+        "  -c config    The configuration (default: %s)\n"
+        "  -s socket    The listening socket (default: mailerd_socket)\n"
+        "  -w workers   The SMTP workers count (default: 4)\n"
+        "  -q queue     The maximum queued jobs (default: 1024)\n"
+        "  -d           Detach from the terminal\n",
+        program, PAM_AURORA_CONFIG_PATH);
+}
+
+
+/**
+ * This function releases a job
+ * @param job The job
+ */
+static void
+aurora_mailerd_job_free(struct aurora_mailerd_job *job)
+{
+    pam_config_release(job->config);
+    free(job);
+}
+
+
+/**
+ * This function queues a job unless the queue is full
+ * @param job The job
+ * @return 0 on success, -1 when the queue is full
+ */
+static int
+aurora_mailerd_queue_push(struct aurora_mailerd_job *job)
+{
+    pthread_mutex_lock(&aurora_mailerd_jobs.lock);
+
+    if(aurora_mailerd_jobs.length >= aurora_mailerd_jobs.capacity)
+    {
+        pthread_mutex_unlock(&aurora_mailerd_jobs.lock);
+        return -1;
+    }
+
+    /* Append the job */
+    job->next = NULL;
+
+    if(aurora_mailerd_jobs.tail != NULL)
+        aurora_mailerd_jobs.tail->next = job;
+    else
+        aurora_mailerd_jobs.head = job;
+
+    aurora_mailerd_jobs.tail = job;
+    aurora_mailerd_jobs.length++;
+
+    /* Wake up a worker */
+    pthread_cond_signal(&aurora_mailerd_jobs.ready);
+    pthread_mutex_unlock(&aurora_mailerd_jobs.lock);
+
+    return 0;
+}
+
+
+/**
+ * This function waits for the next job
+ * @return The job, or NULL when the daemon stops
+ */
+static struct aurora_mailerd_job *
+aurora_mailerd_queue_pop(void)
+{
+    /* The job */
+    struct aurora_mailerd_job *job;
+
+    pthread_mutex_lock(&aurora_mailerd_jobs.lock);
+
+    /* Wait for a job (queued jobs are still delivered when stopping) */
+    while(aurora_mailerd_jobs.head == NULL && ! aurora_mailerd_jobs.stopping)
+        pthread_cond_wait(&aurora_mailerd_jobs.ready,
+            &aurora_mailerd_jobs.lock);
+
+    if((job = aurora_mailerd_jobs.head) != NULL)
+    {
+        aurora_mailerd_jobs.head = job->next;
+
+        if(aurora_mailerd_jobs.head == NULL)
+            aurora_mailerd_jobs.tail = NULL;
+
+        aurora_mailerd_jobs.length--;
+    }
+
+    pthread_mutex_unlock(&aurora_mailerd_jobs.lock);
+
+    return job;
+}
+
+
+/**
+ * The SMTP worker, each worker keeps its own SMTP client so that its
+ * authenticated connections are reused from one job to the next
+ * @param arg Unused
+ * @return NULL
+ */
+static void *
+aurora_mailerd_worker(void *arg)
+{
+    /* The worker SMTP client */
+    struct pam_mail_client client;
+    CURLcode res;
+
+    /* The job */
+    struct aurora_mailerd_job *job;
+    struct pam_email_ctx email_ctx;
+
+    if(pam_mail_client_init(&client) != 0)
+    {
+        syslog(LOG_ERR, "unable to init curl, worker stopped");
+        return NULL;
+    }
+
+    while((job = aurora_mailerd_queue_pop()) != NULL)
+    {
+        /* Check mail server settings */
+        if(job->config->mail_server_host == NULL
+            || job->config->mail_server_user == NULL
+            || job->config->mail_server_pass == NULL)
+        {
+            syslog(LOG_ERR, "mail server configuration not found, "
+                "code for %s dropped", job->field[PAM_AURORA_MAILER_USER]);
+            aurora_mailerd_job_free(job);
+            continue;
+        }
+
+        /* Set email context */
+        email_ctx.from = (char *) job->config->mail_server_user;
+        email_ctx.to = job->field[PAM_AURORA_MAILER_EMAIL];
+        email_ctx.user = job->field[PAM_AURORA_MAILER_USER];
+        email_ctx.code = job->field[PAM_AURORA_MAILER_CODE];
+        email_ctx.uuid = job->field[PAM_AURORA_MAILER_MESSAGE_ID];
+
+        /* Send email (over the kept connections when still alive) */
+        if((res = pam_mail_send(&client, job->config, &email_ctx, 
+            job->deadline)) != CURLE_OK)
+            syslog(LOG_ERR, "code for %s not delivered: %s",
+                job->field[PAM_AURORA_MAILER_USER], curl_easy_strerror(res));
+
+        aurora_mailerd_job_free(job);
+    }
+
+    /* Properly close the connections */
+    pam_mail_client_cleanup(&client);
+
+    return NULL;
+}
+
+
+/**
+ * This function turns a complete request into a queued job
+ * @param request The request
+ * @return The reply byte
+ */
+static char
+aurora_mailerd_accept(const unsigned char *request)
+{
+    /* The request */
+    const struct pam_mailer_request *header =
+        (const struct pam_mailer_request *) request;
+    const unsigned char *field = request + sizeof(*header);
+
+    /* The job */
+    struct aurora_mailerd_job *job;
+    size_t size = 0;
+    char *cursor;
+    int i;
+
+    /* Allocate the job */
+    for(i = 0; i < PAM_AURORA_MAILER_FIELDS; i++)
+        size += header->length[i] + 1;
+
+    if((job = malloc(sizeof(*job) + size)) == NULL)
+        return PAM_AURORA_MAILER_REFUSED;
+
+    /* Copy the fields */
+    for(i = 0, cursor = job->data; i < PAM_AURORA_MAILER_FIELDS; i++)
+    {
+        job->field[i] = cursor;
+        memcpy(cursor, field, header->length[i]);
+        cursor[header->length[i]] = '\0';
+        cursor += header->length[i] + 1;
+        field += header->length[i];
+    }
+
+    /* Attach the current configuration (reloaded when changed) */
+    if(pam_config_acquire(aurora_mailerd_config_path, &job->config)
+        != PAM_AURORA_CONFIG_OK)
+    {
+        syslog(LOG_ERR, "unable to load %s", aurora_mailerd_config_path);
+        free(job);
+        return PAM_AURORA_MAILER_REFUSED;
+    }
+
+    job->deadline = job->config->auth_deadline > 0? 
+        pam_mail_now() + job->config->auth_deadline: 0;
+
+    /* Queue the job */
+    if(aurora_mailerd_queue_push(job) != 0)
+    {
+        syslog(LOG_WARNING, "queue full, code for %s refused",
+            job->field[PAM_AURORA_MAILER_USER]);
+        aurora_mailerd_job_free(job);
+        return PAM_AURORA_MAILER_REFUSED;
+    }
+
+    /* Job accepted */
+    return PAM_AURORA_MAILER_ACCEPTED;
+}
+
+
+/**
+ * This function reads the pending requests of a client
+ * @param client The client
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int
+aurora_mailerd_read(struct aurora_mailerd_client *client)
+{
+    /* The request */
+    const struct pam_mailer_request *header =
+        (const struct pam_mailer_request *) client->buffer;
+    size_t request_size;
+    ssize_t received;
+    char reply;
+    int i;
+
+    for(;;)
+    {
+        /* Receive what is available */
+        received = read(client->fd, client->buffer + client->length,
+            sizeof(client->buffer) - client->length);
+
+        if(received == 0)
+            return -1;
+
+        if(received < 0)
+            return errno == EAGAIN || errno == EINTR? 0: -1;
+
+        client->length += (size_t) received;
+
+        /* Handle each complete request */
+        while(client->length >= sizeof(*header))
+        {
+            if(header->magic != PAM_AURORA_MAILER_MAGIC)
+                return -1;
+
+            for(i = 0, request_size = sizeof(*header);
+                i < PAM_AURORA_MAILER_FIELDS; i++)
+            {
+                if(header->length[i] > PAM_AURORA_MAILER_FIELD_MAX)
+                    return -1;
+
+                request_size += header->length[i];
+            }
+
+            if(client->length < request_size)
+                break;
+
+            /* Queue the job and acknowledge it */
+            reply = aurora_mailerd_accept(client->buffer);
+
+            if(write(client->fd, &reply, 1) != 1)
+                return -1;
+
+            /* Keep the next request */
+            memmove(client->buffer, client->buffer + request_size,
+                client->length - request_size);
+            client->length -= request_size;
+        }
+    }
+}
+
+
+/**
+ * This function opens the listening socket
+ * @param path The socket path
+ * @return The socket, or -1 on error
+ */
+static int
+aurora_mailerd_listen(const char *path)
+{
+    /* The socket */
+    struct sockaddr_un listen_addr;
+    int listen_fd;
+    mode_t umask_saved;
+
+    if(strlen(path) >= sizeof(listen_addr.sun_path))
+        return -1;
+
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sun_family = AF_UNIX;
+    strcpy(listen_addr.sun_path, path);
+
+    if((listen_fd = socket(AF_UNIX,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    /* Only the owner may submit codes */
+    unlink(path);
+    umask_saved = umask(0177);
+
+    if(bind(listen_fd, (struct sockaddr *) &listen_addr,
+        sizeof(listen_addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        umask(umask_saved);
+        close(listen_fd);
+        return -1;
+    }
+
+    umask(umask_saved);
+
+    return listen_fd;
+}
+
+
+/**
+ * The mail daemon entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *socket_path = NULL;
+    int workers_count = 4;
+    int detach = 0;
+    int opt;
+
+    /* The configuration */
+    const struct pam_aurora_config *config;
+
+    /* The workers */
+    pthread_t *workers;
+    int i;
+
+    /* The event loop */
+    struct sigaction action;
+    sigset_t stop_signals;
+    sigset_t wait_signals;
+    struct epoll_event event;
+    struct epoll_event events[AURORA_MAILERD_EVENTS];
+    struct aurora_mailerd_client *client;
+    struct ucred credentials;
+    socklen_t credentials_length;
+    int listen_fd;
+    int epoll_fd;
+    int client_fd;
+    int ready;
+
+    /* Parse arguments */
+    aurora_mailerd_jobs.capacity = 1024;
+
+    while((opt = getopt(argc, argv, "c:s:w:q:dh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                aurora_mailerd_config_path = optarg;
+                break;
+
+            case 's':
+                socket_path = optarg;
+                break;
+
+            case 'w':
+                workers_count = atoi(optarg);
+                break;
+
+            case 'q':
+                aurora_mailerd_jobs.capacity = atoi(optarg);
+                break;
+
+            case 'd':
+                detach = 1;
+                break;
+
+            default:
+                aurora_mailerd_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(workers_count < 1 || aurora_mailerd_jobs.capacity < 1)
+    {
+        aurora_mailerd_usage(argv[0]);
+        return 1;
+    }
+
+    /* Load the configuration */
+    if(pam_config_acquire(aurora_mailerd_config_path, &config)
+        != PAM_AURORA_CONFIG_OK)
+    {
+        fprintf(stderr, "%s: unable to load %s\n", argv[0],
+            aurora_mailerd_config_path);
+        return 1;
+    }
+
+    if(socket_path == NULL)
+        socket_path = config->mailerd_socket;
+
+    /* Open the socket */
+    if((listen_fd = aurora_mailerd_listen(socket_path)) < 0)
+    {
+        fprintf(stderr, "%s: unable to listen on %s: %s\n", argv[0],
+            socket_path, strerror(errno));
+        return 1;
+    }
+
+    if(detach && daemon(0, 0) != 0)
+    {
+        fprintf(stderr, "%s: unable to detach\n", argv[0]);
+        return 1;
+    }
+
+    openlog("aurora-mailerd", LOG_PID | (detach? 0: LOG_PERROR), LOG_MAIL);
+
+    /* Handle signals */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = aurora_mailerd_stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Only the event loop takes the termination signals, while it waits:
+       the workers inherit the blocked signals */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_signals);
+    sigdelset(&wait_signals, SIGTERM);
+    sigdelset(&wait_signals, SIGINT);
+
+    /* Init curl once, before any thread */
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    /* Start the workers */
+    if((workers = calloc((size_t) workers_count, sizeof(*workers))) == NULL)
+        return 1;
+
+    for(i = 0; i < workers_count; i++)
+        if(pthread_create(&workers[i], NULL, aurora_mailerd_worker, NULL)
+            != 0)
+        {
+            syslog(LOG_ERR, "unable to start the workers");
+            return 1;
+        }
+
+    /* Init the event loop */
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return 1;
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    syslog(LOG_INFO, "listening on %s with %d workers", socket_path,
+        workers_count);
+
+    /* Accept and read requests */
+    while(! aurora_mailerd_stopping)
+    {
+        if((ready = epoll_pwait(epoll_fd, events, AURORA_MAILERD_EVENTS, -1,
+            &wait_signals)) < 0)
+            continue;
+
+        for(i = 0; i < ready; i++)
+        {
+            /* A client request */
+            if((client = events[i].data.ptr) != NULL)
+            {
+                if(aurora_mailerd_read(client) != 0)
+                {
+                    close(client->fd);
+                    free(client);
+                }
+
+                continue;
+            }
+
+            /* New clients */
+            while((client_fd = accept4(listen_fd, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            {
+                /* Only accept the daemon user and root */
+                credentials_length = sizeof(credentials);
+
+                if(getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED,
+                    &credentials, &credentials_length) != 0
+                    || (credentials.uid != 0 && credentials.uid != getuid())
+                    || (client = malloc(sizeof(*client))) == NULL)
+                {
+                    close(client_fd);
+                    continue;
+                }
+
+                client->fd = client_fd;
+                client->length = 0;
+
+                event.events = EPOLLIN;
+                event.data.ptr = client;
+
+                if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event)
+                    != 0)
+                {
+                    close(client_fd);
+                    free(client);
+                }
+            }
+        }
+    }
+
+    syslog(LOG_INFO, "stopping, delivering %d queued codes",
+        aurora_mailerd_jobs.length);
+
+    /* Stop accepting requests */
+    close(listen_fd);
+    unlink(socket_path);
+
+    /* Let the workers drain the queue */
+    pthread_mutex_lock(&aurora_mailerd_jobs.lock);
+    aurora_mailerd_jobs.stopping = 1;
+    pthread_cond_broadcast(&aurora_mailerd_jobs.ready);
+    pthread_mutex_unlock(&aurora_mailerd_jobs.lock);
+
+    for(i = 0; i < workers_count; i++)
+        pthread_join(workers[i], NULL);
+
+    /* Free memory */
+    free(workers);
+    pam_config_release(config);
+    curl_global_cleanup();
+    closelog();
+
+    return 0;
+}
@@ -0,0 +1,436 @@
+/**
+ * file:        aurora_stat.c
+ * description: Aurora statistics reader, printing the counters and
+ *              latencies of pam_aurora_email.so, or exporting them for
+ *              Prometheus
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "pam_aurora_admit.h"
+#include "pam_aurora_config.h"
+#include "pam_aurora_stats.h"
+
+
+/**
+ * A counter description
+ **/
+struct aurora_stat_counter
+{
+    /* The counter name, and its Prometheus metric and help */
+    const char *name;
+    const char *metric;
+    const char *help;
+};
+
+
+/* The counters, by PAM_AURORA_STAT_* */
+static const struct aurora_stat_counter
+aurora_stat_counters[PAM_AURORA_STAT_COUNT] = {
+    { "attempts", "aurora_auth_attempts_total", "Authentications." },
+    { "successes", "aurora_auth_successes_total",
+        "Successful authentications." },
+    { "failures", "aurora_auth_failures_total", "Failed authentications." },
+    { "trusted", "aurora_auth_trusted_total",
+        "Authentications of trusted sessions, without a code." },
+    { "wrong_codes", "aurora_wrong_codes_total", "Wrong codes entered." },
+    { "expired_codes", "aurora_expired_codes_total",
+        "Codes entered once expired or discarded." },
+    { "bypasses", "aurora_bypasses_total",
+        "Authentications bypassed after a delivery failure." },
+    { "directory_misses", "aurora_directory_misses_total",
+        "Users not found in the directory." },
+    { "throttled", "aurora_throttled_total",
+        "Authentications rejected by the throttling." },
+    { "deliveries", "aurora_deliveries_total", "Codes delivered." },
+    { "delivery_failures", "aurora_delivery_failures_total",
+        "Codes not delivered." },
+    { "admit_waits", "aurora_admit_waits_total",
+        "SMTP deliveries queued for a delivery slot." },
+    { "admit_overflows", "aurora_admit_overflows_total",
+        "SMTP deliveries not admitted (queue full or wait expired)." }
+};
+
+/* The latency histograms names, and Prometheus metrics */
+static const char *aurora_stat_histograms[PAM_AURORA_HISTOGRAM_COUNT] = {
+    "login", "delivery"
+};
+static const char *aurora_stat_metrics[PAM_AURORA_HISTOGRAM_COUNT] = {
+    "aurora_login_duration_seconds", "aurora_delivery_duration_seconds"
+};
+
+
+/**
+ * This function prints the command usage
+ * @param program The program name
+ */
+static void
+aurora_stat_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-c config] [-i interval] [-p file]\n"
+        "Print the counters and latencies of pam_aurora_email.so\n"
+        "  -c config    The configuration (default: %s)\n"
+        "  -i interval  Print the rates every interval seconds, or rewrite "
+        "the\n"
+        "               Prometheus file\n"
+        "  -p file      Write the Prometheus text format to file (- for "
+        "stdout)\n",
+        program, PAM_AURORA_CONFIG_PATH);
+}
+
+
+/**
+ * This function estimates a latency percentile from a histogram
+ * @param histogram The histogram
+ * @param quantile The quantile (0 to 1)
+ * @return The latency in microseconds
+ */
+static double
+aurora_stat_percentile(const struct pam_stats_histogram *histogram,
+double quantile)
+{
+    /* The rank looked for, and the latencies below the bucket */
+    double rank = quantile * (double) histogram->count;
+    double below = 0;
+    double lower;
+    int i;
+
+    for(i = 0; i < PAM_AURORA_HISTOGRAM_BUCKETS; i++)
+    {
+        if(histogram->buckets[i] == 0
+            || below + (double) histogram->buckets[i] < rank)
+        {
+            below += (double) histogram->buckets[i];
+            continue;
+        }
+
+        /* Interpolate within the bucket, [2^(i-1), 2^i[ microseconds */
+        lower = i > 0? (double) (1ULL << (i - 1)): 0;
+
+        if(i == PAM_AURORA_HISTOGRAM_BUCKETS - 1)
+            return lower;
+
+        return lower + ((double) (1ULL << i) - lower) * (rank - below)
+            / (double) histogram->buckets[i];
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function subtracts a previous reading from a table
+ * @param table The current reading, replaced by the difference
+ * @param previous The previous reading
+ */
+static void
+aurora_stat_subtract(struct pam_stats_table *table,
+const struct pam_stats_table *previous)
+{
+    /* The fields, all counters but the creation date */
+    uint64_t *current = (uint64_t *) table;
+    const uint64_t *last = (const uint64_t *) previous;
+    size_t i;
+
+    for(i = 2; i < sizeof(*table) / sizeof(uint64_t); i++)
+        current[i] -= last[i];
+}
+
+
+/**
+ * This function prints a reading as text
+ * @param table The counters (since the creation, or over the interval)
+ * @param seconds The duration of the counters
+ * @param config The module configuration (for the admission queue)
+ */
+static void
+aurora_stat_print(const struct pam_stats_table *table, double seconds,
+const struct pam_aurora_config *config)
+{
+    /* The SMTP deliveries in flight and waiting */
+    uint32_t running;
+    uint32_t waiting;
+
+    /* The histogram */
+    const struct pam_stats_histogram *histogram;
+    int i;
+
+    printf("%-20s %12s %10s\n", "counter", "count", "per_sec");
+
+    for(i = 0; i < PAM_AURORA_STAT_COUNT; i++)
+        printf("%-20s %12llu %10.2f\n", aurora_stat_counters[i].name,
+            (unsigned long long) table->counters[i],
+            (double) table->counters[i] / seconds);
+
+    for(i = 0; i < PAM_AURORA_STATS_CURL_CODES; i++)
+        if(table->smtp_errors[i] != 0)
+            printf("smtp_error_%-9d %12llu %10.2f  %s\n", i,
+                (unsigned long long) table->smtp_errors[i],
+                (double) table->smtp_errors[i] / seconds,
+                curl_easy_strerror((CURLcode) i));
+
+    printf("%-20s %12s %10s %10s %10s %10s\n", "latency_ms", "count", "mean",
+        "p50", "p90", "p99");
+
+    for(i = 0; i < PAM_AURORA_HISTOGRAM_COUNT; i++)
+    {
+        histogram = &table->histograms[i];
+        printf("%-20s %12llu %10.3f %10.3f %10.3f %10.3f\n",
+            aurora_stat_histograms[i],
+            (unsigned long long) histogram->count,
+            histogram->count > 0? (double) histogram->sum
+                / (double) histogram->count / 1000: 0,
+            aurora_stat_percentile(histogram, 0.50) / 1000,
+            aurora_stat_percentile(histogram, 0.90) / 1000,
+            aurora_stat_percentile(histogram, 0.99) / 1000);
+    }
+
+    /* The admission queue, now */
+    if(config->admit_limit > 0
+        && pam_admit_depth(config, &running, &waiting) == 0)
+        printf("%-20s %12u\n%-20s %12u\n", "admit_running", running,
+            "admit_waiting", waiting);
+
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/**
+ * This function writes a reading in the Prometheus text format
+ * @param table The counters
+ * @param config The module configuration (for the admission queue)
+ * @param output The output stream
+ */
+static void
+aurora_stat_export(const struct pam_stats_table *table,
+const struct pam_aurora_config *config, FILE *output)
+{
+    /* The histogram */
+    const struct pam_stats_histogram *histogram;
+    uint64_t count;
+
+    /* The SMTP deliveries in flight and waiting */
+    uint32_t running;
+    uint32_t waiting;
+    int i;
+    int j;
+
+    for(i = 0; i < PAM_AURORA_STAT_COUNT; i++)
+        fprintf(output, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            aurora_stat_counters[i].metric, aurora_stat_counters[i].help,
+            aurora_stat_counters[i].metric, aurora_stat_counters[i].metric,
+            (unsigned long long) table->counters[i]);
+
+    fprintf(output, "# HELP aurora_smtp_errors_total Failed SMTP "
+        "deliveries, by curl code.\n# TYPE aurora_smtp_errors_total "
+        "counter\n");
+
+    for(i = 0; i < PAM_AURORA_STATS_CURL_CODES; i++)
+        if(table->smtp_errors[i] != 0)
+            fprintf(output, "aurora_smtp_errors_total{code=\"%d\"} %llu\n",
+                i, (unsigned long long) table->smtp_errors[i]);
+
+    for(i = 0; i < PAM_AURORA_HISTOGRAM_COUNT; i++)
+    {
+        histogram = &table->histograms[i];
+        fprintf(output, "# HELP %s The %s latency.\n# TYPE %s histogram\n",
+            aurora_stat_metrics[i], aurora_stat_histograms[i],
+            aurora_stat_metrics[i]);
+
+        /* The buckets are cumulative in the Prometheus format */
+        for(j = 0, count = 0; j < PAM_AURORA_HISTOGRAM_BUCKETS - 1; j++)
+        {
+            count += histogram->buckets[j];
+            fprintf(output, "%s_bucket{le=\"%g\"} %llu\n",
+                aurora_stat_metrics[i], (double) (1ULL << j) / 1e6,
+                (unsigned long long) count);
+        }
+
+        fprintf(output, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n"
+            "%s_count %llu\n", aurora_stat_metrics[i],
+            (unsigned long long) histogram->count, aurora_stat_metrics[i],
+            (double) histogram->sum / 1e6, aurora_stat_metrics[i],
+            (unsigned long long) histogram->count);
+    }
+
+    /* The admission queue, now */
+    if(config->admit_limit > 0
+        && pam_admit_depth(config, &running, &waiting) == 0)
+        fprintf(output, "# HELP aurora_admit_running SMTP deliveries in "
+            "flight.\n# TYPE aurora_admit_running gauge\n"
+            "aurora_admit_running %u\n# HELP aurora_admit_waiting SMTP "
+            "deliveries waiting for a slot.\n# TYPE aurora_admit_waiting "
+            "gauge\naurora_admit_waiting %u\n", running, waiting);
+}
+
+
+/**
+ * This function replaces the Prometheus file, so that a collector never
+ * reads it half written
+ * @param table The counters
+ * @param config The module configuration (for the admission queue)
+ * @param path The file path, "-" for the standard output
+ * @return 0 on success, -1 otherwise
+ */
+static int
+aurora_stat_write(const struct pam_stats_table *table,
+const struct pam_aurora_config *config, const char *path)
+{
+    /* The temporary file */
+    char tmp_path[4096];
+    FILE *output;
+
+    if(strcmp(path, "-") == 0)
+    {
+        aurora_stat_export(table, config, stdout);
+        return fflush(stdout) == 0? 0: -1;
+    }
+
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+        >= (int) sizeof(tmp_path) || (output = fopen(tmp_path, "w")) == NULL)
+        return -1;
+
+    aurora_stat_export(table, config, output);
+
+    if(fflush(output) != 0 || fsync(fileno(output)) != 0)
+    {
+        /* An error occurs */
+        fclose(output);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if(fclose(output) != 0 || rename(tmp_path, path) != 0)
+    {
+        /* An error occurs */
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * The statistics reader entry point
+ * @param argc The arguments count
+ * @param argv The arguments array
+ * @return The exit status
+ */
+int
+main(int argc, char **argv)
+{
+    /* The options */
+    const char *config_path = PAM_AURORA_CONFIG_PATH;
+    const char *prometheus = NULL;
+    int interval = 0;
+    int opt;
+
+    /* The configuration */
+    const struct pam_aurora_config *config;
+
+    /* The statistics table, and its readings */
+    struct pam_shm shm;
+    struct pam_stats_table table;
+    struct pam_stats_table previous;
+    struct pam_stats_table delta;
+    double seconds;
+
+    /* Parse arguments */
+    while((opt = getopt(argc, argv, "c:i:p:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                config_path = optarg;
+                break;
+
+            case 'i':
+                interval = atoi(optarg);
+                break;
+
+            case 'p':
+                prometheus = optarg;
+                break;
+
+            default:
+                aurora_stat_usage(argv[0]);
+                return opt == 'h'? 0: 1;
+        }
+    }
+
+    if(interval < 0 || optind != argc)
+    {
+        aurora_stat_usage(argv[0]);
+        return 1;
+    }
+
+    /* Load the configuration */
+    if(pam_config_acquire(config_path, &config) != PAM_AURORA_CONFIG_OK)
+    {
+        fprintf(stderr, "%s: unable to load %s\n", argv[0], config_path);
+        return 1;
+    }
+
+    /* Map the statistics */
+    if(pam_stats_open(&shm, config->state_dir) != 0)
+    {
+        fprintf(stderr, "%s: unable to open %s/%s: %s\n", argv[0],
+            config->state_dir, PAM_AURORA_STATS_FILE, strerror(errno));
+        return 1;
+    }
+
+    pam_stats_read(&shm, &table);
+
+    for(;;)
+    {
+        /* Export the counters */
+        if(prometheus != NULL)
+        {
+            if(aurora_stat_write(&table, config, prometheus) != 0)
+            {
+                fprintf(stderr, "%s: unable to write %s: %s\n", argv[0],
+                    prometheus, strerror(errno));
+                return 1;
+            }
+        }
+
+        /* Print the counters since the table creation */
+        else if(interval == 0)
+        {
+            seconds = (double) (time(NULL) - table.created);
+            aurora_stat_print(&table, seconds > 0? seconds: 1, config);
+        }
+
+        if(interval == 0)
+            break;
+
+        /* Wait for the next reading */
+        previous = table;
+        sleep((unsigned int) interval);
+        pam_stats_read(&shm, &table);
+
+        /* Print the rates over the interval */
+        if(prometheus == NULL)
+        {
+            delta = table;
+            aurora_stat_subtract(&delta, &previous);
+            aurora_stat_print(&delta, (double) interval, config);
+        }
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+    pam_config_release(config);
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+/**
+ * file:        pam_aurora_admit.c
+ * description: Aurora admission control of the SMTP deliveries (a semaphore
+ *              shared by the processes, with a bounded wait queue)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "pam_aurora_admit.h"
+#include "pam_aurora_mail.h"
+
+
+/**
+ * This function checks whether the process of a slot or an entry is alive
+ * @param pid The process
+ * @param self The current process
+ * @return 1 if it is alive, or may be, 0 otherwise
+ */
+static int
+pam_admit_alive(int32_t pid, int32_t self)
+{
+    return pid == self || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/**
+ * This function frees the slots and the queue entries of the processes
+ * that died
+ * @param table The admission table
+ * @param limit The slots count
+ * @param queue The queue entries count
+ * @param self The current process
+ */
+static void
+pam_admit_reap(struct pam_admit_table *table, int limit, int queue,
+int32_t self)
+{
+    /* The slot or entry */
+    int32_t holder;
+    uint64_t entry;
+    int i;
+
+    for(i = 0; i < limit; i++)
+    {
+        holder = __atomic_load_n(&table->holders[i], __ATOMIC_RELAXED);
+
+        if(holder != 0 && ! pam_admit_alive(holder, self))
+            __atomic_compare_exchange_n(&table->holders[i], &holder, 0, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    for(i = 0; i < queue; i++)
+    {
+        entry = __atomic_load_n(&table->waiters[i].entry, __ATOMIC_RELAXED);
+
+        if(entry != 0 && ! pam_admit_alive((int32_t) (uint32_t) entry, self)
+            && __atomic_compare_exchange_n(&table->waiters[i].entry, &entry,
+                0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            __atomic_sub_fetch(&table->waiting, 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+/**
+ * This function counts the free slots
+ * @param table The admission table
+ * @param limit The slots count
+ * @return The free slots
+ */
+static int
+pam_admit_free(struct pam_admit_table *table, int limit)
+{
+    /* The free slots */
+    int count = 0;
+    int i;
+
+    for(i = 0; i < limit; i++)
+        if(__atomic_load_n(&table->holders[i], __ATOMIC_SEQ_CST) == 0)
+            count++;
+
+    return count;
+}
+
+
+/**
+ * This function takes a free slot
+ * @param table The admission table
+ * @param limit The slots count
+ * @param self The current process
+ * @return The slot taken, -1 when every slot is held
+ */
+static int
+pam_admit_claim(struct pam_admit_table *table, int limit, int32_t self)
+{
+    /* The slot */
+    int32_t holder;
+    int i;
+
+    for(i = 0; i < limit; i++)
+    {
+        holder = 0;
+
+        if(__atomic_load_n(&table->holders[i], __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&table->holders[i], &holder, self,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return i;
+    }
+
+    return -1;
+}
+
+
+/**
+ * This function counts the waiters queued before a ticket
+ * @param table The admission table
+ * @param queue The queue entries count
+ * @param ticket The ticket
+ * @return The older waiters
+ */
+static int
+pam_admit_older(struct pam_admit_table *table, int queue, uint32_t ticket)
+{
+    /* The waiters */
+    uint64_t entry;
+    int count = 0;
+    int i;
+
+    for(i = 0; i < queue; i++)
+    {
+        entry = __atomic_load_n(&table->waiters[i].entry, __ATOMIC_ACQUIRE);
+
+        /* The tickets wrap around */
+        if(entry != 0 && (int32_t) (ticket - (uint32_t) (entry >> 32)) > 0)
+            count++;
+    }
+
+    return count;
+}
+
+
+/**
+ * This function wakes the oldest waiter
+ * @param table The admission table
+ * @param queue The queue entries count
+ */
+static void
+pam_admit_wake(struct pam_admit_table *table, int queue)
+{
+    /* The oldest waiter */
+    uint32_t tickets = __atomic_load_n(&table->tickets, __ATOMIC_ACQUIRE);
+    uint32_t age;
+    uint32_t oldest_age = 0;
+    uint64_t entry;
+    int oldest = -1;
+    int i;
+
+    for(i = 0; i < queue; i++)
+    {
+        entry = __atomic_load_n(&table->waiters[i].entry, __ATOMIC_ACQUIRE);
+
+        if(entry != 0 && (age = tickets - (uint32_t) (entry >> 32))
+            >= oldest_age)
+        {
+            oldest = i;
+            oldest_age = age;
+        }
+    }
+
+    if(oldest < 0)
+        return;
+
+    __atomic_add_fetch(&table->waiters[oldest].wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &table->waiters[oldest].wake, FUTEX_WAKE, 1, NULL,
+        NULL, 0);
+}
+
+
+/**
+ * This function takes a free queue entry
+ * @param table The admission table
+ * @param queue The queue entries count
+ * @param entry The waiter ticket and process
+ * @return The entry taken, -1 when the queue is full
+ */
+static int
+pam_admit_enqueue(struct pam_admit_table *table, int queue, uint64_t entry)
+{
+    /* The queue entry */
+    uint64_t free_entry;
+    int i;
+
+    for(i = 0; i < queue; i++)
+    {
+        free_entry = 0;
+
+        if(__atomic_load_n(&table->waiters[i].entry, __ATOMIC_RELAXED) == 0
+            && __atomic_compare_exchange_n(&table->waiters[i].entry,
+                &free_entry, entry, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            __atomic_add_fetch(&table->waiting, 1, __ATOMIC_SEQ_CST);
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * This function waits for a delivery slot, until the admission wait or the
+ * deadline expires
+ * @param admit The admission destination, to release
+ * @param config The module configuration
+ * @param deadline The delivery deadline (see pam_mail_now, 0 for none)
+ * @return A PAM_AURORA_ADMIT_* code
+ */
+int
+pam_admit_acquire(struct pam_admit *admit,
+const struct pam_aurora_config *config, int64_t deadline)
+{
+    /* The admission table */
+    char path[4096];
+    struct pam_admit_table *table;
+    int32_t self = (int32_t) getpid();
+
+    /* The queue entry */
+    uint64_t entry;
+    uint32_t ticket;
+    uint32_t wake;
+    int index;
+
+    /* The wait */
+    int64_t expires;
+    int64_t remaining;
+    struct timespec pause;
+    int reap = 0;
+    int status;
+
+    memset(admit, 0, sizeof(*admit));
+    admit->slot = -1;
+
+    if(config->admit_limit <= 0)
+        return PAM_AURORA_ADMIT_OK;
+
+    /* Map the table */
+    if(pam_shm_path(config->state_dir, PAM_AURORA_ADMIT_FILE, path,
+        sizeof(path)) != 0 || pam_shm_map(&admit->shm, path,
+        PAM_AURORA_ADMIT_MAGIC, PAM_AURORA_ADMIT_VERSION,
+        sizeof(*table)) != 0)
+    {
+        syslog(LOG_AUTHPRIV | LOG_WARNING, "unable to map %s, deliveries "
+            "are not capped", path);
+        return PAM_AURORA_ADMIT_UNAVAILABLE;
+    }
+
+    table = admit->shm.data;
+    admit->queue = config->admit_queue;
+
+    /* Take a free slot at once, unless deliveries wait for one */
+    if(__atomic_load_n(&table->waiting, __ATOMIC_ACQUIRE) == 0
+        && (admit->slot = pam_admit_claim(table, config->admit_limit, self))
+            >= 0)
+        return PAM_AURORA_ADMIT_OK;
+
+    /* Queue up, in the tickets order */
+    ticket = __atomic_fetch_add(&table->tickets, 1, __ATOMIC_ACQ_REL);
+    entry = (uint64_t) ticket << 32 | (uint32_t) self;
+
+    if((index = pam_admit_enqueue(table, config->admit_queue, entry)) < 0)
+    {
+        /* The entries of the processes that died may free the queue */
+        pam_admit_reap(table, config->admit_limit, config->admit_queue,
+            self);
+
+        if((index = pam_admit_enqueue(table, config->admit_queue, entry))
+            < 0)
+        {
+            /* Properly unmap the table */
+            pam_shm_unmap(&admit->shm);
+
+            return PAM_AURORA_ADMIT_FULL;
+        }
+    }
+
+    admit->waited = 1;
+
+    /* The wait ends with the admission wait, or with the deadline */
+    expires = pam_mail_now() + config->admit_wait;
+
+    if(deadline != 0 && deadline < expires)
+        expires = deadline;
+
+    for(;;)
+    {
+        wake = __atomic_load_n(&table->waiters[index].wake, __ATOMIC_ACQUIRE);
+
+        if(reap)
+            pam_admit_reap(table, config->admit_limit, config->admit_queue,
+                self);
+
+        /* The free slots go to the older waiters first */
+        if(pam_admit_older(table, config->admit_queue, ticket)
+            < pam_admit_free(table, config->admit_limit)
+            && (admit->slot = pam_admit_claim(table, config->admit_limit,
+                self)) >= 0)
+        {
+            status = PAM_AURORA_ADMIT_OK;
+            break;
+        }
+
+        if((remaining = expires - pam_mail_now()) <= 0)
+        {
+            status = PAM_AURORA_ADMIT_EXPIRED;
+            break;
+        }
+
+        /* Sleep until woken, checking for the processes that died from
+           time to time */
+        if(remaining > PAM_AURORA_ADMIT_POLL)
+            remaining = PAM_AURORA_ADMIT_POLL;
+
+        pause.tv_sec = 0;
+        pause.tv_nsec = (long) remaining * 1000000L;
+        reap = syscall(SYS_futex, &table->waiters[index].wake, FUTEX_WAIT,
+            wake, &pause, NULL, 0) != 0 && errno == ETIMEDOUT;
+    }
+
+    /* Leave the queue */
+    __atomic_store_n(&table->waiters[index].entry, 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&table->waiting, 1, __ATOMIC_RELEASE);
+
+    /* Hand a slot still free to the next waiter */
+    if(__atomic_load_n(&table->waiting, __ATOMIC_ACQUIRE) > 0
+        && pam_admit_free(table, config->admit_limit) > 0)
+        pam_admit_wake(table, config->admit_queue);
+
+    if(status != PAM_AURORA_ADMIT_OK)
+    {
+        syslog(LOG_AUTHPRIV | LOG_NOTICE, "delivery not admitted within "
+            "%d ms", config->admit_wait);
+
+        /* Properly unmap the table */
+        pam_shm_unmap(&admit->shm);
+    }
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function releases the slot of a delivery, and wakes the oldest
+ * waiter
+ * @param admit The admission
+ */
+void
+pam_admit_release(struct pam_admit *admit)
+{
+    /* The admission table */
+    struct pam_admit_table *table = admit->shm.data;
+
+    if(admit->slot >= 0)
+    {
+        /* The slot is freed before the queue is read, as a waiter queues
+           up before it looks for a free slot: one of them sees the other */
+        __atomic_store_n(&table->holders[admit->slot], 0, __ATOMIC_SEQ_CST);
+
+        if(__atomic_load_n(&table->waiting, __ATOMIC_SEQ_CST) > 0)
+            pam_admit_wake(table, admit->queue);
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&admit->shm);
+    admit->slot = -1;
+}
+
+
+/**
+ * This function counts the deliveries in flight and waiting
+ * @param config The module configuration
+ * @param running The deliveries in flight destination
+ * @param waiting The deliveries waiting destination
+ * @return 0 on success, -1 when the table is unavailable
+ */
+int
+pam_admit_depth(const struct pam_aurora_config *config, uint32_t *running,
+uint32_t *waiting)
+{
+    /* The admission table */
+    char path[4096];
+    struct pam_shm shm;
+    struct pam_admit_table *table;
+    int i;
+
+    if(pam_shm_path(config->state_dir, PAM_AURORA_ADMIT_FILE, path,
+        sizeof(path)) != 0 || pam_shm_map(&shm, path, PAM_AURORA_ADMIT_MAGIC,
+        PAM_AURORA_ADMIT_VERSION, sizeof(*table)) != 0)
+        return -1;
+
+    table = shm.data;
+    *running = 0;
+    *waiting = __atomic_load_n(&table->waiting, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < PAM_AURORA_ADMIT_LIMIT_MAX; i++)
+        if(__atomic_load_n(&table->holders[i], __ATOMIC_RELAXED) != 0)
+            (*running)++;
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * file:        pam_aurora_admit.h
+ * description: Aurora admission control of the SMTP deliveries (a semaphore
+ *              shared by the processes, with a bounded wait queue)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_ADMIT_H
+#define PAM_AURORA_ADMIT_H
+
+#include <stdint.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_shm.h"
+
+
+/* The admission state file */
+#define PAM_AURORA_ADMIT_FILE "admit.db"
+#define PAM_AURORA_ADMIT_MAGIC "AURADM01"
+#define PAM_AURORA_ADMIT_VERSION 1
+
+/* The largest deliveries in flight and wait queue */
+#define PAM_AURORA_ADMIT_LIMIT_MAX 1024
+#define PAM_AURORA_ADMIT_QUEUE_MAX 4096
+
+/* The longest sleep of a waiter before it checks for holders and waiters
+   that died (milliseconds) */
+#define PAM_AURORA_ADMIT_POLL 100
+
+/* The admission results */
+#define PAM_AURORA_ADMIT_OK 0
+#define PAM_AURORA_ADMIT_FULL 1
+#define PAM_AURORA_ADMIT_EXPIRED 2
+#define PAM_AURORA_ADMIT_UNAVAILABLE 3
+
+/* The policies when a delivery is not admitted in time */
+#define PAM_AURORA_ADMIT_REJECT 0
+#define PAM_AURORA_ADMIT_SEND 1
+#define PAM_AURORA_ADMIT_SPOOL 2
+
+
+/**
+ * A waiter of the queue
+ **/
+struct pam_admit_waiter
+{
+    /* The waiter ticket (high 32 bits) and process (low 32 bits), 0 when
+       the entry is free */
+    uint64_t entry;
+
+    /* The wake sequence, the waiter sleeps on (futex) */
+    uint32_t wake;
+    uint32_t reserved;
+};
+
+
+/**
+ * The admission table (the state file data)
+ *
+ * A delivery holds a slot while it talks to the mail servers: a slot holds
+ * its process id, 0 when free. When every slot is held, the delivery takes
+ * a ticket and an entry of the queue, and the slots are given in the
+ * tickets order: a released slot wakes the oldest waiter, and a waiter
+ * leaving with a slot still free wakes the next one. The slots and the
+ * entries of the processes that died are freed by the waiters.
+ **/
+struct pam_admit_table
+{
+    /* The next ticket and the queue depth, alone on their cache line */
+    uint32_t tickets;
+    uint32_t waiting;
+    uint32_t padding[14];
+
+    /* The slots */
+    int32_t holders[PAM_AURORA_ADMIT_LIMIT_MAX];
+
+    /* The queue */
+    struct pam_admit_waiter waiters[PAM_AURORA_ADMIT_QUEUE_MAX];
+};
+
+
+/**
+ * An admitted delivery
+ **/
+struct pam_admit
+{
+    /* The table mapping (unmapped when the delivery is not capped) */
+    struct pam_shm shm;
+
+    /* The slot held, -1 when none */
+    int slot;
+
+    /* The queue entries, searched for the oldest waiter */
+    int queue;
+
+    /* Whether the delivery waited in the queue */
+    int waited;
+};
+
+
+/**
+ * This function waits for a delivery slot, until the admission wait or the
+ * deadline expires
+ * @param admit The admission destination, to release
+ * @param config The module configuration
+ * @param deadline The delivery deadline (see pam_mail_now, 0 for none)
+ * @return A PAM_AURORA_ADMIT_* code
+ */
+int
+pam_admit_acquire(struct pam_admit *admit,
+const struct pam_aurora_config *config, int64_t deadline);
+
+
+/**
+ * This function releases the slot of a delivery, and wakes the oldest
+ * waiter
+ * @param admit The admission
+ */
+void
+pam_admit_release(struct pam_admit *admit);
+
+
+/**
+ * This function counts the deliveries in flight and waiting
+ * @param config The module configuration
+ * @param running The deliveries in flight destination
+ * @param waiting The deliveries waiting destination
+ * @return 0 on success, -1 when the table is unavailable
+ */
+int
+pam_admit_depth(const struct pam_aurora_config *config, uint32_t *running,
+uint32_t *waiting);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * file:        pam_aurora_arena.c
+ * description: Aurora per-transaction memory arena
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include "pam_aurora_arena.h"
+
+
+/* The size rounded up to the alignment */
+#define PAM_ARENA_ROUND(size) (((size) + PAM_AURORA_ARENA_ALIGN - 1) \
+    & ~((size_t) PAM_AURORA_ARENA_ALIGN - 1))
+
+
+/**
+ * This function initializes an arena
+ * @param arena The arena
+ */
+void
+pam_arena_init(struct pam_arena *arena)
+{
+    arena->used = 0;
+    arena->chunks = NULL;
+    arena->adopted = NULL;
+}
+
+
+/**
+ * This function allocates memory from an arena
+ * @param arena The arena
+ * @param size The memory size
+ * @return The memory (uninitialized), or NULL when out of memory
+ */
+void *
+pam_arena_alloc(struct pam_arena *arena, size_t size)
+{
+    /* The chunk */
+    struct pam_arena_chunk *chunk = arena->chunks;
+    size_t chunk_size;
+    void *data;
+
+    if(size > (size_t) -1 / 2)
+        return NULL;
+
+    size = PAM_ARENA_ROUND(size > 0? size: 1);
+
+    /* From the inline block */
+    if(chunk == NULL && size <= sizeof(arena->block) - arena->used)
+    {
+        data = arena->block + arena->used;
+        arena->used += size;
+
+        return data;
+    }
+
+    /* From a new chunk, when the current one is full */
+    if(chunk == NULL || size > chunk->size - chunk->used)
+    {
+        chunk_size = size > PAM_AURORA_ARENA_BLOCK? size:
+            PAM_AURORA_ARENA_BLOCK;
+
+        if((chunk = malloc(sizeof(*chunk) + chunk_size)) == NULL)
+            return NULL;
+
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->chunks = chunk;
+    }
+
+    data = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return data;
+}
+
+
+/**
+ * This function hands an allocation over to an arena, which frees it on
+ * release
+ * @param arena The arena
+ * @param data The allocation (NULL is ignored)
+ * @param wipe The allocation part to wipe before freeing it
+ * @return 0 on success, -1 when out of memory (the allocation is freed)
+ */
+int
+pam_arena_adopt(struct pam_arena *arena, void *data, size_t wipe)
+{
+    /* The adoption */
+    struct pam_arena_adopted *adopted;
+
+    if(data == NULL)
+        return 0;
+
+    if((adopted = pam_arena_alloc(arena, sizeof(*adopted))) == NULL)
+    {
+        explicit_bzero(data, wipe);
+        free(data);
+        return -1;
+    }
+
+    adopted->data = data;
+    adopted->wipe = wipe;
+    adopted->next = arena->adopted;
+    arena->adopted = adopted;
+
+    return 0;
+}
+
+
+/**
+ * This function releases the memory of an arena, which may be used again
+ * @param arena The arena
+ */
+void
+pam_arena_release(struct pam_arena *arena)
+{
+    /* The chunks and adoptions */
+    struct pam_arena_chunk *chunk;
+    struct pam_arena_adopted *adopted;
+
+    /* Free the adopted allocations (they live in the arena) */
+    for(adopted = arena->adopted; adopted != NULL; adopted = adopted->next)
+    {
+        explicit_bzero(adopted->data, adopted->wipe);
+        free(adopted->data);
+    }
+
+    /* Wipe and free the chunks */
+    while((chunk = arena->chunks) != NULL)
+    {
+        arena->chunks = chunk->next;
+        explicit_bzero(chunk->data, chunk->used);
+        free(chunk);
+    }
+
+    /* Wipe the inline block */
+    explicit_bzero(arena->block, arena->used);
+    pam_arena_init(arena);
+}
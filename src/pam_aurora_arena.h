@@ -0,0 +1,110 @@
+/**
+ * file:        pam_aurora_arena.h
+ * description: Aurora per-transaction memory arena
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_ARENA_H
+#define PAM_AURORA_ARENA_H
+
+#include <stddef.h>
+
+
+/* The arena block kept inline (a login fits in it) */
+#define PAM_AURORA_ARENA_BLOCK 4096
+
+/* The allocations alignment */
+#define PAM_AURORA_ARENA_ALIGN 16
+
+
+/**
+ * An arena overflow chunk
+ **/
+struct pam_arena_chunk
+{
+    /* The previous chunk */
+    struct pam_arena_chunk *next;
+
+    /* The chunk size and the part used */
+    size_t size;
+    size_t used;
+
+    /* The chunk memory */
+    _Alignas(PAM_AURORA_ARENA_ALIGN) unsigned char data[];
+};
+
+
+/**
+ * A memory allocation adopted by the arena (a conversation reply)
+ **/
+struct pam_arena_adopted
+{
+    /* The previous adoption */
+    struct pam_arena_adopted *next;
+
+    /* The allocation, freed with free(), and the part wiped before */
+    void *data;
+    size_t wipe;
+};
+
+
+/**
+ * The memory of a PAM transaction
+ *
+ * Everything a login allocates comes from its arena, or is adopted by it,
+ * and is released at once when the transaction ends, whatever its exit
+ * path. The memory is wiped on release: it holds the codes.
+ **/
+struct pam_arena
+{
+    /* The inline block and the part used */
+    _Alignas(PAM_AURORA_ARENA_ALIGN) unsigned char block[
+        PAM_AURORA_ARENA_BLOCK];
+    size_t used;
+
+    /* The overflow chunks, the current one first */
+    struct pam_arena_chunk *chunks;
+
+    /* The adopted allocations */
+    struct pam_arena_adopted *adopted;
+};
+
+
+/**
+ * This function initializes an arena
+ * @param arena The arena
+ */
+void
+pam_arena_init(struct pam_arena *arena);
+
+
+/**
+ * This function allocates memory from an arena
+ * @param arena The arena
+ * @param size The memory size
+ * @return The memory (uninitialized), or NULL when out of memory
+ */
+void *
+pam_arena_alloc(struct pam_arena *arena, size_t size);
+
+
+/**
+ * This function hands an allocation over to an arena, which frees it on
+ * release
+ * @param arena The arena
+ * @param data The allocation (NULL is ignored)
+ * @param wipe The allocation part to wipe before freeing it
+ * @return 0 on success, -1 when out of memory (the allocation is freed)
+ */
+int
+pam_arena_adopt(struct pam_arena *arena, void *data, size_t wipe);
+
+
+/**
+ * This function releases the memory of an arena, which may be used again
+ * @param arena The arena
+ */
+void
+pam_arena_release(struct pam_arena *arena);
+
+#endif
@@ -0,0 +1,670 @@
+/**
+ * file:        pam_aurora_config.c
+ * description: Aurora email module configuration snapshots
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libconfig.h>
+#include "pam_aurora_admit.h"
+#include "pam_aurora_config.h"
+#include "pam_aurora_local.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_mailer.h"
+#include "pam_aurora_random.h"
+#include "pam_aurora_shm.h"
+#include "pam_aurora_spool.h"
+#include "pam_aurora_throttle.h"
+
+
+/**
+ * The current configuration snapshot of a file
+ **/
+struct pam_config_file
+{
+    /* The configuration path (NULL for a free entry) */
+    char *path;
+
+    /* The current snapshot, and the last acquisition */
+    struct pam_aurora_config *snapshot;
+    unsigned long used;
+};
+
+
+/* The current configuration snapshots of the process, by file, and the lock
+   of the snapshots references (the transactions of a process may run in
+   threads) */
+static struct pam_config_file pam_config_files[PAM_AURORA_CONFIG_FILES];
+static unsigned long pam_config_used = 0;
+static pthread_mutex_t pam_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * This function checks whether a snapshot has been loaded from a file state
+ * @param config The configuration snapshot
+ * @param file_stat The file state
+ * @return 1 if the snapshot matches the file, 0 otherwise
+ */
+static int
+pam_config_matches(const struct pam_aurora_config *config,
+const struct stat *file_stat)
+{
+    return config->file_device == file_stat->st_dev
+        && config->file_inode == file_stat->st_ino
+        && config->file_size == file_stat->st_size
+        && config->file_mtime.tv_sec == file_stat->st_mtim.tv_sec
+        && config->file_mtime.tv_nsec == file_stat->st_mtim.tv_nsec
+        && config->file_ctime.tv_sec == file_stat->st_ctim.tv_sec
+        && config->file_ctime.tv_nsec == file_stat->st_ctim.tv_nsec;
+}
+
+
+/**
+ * This function copies an optional string setting into the snapshot pool
+ * @param config The parsed configuration
+ * @param name The setting name
+ * @param pool The snapshot string pool cursor
+ * @param pool_end The snapshot string pool end
+ * @return The copied string, or NULL when the setting is missing
+ */
+static const char *
+pam_config_copy_string(const config_t *config, const char *name,
+char **pool, const char *pool_end)
+{
+    /* The setting value */
+    const char *value;
+    size_t length;
+    char *copy;
+
+    /* Get the setting */
+    if(config_lookup_string(config, name, &value) == CONFIG_FALSE)
+        return NULL;
+
+    /* Copy the value (the file may have grown while being parsed) */
+    if((length = strlen(value) + 1) > (size_t) (pool_end - *pool))
+        return NULL;
+
+    copy = *pool;
+    memcpy(copy, value, length);
+    *pool += length;
+
+    return copy;
+}
+
+
+/**
+ * This function copies an optional setting, a string or a list of strings,
+ * into the snapshot pool
+ * @param config The parsed configuration
+ * @param name The setting name
+ * @param values The copied strings destination
+ * @param max The most strings
+ * @param pool The snapshot string pool cursor
+ * @param pool_end The snapshot string pool end
+ * @return The strings count, or -1 when the setting is invalid
+ */
+static int
+pam_config_copy_strings(const config_t *config, const char *name,
+const char **values, int max, char **pool, const char *pool_end)
+{
+    /* The setting */
+    config_setting_t *setting;
+    const char *value;
+    size_t length;
+    int count;
+    int i;
+
+    /* A single string */
+    if((setting = config_lookup(config, name)) == NULL)
+        return 0;
+
+    if(config_setting_type(setting) == CONFIG_TYPE_STRING)
+        return (values[0] = pam_config_copy_string(config, name, pool,
+            pool_end)) != NULL? 1: -1;
+
+    /* A list of strings */
+    if((! config_setting_is_array(setting)
+        && ! config_setting_is_list(setting))
+        || (count = config_setting_length(setting)) > max)
+        return -1;
+
+    for(i = 0; i < count; i++)
+    {
+        if((value = config_setting_get_string_elem(setting, i)) == NULL
+            || (length = strlen(value) + 1) > (size_t) (pool_end - *pool))
+            return -1;
+
+        memcpy(*pool, value, length);
+        values[i] = *pool;
+        *pool += length;
+    }
+
+    return count;
+}
+
+
+/**
+ * This function loads a configuration snapshot
+ * @param path The configuration path
+ * @param config The configuration snapshot destination
+ * @return A PAM_AURORA_CONFIG_* code
+ */
+static int
+pam_config_load(const char *path, struct pam_aurora_config **config)
+{
+    /* The module configuration */
+    config_t pam_config;
+    FILE *pam_config_fd;
+    struct stat pam_config_stat;
+
+    /* The snapshot */
+    struct pam_aurora_config *snapshot;
+    size_t pool_size;
+    char *pool;
+    char *pool_end;
+
+    /* The delivery mode, local MTA protocol, throttling and admission
+       policies names */
+    const char *delivery = "smtp";
+    const char *local_protocol = "lmtp";
+    const char *throttle_policy = "reject";
+    const char *admit_policy = "reject";
+    int throttle_slots;
+    int trust_slots;
+
+    /* The email templates */
+    const char *mail_subject = PAM_AURORA_MAIL_SUBJECT;
+    const char *mail_body = PAM_AURORA_MAIL_BODY;
+
+    /* Init configuration file stream */
+    if((pam_config_fd = fopen(path, "r")) == NULL)
+        return PAM_AURORA_CONFIG_UNAVAILABLE;
+
+    /* Remember the state of the file actually parsed */
+    if(fstat(fileno(pam_config_fd), &pam_config_stat) != 0)
+    {
+        fclose(pam_config_fd);
+        return PAM_AURORA_CONFIG_UNAVAILABLE;
+    }
+
+    /* Read and parse the configuration file */
+    config_init(&pam_config);
+
+    if(config_read(&pam_config, pam_config_fd) == CONFIG_FALSE)
+    {
+        config_destroy(&pam_config);
+        fclose(pam_config_fd);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* The file stream is no longer needed */
+    fclose(pam_config_fd);
+
+    /* The string settings can not be longer than the file itself */
+    pool_size = (size_t) pam_config_stat.st_size + 1;
+
+    /* Allocate the snapshot with its string pool */
+    if((snapshot = calloc(1, sizeof(*snapshot) + pool_size)) == NULL)
+    {
+        config_destroy(&pam_config);
+        return PAM_AURORA_CONFIG_UNAVAILABLE;
+    }
+
+    pool = (char *) (snapshot + 1);
+    pool_end = pool + pool_size;
+
+    /* Get settings */
+    snapshot->code_length = 8;
+    snapshot->code_ttl = 300;
+    snapshot->code_attempts = 5;
+    snapshot->code_prompts = 3;
+    snapshot->permit_bypass = 0;
+    config_lookup_int(&pam_config, "code_length", &snapshot->code_length);
+    config_lookup_int(&pam_config, "code_ttl", &snapshot->code_ttl);
+    config_lookup_int(&pam_config, "code_attempts", &snapshot->code_attempts);
+    config_lookup_int(&pam_config, "code_prompts", &snapshot->code_prompts);
+    config_lookup_int(&pam_config, "permit_bypass", &snapshot->permit_bypass);
+
+    snapshot->code_alphabet = pam_config_copy_string(&pam_config,
+        "code_alphabet", &pool, pool_end);
+    if(snapshot->code_alphabet == NULL)
+        snapshot->code_alphabet = PAM_AURORA_CODE_ALPHABET;
+
+    /* Check the code settings */
+    if(snapshot->code_length < 1 || snapshot->code_length > PAM_AURORA_CODE_MAX
+        || strlen(snapshot->code_alphabet) < 2
+        || strlen(snapshot->code_alphabet) > 256
+        || snapshot->code_ttl < 0 || snapshot->code_attempts < 1
+        || snapshot->code_prompts < 1)
+    {
+        /* Invalid code settings */
+        config_destroy(&pam_config);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get mail server settings */
+    snapshot->mail_server_count = pam_config_copy_strings(&pam_config,
+        "mail_server_host", snapshot->mail_servers, PAM_AURORA_RELAY_MAX,
+        &pool, pool_end);
+
+    if(snapshot->mail_server_count < 0)
+    {
+        /* Invalid mail servers list */
+        config_destroy(&pam_config);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->mail_server_host = snapshot->mail_server_count > 0?
+        snapshot->mail_servers[0]: NULL;
+    snapshot->mail_hedge_delay = 1000;
+    config_lookup_int(&pam_config, "mail_hedge_delay",
+        &snapshot->mail_hedge_delay);
+
+    snapshot->auth_deadline = 30000;
+    snapshot->mail_connect_timeout = 10000;
+    snapshot->breaker_failures = 5;
+    snapshot->breaker_cooldown = 30;
+    config_lookup_int(&pam_config, "auth_deadline",
+        &snapshot->auth_deadline);
+    config_lookup_int(&pam_config, "mail_connect_timeout",
+        &snapshot->mail_connect_timeout);
+    config_lookup_int(&pam_config, "breaker_failures",
+        &snapshot->breaker_failures);
+    config_lookup_int(&pam_config, "breaker_cooldown",
+        &snapshot->breaker_cooldown);
+
+    if(snapshot->mail_hedge_delay < 0 || snapshot->auth_deadline < 0
+        || snapshot->mail_connect_timeout < 1
+        || snapshot->breaker_failures < 0 || snapshot->breaker_cooldown < 1)
+    {
+        /* Invalid mail servers settings */
+        config_destroy(&pam_config);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->mail_server_user = pam_config_copy_string(&pam_config,
+        "mail_server_user", &pool, pool_end);
+    snapshot->mail_server_pass = pam_config_copy_string(&pam_config,
+        "mail_server_pass", &pool, pool_end);
+    snapshot->mail_server_cainfo = pam_config_copy_string(&pam_config,
+        "mail_server_cainfo", &pool, pool_end);
+
+    snapshot->mail_server_tls = 1;
+    config_lookup_int(&pam_config, "mail_server_tls", 
+        &snapshot->mail_server_tls);
+
+    snapshot->mail_dns_ttl = 60;
+    snapshot->mail_dns_stale = 3600;
+    config_lookup_int(&pam_config, "mail_dns_ttl", &snapshot->mail_dns_ttl);
+    config_lookup_int(&pam_config, "mail_dns_stale", 
+        &snapshot->mail_dns_stale);
+
+    if(snapshot->mail_dns_ttl < 0 || snapshot->mail_dns_stale < 0)
+    {
+        /* Invalid addresses cache settings */
+        config_destroy(&pam_config);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->mail_tls_cache = 1;
+    config_lookup_int(&pam_config, "mail_tls_cache", 
+        &snapshot->mail_tls_cache);
+
+    /* Compile the email template */
+    config_lookup_string(&pam_config, "mail_subject", &mail_subject);
+    config_lookup_string(&pam_config, "mail_template", &mail_body);
+
+    if((snapshot->mail_template = pam_mail_template_compile(mail_subject, 
+        mail_body)) == NULL)
+    {
+        /* Template too large */
+        config_destroy(&pam_config);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get delivery settings */
+    config_lookup_string(&pam_config, "delivery", &delivery);
+
+    if(strcmp(delivery, "smtp") == 0)
+        snapshot->delivery = PAM_AURORA_DELIVERY_SMTP;
+    else if(strcmp(delivery, "mailerd") == 0)
+        snapshot->delivery = PAM_AURORA_DELIVERY_MAILERD;
+    else if(strcmp(delivery, "spool") == 0)
+        snapshot->delivery = PAM_AURORA_DELIVERY_SPOOL;
+    else if(strcmp(delivery, "local") == 0)
+        snapshot->delivery = PAM_AURORA_DELIVERY_LOCAL;
+    else if(strcmp(delivery, "sendmail") == 0)
+        snapshot->delivery = PAM_AURORA_DELIVERY_SENDMAIL;
+    else
+    {
+        /* Unknown delivery mode */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->mailerd_socket = pam_config_copy_string(&pam_config,
+        "mailerd_socket", &pool, pool_end);
+    if(snapshot->mailerd_socket == NULL)
+        snapshot->mailerd_socket = PAM_AURORA_MAILER_SOCKET;
+
+    config_lookup_int(&pam_config, "async_delivery", 
+        &snapshot->async_delivery);
+
+    snapshot->mailerd_timeout = 2000;
+    config_lookup_int(&pam_config, "mailerd_timeout", 
+        &snapshot->mailerd_timeout);
+
+    if(snapshot->mailerd_timeout < 1)
+    {
+        /* Invalid aurora-mailerd settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->spool_dir = pam_config_copy_string(&pam_config, "spool_dir",
+        &pool, pool_end);
+    if(snapshot->spool_dir == NULL)
+        snapshot->spool_dir = PAM_AURORA_SPOOL_DIR;
+
+    snapshot->spool_max_age = 600;
+    config_lookup_int(&pam_config, "spool_max_age", 
+        &snapshot->spool_max_age);
+
+    if(snapshot->spool_max_age < 1)
+    {
+        /* Invalid spool settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    snapshot->local_socket = pam_config_copy_string(&pam_config,
+        "local_socket", &pool, pool_end);
+    if(snapshot->local_socket == NULL)
+        snapshot->local_socket = PAM_AURORA_LOCAL_SOCKET;
+
+    snapshot->sendmail_path = pam_config_copy_string(&pam_config,
+        "sendmail_path", &pool, pool_end);
+    if(snapshot->sendmail_path == NULL)
+        snapshot->sendmail_path = PAM_AURORA_LOCAL_SENDMAIL;
+
+    config_lookup_string(&pam_config, "local_protocol", &local_protocol);
+    snapshot->local_lmtp = strcmp(local_protocol, "lmtp") == 0;
+
+    snapshot->local_timeout = 2000;
+    config_lookup_int(&pam_config, "local_timeout", 
+        &snapshot->local_timeout);
+
+    if((! snapshot->local_lmtp && strcmp(local_protocol, "smtp") != 0)
+        || snapshot->local_timeout < 1)
+    {
+        /* Invalid local MTA settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get state settings */
+    snapshot->state_dir = pam_config_copy_string(&pam_config, "state_dir",
+        &pool, pool_end);
+    if(snapshot->state_dir == NULL)
+        snapshot->state_dir = PAM_AURORA_STATE_DIR;
+
+    /* Get throttling settings */
+    snapshot->throttle_user_rate = 20;
+    snapshot->throttle_user_burst = 5;
+    snapshot->throttle_global_rate = 6000;
+    snapshot->throttle_global_burst = 200;
+    snapshot->throttle_slots = 65536;
+    snapshot->throttle_wait = 3000;
+    config_lookup_int(&pam_config, "throttle", &snapshot->throttle);
+    config_lookup_int(&pam_config, "throttle_user_rate",
+        &snapshot->throttle_user_rate);
+    config_lookup_int(&pam_config, "throttle_user_burst",
+        &snapshot->throttle_user_burst);
+    config_lookup_int(&pam_config, "throttle_global_rate",
+        &snapshot->throttle_global_rate);
+    config_lookup_int(&pam_config, "throttle_global_burst",
+        &snapshot->throttle_global_burst);
+    config_lookup_int(&pam_config, "throttle_slots",
+        &snapshot->throttle_slots);
+    config_lookup_int(&pam_config, "throttle_wait", &snapshot->throttle_wait);
+    config_lookup_string(&pam_config, "throttle_policy", &throttle_policy);
+
+    if(strcmp(throttle_policy, "reject") == 0)
+        snapshot->throttle_policy = PAM_AURORA_THROTTLE_REJECT;
+    else if(strcmp(throttle_policy, "wait") == 0)
+        snapshot->throttle_policy = PAM_AURORA_THROTTLE_WAIT;
+    else
+        snapshot->throttle_policy = -1;
+
+    /* The user buckets count is a power of two */
+    for(throttle_slots = 64; throttle_slots < snapshot->throttle_slots
+        && throttle_slots < (1 << 24); throttle_slots <<= 1);
+
+    snapshot->throttle_slots = throttle_slots;
+
+    /* Check the throttling settings */
+    if(snapshot->throttle_policy < 0 || snapshot->throttle_wait < 0
+        || snapshot->throttle_user_rate < 0
+        || snapshot->throttle_global_rate < 0
+        || snapshot->throttle_user_burst < 1
+        || snapshot->throttle_user_burst > PAM_AURORA_THROTTLE_BURST_MAX
+        || snapshot->throttle_global_burst < 1
+        || snapshot->throttle_global_burst > PAM_AURORA_THROTTLE_BURST_MAX)
+    {
+        /* Invalid throttling settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get the admission control settings (disabled by default) */
+    snapshot->admit_queue = 256;
+    snapshot->admit_wait = 2000;
+    config_lookup_int(&pam_config, "admit_limit", &snapshot->admit_limit);
+    config_lookup_int(&pam_config, "admit_queue", &snapshot->admit_queue);
+    config_lookup_int(&pam_config, "admit_wait", &snapshot->admit_wait);
+    config_lookup_string(&pam_config, "admit_policy", &admit_policy);
+
+    if(strcmp(admit_policy, "reject") == 0)
+        snapshot->admit_policy = PAM_AURORA_ADMIT_REJECT;
+    else if(strcmp(admit_policy, "send") == 0)
+        snapshot->admit_policy = PAM_AURORA_ADMIT_SEND;
+    else if(strcmp(admit_policy, "spool") == 0)
+        snapshot->admit_policy = PAM_AURORA_ADMIT_SPOOL;
+    else
+        snapshot->admit_policy = -1;
+
+    if(snapshot->admit_policy < 0 || snapshot->admit_wait < 0
+        || snapshot->admit_limit < 0
+        || snapshot->admit_limit > PAM_AURORA_ADMIT_LIMIT_MAX
+        || snapshot->admit_queue < 0
+        || snapshot->admit_queue > PAM_AURORA_ADMIT_QUEUE_MAX)
+    {
+        /* Invalid admission settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get the trusted sessions settings (disabled by default) */
+    snapshot->trust_window = 0;
+    snapshot->trust_slots = 4096;
+    config_lookup_int(&pam_config, "trust_window", &snapshot->trust_window);
+    config_lookup_int(&pam_config, "trust_slots", &snapshot->trust_slots);
+
+    /* The slots are grouped by sets, so their count is a power of two */
+    for(trust_slots = 64; trust_slots < snapshot->trust_slots
+        && trust_slots < (1 << 20); trust_slots <<= 1);
+
+    snapshot->trust_slots = trust_slots;
+
+    if(snapshot->trust_window < 0)
+    {
+        /* Invalid trusted sessions settings */
+        config_destroy(&pam_config);
+        free((void *) snapshot->mail_template);
+        free(snapshot);
+        return PAM_AURORA_CONFIG_INVALID;
+    }
+
+    /* Get the statistics setting (enabled by default) */
+    snapshot->stats = 1;
+    config_lookup_int(&pam_config, "stats", &snapshot->stats);
+
+    /* Properly destroy the configuration */
+    config_destroy(&pam_config);
+
+    /* Record the file state */
+    snapshot->file_device = pam_config_stat.st_dev;
+    snapshot->file_inode = pam_config_stat.st_ino;
+    snapshot->file_size = pam_config_stat.st_size;
+    snapshot->file_mtime = pam_config_stat.st_mtim;
+    snapshot->file_ctime = pam_config_stat.st_ctim;
+
+    /* Configuration loaded */
+    *config = snapshot;
+    return PAM_AURORA_CONFIG_OK;
+}
+
+
+/**
+ * This function frees a configuration snapshot
+ * @param snapshot The configuration snapshot
+ */
+static void
+pam_config_free(struct pam_aurora_config *snapshot)
+{
+    free((void *) snapshot->mail_template);
+    free(snapshot);
+}
+
+
+/**
+ * This function gets the configuration snapshot matching the current file,
+ * loading it if the file changed since its last load
+ * @param path The configuration path
+ * @param config The configuration snapshot destination
+ * @return A PAM_AURORA_CONFIG_* code
+ */
+int
+pam_config_acquire(const char *path, const struct pam_aurora_config **config)
+{
+    /* The file state */
+    struct stat pam_config_stat;
+
+    /* The file entry */
+    struct pam_config_file *file = NULL;
+    char *file_path;
+    int i;
+
+    /* The new snapshot */
+    struct pam_aurora_config *snapshot;
+    int status;
+
+    pthread_mutex_lock(&pam_config_lock);
+
+    /* Find the entry of the file, or the least recently used one */
+    for(i = 0; i < PAM_AURORA_CONFIG_FILES; i++)
+    {
+        if(pam_config_files[i].path != NULL
+            && strcmp(pam_config_files[i].path, path) == 0)
+        {
+            file = &pam_config_files[i];
+            break;
+        }
+
+        if(file == NULL || (file->path != NULL
+            && (pam_config_files[i].path == NULL
+                || pam_config_files[i].used < file->used)))
+            file = &pam_config_files[i];
+    }
+
+    file->used = ++pam_config_used;
+
+    /* Reuse the current snapshot while the file is unchanged */
+    if(file->path != NULL && strcmp(file->path, path) == 0
+        && stat(path, &pam_config_stat) == 0
+        && pam_config_matches(file->snapshot, &pam_config_stat))
+    {
+        file->snapshot->references++;
+        *config = file->snapshot;
+        pthread_mutex_unlock(&pam_config_lock);
+        return PAM_AURORA_CONFIG_OK;
+    }
+
+    /* Load a new snapshot, once for the threads waiting for it */
+    if((status = pam_config_load(path, &snapshot)) != PAM_AURORA_CONFIG_OK)
+    {
+        pthread_mutex_unlock(&pam_config_lock);
+        return status;
+    }
+
+    /* Take the entry of another file */
+    if(file->path == NULL || strcmp(file->path, path) != 0)
+    {
+        if((file_path = strdup(path)) == NULL)
+        {
+            /* Referenced by the caller only */
+            snapshot->references = 1;
+            pthread_mutex_unlock(&pam_config_lock);
+            *config = snapshot;
+            return PAM_AURORA_CONFIG_OK;
+        }
+
+        free(file->path);
+        file->path = file_path;
+    }
+
+    /* Replace the current snapshot, which is freed once released */
+    if(file->snapshot != NULL && --file->snapshot->references == 0)
+        pam_config_free(file->snapshot);
+
+    /* Referenced by the process and by the caller */
+    file->snapshot = snapshot;
+    file->snapshot->references = 2;
+    pthread_mutex_unlock(&pam_config_lock);
+
+    /* Configuration acquired */
+    *config = snapshot;
+    return PAM_AURORA_CONFIG_OK;
+}
+
+
+/**
+ * This function releases a configuration snapshot
+ * @param config The configuration snapshot
+ */
+void
+pam_config_release(const struct pam_aurora_config *config)
+{
+    /* The snapshot */
+    struct pam_aurora_config *snapshot = (struct pam_aurora_config *) config;
+    int references;
+
+    pthread_mutex_lock(&pam_config_lock);
+    references = --snapshot->references;
+    pthread_mutex_unlock(&pam_config_lock);
+
+    /* Free replaced snapshots once unused */
+    if(references == 0)
+        pam_config_free(snapshot);
+}
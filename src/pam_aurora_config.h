@@ -0,0 +1,188 @@
+/**
+ * file:        pam_aurora_config.h
+ * description: Aurora email module configuration snapshots
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_CONFIG_H
+#define PAM_AURORA_CONFIG_H
+
+#include <sys/types.h>
+#include <time.h>
+
+
+/* The default configuration path */
+#define PAM_AURORA_CONFIG_PATH "/etc/aurora/email.conf"
+
+/* The configuration files whose snapshots a process keeps (the PAM stacks
+   of a process may use several config= files) */
+#define PAM_AURORA_CONFIG_FILES 8
+
+/* The configuration load results */
+#define PAM_AURORA_CONFIG_OK 0
+#define PAM_AURORA_CONFIG_UNAVAILABLE 1
+#define PAM_AURORA_CONFIG_INVALID 2
+
+/* The delivery modes */
+#define PAM_AURORA_DELIVERY_SMTP 0
+#define PAM_AURORA_DELIVERY_MAILERD 1
+#define PAM_AURORA_DELIVERY_SPOOL 2
+#define PAM_AURORA_DELIVERY_LOCAL 3
+#define PAM_AURORA_DELIVERY_SENDMAIL 4
+
+/* The most mail servers (relays) */
+#define PAM_AURORA_RELAY_MAX 8
+
+
+/* The compiled email template (see pam_aurora_mail.h) */
+struct pam_mail_template;
+
+
+/**
+ * The email module configuration
+ *
+ * A configuration is an immutable snapshot of email.conf: it is loaded
+ * once per process and only reloaded when the file changes, so a single
+ * login always reads settings from the same version of the file.
+ **/
+struct pam_aurora_config
+{
+    /* The size of the code to generate, and its characters */
+    int code_length;
+    const char *code_alphabet;
+
+    /* The code lifetime (seconds, 0 to send a code for each login), the
+       wrong codes accepted before it is discarded, and the prompts of one
+       authentication */
+    int code_ttl;
+    int code_attempts;
+    int code_prompts;
+
+    /* Permit to bypass the authentication when unable to send email */
+    int permit_bypass;
+
+    /* The mail server settings (NULL when missing) */
+    const char *mail_server_host;
+    const char *mail_server_user;
+    const char *mail_server_pass;
+
+    /* The mail servers, in preference order (mail_server_host is the
+       first), and the delay before trying the next one in parallel
+       (milliseconds, 0 to only try it after a failure) */
+    const char *mail_servers[PAM_AURORA_RELAY_MAX];
+    int mail_server_count;
+    int mail_hedge_delay;
+
+    /* The authentication time budget, spent waiting for the code delivery
+       (milliseconds, 0 for none), and the longest connection to a mail
+       server (milliseconds) */
+    int auth_deadline;
+    int mail_connect_timeout;
+
+    /* The mail servers circuit breaker: consecutive failures opening it (0
+       to disable it) and the time before probing again (seconds) */
+    int breaker_failures;
+    int breaker_cooldown;
+
+    /* Require STARTTLS, and the CA bundle to verify the server with */
+    int mail_server_tls;
+    const char *mail_server_cainfo;
+
+    /* The mail servers addresses freshness (seconds, 0 to let curl resolve
+       them for each transfer), and the time stale addresses are served
+       while the resolver fails (seconds) */
+    int mail_dns_ttl;
+    int mail_dns_stale;
+
+    /* Resume the TLS sessions of the other processes (when built with
+       PAM_AURORA_TLS_CACHE) */
+    int mail_tls_cache;
+
+    /* The email template, compiled from mail_subject and mail_template */
+    const struct pam_mail_template *mail_template;
+
+    /* The delivery mode (PAM_AURORA_DELIVERY_*) */
+    int delivery;
+
+    /* Deliver the code while the user is prompted */
+    int async_delivery;
+
+    /* The aurora-mailerd socket and reply timeout (milliseconds) */
+    const char *mailerd_socket;
+    int mailerd_timeout;
+
+    /* The outbound spool drained by aurora-flusher, and the age after
+       which a spooled code is dropped (seconds) */
+    const char *spool_dir;
+    int spool_max_age;
+
+    /* The local MTA socket and protocol (LMTP, or SMTP when 0), its
+       sendmail command, and the hand-off timeout (milliseconds) */
+    const char *local_socket;
+    int local_lmtp;
+    const char *sendmail_path;
+    int local_timeout;
+
+    /* The directory of the state files shared by the processes */
+    const char *state_dir;
+
+    /* The code sending throttling: rates (codes per hour, 0 for no limit),
+       bursts, user buckets count, policy over the limit (and longest wait,
+       milliseconds) */
+    int throttle;
+    int throttle_user_rate;
+    int throttle_user_burst;
+    int throttle_global_rate;
+    int throttle_global_burst;
+    int throttle_slots;
+    int throttle_policy;
+    int throttle_wait;
+
+    /* The admission control of the SMTP deliveries: deliveries in flight
+       in all the processes (0 for no limit), deliveries waiting for one to
+       end, longest wait (milliseconds), and policy when a delivery is not
+       admitted (PAM_AURORA_ADMIT_*) */
+    int admit_limit;
+    int admit_queue;
+    int admit_wait;
+    int admit_policy;
+
+    /* The trusted sessions: trust duration after a successful login (seconds,
+       0 to always send a code) and slots count */
+    int trust_window;
+    int trust_slots;
+
+    /* Count the authentications in state_dir/stats.db (aurora-stat) */
+    int stats;
+
+    /* The file state the snapshot has been loaded from */
+    dev_t file_device;
+    ino_t file_inode;
+    off_t file_size;
+    struct timespec file_mtime;
+    struct timespec file_ctime;
+
+    /* The snapshot users count */
+    int references;
+};
+
+
+/**
+ * This function gets the configuration snapshot matching the current file,
+ * loading it if the file changed since its last load
+ * @param path The configuration path
+ * @param config The configuration snapshot destination
+ * @return A PAM_AURORA_CONFIG_* code
+ */
+int
+pam_config_acquire(const char *path, const struct pam_aurora_config **config);
+
+
+/**
+ * This function releases a configuration snapshot
+ * @param config The configuration snapshot
+ */
+void
+pam_config_release(const struct pam_aurora_config *config);
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * file:        pam_aurora_curl.c
+ * description: Aurora libcurl loader (libcurl is only loaded by the first
+ *              delivery of the process)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "pam_aurora_curl.h"
+
+
+/* The libcurl functions, by symbol */
+static const struct
+{
+    const char *name;
+    size_t offset;
+} pam_curl_symbols[] = {
+    { "curl_easy_init", offsetof(struct pam_curl_api, easy_init) },
+    { "curl_easy_setopt", offsetof(struct pam_curl_api, easy_setopt) },
+    { "curl_easy_getinfo", offsetof(struct pam_curl_api, easy_getinfo) },
+    { "curl_easy_pause", offsetof(struct pam_curl_api, easy_pause) },
+    { "curl_easy_cleanup", offsetof(struct pam_curl_api, easy_cleanup) },
+    { "curl_multi_init", offsetof(struct pam_curl_api, multi_init) },
+    { "curl_multi_add_handle",
+        offsetof(struct pam_curl_api, multi_add_handle) },
+    { "curl_multi_remove_handle",
+        offsetof(struct pam_curl_api, multi_remove_handle) },
+    { "curl_multi_perform", offsetof(struct pam_curl_api, multi_perform) },
+    { "curl_multi_poll", offsetof(struct pam_curl_api, multi_poll) },
+    { "curl_multi_info_read", offsetof(struct pam_curl_api, multi_info_read) },
+    { "curl_multi_cleanup", offsetof(struct pam_curl_api, multi_cleanup) },
+    { "curl_slist_append", offsetof(struct pam_curl_api, slist_append) },
+    { "curl_slist_free_all", offsetof(struct pam_curl_api, slist_free_all) },
+    { "curl_version_info", offsetof(struct pam_curl_api, version_info) }
+};
+
+/* The libcurl functions */
+struct pam_curl_api pam_curl;
+
+/* The libcurl loading, done once per process: left to curl_easy_init, the
+   initialization is not thread-safe */
+static pthread_once_t pam_curl_once = PTHREAD_ONCE_INIT;
+static int pam_curl_loaded = 0;
+
+
+/**
+ * This function loads libcurl and initializes it (pthread_once)
+ */
+static void
+pam_curl_init(void)
+{
+    /* The library */
+    void *library;
+    CURLcode (*global_init)(long);
+    struct pam_curl_api api;
+    void *symbol;
+    size_t i;
+
+    if((library = dlopen(PAM_AURORA_CURL_LIBRARY,
+        RTLD_NOW | RTLD_LOCAL | RTLD_NODELETE)) == NULL)
+        return;
+
+    api.library = library;
+
+    /* Resolve the functions (an older libcurl misses some of them) */
+    for(i = 0; i < sizeof(pam_curl_symbols) / sizeof(pam_curl_symbols[0]);
+        i++)
+    {
+        if((symbol = dlsym(library, pam_curl_symbols[i].name)) == NULL)
+        {
+            dlclose(library);
+            return;
+        }
+
+        *(void **) ((char *) &api + pam_curl_symbols[i].offset) = symbol;
+    }
+
+    if((*(void **) &global_init = dlsym(library, "curl_global_init")) == NULL
+        || global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    {
+        dlclose(library);
+        return;
+    }
+
+    pam_curl = api;
+    pam_curl_loaded = 1;
+}
+
+
+/**
+ * This function loads and initializes libcurl, once per process
+ *
+ * libcurl is never unloaded nor cleaned up: the module stays loaded
+ * (-z nodelete) and the application may use libcurl too.
+ * @return 0 on success, -1 when libcurl is unavailable
+ */
+int
+pam_curl_load(void)
+{
+    if(pthread_once(&pam_curl_once, pam_curl_init) != 0 || ! pam_curl_loaded)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * file:        pam_aurora_curl.h
+ * description: Aurora libcurl loader (libcurl is only loaded by the first
+ *              delivery of the process)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_CURL_H
+#define PAM_AURORA_CURL_H
+
+#include <curl/curl.h>
+
+
+/* The libcurl shared object */
+#ifndef PAM_AURORA_CURL_LIBRARY
+#define PAM_AURORA_CURL_LIBRARY "libcurl.so.4"
+#endif
+
+
+/**
+ * The libcurl functions used by the module
+ *
+ * The functions are resolved by pam_curl_load: a login rejected before the
+ * delivery (unknown user, broken configuration) does not map libcurl nor its
+ * TLS library.
+ **/
+struct pam_curl_api
+{
+    /* The library handle (searched for the TLS library functions too) */
+    void *library;
+
+    /* The easy interface */
+    CURL *(*easy_init)(void);
+    CURLcode (*easy_setopt)(CURL *, CURLoption, ...);
+    CURLcode (*easy_getinfo)(CURL *, CURLINFO, ...);
+    CURLcode (*easy_pause)(CURL *, int);
+    void (*easy_cleanup)(CURL *);
+
+    /* The multi interface */
+    CURLM *(*multi_init)(void);
+    CURLMcode (*multi_add_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_remove_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_perform)(CURLM *, int *);
+    CURLMcode (*multi_poll)(CURLM *, struct curl_waitfd *, unsigned int, int,
+        int *);
+    CURLMsg *(*multi_info_read)(CURLM *, int *);
+    CURLMcode (*multi_cleanup)(CURLM *);
+
+    /* The lists and the build */
+    struct curl_slist *(*slist_append)(struct curl_slist *, const char *);
+    void (*slist_free_all)(struct curl_slist *);
+    curl_version_info_data *(*version_info)(CURLversion);
+};
+
+
+/* The libcurl functions, set once pam_curl_load succeeded */
+extern struct pam_curl_api pam_curl;
+
+
+/**
+ * This function loads and initializes libcurl, once per process
+ *
+ * libcurl is never unloaded nor cleaned up: the module stays loaded
+ * (-z nodelete) and the application may use libcurl too.
+ * @return 0 on success, -1 when libcurl is unavailable
+ */
+int
+pam_curl_load(void);
+
+#endif
@@ -0,0 +1,823 @@
+/**
+ * file:        pam_aurora_directory.c
+ * description: Aurora user directory and compiled directory index
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libconfig.h>
+#include "pam_aurora_directory.h"
+
+
+/**
+ * This function hashes a login for the directory index (FNV-1a)
+ * @param login The login
+ * @param length The login length
+ * @return The 64 bits hash
+ */
+uint64_t
+pam_directory_hash(const char *login, size_t length)
+{
+    /* The hash state */
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    /* Mix each byte */
+    for(i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) login[i];
+        hash *= 1099511628211ULL;
+    }
+
+    /* Return hash */
+    return hash;
+}
+
+
+/**
+ * This function builds the default index path of a directory source, by
+ * replacing its ".conf" extension with ".idx"
+ * @param source_path The directory source path
+ * @param index_path The index path destination
+ * @param size The index path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_directory_index_path(const char *source_path, char *index_path,
+size_t size)
+{
+    /* The source path without extension */
+    size_t length = strlen(source_path);
+
+    if(length >= 5 && strcmp(source_path + length - 5, ".conf") == 0)
+        length -= 5;
+
+    /* Append the index extension */
+    if(length + 5 > size)
+        return -1;
+
+    memcpy(index_path, source_path, length);
+    strcpy(index_path + length, ".idx");
+
+    return 0;
+}
+
+
+/**
+ * This function builds the path of a file next to an index, by replacing
+ * its ".idx" extension
+ * @param index_path The index path
+ * @param extension The file extension (PAM_AURORA_*_EXTENSION)
+ * @param path The file path destination
+ * @param size The file path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_directory_sibling_path(const char *index_path, const char *extension,
+char *path, size_t size)
+{
+    /* The index path without extension */
+    size_t length = strlen(index_path);
+
+    if(length >= 4 && strcmp(index_path + length - 4, ".idx") == 0)
+        length -= 4;
+
+    /* Append the extension */
+    if(length + strlen(extension) + 1 > size)
+        return -1;
+
+    memcpy(path, index_path, length);
+    strcpy(path + length, extension);
+
+    return 0;
+}
+
+
+/**
+ * This function computes the checksum of a change log record
+ * @param record The record, followed by its login and email
+ * @return The checksum
+ */
+uint32_t
+pam_directory_log_checksum(const struct pam_directory_log_record *record)
+{
+    /* Everything after the checksum itself */
+    return (uint32_t) pam_directory_hash((const char *) &record->hash,
+        sizeof(*record) - sizeof(record->checksum) + record->login_length
+        + record->email_length);
+}
+
+
+/**
+ * This function returns the next record of a change log, checking its
+ * bounds only
+ * @param log The log mapping
+ * @param size The log size
+ * @param offset The record offset, moved to the next record
+ * @return The record, or NULL at the end of the log (or of its complete
+ *         records)
+ */
+const struct pam_directory_log_record *
+pam_directory_log_next(const unsigned char *log, size_t size,
+size_t *offset)
+{
+    /* The record */
+    const struct pam_directory_log_record *record;
+
+    if(*offset > size || size - *offset < sizeof(*record))
+        return NULL;
+
+    record = (const struct pam_directory_log_record *) (log + *offset);
+
+    /* A record being appended is not complete yet */
+    if(record->login_length == 0 || size - *offset - sizeof(*record)
+        < (size_t) record->login_length + record->email_length)
+        return NULL;
+
+    *offset += sizeof(*record) + record->login_length + record->email_length;
+
+    return record;
+}
+
+
+/**
+ * This function looks for the last change of a login in the change log
+ * @param log_path The change log path
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return PAM_AURORA_DIR_FOUND, PAM_AURORA_DIR_NOT_FOUND for a removed
+ *         login, PAM_AURORA_DIR_TOO_LONG, or PAM_AURORA_DIR_UNCHANGED when
+ *         the log has no change of the login (or no log exists)
+ */
+int
+pam_directory_log_lookup(const char *log_path, const char *login,
+char *email)
+{
+    /* The log file */
+    int log_fd;
+    struct stat log_stat;
+    const unsigned char *log_map;
+    size_t log_size;
+
+    /* The log structures */
+    const struct pam_directory_log_header *header;
+    const struct pam_directory_log_record *record;
+    const struct pam_directory_log_record *change = NULL;
+
+    /* The lookup state */
+    size_t login_length = strlen(login);
+    uint32_t hash;
+    size_t offset;
+    int status;
+
+    /* Without a log, or with an empty one, nothing changed */
+    if((log_fd = open(log_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return PAM_AURORA_DIR_UNCHANGED;
+
+    if(fstat(log_fd, &log_stat) != 0
+        || log_stat.st_size <= (off_t) sizeof(*header))
+    {
+        close(log_fd);
+        return PAM_AURORA_DIR_UNCHANGED;
+    }
+
+    log_size = (size_t) log_stat.st_size;
+    log_map = mmap(NULL, log_size, PROT_READ, MAP_SHARED, log_fd, 0);
+
+    /* The mapping keeps the file alive */
+    close(log_fd);
+
+    if(log_map == MAP_FAILED)
+        return PAM_AURORA_DIR_UNCHANGED;
+
+    header = (const struct pam_directory_log_header *) log_map;
+    hash = (uint32_t) (pam_directory_hash(login, login_length) >> 32);
+
+    /* Keep the last change of the login, the records are in order */
+    if(memcmp(header->magic, PAM_AURORA_LOG_MAGIC, 8) == 0
+        && header->version == PAM_AURORA_LOG_VERSION)
+    {
+        offset = sizeof(*header);
+
+        while((record = pam_directory_log_next(log_map, log_size, &offset))
+            != NULL)
+        {
+            if(record->hash != hash || record->login_length != login_length
+                || memcmp(record + 1, login, login_length) != 0)
+                continue;
+
+            /* A torn record ends the log */
+            if(pam_directory_log_checksum(record) != record->checksum)
+                break;
+
+            change = record;
+        }
+    }
+
+    /* Copy email */
+    if(change == NULL)
+        status = PAM_AURORA_DIR_UNCHANGED;
+    else if(change->email_length == 0)
+        status = PAM_AURORA_DIR_NOT_FOUND;
+    else if(change->email_length > PAM_AURORA_EMAIL_MAX)
+        status = PAM_AURORA_DIR_TOO_LONG;
+    else
+    {
+        memcpy(email, (const char *) (change + 1) + login_length,
+            change->email_length);
+        email[change->email_length] = '\0';
+        status = PAM_AURORA_DIR_FOUND;
+    }
+
+    /* Properly unmap the log */
+    munmap((void *) log_map, log_size);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function checks that a login may be part of an email address
+ * @param login The login
+ * @param length The login length
+ * @return 1 if the login is made of letters, digits, ".", "_", "-" and
+ *         "+", 0 otherwise
+ */
+static int
+pam_directory_plain(const char *login, size_t length)
+{
+    /* The login character */
+    char c;
+    size_t i;
+
+    for(i = 0; i < length; i++)
+    {
+        c = login[i];
+
+        if(! ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-'
+            || c == '+'))
+            return 0;
+    }
+
+    return length > 0;
+}
+
+
+/**
+ * This function matches a login against a glob pattern (* and ?)
+ * @param pattern The pattern
+ * @param pattern_length The pattern length
+ * @param login The login
+ * @param login_length The login length
+ * @param rest The offset destination of the login part matched by the
+ *        first * (the whole login without a *)
+ * @param rest_length The length destination of this part
+ * @return 1 if the login matches, 0 otherwise
+ */
+static int
+pam_directory_glob(const char *pattern, size_t pattern_length,
+const char *login, size_t login_length, size_t *rest, size_t *rest_length)
+{
+    /* The positions, and the last star to backtrack to */
+    size_t p = 0;
+    size_t s = 0;
+    size_t star = (size_t) -1;
+    size_t star_login = 0;
+    size_t first = (size_t) -1;
+
+    *rest = 0;
+    *rest_length = login_length;
+
+    while(s < login_length)
+    {
+        if(p < pattern_length && pattern[p] == '*')
+        {
+            /* A star matches nothing first, then more when backtracking */
+            star = p++;
+            star_login = s;
+
+            if(first == (size_t) -1)
+            {
+                first = star;
+                *rest = s;
+                *rest_length = 0;
+            }
+        }
+        else if(p < pattern_length
+            && (pattern[p] == '?' || pattern[p] == login[s]))
+        {
+            p++;
+            s++;
+        }
+        else if(star != (size_t) -1)
+        {
+            /* The last star matches one more character (the previous
+               stars keep their match) */
+            p = star + 1;
+            s = ++star_login;
+
+            if(star == first)
+                *rest_length = s - *rest;
+        }
+        else
+            return 0;
+    }
+
+    /* The trailing stars match the end of the login */
+    for(; p < pattern_length && pattern[p] == '*'; p++)
+        if(first == (size_t) -1)
+        {
+            first = p;
+            *rest = s;
+            *rest_length = 0;
+        }
+
+    return p == pattern_length;
+}
+
+
+/**
+ * This function reads a derivation rule of the directory source, like
+ * { prefix = "ext-"; email = "%r@partners.company.org"; }
+ * @param setting The rule setting
+ * @param rule The rule destination, pointing to the setting strings
+ * @return 0 on success, -1 if the rule is invalid
+ */
+int
+pam_directory_rule_parse(const config_setting_t *setting,
+struct pam_directory_rule *rule)
+{
+    /* The pattern settings, by PAM_AURORA_RULE_* */
+    static const char *kinds[3] = { "prefix", "suffix", "glob" };
+    const char *pattern;
+    size_t i;
+
+    /* Get the pattern, exactly one */
+    rule->kind = 0;
+
+    for(i = 0; i < 3; i++)
+        if(config_setting_lookup_string(setting, kinds[i], &pattern)
+            == CONFIG_TRUE)
+        {
+            if(rule->kind != 0)
+                return -1;
+
+            rule->kind = (int) i + 1;
+            rule->pattern = pattern;
+        }
+
+    /* Get the email template */
+    if(rule->kind == 0 || config_setting_lookup_string(setting, "email",
+        &rule->email) == CONFIG_FALSE)
+        return -1;
+
+    rule->pattern_length = strlen(rule->pattern);
+    rule->email_length = strlen(rule->email);
+
+    if(rule->pattern_length > PAM_AURORA_RULE_MAX
+        || rule->email_length > PAM_AURORA_RULE_MAX
+        || rule->email_length == 0)
+        return -1;
+
+    /* Check the template escapes */
+    for(i = 0; i < rule->email_length; i++)
+        if(rule->email[i] == '%' && (++i == rule->email_length
+            || (rule->email[i] != 'u' && rule->email[i] != 'r'
+                && rule->email[i] != '%')))
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * This function derives the email address of a login from a rule
+ * @param rule The rule
+ * @param login The user login
+ * @param login_length The user login length
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return PAM_AURORA_DIR_FOUND, PAM_AURORA_DIR_NOT_FOUND when the rule
+ *         does not match, or PAM_AURORA_DIR_TOO_LONG
+ */
+int
+pam_directory_rule_apply(const struct pam_directory_rule *rule,
+const char *login, size_t login_length, char *email)
+{
+    /* The login part not matched by the pattern (%r) */
+    size_t rest;
+    size_t rest_length;
+
+    /* The template expansion */
+    const char *part;
+    size_t part_length;
+    size_t length = 0;
+    size_t i;
+
+    /* Match the login */
+    switch(rule->kind)
+    {
+        case PAM_AURORA_RULE_PREFIX:
+            if(login_length <= rule->pattern_length
+                || memcmp(login, rule->pattern, rule->pattern_length) != 0)
+                return PAM_AURORA_DIR_NOT_FOUND;
+
+            rest = rule->pattern_length;
+            rest_length = login_length - rule->pattern_length;
+            break;
+
+        case PAM_AURORA_RULE_SUFFIX:
+            if(login_length <= rule->pattern_length
+                || memcmp(login + login_length - rule->pattern_length,
+                    rule->pattern, rule->pattern_length) != 0)
+                return PAM_AURORA_DIR_NOT_FOUND;
+
+            rest = 0;
+            rest_length = login_length - rule->pattern_length;
+            break;
+
+        default:
+            if(! pam_directory_glob(rule->pattern, rule->pattern_length,
+                login, login_length, &rest, &rest_length))
+                return PAM_AURORA_DIR_NOT_FOUND;
+
+            break;
+    }
+
+    /* The login becomes part of the address: it must not carry anything
+       else (a header, another recipient...) */
+    if(! pam_directory_plain(login, login_length))
+        return PAM_AURORA_DIR_NOT_FOUND;
+
+    /* Expand the template */
+    for(i = 0; i < rule->email_length; i++)
+    {
+        part = rule->email + i;
+        part_length = 1;
+
+        if(rule->email[i] == '%' && i + 1 < rule->email_length)
+        {
+            if(rule->email[++i] == 'u')
+            {
+                part = login;
+                part_length = login_length;
+            }
+            else if(rule->email[i] == 'r')
+            {
+                part = login + rest;
+                part_length = rest_length;
+            }
+            else
+                part = rule->email + i;
+        }
+
+        if(length + part_length > PAM_AURORA_EMAIL_MAX)
+            return PAM_AURORA_DIR_TOO_LONG;
+
+        memcpy(email + length, part, part_length);
+        length += part_length;
+    }
+
+    email[length] = '\0';
+
+    return PAM_AURORA_DIR_FOUND;
+}
+
+
+/**
+ * This function derives an email from the rules of the compiled index
+ * @param index_map The index mapping
+ * @param index_size The index size
+ * @param login The user login
+ * @param login_length The user login length
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return A PAM_AURORA_DIR_* code
+ */
+static int
+pam_directory_index_rules(const unsigned char *index_map, size_t index_size,
+const char *login, size_t login_length, char *email)
+{
+    /* The index structures */
+    const struct pam_directory_index_header *header =
+        (const struct pam_directory_index_header *) index_map;
+    const struct pam_directory_index_rule *record;
+
+    /* The rule */
+    struct pam_directory_rule rule;
+    uint64_t offset = header->rules_offset;
+    uint32_t i;
+    int status;
+
+    /* The first matching rule gives the email */
+    for(i = 0; i < header->rule_count; i++)
+    {
+        /* Check the rule bounds */
+        if(offset > index_size - sizeof(*record))
+            return PAM_AURORA_DIR_UNAVAILABLE;
+
+        record = (const struct pam_directory_index_rule *)
+            (index_map + offset);
+
+        if(offset + sizeof(*record) + record->pattern_length
+            + record->email_length > index_size)
+            return PAM_AURORA_DIR_UNAVAILABLE;
+
+        rule.kind = record->kind;
+        rule.pattern = (const char *) (record + 1);
+        rule.pattern_length = record->pattern_length;
+        rule.email = rule.pattern + record->pattern_length;
+        rule.email_length = record->email_length;
+
+        if((status = pam_directory_rule_apply(&rule, login, login_length,
+            email)) != PAM_AURORA_DIR_NOT_FOUND)
+            return status;
+
+        offset += sizeof(*record) + record->pattern_length
+            + record->email_length;
+    }
+
+    return PAM_AURORA_DIR_NOT_FOUND;
+}
+
+
+/**
+ * This function checks that an index has been compiled from the current
+ * directory source
+ * @param header The index header
+ * @param source_path The directory source path (NULL when the index has no
+ *        source)
+ * @return 1 if the index is up to date, 0 otherwise
+ */
+int
+pam_directory_index_fresh(const struct pam_directory_index_header *header,
+const char *source_path)
+{
+    /* The source status */
+    struct stat source_stat;
+
+    /* A missing source leaves the index authoritative */
+    if(source_path == NULL || stat(source_path, &source_stat) != 0)
+        return 1;
+
+    /* Compare the recorded source state */
+    return header->source_mtime_sec == (uint64_t) source_stat.st_mtim.tv_sec
+        && header->source_mtime_nsec == (uint64_t) source_stat.st_mtim.tv_nsec
+        && header->source_size == (uint64_t) source_stat.st_size
+        && header->source_inode == (uint64_t) source_stat.st_ino;
+}
+
+
+/**
+ * This function checks the header of a mapped index
+ * @param index_map The index mapping
+ * @param index_size The index size
+ * @return 1 if the index is valid, 0 otherwise
+ */
+int
+pam_directory_index_valid(const unsigned char *index_map, size_t index_size)
+{
+    /* The index structures */
+    const struct pam_directory_index_header *header =
+        (const struct pam_directory_index_header *) index_map;
+    const struct pam_directory_index_slot *slots =
+        (const struct pam_directory_index_slot *) (header + 1);
+
+    return index_size >= sizeof(*header)
+        && memcmp(header->magic, PAM_AURORA_INDEX_MAGIC, 8) == 0
+        && header->version == PAM_AURORA_INDEX_VERSION
+        && header->file_size == index_size
+        && header->bucket_count != 0
+        && (header->bucket_count & (header->bucket_count - 1)) == 0
+        && header->bucket_count <= (index_size - sizeof(*header))
+            / sizeof(*slots)
+        && header->rules_offset <= index_size;
+}
+
+
+/**
+ * This function looks for an email in the compiled directory index
+ * @param index_path The index path
+ * @param source_path The directory source path (NULL when the index has no
+ *        source)
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return A PAM_AURORA_DIR_* code
+ */
+int
+pam_directory_index_lookup(const char *index_path, const char *source_path,
+const char *login, char *email)
+{
+    /* The index file */
+    int index_fd;
+    struct stat index_stat;
+    const unsigned char *index_map;
+    size_t index_size;
+
+    /* The index structures */
+    const struct pam_directory_index_header *header;
+    const struct pam_directory_index_slot *slots;
+    const struct pam_directory_index_record *record;
+
+    /* The lookup state */
+    int removed = 0;
+    size_t login_length;
+    uint64_t hash;
+    uint32_t mask;
+    uint32_t probe;
+    uint32_t i;
+    int status;
+
+    /* Open the index */
+    if((index_fd = open(index_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return PAM_AURORA_DIR_UNAVAILABLE;
+
+    /* Map the whole index */
+    if(fstat(index_fd, &index_stat) != 0
+        || index_stat.st_size < (off_t) sizeof(*header))
+    {
+        close(index_fd);
+        return PAM_AURORA_DIR_UNAVAILABLE;
+    }
+
+    index_size = (size_t) index_stat.st_size;
+    index_map = mmap(NULL, index_size, PROT_READ, MAP_SHARED, index_fd, 0);
+
+    /* The mapping keeps the file alive */
+    close(index_fd);
+
+    if(index_map == MAP_FAILED)
+        return PAM_AURORA_DIR_UNAVAILABLE;
+
+    /* Check the header */
+    header = (const struct pam_directory_index_header *) index_map;
+    slots = (const struct pam_directory_index_slot *) (header + 1);
+
+    if(! pam_directory_index_valid(index_map, index_size)
+        || ! pam_directory_index_fresh(header, source_path))
+    {
+        munmap((void *) index_map, index_size);
+        return PAM_AURORA_DIR_UNAVAILABLE;
+    }
+
+    /* Hash the login */
+    login_length = strlen(login);
+    hash = pam_directory_hash(login, login_length);
+    mask = header->bucket_count - 1;
+    status = PAM_AURORA_DIR_NOT_FOUND;
+
+    /* Probe the table (linear probing) */
+    for(i = 0, probe = (uint32_t) hash & mask; i < header->bucket_count;
+        i++, probe = (probe + 1) & mask)
+    {
+        /* An empty slot ends the chain */
+        if(slots[probe].offset == 0)
+            break;
+
+        /* Skip other hashes */
+        if(slots[probe].hash != (uint32_t) (hash >> 32))
+            continue;
+
+        /* Check the record bounds */
+        if(slots[probe].offset > index_size - sizeof(*record))
+        {
+            status = PAM_AURORA_DIR_UNAVAILABLE;
+            break;
+        }
+
+        record = (const struct pam_directory_index_record *)
+            (index_map + slots[probe].offset);
+
+        if((size_t) slots[probe].offset + sizeof(*record)
+            + record->login_length + record->email_length + 1 > index_size)
+        {
+            status = PAM_AURORA_DIR_UNAVAILABLE;
+            break;
+        }
+
+        /* Compare logins */
+        if(record->login_length != login_length
+            || memcmp(record + 1, login, login_length) != 0)
+            continue;
+
+        /* A removed login is not derived */
+        if(record->email_length == 0)
+        {
+            removed = 1;
+            break;
+        }
+
+        /* Check the email address length */
+        if(record->email_length > PAM_AURORA_EMAIL_MAX)
+        {
+            status = PAM_AURORA_DIR_TOO_LONG;
+            break;
+        }
+
+        /* Copy email */
+        memcpy(email, (const char *) (record + 1) + login_length,
+            record->email_length);
+        email[record->email_length] = '\0';
+        status = PAM_AURORA_DIR_FOUND;
+        break;
+    }
+
+    /* Derive the email of the logins without an entry */
+    if(status == PAM_AURORA_DIR_NOT_FOUND && ! removed
+        && header->rule_count > 0)
+        status = pam_directory_index_rules(index_map, index_size, login,
+            login_length, email);
+
+    /* Properly unmap the index */
+    munmap((void *) index_map, index_size);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function looks for an email in the directory source file
+ * @param source_path The directory source path
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return A PAM_AURORA_DIR_* code
+ */
+int
+pam_directory_text_lookup(const char *source_path, const char *login,
+char *email)
+{
+    /* The directory */
+    config_t directory;
+    FILE *directory_fd;
+    config_setting_t *directory_emails;
+    config_setting_t *directory_rules;
+
+    /* The email buffer */
+    const char *stored_email;
+
+    /* The derivation rules */
+    struct pam_directory_rule rule;
+    int count;
+    int i;
+
+    /* The lookup status */
+    int status;
+
+    /* Init configuration file stream */
+    if((directory_fd = fopen(source_path, "r")) == NULL)
+        return PAM_AURORA_DIR_UNAVAILABLE;
+
+    /* Read and parse the configuration file */
+    config_init(&directory);
+
+    if(config_read(&directory, directory_fd) == CONFIG_FALSE)
+    {
+        config_destroy(&directory);
+        fclose(directory_fd);
+        return PAM_AURORA_DIR_INVALID;
+    }
+
+    /* The file stream is no longer needed */
+    fclose(directory_fd);
+
+    /* Look for user email */
+    directory_emails = config_lookup(&directory, "emails");
+
+    if(directory_emails == NULL || config_setting_lookup_string(
+        directory_emails, login, &stored_email) == CONFIG_FALSE)
+        status = PAM_AURORA_DIR_NOT_FOUND;
+    else if(strlen(stored_email) > PAM_AURORA_EMAIL_MAX)
+        status = PAM_AURORA_DIR_TOO_LONG;
+    else
+    {
+        /* Copy email */
+        strcpy(email, stored_email);
+        status = PAM_AURORA_DIR_FOUND;
+    }
+
+    /* Derive the email of the logins without an entry */
+    directory_rules = config_lookup(&directory, "rules");
+    count = directory_rules? config_setting_length(directory_rules): 0;
+
+    for(i = 0; i < count && status == PAM_AURORA_DIR_NOT_FOUND; i++)
+    {
+        if(pam_directory_rule_parse(config_setting_get_elem(directory_rules,
+            (unsigned int) i), &rule) != 0)
+            status = PAM_AURORA_DIR_INVALID;
+        else
+            status = pam_directory_rule_apply(&rule, login, strlen(login),
+                email);
+    }
+
+    /* Properly destroy the directory */
+    config_destroy(&directory);
+
+    /* Return status */
+    return status;
+}
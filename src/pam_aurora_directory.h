@@ -0,0 +1,336 @@
+/**
+ * file:        pam_aurora_directory.h
+ * description: Aurora user directory and compiled directory index
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_DIRECTORY_H
+#define PAM_AURORA_DIRECTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libconfig.h>
+
+
+/* The default directory paths */
+#define PAM_AURORA_DIRECTORY_PATH "/etc/aurora/directory.conf"
+#define PAM_AURORA_DIRECTORY_INDEX_PATH "/etc/aurora/directory.idx"
+
+/* The maximum email address length (RFC 3696) */
+#define PAM_AURORA_EMAIL_MAX 320
+
+/* The maximum login length stored in the index */
+#define PAM_AURORA_LOGIN_MAX 256
+
+/* The directory index format */
+#define PAM_AURORA_INDEX_MAGIC "AURDIX01"
+#define PAM_AURORA_INDEX_VERSION 3
+
+/* The directory change log format, and the records count over which
+   aurora-dirc compacts it after an update */
+#define PAM_AURORA_LOG_MAGIC "AURDLG01"
+#define PAM_AURORA_LOG_VERSION 1
+#define PAM_AURORA_LOG_COMPACT 4096
+
+/* The change log and compacted changes extensions, next to the index */
+#define PAM_AURORA_LOG_EXTENSION ".log"
+#define PAM_AURORA_CHANGES_EXTENSION ".chg"
+
+/* The directory lookup results */
+#define PAM_AURORA_DIR_FOUND 0
+#define PAM_AURORA_DIR_NOT_FOUND 1
+#define PAM_AURORA_DIR_TOO_LONG 2
+#define PAM_AURORA_DIR_UNAVAILABLE 3
+#define PAM_AURORA_DIR_INVALID 4
+#define PAM_AURORA_DIR_UNCHANGED 5
+
+/* The derivation rules kinds */
+#define PAM_AURORA_RULE_PREFIX 1
+#define PAM_AURORA_RULE_SUFFIX 2
+#define PAM_AURORA_RULE_GLOB 3
+
+/* The maximum rule pattern and email template length */
+#define PAM_AURORA_RULE_MAX 1024
+
+
+/**
+ * The directory index header, at offset 0 of the index file
+ *
+ * The header is followed by bucket_count slots, then by the records.
+ * Each record is a login length (uint16), an email length (uint16), the
+ * login bytes and the NUL terminated email bytes. A record without email
+ * is a login removed by the change log: it is not derived. The derivation
+ * rules follow the records, from rules_offset, in order.
+ **/
+struct pam_directory_index_header
+{
+    /* Index magic and format version */
+    char magic[8];
+    uint32_t version;
+
+    /* Hash table size (a power of two), number of entries (the removed
+       logins included) and rules */
+    uint32_t bucket_count;
+    uint32_t entry_count;
+    uint32_t rule_count;
+
+    /* The source directory state when the index was compiled */
+    uint64_t source_mtime_sec;
+    uint64_t source_mtime_nsec;
+    uint64_t source_size;
+    uint64_t source_inode;
+
+    /* The whole index size, and the rules offset */
+    uint64_t file_size;
+    uint64_t rules_offset;
+};
+
+
+/**
+ * The directory index hash table slot
+ **/
+struct pam_directory_index_slot
+{
+    /* High bits of the login hash */
+    uint32_t hash;
+
+    /* Record offset from the start of the file (0 for an empty slot) */
+    uint32_t offset;
+};
+
+
+/**
+ * The directory index record header
+ **/
+struct pam_directory_index_record
+{
+    /* The login and email lengths */
+    uint16_t login_length;
+    uint16_t email_length;
+};
+
+
+/**
+ * The directory index rule header, followed by the pattern and email
+ * template bytes
+ **/
+struct pam_directory_index_rule
+{
+    /* The rule kind, and the pattern and template lengths */
+    uint16_t kind;
+    uint16_t pattern_length;
+    uint16_t email_length;
+    uint16_t reserved;
+};
+
+
+/**
+ * The directory change log header, at offset 0 of the log file
+ *
+ * The change log is appended by aurora-dirc -a, and folded by its
+ * compaction into a new index, which replaces the previous one. The log
+ * records override the index, the last one of a login first.
+ *
+ * The compaction also folds the log into the compacted changes, a file of
+ * the same format holding the last change of each login, which a full
+ * compile of the directory source applies again (aurora-dirc -d drops
+ * them).
+ **/
+struct pam_directory_log_header
+{
+    /* Log magic and format version */
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+
+/**
+ * The directory change log record, followed by the login and email bytes
+ **/
+struct pam_directory_log_record
+{
+    /* The checksum of the rest of the record (see
+       pam_directory_log_checksum) */
+    uint32_t checksum;
+
+    /* High bits of the login hash */
+    uint32_t hash;
+
+    /* The login and email lengths (no email for a removed login) */
+    uint16_t login_length;
+    uint16_t email_length;
+};
+
+
+/**
+ * An email derivation rule, for the logins without an entry
+ *
+ * The first rule matching the login gives its email address, by replacing
+ * in the template %u with the login, %r with the login part not matched
+ * by the prefix or suffix (or matched by the first * of a glob), and %%
+ * with %. Only the logins made of letters, digits, ".", "_", "-" and "+"
+ * are derived.
+ **/
+struct pam_directory_rule
+{
+    /* The rule kind (PAM_AURORA_RULE_*), and the login pattern */
+    int kind;
+    const char *pattern;
+    size_t pattern_length;
+
+    /* The email template */
+    const char *email;
+    size_t email_length;
+};
+
+
+/**
+ * This function hashes a login for the directory index (FNV-1a)
+ * @param login The login
+ * @param length The login length
+ * @return The 64 bits hash
+ */
+uint64_t
+pam_directory_hash(const char *login, size_t length);
+
+
+/**
+ * This function builds the default index path of a directory source, by
+ * replacing its ".conf" extension with ".idx"
+ * @param source_path The directory source path
+ * @param index_path The index path destination
+ * @param size The index path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_directory_index_path(const char *source_path, char *index_path,
+size_t size);
+
+
+/**
+ * This function builds the path of a file next to an index, by replacing
+ * its ".idx" extension
+ * @param index_path The index path
+ * @param extension The file extension (PAM_AURORA_*_EXTENSION)
+ * @param path The file path destination
+ * @param size The file path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_directory_sibling_path(const char *index_path, const char *extension,
+char *path, size_t size);
+
+
+/**
+ * This function checks the header of a mapped index
+ * @param index_map The index mapping
+ * @param index_size The index size
+ * @return 1 if the index is valid, 0 otherwise
+ */
+int
+pam_directory_index_valid(const unsigned char *index_map, size_t index_size);
+
+
+/**
+ * This function computes the checksum of a change log record
+ * @param record The record, followed by its login and email
+ * @return The checksum
+ */
+uint32_t
+pam_directory_log_checksum(const struct pam_directory_log_record *record);
+
+
+/**
+ * This function returns the next record of a change log, checking its
+ * bounds only
+ * @param log The log mapping
+ * @param size The log size
+ * @param offset The record offset, moved to the next record
+ * @return The record, or NULL at the end of the log (or of its complete
+ *         records)
+ */
+const struct pam_directory_log_record *
+pam_directory_log_next(const unsigned char *log, size_t size,
+size_t *offset);
+
+
+/**
+ * This function looks for the last change of a login in the change log
+ * @param log_path The change log path
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return PAM_AURORA_DIR_FOUND, PAM_AURORA_DIR_NOT_FOUND for a removed
+ *         login, PAM_AURORA_DIR_TOO_LONG, or PAM_AURORA_DIR_UNCHANGED when
+ *         the log has no change of the login (or no log exists)
+ */
+int
+pam_directory_log_lookup(const char *log_path, const char *login,
+char *email);
+
+
+/**
+ * This function checks that an index has been compiled from the current
+ * directory source
+ * @param header The index header
+ * @param source_path The directory source path (NULL when the index has no
+ *        source)
+ * @return 1 if the index is up to date, 0 otherwise
+ */
+int
+pam_directory_index_fresh(const struct pam_directory_index_header *header,
+const char *source_path);
+
+
+/**
+ * This function reads a derivation rule of the directory source, like
+ * { prefix = "ext-"; email = "%r@partners.company.org"; }
+ * @param setting The rule setting
+ * @param rule The rule destination, pointing to the setting strings
+ * @return 0 on success, -1 if the rule is invalid
+ */
+int
+pam_directory_rule_parse(const config_setting_t *setting,
+struct pam_directory_rule *rule);
+
+
+/**
+ * This function derives the email address of a login from a rule
+ * @param rule The rule
+ * @param login The user login
+ * @param login_length The user login length
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return PAM_AURORA_DIR_FOUND, PAM_AURORA_DIR_NOT_FOUND when the rule
+ *         does not match, or PAM_AURORA_DIR_TOO_LONG
+ */
+int
+pam_directory_rule_apply(const struct pam_directory_rule *rule,
+const char *login, size_t login_length, char *email);
+
+
+/**
+ * This function looks for an email in the compiled directory index
+ * @param index_path The index path
+ * @param source_path The directory source path (NULL when the index has no
+ *        source)
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return A PAM_AURORA_DIR_* code
+ */
+int
+pam_directory_index_lookup(const char *index_path, const char *source_path,
+const char *login, char *email);
+
+
+/**
+ * This function looks for an email in the directory source file
+ * @param source_path The directory source path
+ * @param login The user login
+ * @param email The email destination (PAM_AURORA_EMAIL_MAX + 1 bytes)
+ * @return A PAM_AURORA_DIR_* code
+ */
+int
+pam_directory_text_lookup(const char *source_path, const char *login,
+char *email);
+
+#endif
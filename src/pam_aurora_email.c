@@ -8,11 +8,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 #include <libconfig.h>
 #include <curl/curl.h>
-#include <uuid/uuid.h>
+#include "pam_aurora_admit.h"
+#include "pam_aurora_arena.h"
+#include "pam_aurora_config.h"
+#include "pam_aurora_directory.h"
+#include "pam_aurora_local.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_mailer.h"
+#include "pam_aurora_pending.h"
+#include "pam_aurora_prompt.h"
+#include "pam_aurora_random.h"
+#include "pam_aurora_session.h"
+#include "pam_aurora_spool.h"
+#include "pam_aurora_stats.h"
+#include "pam_aurora_throttle.h"
+#include "pam_aurora_trace.h"
 
 
 /**
@@ -54,6 +69,7 @@ const char **pam_argv)
 /**
  * This function lets us do IO via PAM
  * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena, which takes the responses over
  * @param pam_argc The number of args
  * @param pam_message The message to prompt
  * @param pam_response The user response
@@ -61,12 +77,14 @@ const char **pam_argv)
  * @see pam_unix/support.c
  */
 int
-pam_converse(pam_handle_t *pam_handle, int pam_argc, 
-struct pam_message **pam_message, struct pam_response **pam_response)
+pam_converse(pam_handle_t *pam_handle, struct pam_arena *pam_arena, 
+int pam_argc, struct pam_message **pam_message, 
+struct pam_response **pam_response)
 {
     /* PAM data */
     struct pam_conv *pam_conversation;
     int pam_status;
+    int i;
 
     /* Check feasibility of PAM conversations */
     pam_status = pam_get_item(pam_handle, PAM_CONV, 
@@ -78,426 +96,448 @@ struct pam_message **pam_message, struct pam_response **pam_response)
             (const struct pam_message **) pam_message, pam_response, 
             pam_conversation->appdata_ptr);
 
+    /* The responses are freed with the transaction, even when unused */
+    if(pam_status != PAM_SUCCESS || *pam_response == NULL)
+        return pam_status;
+
+    for(i = 0; i < pam_argc; i++)
+    {
+        if((*pam_response)[i].resp != NULL && pam_arena_adopt(pam_arena, 
+            (*pam_response)[i].resp, strlen((*pam_response)[i].resp)) != 0)
+        {
+            (*pam_response)[i].resp = NULL;
+            pam_status = PAM_BUF_ERR;
+        }
+    }
+
+    if(pam_arena_adopt(pam_arena, *pam_response, 0) != 0)
+    {
+        *pam_response = NULL;
+        pam_status = PAM_BUF_ERR;
+    }
+
     /* Return PAM status */
     return pam_status;
 }
 
 
 /**
- * This function looks for user data in directory
- * @param pam_handle The PAM handle
- * @param pam_user_login The user login
- * @param pam_user_email The email destination
- * @return A PAM return code
- */
-int
-pam_directory_lookup(pam_handle_t *pam_handle, const char *pam_user_login, 
-char *pam_user_email)
+ * The module arguments (from the PAM service file)
+ **/
+struct pam_aurora_args
 {
-    /* The module dialogs */
-    struct pam_message *pam_dialog_message[1];
-    struct pam_message pam_dialog_message_ptr[1];
-    struct pam_response *pam_dialog_response;
-
-    /* The module directory */
-    config_t pam_directory;
-    FILE *pam_directory_fd;
-    config_setting_t *pam_directory_emails;
+    /* The configuration path (config=) */
+    const char *config_path;
 
-    /* The email buffer */
-    const char *stored_user_email;
-
-    /* Init PAM dialog variables */
-    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
-    pam_dialog_response = NULL;
-
-    /* Init configuration */
-    config_init(&pam_directory);
-
-    /* Init configuration file stream */
-    if((pam_directory_fd = fopen("/etc/aurora/directory.conf", "r")) == NULL)
-    {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to open directory";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+    /* The directory source and index paths (directory=, index=) */
+    const char *directory_path;
+    const char *directory_index_path;
 
-        /* Properly destroy the directory */
-        config_destroy(&pam_directory);
+    /* The default index path of an overridden directory */
+    char directory_index_buffer[4096];
 
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
-    }
+    /* The change log path, next to the index (NULL when too long) */
+    const char *directory_log_path;
+    char directory_log_buffer[4096];
 
-    /* Read and parse the configuration file */
-    if(config_read(&pam_directory, pam_directory_fd) == CONFIG_FALSE)
-    {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to read directory";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+    /* The compacted changes path, next to the index (NULL when too long) */
+    const char *directory_changes_path;
+    char directory_changes_buffer[4096];
 
-        /* Properly destroy the directory */
-        config_destroy(&pam_directory);
+    /* The trace sink (trace=), NULL when tracing is disabled */
+    const char *trace_sink;
+};
 
-        /* Properly destroy the directory file stream */
-        fclose(pam_directory_fd);
 
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
-    }
+/**
+ * This function parses the module arguments
+ * @param pam_argc The PAM arguments count
+ * @param pam_argv The PAM arguments array
+ * @param pam_args The parsed arguments destination
+ */
+static void
+pam_parse_args(int pam_argc, const char **pam_argv, 
+struct pam_aurora_args *pam_args)
+{
+    /* The argument index */
+    int i;
 
-    /* Get the emails collection */
-    pam_directory_emails = config_lookup(&pam_directory, "emails");
+    /* Set default paths */
+    pam_args->config_path = PAM_AURORA_CONFIG_PATH;
+    pam_args->directory_path = PAM_AURORA_DIRECTORY_PATH;
+    pam_args->directory_index_path = NULL;
+    pam_args->trace_sink = NULL;
 
-    /* Look for user email */
-    if (config_setting_lookup_string(pam_directory_emails, 
-        pam_user_login, &stored_user_email) == CONFIG_FALSE)
+    /* Override them */
+    for(i = 0; i < pam_argc; i++)
     {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Email not found in directory";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Properly destroy the directory */
-        config_destroy(&pam_directory);
-
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
+        if(strncmp(pam_argv[i], "config=", 7) == 0)
+            pam_args->config_path = pam_argv[i] + 7;
+        else if(strncmp(pam_argv[i], "directory=", 10) == 0)
+            pam_args->directory_path = pam_argv[i] + 10;
+        else if(strncmp(pam_argv[i], "index=", 6) == 0)
+            pam_args->directory_index_path = pam_argv[i] + 6;
+        else if(strncmp(pam_argv[i], "trace=", 6) == 0)
+            pam_args->trace_sink = pam_argv[i] + 6;
     }
 
-    /* Check the email address length */
-    if(strlen(stored_user_email) > 320)
+    /* The index follows the directory, unless set */
+    if(pam_args->directory_index_path == NULL)
     {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Email address too long (max 320 chars)";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Properly destroy the directory */
-        config_destroy(&pam_directory);
-
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
+        if(strcmp(pam_args->directory_path, PAM_AURORA_DIRECTORY_PATH) == 0 
+            || pam_directory_index_path(pam_args->directory_path, 
+                pam_args->directory_index_buffer, 
+                sizeof(pam_args->directory_index_buffer)) != 0)
+            pam_args->directory_index_path = PAM_AURORA_DIRECTORY_INDEX_PATH;
+        else
+            pam_args->directory_index_path = pam_args->directory_index_buffer;
     }
 
-    /* Copy email */
-    strcpy(pam_user_email, stored_user_email);
-
-    /* Properly destroy the directory */
-    config_destroy(&pam_directory);
-
-    /* User email found */
-    return PAM_SUCCESS;
+    /* The changes follow the index */
+    pam_args->directory_log_path = pam_directory_sibling_path(
+        pam_args->directory_index_path, PAM_AURORA_LOG_EXTENSION, 
+        pam_args->directory_log_buffer, 
+        sizeof(pam_args->directory_log_buffer)) == 0? 
+        pam_args->directory_log_buffer: NULL;
+    pam_args->directory_changes_path = pam_directory_sibling_path(
+        pam_args->directory_index_path, PAM_AURORA_CHANGES_EXTENSION, 
+        pam_args->directory_changes_buffer, 
+        sizeof(pam_args->directory_changes_buffer)) == 0? 
+        pam_args->directory_changes_buffer: NULL;
 }
 
 
 /**
- * The email context structure for curl library 
- **/
-struct pam_email_ctx
+ * This function looks for user data in directory
+ *
+ * The changes (see aurora-dirc -a) override the directory. The
+ * compiled index (see aurora-dirc) is used when it is up to date, the
+ * compacted changes (see aurora-dirc -c) then the directory source are
+ * read otherwise.
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param pam_args The module arguments
+ * @param pam_trace The authentication trace
+ * @param pam_user_login The user login
+ * @param pam_user_email The email destination (PAM_AURORA_EMAIL_MAX + 1)
+ * @return A PAM return code
+ */
+int
+pam_directory_lookup(pam_handle_t *pam_handle, struct pam_arena *pam_arena,
+const struct pam_aurora_args *pam_args, struct pam_aurora_trace *pam_trace,
+const char *pam_user_login, char *pam_user_email)
 {
-    /* Email transmitter */
-    char *from;
-  
-    /* Email receiver */
-    char *to;
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
 
-    /* Receiver username */
-    char *user;
+    /* The lookup status */
+    int pam_directory_status;
 
-    /* Authentication code */
-    char *code;
-  
-    /* Email id */
-    char *uuid;
-  
-    /* Current line of message */
-    int current_line;
-};
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
 
+    /* Look for the changes of the user first, the last one first */
+    pam_directory_status = PAM_AURORA_DIR_UNCHANGED;
 
-/**
- * Email payload function for curl library
- * @param buffer The data buffer
- * @param size The size to read
- * @param items_count The items count to read
- * @param email_ctx The email context
- * @return The data size
- */
-size_t
-pam_payload_email_source(char *buffer, size_t size, size_t items_count, 
-void *email_ctx)
-{
-    /* The email context */
-    struct pam_email_ctx *ctx = (struct pam_email_ctx *) email_ctx;
+    if(pam_args->directory_log_path != NULL)
+        pam_directory_status = pam_directory_log_lookup(
+            pam_args->directory_log_path, pam_user_login, pam_user_email);
 
-    /* The message line with length */
-    char *line;
-    size_t line_length;
-    
-   
-    /* If the message has been read, exit from here */
-    if((size == 0) || (items_count == 0) || ((size * items_count) < 1))
-        return 0;
+    pam_trace_mark(pam_trace, PAM_AURORA_PHASE_DIRECTORY_LOG);
 
-    /* Build current line */
-    switch(ctx->current_line)
+    /* Look for user email in the compiled index */
+    if(pam_directory_status == PAM_AURORA_DIR_UNCHANGED)
     {
-        case 0:
-	    /* Line 0: Date */
-	    line = (char*) malloc(40 * sizeof(char));
-            sprintf(line, "Date: Mon, 29 Nov 2010 21:54:29 +1100\r\n");
-            break;
+        pam_directory_status = pam_directory_index_lookup(
+            pam_args->directory_index_path, pam_args->directory_path, 
+            pam_user_login, pam_user_email);
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_DIRECTORY_INDEX);
+    }
 
-        case 1:
-	    /* Line 1: To */
-            line = (char*) malloc((strlen(ctx->to) + 7) * sizeof(char));
-            sprintf(line, "To: %s\r\n", (char*) ctx->to);
-            break;
+    /* Fall back to the compacted changes, then to the directory source */
+    if(pam_directory_status == PAM_AURORA_DIR_UNAVAILABLE)
+    {
+        pam_directory_status = pam_args->directory_changes_path != NULL? 
+            pam_directory_log_lookup(pam_args->directory_changes_path, 
+                pam_user_login, pam_user_email): PAM_AURORA_DIR_UNCHANGED;
 
-        case 2:
-	    /* Line 2: From */
-            line = (char*) malloc((strlen(ctx->from) + 22) * sizeof(char));
-            sprintf(line, "From: %s (PAM Aurora)\r\n", (char*) ctx->from);
-            break;
+        if(pam_directory_status == PAM_AURORA_DIR_UNCHANGED)
+            pam_directory_status = pam_directory_text_lookup(
+                pam_args->directory_path, pam_user_login, pam_user_email);
 
-        case 3:
-            /* Line 3: ID */
-            line = (char*) malloc((strlen(ctx->uuid) + 15) * sizeof(char));
-            sprintf(line, "Message-ID: %s\r\n", (char*) ctx->uuid);
-            break;
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_DIRECTORY_TEXT);
+    }
 
-        case 4:
-	    /* Line 2: Subject */
-            line = (char*) malloc(32 * sizeof(char));
-            sprintf(line, "Subject: Your validation code\r\n");
-            break;
+    /* Check the lookup status */
+    switch(pam_directory_status)
+    {
+        case PAM_AURORA_DIR_FOUND:
+            /* User email found */
+            return PAM_SUCCESS;
 
-        case 5:
-	    /* Line 2: Jump */
-            line = (char*) malloc(3 * sizeof(char));
-            sprintf(line, "\r\n");
+        case PAM_AURORA_DIR_UNAVAILABLE:
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Unable to open directory";
             break;
 
-        case 6:
-	    /* Line 6: Message (line 1) */
-	  line = (char*) malloc((7 + strlen(ctx->user))  * sizeof(char));
-            sprintf(line, "Hi %s,\r\n", ctx->user);
-	    break;
+        case PAM_AURORA_DIR_INVALID:
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Unable to read directory";
+            break;
 
-        case 7:
-	    /* Line 2: Message (line 2) */
-            line = (char*) malloc(3 * sizeof(char));
-            sprintf(line, "\r\n");
+        case PAM_AURORA_DIR_TOO_LONG:
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Email address too long (max 320 chars)";
             break;
 
-        case 8:
-	    /* Line 6: Message (line 3) */
-            line = (char*) malloc((32 + strlen(ctx->code)) * sizeof(char));
-            sprintf(line, "Your authentication code is %s.\r\n", ctx->code);
-	    break;
-	    
         default:
-            /* Line out of range  */
-            return 0;
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Email not found in directory";
+            pam_trace->stats.counters[PAM_AURORA_STAT_DIRECTORY_MISSES]++;
             break;
     }
 
-    /* Get line length */
-    line_length = strlen(line);
+    /* An error occurs */
+    pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
+    pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+        &pam_dialog_response);
 
-    /* Fill buffer */
-    memcpy(buffer, line, line_length);
+    /* Reject authentication */
+    return PAM_AUTH_ERR;
+}
 
-    /* Increase line */
-    ctx->current_line++;
 
-    /* Return length */
-    return line_length;
-}
+/**
+ * The background delivery state
+ **/
+struct pam_delivery
+{
+    /* The delivery thread */
+    pthread_t thread;
+
+    /* The delivery parameters */
+    const struct pam_aurora_config *config;
+    const char *user;
+    const char *email;
+    const char *code;
+
+    /* The authentication trace, and deadline */
+    struct pam_aurora_trace *trace;
+    int64_t deadline;
+
+    /* The delivery status and error message */
+    int status;
+    const char *error;
+};
 
 
 /**
- * This function transmits the code to the user
+ * This function delivers the code to the user, without conversing with PAM
+ * @param pam_config The module configuration
  * @param pam_user The user login
  * @param pam_email The user email address
  * @param pam_code The generated code
+ * @param pam_trace The authentication trace
+ * @param pam_deadline The authentication deadline (see pam_mail_now, 0 for
+ *        none)
+ * @param pam_error The error message destination
  * @return A PAM return code
  */
-int
-pam_transmit_code(pam_handle_t *pam_handle, const char *pam_user,
-const char *pam_email, const char *pam_code)
+static int
+pam_deliver_code(const struct pam_aurora_config *pam_config, 
+const char *pam_user, const char *pam_email, const char *pam_code, 
+struct pam_aurora_trace *pam_trace, int64_t pam_deadline, 
+const char **pam_error)
 {
-    /* The curl instance */
-    CURL *curl;
+    /* The SMTP client */
+    struct pam_mail_client client;
 
     /* The curl return */
     CURLcode res = CURLE_OK;
 
-    /* The recipents list */
-    struct curl_slist *recipients = NULL;
+    /* The delivery slot */
+    struct pam_admit admit;
+    int pam_admitted;
 
     /* The email contect */
     struct pam_email_ctx email_ctx;
     
     /* The email id */
-    uuid_t uuid;
-    char email_id[37];
+    char email_id[PAM_AURORA_UUID_LENGTH + 1];
 
-    /* The mail server configuration */
-    const char *pam_mail_server_host;
-    const char *pam_mail_server_user;
-    const char *pam_mail_server_pass;
-
-    /* The module configuration */
-    config_t pam_config;
-    FILE *pam_config_fd;
-
-    /* The module dialogs */
-    struct pam_message *pam_dialog_message[1];
-    struct pam_message pam_dialog_message_ptr[1];
-    struct pam_response *pam_dialog_response;
-
-    /* Init PAM dialog variables */
-    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
-    pam_dialog_response = NULL;
+    /* The daemon reply timeout, within the time budget */
+    int64_t pam_timeout = pam_config->mailerd_timeout;
 
     /* Generate a random id for email */
-    uuid_generate_random(uuid);
-
-    /* Init configuration */
-    config_init(&pam_config);
-
-    /* Init configuration file stream */
-    if((pam_config_fd = fopen("/etc/aurora/email.conf", "r")) == NULL)
+    if(pam_random_uuid(email_id) != 0)
     {
         /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to open configuration";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Properly destroy the configuration */
-        config_destroy(&pam_config);
+        *pam_error = "[ERROR] Unable to generate email id";
 
         /* Reject authentication */
         return PAM_AUTH_ERR;
     }
 
-    /* Read and parse the configuration file */
-    if(config_read(&pam_config, pam_config_fd) == CONFIG_FALSE)
+    /* Hand the code over to aurora-mailerd */
+    if(pam_config->delivery == PAM_AURORA_DELIVERY_MAILERD)
     {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to read configuration";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+        if(pam_deadline != 0 && pam_deadline - pam_mail_now() < pam_timeout)
+            pam_timeout = pam_deadline - pam_mail_now();
 
-        /* Properly destroy the configuration */
-        config_destroy(&pam_config);
+        if(pam_timeout <= 0 || pam_mailer_submit(pam_config->mailerd_socket, 
+            (int) pam_timeout, pam_user, pam_email, pam_code, 
+            email_id) != 0)
+        {
+            /* An error occurs */
+            *pam_error = "[ERROR] Mail daemon unavailable";
 
-        /* Properly destroy the configuration file stream */
-        fclose(pam_config_fd);
+            /* Reject authentication */
+            return PAM_AUTH_ERR;
+        }
 
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
+        /* Transmission queued */
+        return PAM_SUCCESS;
     }
 
-    /* Get mail server settings */
-    if(
-        (config_lookup_string(&pam_config, "mail_server_host", 
-            &pam_mail_server_host) == CONFIG_FALSE) ||
-        (config_lookup_string(&pam_config, "mail_server_user", 
-            &pam_mail_server_user) == CONFIG_FALSE) ||
-        (config_lookup_string(&pam_config, "mail_server_pass", 
-            &pam_mail_server_pass) == CONFIG_FALSE)
-    )
+    /* Check mail server settings (a local MTA only needs the sender) */
+    if(pam_config->mail_server_user == NULL || 
+        (pam_config->delivery != PAM_AURORA_DELIVERY_LOCAL && 
+        pam_config->delivery != PAM_AURORA_DELIVERY_SENDMAIL && 
+        (pam_config->mail_server_host == NULL || 
+        pam_config->mail_server_pass == NULL)))
     {
         /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Mail server configuration not found";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Properly destroy the directory */
-        config_destroy(&pam_config);
+        *pam_error = "[ERROR] Mail server configuration not found";
 
         /* Reject authentication */
         return PAM_AUTH_ERR;
     }
 
     /* Set email context */
-    email_ctx.from = (char*) pam_mail_server_user;
+    email_ctx.from = (char*) pam_config->mail_server_user;
     email_ctx.to = (char*) pam_email;
     email_ctx.user = (char*) pam_user;
     email_ctx.code = (char*) pam_code;
-    uuid_unparse(uuid, email_id);
     email_ctx.uuid = email_id;
-    email_ctx.current_line = 0;
-    
-    /* Init curl */
-    curl = curl_easy_init();
 
-    if(curl) {
-	/* Set server url */
-        curl_easy_setopt(curl, CURLOPT_URL, (char*) pam_mail_server_host);
+    /* Queue the email for aurora-flusher, once durable */
+    if(pam_config->delivery == PAM_AURORA_DELIVERY_SPOOL)
+    {
+        if(pam_spool_submit(pam_config, &email_ctx, pam_deadline) != 0)
+        {
+            /* An error occurs */
+            *pam_error = "[ERROR] Mail spool unavailable";
 
-	/* Set username */
-        curl_easy_setopt(curl, CURLOPT_USERNAME, (char*) pam_mail_server_user);
+            /* Reject authentication */
+            return PAM_AUTH_ERR;
+        }
 
-	/* Set password */
-        curl_easy_setopt(curl, CURLOPT_PASSWORD, (char*) pam_mail_server_pass);
+        /* Transmission queued */
+        return PAM_SUCCESS;
+    }
 
-	/* Enable SSL */
-        curl_easy_setopt(curl, CURLOPT_USE_SSL, (long) CURLUSESSL_ALL);
+    /* Hand the email to the local MTA, which queues and retries it */
+    if(pam_config->delivery == PAM_AURORA_DELIVERY_LOCAL || 
+        pam_config->delivery == PAM_AURORA_DELIVERY_SENDMAIL)
+    {
+        if((pam_config->delivery == PAM_AURORA_DELIVERY_LOCAL? 
+            pam_local_submit(pam_config, &email_ctx, pam_deadline): 
+            pam_local_sendmail(pam_config, &email_ctx, pam_deadline)) != 0)
+        {
+            /* An error occurs */
+            *pam_error = "[ERROR] Local mail server unavailable";
 
-	/* Set sender */
-        curl_easy_setopt(curl, CURLOPT_MAIL_FROM, (void *) email_ctx.from);
+            /* Reject authentication */
+            return PAM_AUTH_ERR;
+        }
 
-	/* Set secipients */
-        recipients = curl_slist_append(recipients, (void *) email_ctx.to);
-        curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
+        /* Transmission queued */
+        return PAM_SUCCESS;
+    }
 
-	/* Register the payload function */
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, pam_payload_email_source);
+    /* Wait for a delivery slot: the mail servers slow down for everyone 
+       past a number of concurrent sessions */
+    pam_admitted = pam_admit_acquire(&admit, pam_config, pam_deadline);
 
-	/* Set the email context */
-        curl_easy_setopt(curl, CURLOPT_READDATA, &email_ctx);
+    if(admit.waited)
+        pam_trace->stats.counters[PAM_AURORA_STAT_ADMIT_WAITS]++;
 
-	/* Enable upload */
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    if(pam_admitted == PAM_AURORA_ADMIT_FULL || 
+        pam_admitted == PAM_AURORA_ADMIT_EXPIRED)
+    {
+        pam_trace->stats.counters[PAM_AURORA_STAT_ADMIT_OVERFLOWS]++;
 
-	/* Send email */
-        res = curl_easy_perform(curl);
+        /* Queue the email for aurora-flusher instead, within a new 
+           admission wait (one sync at least) since the deadline may be 
+           spent already */
+        if(pam_config->admit_policy == PAM_AURORA_ADMIT_SPOOL)
+        {
+            if(pam_spool_submit(pam_config, &email_ctx, pam_mail_now() + 
+                (pam_config->admit_wait > PAM_AURORA_SPOOL_WAIT? 
+                    pam_config->admit_wait: PAM_AURORA_SPOOL_WAIT)) != 0)
+            {
+                /* An error occurs */
+                *pam_error = "[ERROR] Mail spool unavailable";
+
+                /* Reject authentication */
+                return PAM_AUTH_ERR;
+            }
+
+            /* Transmission queued */
+            return PAM_SUCCESS;
+        }
 
-        if(res != CURLE_OK)
-	{
+        if(pam_config->admit_policy == PAM_AURORA_ADMIT_REJECT)
+        {
             /* An error occurs */
-            pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-            pam_dialog_message_ptr[0].msg = 
-                "[ERROR] Email transmission failure";
-            pam_converse(pam_handle, 1, pam_dialog_message, 
-                &pam_dialog_response);
+            *pam_error = "[ERROR] Mail server busy, please try again later";
+
+            /* Reject authentication */
+            return PAM_AUTH_ERR;
+        }
+    }
 
+    /* Send email */
+    if(pam_mail_client_init(&client) == 0)
+    {
+        res = pam_mail_send(&client, pam_config, &email_ctx, pam_deadline);
 
-            /* Free memory */
-            config_destroy(&pam_config);
-            curl_slist_free_all(recipients);
-            curl_easy_cleanup(curl);
+        if(client.last != NULL)
+            pam_trace_curl(pam_trace, client.last);
+    }
+    else
+        res = CURLE_FAILED_INIT;
 
-	    /* Reject authentication */
-            return PAM_AUTH_ERR;
-	}
+    /* Every mail server breaker is open: no connection has been tried */
+    if(res == CURLE_COULDNT_CONNECT && client.last == NULL)
+    {
+        pam_mail_client_cleanup(&client);
+        pam_admit_release(&admit);
+        pam_trace->stats.smtp_error = (int) res;
+
+        /* An error occurs */
+        *pam_error = "[ERROR] Mail server unavailable, please try again later";
+
+        /* Reject authentication */
+        return PAM_AUTH_ERR;
+    }
+
+    /* The connections are closed: hand the slot over */
+    pam_mail_client_cleanup(&client);
+    pam_admit_release(&admit);
+
+    if(res != CURLE_OK)
+    {
+        pam_trace->stats.smtp_error = (int) res;
+
+        /* An error occurs */
+        *pam_error = "[ERROR] Email transmission failure";
 
-	/* Free memory */
-        config_destroy(&pam_config);
-        curl_slist_free_all(recipients);
-        curl_easy_cleanup(curl);
+        /* Reject authentication */
+        return PAM_AUTH_ERR;
     }
   
     /* Transmission success */
@@ -506,277 +546,688 @@ const char *pam_email, const char *pam_code)
 
 
 /**
- * This function performs the task of authenticating the user
+ * This function transmits the code to the user
  * @param pam_handle The PAM handle
- * @param pam_flags The authentication flags
- * @param pam_argc The system arguments count
- * @param pam_argv The system arguments array
+ * @param pam_arena The transaction arena
+ * @param pam_config The module configuration
+ * @param pam_user The user login
+ * @param pam_email The user email address
+ * @param pam_code The generated code
+ * @param pam_trace The authentication trace
+ * @param pam_deadline The authentication deadline (see pam_mail_now, 0 for
+ *        none)
  * @return A PAM return code
  */
-PAM_EXTERN int 
-pam_sm_authenticate(pam_handle_t *pam_handle, int pam_flags, int pam_argc, 
-const char **pam_argv)
+int
+pam_transmit_code(pam_handle_t *pam_handle, struct pam_arena *pam_arena,
+const struct pam_aurora_config *pam_config, const char *pam_user,
+const char *pam_email, const char *pam_code, 
+struct pam_aurora_trace *pam_trace, int64_t pam_deadline)
 {
     /* The module dialogs */
     struct pam_message *pam_dialog_message[1];
     struct pam_message pam_dialog_message_ptr[1];
     struct pam_response *pam_dialog_response;
-    char *pam_dialog_input;
-
-    /* The module parameters */
-    int pam_config_permit_bypass = 0;
-    int pam_config_code_length = 8;
-
-    /* The module configuration */
-    config_t pam_config;
-    FILE *pam_config_fd;
 
     /* The module status */
     int pam_status;
+    const char *pam_error;
 
-    /* The module data */
-    const char *pam_user;
-    char pam_email[320];
-    char *pam_code;
-    char *pam_str_buffer;
-
-    /* The module randomization */
-    FILE *pam_urandom_fd;
-    int pam_random;
+    /* The delivery start */
+    uint64_t pam_start = pam_stats_now();
 
     /* Init PAM dialog variables */
     pam_dialog_message[0] = &pam_dialog_message_ptr[0];
     pam_dialog_response = NULL;
 
-    /* Init configuration */
-    config_init(&pam_config);
+    /* Deliver the code */
+    pam_status = pam_deliver_code(pam_config, pam_user, pam_email, pam_code, 
+        pam_trace, pam_deadline, &pam_error);
+    pam_trace_mark(pam_trace, PAM_AURORA_PHASE_DELIVERY);
+    pam_stats_delivered(&pam_trace->stats, pam_status == PAM_SUCCESS, 
+        pam_start);
+
+    if(pam_trace->sink != NULL)
+        pam_trace->send = pam_trace->phase[PAM_AURORA_PHASE_DELIVERY];
 
-    /* Init configuration file stream */
-    if((pam_config_fd = fopen("/etc/aurora/email.conf", "r")) == NULL)
+    if(pam_status != PAM_SUCCESS)
     {
         /* An error occurs */
         pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to open configuration";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+        pam_dialog_message_ptr[0].msg = pam_error;
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
+    }
 
-        /* Properly destroy the configuration */
-        config_destroy(&pam_config);
+    /* Return status */
+    return pam_status;
+}
 
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
-    }
 
-    /* Read and parse the configuration file */
-    if(config_read(&pam_config, pam_config_fd) == CONFIG_FALSE)
+/**
+ * The background delivery thread
+ * @param delivery_ptr The delivery state
+ * @return NULL
+ */
+static void *
+pam_delivery_run(void *delivery_ptr)
+{
+    /* The delivery state */
+    struct pam_delivery *delivery = (struct pam_delivery *) delivery_ptr;
+    uint64_t start = pam_trace_now(delivery->trace);
+    uint64_t stats_start = pam_stats_now();
+
+    /* Deliver the code */
+    delivery->status = pam_deliver_code(delivery->config, delivery->user, 
+        delivery->email, delivery->code, delivery->trace, delivery->deadline, 
+        &delivery->error);
+    pam_stats_delivered(&delivery->trace->stats, 
+        delivery->status == PAM_SUCCESS, stats_start);
+
+    /* Record the delivery duration */
+    if(delivery->trace->sink != NULL)
+        delivery->trace->send = (uint32_t) (pam_trace_now(delivery->trace) 
+            - start);
+
+    return NULL;
+}
+
+
+/**
+ * This function starts delivering the code in background
+ * @param delivery The delivery state, which must outlive the delivery
+ * @param pam_config The module configuration
+ * @param pam_user The user login
+ * @param pam_email The user email address
+ * @param pam_code The generated code
+ * @param pam_trace The authentication trace
+ * @param pam_deadline The authentication deadline (see pam_mail_now, 0 for
+ *        none)
+ * @return 0 when the delivery is started, -1 otherwise
+ */
+static int
+pam_delivery_start(struct pam_delivery *delivery, 
+const struct pam_aurora_config *pam_config, const char *pam_user, 
+const char *pam_email, const char *pam_code, 
+struct pam_aurora_trace *pam_trace, int64_t pam_deadline)
+{
+    /* Set delivery parameters */
+    delivery->config = pam_config;
+    delivery->user = pam_user;
+    delivery->email = pam_email;
+    delivery->code = pam_code;
+    delivery->trace = pam_trace;
+    delivery->deadline = pam_deadline;
+    delivery->status = PAM_AUTH_ERR;
+    delivery->error = NULL;
+
+    /* Start the delivery thread */
+    return pthread_create(&delivery->thread, NULL, pam_delivery_run, 
+        delivery) == 0? 0: -1;
+}
+
+
+/**
+ * This function waits for the end of a background delivery and reports
+ * its error, if any
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param delivery The delivery state
+ * @return The delivery PAM return code
+ */
+static int
+pam_delivery_wait(pam_handle_t *pam_handle, struct pam_arena *pam_arena,
+struct pam_delivery *delivery)
+{
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
+
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
+
+    /* Wait for the delivery thread */
+    pthread_join(delivery->thread, NULL);
+
+    if(delivery->status != PAM_SUCCESS)
     {
         /* An error occurs */
         pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to read configuration";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Properly destroy the configuration */
-        config_destroy(&pam_config);
+        pam_dialog_message_ptr[0].msg = delivery->error;
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
+    }
 
-        /* Properly destroy the configuration file stream */
-        fclose(pam_config_fd);
+    /* Return status */
+    return delivery->status;
+}
 
-        /* Reject authentication */
-        return PAM_AUTH_ERR;
-    }
 
-    /* Get settings */
-    config_lookup_int(&pam_config, "code_length", 
-        &pam_config_code_length);
-    config_lookup_int(&pam_config, "permit_bypass", 
-        &pam_config_permit_bypass);
+/**
+ * This function applies the bypass policy after a delivery failure
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param pam_config The module configuration
+ * @param pam_trace The authentication trace
+ * @param pam_status The delivery PAM return code
+ * @return A PAM return code
+ */
+static int
+pam_delivery_failed(pam_handle_t *pam_handle, struct pam_arena *pam_arena,
+const struct pam_aurora_config *pam_config, 
+struct pam_aurora_trace *pam_trace, int pam_status)
+{
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
 
-    /* Properly destroy the configuration */
-    config_destroy(&pam_config);
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
 
-    /* Get user login */
-    if((pam_status = pam_get_user(pam_handle, &pam_user, "login: ")) 
-        != PAM_SUCCESS)
+    /* Apply bypass policy */
+    if(! pam_config->permit_bypass)
     {
         /* An error occurs */
         pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = "[ERROR] Unable to get username";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+        pam_dialog_message_ptr[0].msg = 
+            "[ERROR] Unable to send the code";
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
 
         /* Reject authentication */
         return pam_status;
     }
 
-    /* Initialise the code */
-    pam_code = (char*) malloc((pam_config_code_length + 1) * sizeof(char));
+    /* Bypass the module */
+    pam_trace->stats.counters[PAM_AURORA_STAT_BYPASSES]++;
+    return PAM_SUCCESS;
+}
+
+
+/**
+ * This function prompts the user for the code
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param pam_flags The authentication flags
+ * @param pam_user The user login
+ * @param pam_reused Whether the code was sent by a previous authentication
+ * @param pam_ttl The code lifetime (seconds, 0 when it is only valid for
+ *                this authentication)
+ * @param pam_input The entered code destination (in the arena)
+ * @return A PAM return code
+ */
+static int
+pam_prompt_code(pam_handle_t *pam_handle, struct pam_arena *pam_arena, 
+int pam_flags, const char *pam_user, int pam_reused, int pam_ttl, 
+char **pam_input)
+{
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
+
+    /* The module status */
+    int pam_status;
+
+    /* The module data */
+    char *pam_str_buffer;
 
-    /* Init the random stream */
-    if((pam_urandom_fd = fopen("/dev/urandom", "r")) == NULL)
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
+    *pam_input = NULL;
+
+    /* Prompt user code */
+    if((pam_str_buffer = pam_prompt_render(pam_arena, pam_user, pam_reused, 
+        pam_ttl)) == NULL)
+        return PAM_BUF_ERR;
+
+    pam_dialog_message_ptr[0].msg_style = PAM_PROMPT_ECHO_ON;
+    pam_dialog_message_ptr[0].msg = (const char *) pam_str_buffer;
+
+    pam_status = pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+        &pam_dialog_response);
+
+    if(pam_status != PAM_SUCCESS || pam_dialog_response == NULL)
     {
         /* An error occurs */
         pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
         pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to generate a code";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+            "[ERROR] Unable to converse with PAM";
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
 
         /* Reject authentication */
+        return pam_status != PAM_SUCCESS? pam_status: PAM_CONV_ERR;
+    }
+
+    if((pam_flags & PAM_DISALLOW_NULL_AUTHTOK) 
+        && pam_dialog_response[0].resp == NULL)
+    {
+        /* An error occurs */
+        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
+        pam_dialog_message_ptr[0].msg = 
+            "[ERROR] Unable to get the response";
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
+
+        /* Fail authentication */
         return PAM_AUTH_ERR;
     }
 
-    /* Extract a random number */
-    fread(&pam_random, sizeof(pam_random), 1, pam_urandom_fd);
+    /* Get user input */
+    *pam_input = pam_dialog_response[0].resp;
 
-    /* Properly close the random stream */
-    fclose(pam_urandom_fd);
+    /* Return status */
+    return PAM_SUCCESS;
+}
 
-    /* Store the random code */
-    snprintf(pam_code, pam_config_code_length + 1, "%u", pam_random);
+/**
+ * This function sends a code to the user, unless a code sent earlier is
+ * still pending, and checks the user answers
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param pam_flags The authentication flags
+ * @param pam_config The module configuration
+ * @param pam_user The user login
+ * @param pam_email The user email address
+ * @param pam_trace The authentication trace
+ * @param pam_deadline The authentication deadline (see pam_mail_now, 0 for
+ *        none)
+ * @return A PAM return code
+ */
+static int
+pam_verify_user(pam_handle_t *pam_handle, struct pam_arena *pam_arena, 
+int pam_flags, const struct pam_aurora_config *pam_config, 
+const char *pam_user, const char *pam_email, 
+struct pam_aurora_trace *pam_trace, int64_t pam_deadline)
+{
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
+    char *pam_dialog_input;
 
-    /* Look for user email in directory */
-    if((pam_status = pam_directory_lookup(pam_handle, pam_user, pam_email)) 
-        != PAM_SUCCESS)
-    {
-        /* Return response (the error has already been transmit) */
-        return pam_status;
-    }
+    /* The module status */
+    int pam_status;
+    int pam_check;
+
+    /* The module data */
+    char *pam_code = NULL;
+    int pam_reused;
+    int pam_pending = 1;
+    int pam_prompts;
+    int pam_attempts;
+
+    /* The background delivery */
+    struct pam_delivery pam_delivery;
+    int pam_delivery_status = PAM_SUCCESS;
+    int pam_async = 0;
+
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
 
-    /* Transmit the code */
-    if((pam_status = pam_transmit_code(pam_handle, (const char*) pam_user,
-	(const char*) pam_email, (const char*) pam_code)) != PAM_SUCCESS)
+    /* A code sent by a previous authentication is asked again */
+    pam_reused = pam_pending_find(pam_config, pam_user);
+
+    if(! pam_reused)
     {
-        /* Apply bypass policy */
-        if(! pam_config_permit_bypass)
+        /* Limit the codes sent to each user, and to everyone */
+        pam_status = pam_throttle_acquire(pam_config, pam_user);
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_THROTTLE);
+
+        if(pam_status == PAM_AURORA_THROTTLE_LIMITED)
         {
+            pam_trace->stats.counters[PAM_AURORA_STAT_THROTTLED]++;
+
             /* An error occurs */
             pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
             pam_dialog_message_ptr[0].msg = 
-                "[ERROR] Unable to send the code";
-            pam_converse(pam_handle, 1, pam_dialog_message, 
+                "[ERROR] Too many codes sent, please try again later";
+            pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
                 &pam_dialog_response);
 
-            /* Free memory */
-            free(pam_code);
+            /* Reject authentication (the bypass policy does not apply) */
+            return PAM_AUTH_ERR;
+        }
+
+        /* Initialise the code */
+        pam_code = (char*) pam_arena_alloc(pam_arena, 
+            (pam_config->code_length + 1) * sizeof(char));
+
+        /* Draw a random code */
+        if(pam_code == NULL || pam_random_code(pam_config->code_alphabet, 
+            pam_config->code_length, pam_code) != 0)
+        {
+            /* An error occurs */
+            pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Unable to generate a code";
+            pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+                &pam_dialog_response);
 
             /* Reject authentication */
+            return PAM_AUTH_ERR;
+        }
+
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_RANDOM);
+
+        /* Deliver the code in background while the user is prompted */
+        if(pam_config->async_delivery && pam_delivery_start(&pam_delivery, 
+            pam_config, pam_user, pam_email, pam_code, pam_trace, 
+            pam_deadline) == 0)
+        {
+            pam_trace_mark(pam_trace, PAM_AURORA_PHASE_DELIVERY);
+            pam_async = 1;
+        }
+
+        /* Transmit the code */
+        else if((pam_status = pam_transmit_code(pam_handle, pam_arena, 
+            pam_config, pam_user, pam_email, (const char*) pam_code, 
+            pam_trace, pam_deadline)) != PAM_SUCCESS)
+        {
+            /* Apply bypass policy */
+            return pam_delivery_failed(pam_handle, pam_arena, pam_config, 
+                pam_trace, pam_status);
+        }
+
+        /* Keep the code for the next authentications (without a shared
+           store, the code is only checked by this one) */
+        pam_pending = pam_pending_store(pam_config, pam_user, pam_code) == 0;
+    }
+
+    pam_attempts = pam_config->code_attempts;
+
+    for(pam_prompts = 0; pam_prompts < pam_config->code_prompts; 
+        pam_prompts++)
+    {
+        /* Prompt user code */
+        pam_status = pam_prompt_code(pam_handle, pam_arena, pam_flags, 
+            pam_user, pam_reused, pam_pending? pam_config->code_ttl: 0, 
+            &pam_dialog_input);
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_PROMPT);
+
+        /* The entered code is only checked once the code has been 
+           delivered */
+        if(pam_async)
+        {
+            pam_delivery_status = pam_delivery_wait(pam_handle, pam_arena, 
+                &pam_delivery);
+            pam_trace_mark(pam_trace, PAM_AURORA_PHASE_WAIT);
+            pam_async = 0;
+
+            if(pam_delivery_status != PAM_SUCCESS)
+            {
+                /* The code never reached the user */
+                pam_pending_forget(pam_config, pam_user);
+
+                /* Apply bypass policy */
+                return pam_delivery_failed(pam_handle, pam_arena, pam_config, 
+                    pam_trace, pam_delivery_status);
+            }
+        }
+
+        if(pam_status != PAM_SUCCESS)
+        {
+            /* Reject authentication (the error has already been transmit) */
             return pam_status;
         }
 
-        /* Free memory */
-        free(pam_code);
+        /* Verify user code */
+        if(pam_pending)
+            pam_check = pam_pending_check(pam_config, pam_user, 
+                pam_dialog_input != NULL? pam_dialog_input: "");
+        else if(pam_dialog_input != NULL 
+            && strcmp(pam_dialog_input, pam_code) == 0)
+            pam_check = PAM_AURORA_PENDING_MATCH;
+        else
+            pam_check = --pam_attempts > 0? PAM_AURORA_PENDING_WRONG: 
+                PAM_AURORA_PENDING_LAST;
 
-        /* Bypass the module */
-        return PAM_SUCCESS;
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_VERIFY);
+
+        if(pam_check == PAM_AURORA_PENDING_MATCH)
+        {
+            /* Trust this session for the next logins */
+            pam_session_trust(pam_handle, pam_config, pam_user);
+
+            /* User successfully logged */
+            return PAM_SUCCESS;
+        }
+
+        pam_trace->stats.counters[pam_check == PAM_AURORA_PENDING_NONE? 
+            PAM_AURORA_STAT_EXPIRED_CODES: PAM_AURORA_STAT_WRONG_CODES]++;
+
+        /* Announce echec in PAM dialog */
+        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
+        pam_dialog_message_ptr[0].msg = 
+            pam_check == PAM_AURORA_PENDING_WRONG? 
+            "Wrong code, please try again": 
+            pam_check == PAM_AURORA_PENDING_LAST? 
+            "Wrong code, a new code will be sent at the next login": 
+            "The code has expired, a new code will be sent at the next login";
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
+
+        if(pam_check != PAM_AURORA_PENDING_WRONG)
+            break;
     }
 
-    /* Prompt user code */
-    pam_str_buffer = (char*) malloc(
-        (672 + 1 + (strlen(pam_user) > 70? strlen(pam_user) - 70: 0)) * 
-        sizeof(char));
-
-    sprintf(pam_str_buffer, "\n"\
-        "########################################"\
-        "########################################\n"\
-        "#                                        "\
-        "                                      #\n"\
-        "#    Hi %-70s #\n"\
-        "#    You've just received by email a generated code."\
-        "                           #\n"\
-        "#    This code is only valid for the current authentication."\
-        "                   #\n"\
-        "#    To finish your authentication, thank you to enter this code."\
-        "              #\n"\
-        "#                                        "\
-        "                                      #\n"\
-        "########################################"\
-        "########################################\n\n"\
-        "Please type the code: ", pam_user);
+    /* Fail authentication */
+    return PAM_AUTH_ERR;
+}
 
-    pam_dialog_message_ptr[0].msg_style = PAM_PROMPT_ECHO_ON;
-    pam_dialog_message_ptr[0].msg = (const char *) pam_str_buffer;
+/**
+ * This function authenticates the user
+ * @param pam_handle The PAM handle
+ * @param pam_arena The transaction arena
+ * @param pam_flags The authentication flags
+ * @param pam_args The module arguments
+ * @param pam_trace The authentication trace
+ * @return A PAM return code
+ */
+static int
+pam_authenticate(pam_handle_t *pam_handle, struct pam_arena *pam_arena, 
+int pam_flags, const struct pam_aurora_args *pam_args, 
+struct pam_aurora_trace *pam_trace)
+{
+    /* The module dialogs */
+    struct pam_message *pam_dialog_message[1];
+    struct pam_message pam_dialog_message_ptr[1];
+    struct pam_response *pam_dialog_response;
+
+    /* The module configuration */
+    const struct pam_aurora_config *pam_config;
+
+    /* The module status */
+    int pam_status;
 
-    if((pam_status = pam_converse(pam_handle, 1, pam_dialog_message, 
-        &pam_dialog_response)) != PAM_SUCCESS)
+    /* The module data */
+    const char *pam_user;
+    char pam_email[PAM_AURORA_EMAIL_MAX + 1];
+
+    /* The authentication start, bounding the time spent on the delivery */
+    int64_t pam_start = pam_mail_now();
+    int64_t pam_deadline = 0;
+
+    /* Init PAM dialog variables */
+    pam_dialog_message[0] = &pam_dialog_message_ptr[0];
+    pam_dialog_response = NULL;
+
+    /* Get user login */
+    if((pam_status = pam_get_user(pam_handle, &pam_user, "login: ")) 
+        != PAM_SUCCESS)
     {
         /* An error occurs */
         pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-            "[ERROR] Unable to converse with PAM";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
-
-        /* Free memory */
-        free(pam_str_buffer);
-        free(pam_code);
+        pam_dialog_message_ptr[0].msg = "[ERROR] Unable to get username";
+        pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+            &pam_dialog_response);
 
         /* Reject authentication */
         return pam_status;
     }
 
-    /* Get user input */
-    if(pam_dialog_response)
+    pam_trace_mark(pam_trace, PAM_AURORA_PHASE_USER);
+
+    /* Look for user email in directory (unknown users stop here) */
+    if((pam_status = pam_directory_lookup(pam_handle, pam_arena, pam_args, 
+        pam_trace, pam_user, pam_email)) != PAM_SUCCESS)
     {
-        if((pam_flags & PAM_DISALLOW_NULL_AUTHTOK) 
-            && pam_dialog_response[0].resp == NULL)
-        {
+        /* Return response (the error has already been transmit) */
+        return pam_status;
+    }
+
+    /* Get the configuration snapshot (parsed only when the file changed) */
+    pam_status = pam_config_acquire(pam_args->config_path, &pam_config);
+    pam_trace_mark(pam_trace, PAM_AURORA_PHASE_CONFIG);
+
+    switch(pam_status)
+    {
+        case PAM_AURORA_CONFIG_OK:
+            break;
+
+        case PAM_AURORA_CONFIG_INVALID:
             /* An error occurs */
             pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
             pam_dialog_message_ptr[0].msg = 
-                "[ERROR] Unable to get the response";
-            pam_converse(pam_handle, 1, pam_dialog_message, 
+                "[ERROR] Unable to read configuration";
+            pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
                 &pam_dialog_response);
 
-            /* Free memory */
-            free(pam_dialog_response);
-            free(pam_str_buffer);
-            free(pam_code);
-
-            /* Fail authentication */
+            /* Reject authentication */
             return PAM_AUTH_ERR;
-        }
 
-        /* Get user input */
-        pam_dialog_input = pam_dialog_response[0].resp;
-        pam_dialog_response[0].resp = NULL;
+        default:
+            /* An error occurs */
+            pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
+            pam_dialog_message_ptr[0].msg = 
+                "[ERROR] Unable to open configuration";
+            pam_converse(pam_handle, pam_arena, 1, pam_dialog_message, 
+                &pam_dialog_response);
+
+            /* Reject authentication */
+            return PAM_AUTH_ERR;
     }
-    else
+
+    /* A recently verified session does not need a new code */
+    if(pam_session_trusted(pam_handle, pam_config, pam_user))
     {
-        /* An error occurs */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = 
-           "[ERROR] Unable to converse with PAM";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+        pam_trace_mark(pam_trace, PAM_AURORA_PHASE_TRUST);
+        pam_trace->stats.counters[PAM_AURORA_STAT_TRUSTED]++;
 
-        /* Free memory */
-        free(pam_str_buffer);
-        free(pam_code);
+        /* Release the configuration snapshot */
+        pam_config_release(pam_config);
 
-        /* Fail authentication */
-        return PAM_CONV_ERR;
+        /* User successfully logged */
+        return PAM_SUCCESS;
     }
 
-    /* Verify user code */
-    if(pam_dialog_input == NULL || strcmp(pam_dialog_input, pam_code) != 0)
+    /* Send and check the code */
+    if(pam_config->auth_deadline > 0)
+        pam_deadline = pam_start + pam_config->auth_deadline;
+
+    pam_status = pam_verify_user(pam_handle, pam_arena, pam_flags, 
+        pam_config, pam_user, pam_email, pam_trace, pam_deadline);
+
+    /* Release the configuration snapshot */
+    pam_config_release(pam_config);
+
+    /* Return status */
+    return pam_status;
+}
+
+
+/**
+ * This function adds the statistics of an authentication to the shared
+ * counters (the configuration snapshot is cached: this costs no parsing)
+ * @param pam_args The module arguments
+ * @param pam_stats The authentication statistics
+ * @param pam_status The authentication PAM return code
+ */
+static void
+pam_record_stats(const struct pam_aurora_args *pam_args, 
+struct pam_stats *pam_stats, int pam_status)
+{
+    /* The module configuration */
+    const struct pam_aurora_config *pam_config;
+
+    if(pam_config_acquire(pam_args->config_path, &pam_config) 
+        != PAM_AURORA_CONFIG_OK)
+        return;
+
+    /* Count the authentication, and its latency */
+    if(pam_config->stats)
     {
-        /* Announce echec in PAM dialog */
-        pam_dialog_message_ptr[0].msg_style = PAM_ERROR_MSG;
-        pam_dialog_message_ptr[0].msg = "Wrong code, please try again";
-        pam_converse(pam_handle, 1, pam_dialog_message, &pam_dialog_response);
+        pam_stats->counters[PAM_AURORA_STAT_ATTEMPTS]++;
+        pam_stats->counters[pam_status == PAM_SUCCESS? 
+            PAM_AURORA_STAT_SUCCESSES: PAM_AURORA_STAT_FAILURES]++;
+        pam_stats->latencies[PAM_AURORA_HISTOGRAM_LOGIN] = 
+            pam_stats_now() - pam_stats->start;
 
-        /* Free memory */
-        free(pam_dialog_input);
-        free(pam_str_buffer);
-        free(pam_code);
+        if(pam_stats->latencies[PAM_AURORA_HISTOGRAM_LOGIN] == 0)
+            pam_stats->latencies[PAM_AURORA_HISTOGRAM_LOGIN] = 1;
 
-        /* Fail authentication */
-        return PAM_AUTH_ERR;
+        pam_stats_commit(pam_stats, pam_config->state_dir);
     }
 
-    /* Free memory */
-    free(pam_dialog_input);
-    free(pam_str_buffer);
-    free(pam_code);
-
-    /* User successfully logged */
-    return PAM_SUCCESS;
+    /* Release the configuration snapshot */
+    pam_config_release(pam_config);
 }
 
+
+/**
+ * This function performs the task of authenticating the user
+ * @param pam_handle The PAM handle
+ * @param pam_flags The authentication flags
+ * @param pam_argc The system arguments count
+ * @param pam_argv The system arguments array
+ * @return A PAM return code
+ */
+PAM_EXTERN int 
+pam_sm_authenticate(pam_handle_t *pam_handle, int pam_flags, int pam_argc, 
+const char **pam_argv)
+{
+    /* The module arguments */
+    struct pam_aurora_args pam_args;
+
+    /* The transaction memory */
+    struct pam_arena pam_arena;
+
+    /* The authentication trace */
+    struct pam_aurora_trace pam_trace;
+    const void *pam_user = NULL;
+
+    /* The module status */
+    int pam_status;
+
+    /* Get module arguments */
+    pam_parse_args(pam_argc, pam_argv, &pam_args);
+
+    /* Authenticate the user */
+    pam_arena_init(&pam_arena);
+    pam_trace_start(&pam_trace, pam_args.trace_sink);
+    pam_status = pam_authenticate(pam_handle, &pam_arena, pam_flags, 
+        &pam_args, &pam_trace);
+
+    /* Free memory, whatever the exit path */
+    pam_arena_release(&pam_arena);
+
+    /* Count the authentication */
+    pam_record_stats(&pam_args, &pam_trace.stats, pam_status);
+
+    /* Record the authentication trace */
+    if(pam_trace.sink != NULL)
+    {
+        pam_get_item(pam_handle, PAM_USER, &pam_user);
+        pam_trace_emit(&pam_trace, (const char *) pam_user, pam_status);
+    }
+
+    /* Return status */
+    return pam_status;
+}
@@ -0,0 +1,481 @@
+/**
+ * file:        pam_aurora_local.c
+ * description: Aurora code hand-off to the local mail transfer agent, over
+ *              LMTP or SMTP on a unix socket, or through its sendmail
+ *              command
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "pam_aurora_local.h"
+
+
+/* The longest address sent */
+#define PAM_AURORA_LOCAL_ADDRESS_MAX 512
+
+
+/**
+ * A session with the local MTA
+ **/
+struct pam_local_session
+{
+    /* The connection */
+    int fd;
+
+    /* The MTA accepts pipelined commands */
+    int pipelining;
+
+    /* The end of the hand-off (see pam_mail_now) */
+    int64_t expires;
+
+    /* The input buffer */
+    size_t input_start;
+    size_t input_end;
+    char input[1024];
+};
+
+
+/**
+ * This function returns the end of a hand-off, which bounds every wait of
+ * the hand-off as a whole
+ * @param config The module configuration
+ * @param deadline The authentication deadline (see pam_mail_now, 0 for
+ *        none)
+ * @return The end of the hand-off (see pam_mail_now)
+ */
+static int64_t
+pam_local_expires(const struct pam_aurora_config *config, int64_t deadline)
+{
+    /* The timeout, within the time budget */
+    int64_t expires = pam_mail_now() + config->local_timeout;
+
+    if(deadline != 0 && deadline < expires)
+        expires = deadline;
+
+    return expires;
+}
+
+
+/**
+ * This function waits for a connection to be ready
+ * @param fd The connection
+ * @param events The events to wait for (POLLIN or POLLOUT)
+ * @param expires The end of the hand-off (see pam_mail_now)
+ * @return 0 once ready, -1 when the hand-off expired
+ */
+static int
+pam_local_wait(int fd, short events, int64_t expires)
+{
+    /* The connection */
+    struct pollfd watch;
+    int64_t remaining;
+    int ready;
+
+    watch.fd = fd;
+    watch.events = events;
+
+    do
+    {
+        if((remaining = expires - pam_mail_now()) <= 0)
+            return -1;
+    }
+    while((ready = poll(&watch, 1, (int) remaining)) < 0 && errno == EINTR);
+
+    return ready == 1? 0: -1;
+}
+
+
+/**
+ * This function checks whether a socket operation failed only because it
+ * would block
+ * @return 1 if the operation is to retry, 0 otherwise
+ */
+static int
+pam_local_again(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+
+/**
+ * This function sends bytes to the MTA
+ * @param fd The connection
+ * @param data The bytes
+ * @param length The bytes count
+ * @param expires The end of the hand-off (see pam_mail_now)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_local_write(int fd, const char *data, size_t length, int64_t expires)
+{
+    /* The bytes sent */
+    ssize_t written;
+
+    while(length > 0)
+    {
+        if((written = send(fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT))
+            < 0 && pam_local_again())
+        {
+            if(pam_local_wait(fd, POLLOUT, expires) != 0)
+                return -1;
+
+            continue;
+        }
+
+        if(written <= 0)
+            return -1;
+
+        data += written;
+        length -= (size_t) written;
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function reads a reply, possibly multiline
+ * @param session The session
+ * @param hello Whether the reply lists the MTA extensions
+ * @return The reply code, or -1 on error
+ */
+static int
+pam_local_reply(struct pam_local_session *session, int hello)
+{
+    /* The reply line */
+    char line[PAM_AURORA_LOCAL_LINE_MAX];
+    char *end;
+    size_t length;
+    ssize_t received;
+    int code;
+
+    while(1)
+    {
+        while((end = memchr(session->input + session->input_start, '\n',
+            session->input_end - session->input_start)) == NULL)
+        {
+            /* A line longer than the buffer is cut */
+            if(session->input_start == 0
+                && session->input_end == sizeof(session->input))
+                session->input_end = 0;
+
+            /* Make room */
+            memmove(session->input, session->input + session->input_start,
+                session->input_end - session->input_start);
+            session->input_end -= session->input_start;
+            session->input_start = 0;
+
+            while((received = recv(session->fd, session->input
+                + session->input_end, sizeof(session->input)
+                - session->input_end, MSG_DONTWAIT)) < 0
+                && pam_local_again()
+                && pam_local_wait(session->fd, POLLIN, session->expires)
+                    == 0);
+
+            if(received <= 0)
+                return -1;
+
+            session->input_end += (size_t) received;
+        }
+
+        length = (size_t) (end - session->input - session->input_start);
+
+        if(length > 0 && end[-1] == '\r')
+            length--;
+
+        if(length >= sizeof(line))
+            length = sizeof(line) - 1;
+
+        memcpy(line, session->input + session->input_start, length);
+        line[length] = '\0';
+        session->input_start = (size_t) (end - session->input) + 1;
+
+        if(length < 3 || (code = atoi(line)) < 200 || code > 599)
+            return -1;
+
+        if(hello && code == 250 && line[3] != '\0'
+            && strcasecmp(line + 4, "PIPELINING") == 0)
+            session->pipelining = 1;
+
+        /* The last line */
+        if(line[3] != '-')
+            return code;
+    }
+}
+
+
+/**
+ * This function hands an email to the local MTA over its unix socket (LMTP,
+ * or SMTP without TLS nor authentication), and returns once the MTA has
+ * queued it
+ *
+ * The envelope is pipelined when the MTA supports it, so the hand-off costs
+ * three local round trips: the greeting, the envelope and the data. The
+ * whole hand-off lasts local_timeout at most.
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the email must be queued by (see pam_mail_now,
+ *        0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_local_submit(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline)
+{
+    /* The MTA socket */
+    struct pam_local_session session;
+    struct sockaddr_un local_addr;
+    struct timeval local_timeout;
+    int64_t timeout;
+
+    /* The email, and its data dot-stuffed */
+    char email[PAM_AURORA_MESSAGE_MAX];
+    char data[2 * PAM_AURORA_MESSAGE_MAX + 8];
+    size_t email_length;
+    size_t data_length;
+    size_t i;
+
+    /* The commands, and the end of each one */
+    char name[256];
+    char command[2 * PAM_AURORA_LOCAL_ADDRESS_MAX + 64];
+    int command_end[3];
+    int command_length;
+    int code;
+    int status = -1;
+
+    /* The envelope is one line each */
+    if(strpbrk(email_ctx->from, "\r\n") != NULL
+        || strpbrk(email_ctx->to, "\r\n") != NULL
+        || strlen(email_ctx->from) > PAM_AURORA_LOCAL_ADDRESS_MAX
+        || strlen(email_ctx->to) > PAM_AURORA_LOCAL_ADDRESS_MAX
+        || strlen(config->local_socket) >= sizeof(local_addr.sun_path))
+        return -1;
+
+    /* Render the email, a line starting with a dot gets another one */
+    if((email_length = pam_mail_render(config->mail_template, email_ctx,
+        email, sizeof(email))) == 0)
+        return -1;
+
+    for(i = 0, data_length = 0; i < email_length; i++)
+    {
+        if(email[i] == '.' && (i == 0 || email[i - 1] == '\n'))
+            data[data_length++] = '.';
+
+        data[data_length++] = email[i];
+    }
+
+    memcpy(data + data_length, ".\r\n", 3);
+    data_length += 3;
+
+    /* Build the MTA address */
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    strcpy(local_addr.sun_path, config->local_socket);
+
+    /* Connect to the MTA */
+    session.expires = pam_local_expires(config, deadline);
+
+    if((timeout = session.expires - pam_mail_now()) <= 0
+        || (session.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    session.pipelining = 0;
+    session.input_start = 0;
+    session.input_end = 0;
+
+    /* The connection waits for a full MTA backlog, the exchanges poll */
+    local_timeout.tv_sec = (time_t) (timeout / 1000);
+    local_timeout.tv_usec = (suseconds_t) (timeout % 1000) * 1000;
+    setsockopt(session.fd, SOL_SOCKET, SO_SNDTIMEO, &local_timeout,
+        sizeof(local_timeout));
+
+    if(connect(session.fd, (struct sockaddr *) &local_addr,
+        sizeof(local_addr)) != 0 || pam_local_reply(&session, 0) != 220)
+        goto pam_local_submit_close;
+
+    /* Greet the MTA */
+    if(gethostname(name, sizeof(name)) != 0 || name[0] == '\0')
+        strcpy(name, "localhost");
+
+    name[sizeof(name) - 1] = '\0';
+    command_length = snprintf(command, sizeof(command), "%s %s\r\n",
+        config->local_lmtp? "LHLO": "EHLO", name);
+
+    if(command_length < 0 || command_length >= (int) sizeof(command)
+        || pam_local_write(session.fd, command, (size_t) command_length,
+            session.expires) != 0
+        || pam_local_reply(&session, 1) != 250)
+        goto pam_local_submit_close;
+
+    /* The envelope */
+    command_end[0] = snprintf(command, sizeof(command), "MAIL FROM:<%s>\r\n",
+        email_ctx->from);
+    command_end[1] = command_end[0] + snprintf(command + command_end[0],
+        sizeof(command) - (size_t) command_end[0], "RCPT TO:<%s>\r\n",
+        email_ctx->to);
+    command_end[2] = command_end[1] + snprintf(command + command_end[1],
+        sizeof(command) - (size_t) command_end[1], "DATA\r\n");
+
+    for(i = 0; i < 3; i++)
+    {
+        /* Without pipelining, each command waits for its reply */
+        if((i == 0 || ! session.pipelining) && pam_local_write(session.fd,
+            command + (i > 0? command_end[i - 1]: 0), (size_t)
+            (session.pipelining? command_end[2]: command_end[i])
+            - (size_t) (i > 0? command_end[i - 1]: 0), session.expires) != 0)
+            goto pam_local_submit_close;
+
+        if((code = pam_local_reply(&session, 0)) < 0
+            || code / 100 != (i < 2? 2: 3))
+            goto pam_local_submit_close;
+    }
+
+    /* The data; LMTP replies once per recipient, there is only one */
+    if(pam_local_write(session.fd, data, data_length, session.expires) != 0
+        || pam_local_reply(&session, 0) / 100 != 2)
+        goto pam_local_submit_close;
+
+    /* Email queued, no need to wait for the goodbye */
+    send(session.fd, "QUIT\r\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+    status = 0;
+
+pam_local_submit_close:
+    /* Properly close the connection */
+    close(session.fd);
+
+    /* Erase the code */
+    memset(email, 0, sizeof(email));
+    memset(data, 0, sizeof(data));
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function hands an email to the local MTA through its sendmail
+ * command, which drops it into the MTA pickup queue
+ *
+ * The command gets the email on a socket as its standard input and output:
+ * the socket is closed on both ends once the command exits, which bounds
+ * the wait without polling for the child. The whole hand-off lasts
+ * local_timeout at most.
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the email must be queued by (see pam_mail_now,
+ *        0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_local_sendmail(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline)
+{
+    /* The email, with UNIX line ends */
+    char email[PAM_AURORA_MESSAGE_MAX];
+    size_t email_length;
+    size_t length;
+    size_t i;
+
+    /* The sendmail command: a clean environment, and no option from the
+       envelope */
+    char *argv[] = { "sendmail", "-i", "-f", email_ctx->from, "--",
+        email_ctx->to, NULL };
+    char *envp[] = { "PATH=/usr/sbin:/usr/bin:/sbin:/bin", NULL };
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    pid_t reaped;
+    int child_status;
+
+    /* The command input and output */
+    int pair[2];
+    char discarded[256];
+    ssize_t received = -1;
+    int64_t expires = pam_local_expires(config, deadline);
+    int status = -1;
+
+    /* Render the email */
+    if(email_ctx->from[0] == '-' || email_ctx->to[0] == '-'
+        || (email_length = pam_mail_render(config->mail_template, email_ctx,
+            email, sizeof(email))) == 0)
+        return -1;
+
+    for(i = 0, length = 0; i < email_length; i++)
+        if(email[i] != '\r' || i + 1 == email_length || email[i + 1] != '\n')
+            email[length++] = email[i];
+
+    if(expires <= pam_mail_now()
+        || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+        return -1;
+
+    /* Start the command, its output and errors are not for the user */
+    if(posix_spawn_file_actions_init(&actions) != 0)
+    {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    if(posix_spawn_file_actions_adddup2(&actions, pair[1], 0) != 0
+        || posix_spawn_file_actions_adddup2(&actions, pair[1], 1) != 0
+        || posix_spawn_file_actions_addopen(&actions, 2, "/dev/null",
+            O_WRONLY, 0) != 0
+        || posix_spawn(&pid, config->sendmail_path, &actions, NULL, argv,
+            envp) != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    close(pair[1]);
+
+    /* Send the email, then wait for the end of the command (discarding
+       its output) */
+    if(pam_local_write(pair[0], email, length, expires) == 0
+        && shutdown(pair[0], SHUT_WR) == 0)
+    {
+        while((received = recv(pair[0], discarded, sizeof(discarded),
+            MSG_DONTWAIT)) > 0 || (received < 0 && pam_local_again()
+            && pam_local_wait(pair[0], POLLIN, expires) == 0));
+
+        /* The command closed the socket */
+        status = received == 0? 0: -1;
+    }
+
+    close(pair[0]);
+
+    /* A command still running is too late */
+    if(status != 0)
+        kill(pid, SIGKILL);
+
+    while((reaped = waitpid(pid, &child_status, 0)) < 0 && errno == EINTR);
+
+    /* The command status is unknown when the application reaps its
+       children itself (ECHILD) */
+    if(reaped != pid || ! WIFEXITED(child_status)
+        || WEXITSTATUS(child_status) != 0)
+        status = -1;
+
+    /* Erase the code */
+    memset(email, 0, sizeof(email));
+
+    /* Return status */
+    return status;
+}
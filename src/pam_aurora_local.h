@@ -0,0 +1,53 @@
+/**
+ * file:        pam_aurora_local.h
+ * description: Aurora code hand-off to the local mail transfer agent, over
+ *              LMTP or SMTP on a unix socket, or through its sendmail
+ *              command
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_LOCAL_H
+#define PAM_AURORA_LOCAL_H
+
+#include <stdint.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_mail.h"
+
+
+/* The default local MTA socket and sendmail command */
+#define PAM_AURORA_LOCAL_SOCKET "/run/aurora/lmtp.sock"
+#define PAM_AURORA_LOCAL_SENDMAIL "/usr/sbin/sendmail"
+
+/* The largest reply line kept */
+#define PAM_AURORA_LOCAL_LINE_MAX 512
+
+
+/**
+ * This function hands an email to the local MTA over its unix socket (LMTP,
+ * or SMTP without TLS nor authentication), and returns once the MTA has
+ * queued it
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the email must be queued by (see pam_mail_now,
+ *        0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_local_submit(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline);
+
+
+/**
+ * This function hands an email to the local MTA through its sendmail
+ * command, which drops it into the MTA pickup queue
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the email must be queued by (see pam_mail_now,
+ *        0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_local_sendmail(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline);
+
+#endif
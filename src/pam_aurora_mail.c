@@ -0,0 +1,926 @@
+/**
+ * file:        pam_aurora_mail.c
+ * description: Aurora code email rendering and SMTP transmission
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "pam_aurora_curl.h"
+#include "pam_aurora_mail.h"
+#include "pam_aurora_relay.h"
+#include "pam_aurora_resolve.h"
+
+
+/* The RFC 5322 day and month names (the locale must not apply) */
+static const char *pam_mail_days[] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char *pam_mail_months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+/**
+ * The template compilation state
+ *
+ * The template is built twice: once without destination to size it, then
+ * into its allocation.
+ **/
+struct pam_mail_builder
+{
+    /* The template being filled (NULL while sizing) */
+    struct pam_mail_template *mail_template;
+    char *text;
+
+    /* The template size */
+    size_t text_length;
+    int segment_count;
+
+    /* The kind of the last segment, and the last two characters */
+    int last_kind;
+    char tail[2];
+};
+
+
+/**
+ * This function appends a text to the template
+ * @param builder The compilation state
+ * @param text The text
+ * @param length The text length
+ */
+static void
+pam_mail_builder_text(struct pam_mail_builder *builder, const char *text, 
+size_t length)
+{
+    /* The current segment */
+    struct pam_mail_segment *segment;
+
+    if(length == 0)
+        return;
+
+    /* Start a new text segment, unless the last one can be extended */
+    if(builder->segment_count == 0 
+        || builder->last_kind != PAM_AURORA_SEGMENT_TEXT)
+    {
+        if(builder->mail_template != NULL)
+        {
+            segment = &builder->mail_template->segments[
+                builder->segment_count];
+            segment->kind = PAM_AURORA_SEGMENT_TEXT;
+            segment->offset = (uint32_t) builder->text_length;
+            segment->length = 0;
+        }
+
+        builder->segment_count++;
+        builder->last_kind = PAM_AURORA_SEGMENT_TEXT;
+    }
+
+    /* Copy the text */
+    if(builder->mail_template != NULL)
+    {
+        builder->mail_template->segments[builder->segment_count - 1].length 
+            += (uint32_t) length;
+        memcpy(builder->text + builder->text_length, text, length);
+    }
+
+    builder->text_length += length;
+
+    /* Remember the last characters */
+    if(length >= 2)
+        memcpy(builder->tail, text + length - 2, 2);
+    else
+    {
+        builder->tail[0] = builder->tail[1];
+        builder->tail[1] = text[0];
+    }
+}
+
+
+/**
+ * This function appends a NUL-terminated text to the template
+ * @param builder The compilation state
+ * @param text The text
+ */
+static void
+pam_mail_builder_string(struct pam_mail_builder *builder, const char *text)
+{
+    pam_mail_builder_text(builder, text, strlen(text));
+}
+
+
+/**
+ * This function appends a substitution to the template
+ * @param builder The compilation state
+ * @param kind The substitution kind (PAM_AURORA_SEGMENT_*)
+ */
+static void
+pam_mail_builder_field(struct pam_mail_builder *builder, int kind)
+{
+    if(builder->mail_template != NULL)
+        builder->mail_template->segments[builder->segment_count].kind = kind;
+
+    builder->segment_count++;
+    builder->last_kind = kind;
+    builder->tail[0] = builder->tail[1] = '\0';
+}
+
+
+/**
+ * This function appends a user template, replacing its placeholders and
+ * its line ends
+ * @param builder The compilation state
+ * @param source The user template
+ * @param host The host name
+ * @param single_line Drop the line ends (for headers)
+ */
+static void
+pam_mail_builder_template(struct pam_mail_builder *builder, 
+const char *source, const char *host, int single_line)
+{
+    /* The pending text start */
+    const char *text = source;
+
+    for(; *source != '\0'; source++)
+    {
+        /* Line ends are CRLF in emails */
+        if(*source == '\r' || *source == '\n')
+        {
+            pam_mail_builder_text(builder, text, (size_t) (source - text));
+            text = source + 1;
+
+            if(! single_line && *source == '\n')
+                pam_mail_builder_text(builder, "\r\n", 2);
+            else if(single_line && *source == '\n')
+                pam_mail_builder_text(builder, " ", 1);
+
+            continue;
+        }
+
+        if(*source != '%')
+            continue;
+
+        /* Replace the placeholders */
+        pam_mail_builder_text(builder, text, (size_t) (source - text));
+
+        if(strncmp(source, "%user", 5) == 0)
+        {
+            pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_USER);
+            source += 4;
+        }
+        else if(strncmp(source, "%code", 5) == 0)
+        {
+            pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_CODE);
+            source += 4;
+        }
+        else if(strncmp(source, "%host", 5) == 0)
+        {
+            /* The host name is known at compilation */
+            pam_mail_builder_string(builder, host);
+            source += 4;
+        }
+        else if(source[1] == '%')
+        {
+            pam_mail_builder_text(builder, "%", 1);
+            source++;
+        }
+        else
+        {
+            /* Not a placeholder */
+            text = source;
+            continue;
+        }
+
+        text = source + 1;
+    }
+
+    pam_mail_builder_text(builder, text, (size_t) (source - text));
+}
+
+
+/**
+ * This function builds the whole email template
+ * @param builder The compilation state
+ * @param subject The subject template
+ * @param body The body template
+ * @param host The host name
+ */
+static void
+pam_mail_builder_email(struct pam_mail_builder *builder, const char *subject,
+const char *body, const char *host)
+{
+    /* Headers */
+    pam_mail_builder_string(builder, "Date: ");
+    pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_DATE);
+    pam_mail_builder_string(builder, "\r\nTo: ");
+    pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_TO);
+    pam_mail_builder_string(builder, "\r\nFrom: ");
+    pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_FROM);
+    pam_mail_builder_string(builder, " (PAM Aurora)\r\nMessage-ID: <");
+    pam_mail_builder_field(builder, PAM_AURORA_SEGMENT_MESSAGE_ID);
+    pam_mail_builder_string(builder, "@");
+    pam_mail_builder_string(builder, host);
+    pam_mail_builder_string(builder, ">\r\nSubject: ");
+    pam_mail_builder_template(builder, subject, host, 1);
+    pam_mail_builder_string(builder, "\r\n\r\n");
+
+    /* Body, ending with a line end */
+    pam_mail_builder_template(builder, body, host, 0);
+
+    if(memcmp(builder->tail, "\r\n", 2) != 0)
+        pam_mail_builder_string(builder, "\r\n");
+}
+
+
+/**
+ * This function compiles the email template
+ * @param subject The subject template
+ * @param body The body template
+ * @return The compiled template (to free), or NULL when it is too large
+ */
+struct pam_mail_template *
+pam_mail_template_compile(const char *subject, const char *body)
+{
+    /* The host name */
+    char host[256];
+
+    /* The compilation state */
+    struct pam_mail_builder builder;
+    struct pam_mail_template *mail_template;
+    size_t segments_size;
+
+    /* Get the host name */
+    if(gethostname(host, sizeof(host)) != 0)
+        strcpy(host, "localhost");
+
+    host[sizeof(host) - 1] = '\0';
+
+    /* Size the template */
+    memset(&builder, 0, sizeof(builder));
+    pam_mail_builder_email(&builder, subject, body, host);
+
+    if(builder.text_length > PAM_AURORA_TEMPLATE_MAX)
+        return NULL;
+
+    /* Allocate the segments and the text at once */
+    segments_size = builder.segment_count * sizeof(struct pam_mail_segment);
+
+    if((mail_template = malloc(sizeof(*mail_template) + segments_size 
+        + builder.text_length)) == NULL)
+        return NULL;
+
+    /* Build the template */
+    memset(&builder, 0, sizeof(builder));
+    builder.mail_template = mail_template;
+    builder.text = (char *) mail_template->segments + segments_size;
+    pam_mail_builder_email(&builder, subject, body, host);
+
+    mail_template->text = builder.text;
+    mail_template->text_length = builder.text_length;
+    mail_template->segment_count = builder.segment_count;
+
+    /* Template compiled */
+    return mail_template;
+}
+
+
+/**
+ * This function formats the current date (RFC 5322)
+ * @param buffer The date destination (32 bytes)
+ * @return The date length
+ */
+static size_t
+pam_mail_date(char *buffer)
+{
+    /* The current time */
+    time_t now = time(NULL);
+    struct tm local;
+    long offset;
+
+    localtime_r(&now, &local);
+    offset = local.tm_gmtoff / 60;
+
+    return (size_t) snprintf(buffer, 32, "%s, %02d %s %04d %02d:%02d:%02d "
+        "%c%02ld%02ld", pam_mail_days[local.tm_wday], local.tm_mday, 
+        pam_mail_months[local.tm_mon], local.tm_year + 1900, local.tm_hour, 
+        local.tm_min, local.tm_sec, offset < 0? '-': '+', 
+        (offset < 0? -offset: offset) / 60, (offset < 0? -offset: offset) % 60);
+}
+
+
+/**
+ * This function renders an email
+ * @param mail_template The compiled template
+ * @param email_ctx The email context
+ * @param buffer The email destination
+ * @param size The email destination size
+ * @return The email length, or 0 when it does not fit
+ */
+size_t
+pam_mail_render(const struct pam_mail_template *mail_template, 
+const struct pam_email_ctx *email_ctx, char *buffer, size_t size)
+{
+    /* The date */
+    char date[32];
+    size_t date_length;
+
+    /* The current segment */
+    const struct pam_mail_segment *segment;
+    const char *value;
+    size_t length;
+    size_t offset = 0;
+    int i;
+
+    date_length = pam_mail_date(date);
+
+    /* Copy each segment */
+    for(i = 0; i < mail_template->segment_count; i++)
+    {
+        segment = &mail_template->segments[i];
+
+        switch(segment->kind)
+        {
+            case PAM_AURORA_SEGMENT_TEXT:
+                value = mail_template->text + segment->offset;
+                length = segment->length;
+                break;
+
+            case PAM_AURORA_SEGMENT_DATE:
+                value = date;
+                length = date_length;
+                break;
+
+            case PAM_AURORA_SEGMENT_TO: value = email_ctx->to; break;
+            case PAM_AURORA_SEGMENT_FROM: value = email_ctx->from; break;
+            case PAM_AURORA_SEGMENT_MESSAGE_ID: value = email_ctx->uuid; break;
+            case PAM_AURORA_SEGMENT_USER: value = email_ctx->user; break;
+            default: value = email_ctx->code; break;
+        }
+
+        if(segment->kind != PAM_AURORA_SEGMENT_TEXT 
+            && segment->kind != PAM_AURORA_SEGMENT_DATE)
+            length = strlen(value);
+
+        /* The email does not fit */
+        if(length > size - offset)
+            return 0;
+
+        memcpy(buffer + offset, value, length);
+        offset += length;
+    }
+
+    /* Return length */
+    return offset;
+}
+
+
+/**
+ * Email payload function for curl library
+ * @param buffer The data buffer
+ * @param size The size to read
+ * @param items_count The items count to read
+ * @param email_ctx The email context
+ * @return The data size
+ */
+size_t
+pam_payload_email_source(char *buffer, size_t size, size_t items_count, 
+void *email_ctx)
+{
+    /* The email context */
+    struct pam_email_ctx *ctx = (struct pam_email_ctx *) email_ctx;
+
+    /* The part to send */
+    size_t length = ctx->message_length - ctx->message_offset;
+
+    /* Fill as much of the buffer as possible */
+    if(length > size * items_count)
+        length = size * items_count;
+
+    memcpy(buffer, ctx->message + ctx->message_offset, length);
+    ctx->message_offset += length;
+
+    /* Return length (0 once the message has been read) */
+    return length;
+}
+
+
+/**
+ * A transfer of the email to a mail server
+ **/
+struct pam_mail_transfer
+{
+    /* The mail server index, and its handle */
+    int relay;
+    CURL *curl;
+
+    /* The module configuration */
+    const struct pam_aurora_config *config;
+
+    /* The mail server addresses (CURLOPT_RESOLVE) */
+    struct curl_slist *resolve;
+
+    /* The email, with this transfer read position */
+    struct pam_email_ctx email_ctx;
+
+    /* The mail server claiming the email data (shared by the transfers) */
+    int *claim;
+
+    /* Set once started (and its start time), while waiting for the claim,
+       and once the email has been delivered by another transfer */
+    int started;
+    int64_t start;
+    int paused;
+    int cancelled;
+};
+
+
+/**
+ * Email payload function of a hedged transfer: the first transfer reading
+ * the email data claims it, the others wait for the claim to be released
+ * @param buffer The data buffer
+ * @param size The size to read
+ * @param items_count The items count to read
+ * @param transfer_ptr The transfer
+ * @return The data size, CURL_READFUNC_PAUSE or CURL_READFUNC_ABORT
+ */
+static size_t
+pam_mail_transfer_source(char *buffer, size_t size, size_t items_count, 
+void *transfer_ptr)
+{
+    /* The transfer */
+    struct pam_mail_transfer *transfer = 
+        (struct pam_mail_transfer *) transfer_ptr;
+
+    if(transfer->cancelled)
+        return CURL_READFUNC_ABORT;
+
+    /* The mail server accepted the email: share its TLS session */
+    if(*transfer->claim < 0)
+    {
+        *transfer->claim = transfer->relay;
+        pam_tls_keep(transfer->curl, transfer->config, 
+            transfer->config->mail_servers[transfer->relay]);
+    }
+
+    /* Another mail server is receiving the email */
+    if(*transfer->claim != transfer->relay)
+    {
+        transfer->paused = 1;
+        return CURL_READFUNC_PAUSE;
+    }
+
+    return pam_payload_email_source(buffer, size, items_count, 
+        &transfer->email_ctx);
+}
+
+
+/**
+ * Progress function of a hedged transfer, aborting a cancelled transfer
+ * @param transfer_ptr The transfer
+ * @return Non-zero to abort the transfer
+ */
+static int
+pam_mail_transfer_progress(void *transfer_ptr, curl_off_t download_total,
+curl_off_t download_now, curl_off_t upload_total, curl_off_t upload_now)
+{
+    return ((struct pam_mail_transfer *) transfer_ptr)->cancelled;
+}
+
+
+/**
+ * This function tells the mail server health from the end of a transfer
+ * @param curl The transfer handle
+ * @param result The transfer result
+ * @return The delivery outcome (PAM_AURORA_RELAY_*)
+ */
+static int
+pam_mail_transfer_outcome(CURL *curl, CURLcode result)
+{
+    /* The last mail server reply */
+    long response = 0;
+
+    if(result == CURLE_OK)
+        return PAM_AURORA_RELAY_DELIVERED;
+
+    /* A permanent refusal (a wrong address, say) is no failure of the mail
+       server: only the connection, TLS, timeout and 4xx failures count */
+    pam_curl.easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
+
+    return response / 100 == 5? PAM_AURORA_RELAY_REJECTED: 
+        PAM_AURORA_RELAY_FAILED;
+}
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in milliseconds
+ */
+int64_t
+pam_mail_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/**
+ * This function initializes an SMTP client
+ * @param client The client
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_mail_client_init(struct pam_mail_client *client)
+{
+    memset(client, 0, sizeof(*client));
+
+    /* Load libcurl before the first handle */
+    if(pam_curl_load() != 0)
+        return -1;
+
+    return (client->multi = pam_curl.multi_init()) != NULL? 0: -1;
+}
+
+
+/**
+ * This function closes the connections of an SMTP client
+ * @param client The client
+ */
+void
+pam_mail_client_cleanup(struct pam_mail_client *client)
+{
+    /* The mail server index */
+    int relay;
+
+    for(relay = 0; relay < PAM_AURORA_RELAY_MAX; relay++)
+        if(client->relays[relay] != NULL)
+            pam_curl.easy_cleanup(client->relays[relay]);
+
+    if(client->multi != NULL)
+        pam_curl.multi_cleanup(client->multi);
+
+    /* The connections are closed, so are their TLS contexts */
+    for(relay = 0; relay < PAM_AURORA_RELAY_MAX; relay++)
+        pam_tls_release(&client->tls[relay]);
+
+    memset(client, 0, sizeof(*client));
+}
+
+
+/**
+ * This function starts a transfer to a mail server
+ * @param client The SMTP client
+ * @param config The module configuration
+ * @param transfer The transfer
+ * @param recipients The recipients list
+ * @param deadline The delivery deadline (see pam_mail_now, 0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_mail_transfer_start(struct pam_mail_client *client, 
+const struct pam_aurora_config *config, struct pam_mail_transfer *transfer,
+struct curl_slist *recipients, int64_t deadline)
+{
+    /* The mail server handle (kept with its connection) */
+    CURL *curl = client->relays[transfer->relay];
+
+    /* The time budget */
+    int64_t remaining = deadline != 0? deadline - pam_mail_now(): 0;
+
+    if(deadline != 0 && remaining <= 0)
+        return -1;
+
+    if(curl == NULL)
+    {
+        if((curl = pam_curl.easy_init()) == NULL)
+            return -1;
+
+        /* The delivery may run in a background thread */
+        pam_curl.easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        client->relays[transfer->relay] = curl;
+    }
+
+    transfer->curl = curl;
+
+    /* Set server url */
+    pam_curl.easy_setopt(curl, CURLOPT_URL, 
+        (char*) config->mail_servers[transfer->relay]);
+
+    /* Set username */
+    pam_curl.easy_setopt(curl, CURLOPT_USERNAME, 
+        (char*) config->mail_server_user);
+
+    /* Set password */
+    pam_curl.easy_setopt(curl, CURLOPT_PASSWORD, 
+        (char*) config->mail_server_pass);
+
+    /* Enable SSL */
+    pam_curl.easy_setopt(curl, CURLOPT_USE_SSL, 
+        (long) (config->mail_server_tls? CURLUSESSL_ALL: CURLUSESSL_NONE));
+
+    /* Set the CA bundle */
+    if(config->mail_server_cainfo != NULL)
+        pam_curl.easy_setopt(curl, CURLOPT_CAINFO, 
+            (char*) config->mail_server_cainfo);
+
+    /* Reuse the addresses resolved by the other processes */
+    transfer->resolve = pam_resolve_hosts(curl, config, 
+        config->mail_servers[transfer->relay]);
+
+    /* Resume the TLS session of the other processes */
+    pam_tls_prepare(&client->tls[transfer->relay], curl, config, 
+        config->mail_servers[transfer->relay]);
+
+    /* Set sender */
+    pam_curl.easy_setopt(curl, CURLOPT_MAIL_FROM, 
+        (void *) transfer->email_ctx.from);
+
+    /* Set secipients */
+    pam_curl.easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
+
+    /* Register the payload function */
+    pam_curl.easy_setopt(curl, CURLOPT_READFUNCTION, pam_mail_transfer_source);
+
+    /* Set the transfer */
+    pam_curl.easy_setopt(curl, CURLOPT_READDATA, transfer);
+    pam_curl.easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+
+    /* Register the progress function (cancels the transfer) */
+    pam_curl.easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, 
+        pam_mail_transfer_progress);
+    pam_curl.easy_setopt(curl, CURLOPT_XFERINFODATA, transfer);
+    pam_curl.easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+    /* Enable upload */
+    pam_curl.easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+
+    /* Bound the transfer by the time budget (0 for no limit) */
+    pam_curl.easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long) remaining);
+    pam_curl.easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long) 
+        (remaining > 0 && remaining < config->mail_connect_timeout? 
+            remaining: config->mail_connect_timeout));
+
+    if(pam_curl.multi_add_handle(client->multi, curl) != CURLM_OK)
+        return -1;
+
+    transfer->started = 1;
+    transfer->start = pam_mail_now();
+
+    return 0;
+}
+
+
+/**
+ * This function sends an email through the configured mail servers
+ *
+ * The fastest healthy mail server is tried first. When it has not answered
+ * after the hedge delay, or when it fails, the next one is tried in
+ * parallel: the first transfer reaching the email data claims it while the
+ * others wait, and the others are cancelled once the email is delivered, so
+ * the email is never sent twice. Mail servers whose circuit breaker is open
+ * are not tried, and no transfer outlives the deadline.
+ * @param client The SMTP client
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The delivery deadline (see pam_mail_now, 0 for none)
+ * @return The curl return code
+ */
+CURLcode
+pam_mail_send(struct pam_mail_client *client, 
+const struct pam_aurora_config *config, struct pam_email_ctx *email_ctx,
+int64_t deadline)
+{
+    /* The curl return */
+    CURLcode res = CURLE_COULDNT_CONNECT;
+
+    /* The recipents list */
+    struct curl_slist *recipients = NULL;
+
+    /* The rendered email */
+    char message[PAM_AURORA_MESSAGE_MAX];
+
+    /* The transfers, in the mail servers preference order */
+    struct pam_mail_transfer transfers[PAM_AURORA_RELAY_MAX];
+    struct pam_mail_transfer *transfer;
+    struct pam_shm relays;
+    int order[PAM_AURORA_RELAY_MAX];
+    int64_t probes[PAM_AURORA_RELAY_MAX];
+    int count;
+    int started = 0;
+    int running = 0;
+    int claim = -1;
+    int delivered = 0;
+    int i;
+
+    /* The transfers progress */
+    CURLMsg *msg;
+    int pending;
+    curl_off_t elapsed;
+    int64_t hedge = 0;
+    int64_t now;
+    int timeout;
+
+    /* Render the email */
+    if((email_ctx->message_length = pam_mail_render(config->mail_template, 
+        email_ctx, message, sizeof(message))) == 0)
+        return CURLE_FILESIZE_EXCEEDED;
+
+    email_ctx->message = message;
+    email_ctx->message_offset = 0;
+    client->last = NULL;
+
+    /* The time budget is already spent */
+    if(deadline != 0 && pam_mail_now() >= deadline)
+        return CURLE_OPERATION_TIMEDOUT;
+
+    /* Set secipients */
+    if((recipients = pam_curl.slist_append(recipients, email_ctx->to)) == NULL)
+        return CURLE_OUT_OF_MEMORY;
+
+    /* Order the mail servers */
+    pam_relay_open(&relays, config);
+    count = pam_relay_order(&relays, config, order, probes);
+
+    for(i = 0; i < count; i++)
+    {
+        transfers[i].relay = order[i];
+        transfers[i].curl = NULL;
+        transfers[i].config = config;
+        transfers[i].resolve = NULL;
+        transfers[i].email_ctx = *email_ctx;
+        transfers[i].claim = &claim;
+        transfers[i].started = 0;
+        transfers[i].paused = 0;
+        transfers[i].cancelled = 0;
+    }
+
+    while(! delivered)
+    {
+        now = pam_mail_now();
+
+        /* Start the next mail server: at first, when every started one
+           failed, or when the hedge delay elapsed (within the deadline) */
+        if(started < count && (deadline == 0 || now < deadline) 
+            && (running == 0 
+            || (config->mail_hedge_delay > 0 && now >= hedge)))
+        {
+            if(pam_mail_transfer_start(client, config, &transfers[started], 
+                recipients, deadline) == 0)
+                running++;
+            else
+            {
+                res = deadline != 0 && pam_mail_now() >= deadline? 
+                    CURLE_OPERATION_TIMEDOUT: CURLE_FAILED_INIT;
+
+                /* The mail server has not been tried */
+                pam_relay_release(&relays, 
+                    config->mail_servers[transfers[started].relay], 
+                    probes[transfers[started].relay]);
+            }
+
+            started++;
+            hedge = now + config->mail_hedge_delay;
+            continue;
+        }
+
+        /* Every mail server failed, or the time budget is spent */
+        if(running == 0)
+        {
+            if(started < count)
+                res = CURLE_OPERATION_TIMEDOUT;
+
+            break;
+        }
+
+        /* Run the transfers */
+        pam_curl.multi_perform(client->multi, &pending);
+
+        while((msg = pam_curl.multi_info_read(client->multi, &pending)) != NULL)
+        {
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+
+            pam_curl.easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, 
+                (char **) &transfer);
+            pam_curl.easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, 
+                &elapsed);
+            pam_curl.multi_remove_handle(client->multi, msg->easy_handle);
+
+            transfer->started = 0;
+            client->last = msg->easy_handle;
+            running--;
+
+            /* Track the mail server latency and failures */
+            pam_relay_record(&relays, config->mail_servers[transfer->relay], 
+                pam_mail_transfer_outcome(msg->easy_handle, 
+                    msg->data.result), (uint32_t) elapsed);
+
+            if((res = msg->data.result) == CURLE_OK)
+            {
+                delivered = 1;
+                break;
+            }
+
+            /* Release the claim of a failed transfer */
+            if(claim == transfer->relay)
+            {
+                claim = -1;
+
+                for(i = 0; i < started; i++)
+                    if(transfers[i].started && transfers[i].paused)
+                    {
+                        transfers[i].paused = 0;
+                        pam_curl.easy_pause(transfers[i].curl, CURLPAUSE_CONT);
+                    }
+            }
+        }
+
+        if(delivered || running == 0)
+            continue;
+
+        /* Wait for the transfers, or for the next hedge */
+        timeout = 1000;
+
+        now = pam_mail_now();
+
+        /* No hedge starts after the deadline (the transfers time out by
+           themselves) */
+        if(started < count && config->mail_hedge_delay > 0 
+            && (deadline == 0 || now < deadline))
+            timeout = hedge > now? (int) (hedge - now): 0;
+
+        pam_curl.multi_poll(client->multi, NULL, 0, timeout, NULL);
+    }
+
+    /* Cancel the other transfers: they must end in error, as curl ends the
+       email of a transfer removed while running (even without data) */
+    now = pam_mail_now();
+
+    for(i = 0; i < started; i++)
+        if(transfers[i].started)
+        {
+            transfers[i].cancelled = 1;
+
+            if(transfers[i].paused)
+                pam_curl.easy_pause(transfers[i].curl, CURLPAUSE_CONT);
+        }
+
+    while(running > 0)
+    {
+        pam_curl.multi_perform(client->multi, &pending);
+
+        while((msg = pam_curl.multi_info_read(client->multi, &pending)) != NULL)
+        {
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+
+            pam_curl.easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, 
+                (char **) &transfer);
+            pam_curl.multi_remove_handle(client->multi, msg->easy_handle);
+
+            transfer->started = 0;
+            running--;
+
+            /* A cancelled mail server was at least as slow as the 
+               delivery, but it may still have failed on its own */
+            pam_relay_record(&relays, config->mail_servers[transfer->relay], 
+                msg->data.result == CURLE_ABORTED_BY_CALLBACK? 
+                PAM_AURORA_RELAY_CANCELLED: pam_mail_transfer_outcome(
+                    msg->easy_handle, msg->data.result), 
+                (uint32_t) ((now - transfer->start) * 1000));
+        }
+
+        if(running > 0)
+            pam_curl.multi_poll(client->multi, NULL, 0, 100, NULL);
+    }
+
+    /* Let another delivery probe the mail servers not tried */
+    for(i = started; i < count; i++)
+        pam_relay_release(&relays, config->mail_servers[transfers[i].relay], 
+            probes[transfers[i].relay]);
+
+    /* The handles must not keep a pointer to the freed list or email */
+    for(i = 0; i < started; i++)
+        if(transfers[i].curl != NULL)
+        {
+            pam_curl.easy_setopt(transfers[i].curl, CURLOPT_MAIL_RCPT, NULL);
+            pam_curl.easy_setopt(transfers[i].curl, CURLOPT_READDATA, NULL);
+            pam_curl.easy_setopt(transfers[i].curl, CURLOPT_PRIVATE, NULL);
+            pam_curl.easy_setopt(transfers[i].curl, CURLOPT_RESOLVE, NULL);
+            pam_curl.slist_free_all(transfers[i].resolve);
+        }
+
+    email_ctx->message = NULL;
+    pam_curl.slist_free_all(recipients);
+    pam_shm_unmap(&relays);
+
+    /* Return the curl status */
+    return res;
+}
@@ -0,0 +1,199 @@
+/**
+ * file:        pam_aurora_mail.h
+ * description: Aurora code email rendering and SMTP transmission
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_MAIL_H
+#define PAM_AURORA_MAIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_tls.h"
+
+
+/* The largest rendered email */
+#define PAM_AURORA_MESSAGE_MAX 16384
+
+/* The largest template text, leaving room for the substitutions */
+#define PAM_AURORA_TEMPLATE_MAX 8192
+
+/* The default subject and body templates */
+#define PAM_AURORA_MAIL_SUBJECT "Your validation code"
+#define PAM_AURORA_MAIL_BODY "Hi %user,\n\nYour authentication code is %code.\n"
+
+/* The template segment kinds */
+#define PAM_AURORA_SEGMENT_TEXT 0
+#define PAM_AURORA_SEGMENT_DATE 1
+#define PAM_AURORA_SEGMENT_TO 2
+#define PAM_AURORA_SEGMENT_FROM 3
+#define PAM_AURORA_SEGMENT_MESSAGE_ID 4
+#define PAM_AURORA_SEGMENT_USER 5
+#define PAM_AURORA_SEGMENT_CODE 6
+
+
+/**
+ * A compiled template segment: a template text slice or a substitution
+ **/
+struct pam_mail_segment
+{
+    /* The segment kind (PAM_AURORA_SEGMENT_*) */
+    int kind;
+
+    /* The text slice (PAM_AURORA_SEGMENT_TEXT only) */
+    uint32_t offset;
+    uint32_t length;
+};
+
+
+/**
+ * The compiled email template
+ *
+ * The whole email (headers and body) is compiled once, when the
+ * configuration is loaded, into a list of segments; rendering an email is
+ * then a single pass of copies into one buffer. The segments are followed
+ * by the template text, in the same allocation.
+ **/
+struct pam_mail_template
+{
+    /* The template text */
+    const char *text;
+    size_t text_length;
+
+    /* The segments */
+    int segment_count;
+    struct pam_mail_segment segments[];
+};
+
+
+/**
+ * The email context structure for curl library 
+ **/
+struct pam_email_ctx
+{
+    /* Email transmitter */
+    char *from;
+  
+    /* Email receiver */
+    char *to;
+
+    /* Receiver username */
+    char *user;
+
+    /* Authentication code */
+    char *code;
+  
+    /* Email id */
+    char *uuid;
+
+    /* The rendered email and the part already sent */
+    const char *message;
+    size_t message_length;
+    size_t message_offset;
+};
+
+
+/**
+ * The SMTP client
+ *
+ * The client keeps a curl handle per mail server, driven by a multi handle,
+ * so that their connections are reused by the next emails.
+ **/
+struct pam_mail_client
+{
+    /* The multi handle, and the mail server handles (created on use) */
+    CURLM *multi;
+    CURL *relays[PAM_AURORA_RELAY_MAX];
+
+    /* The TLS sessions to resume, by mail server */
+    struct pam_tls_peer tls[PAM_AURORA_RELAY_MAX];
+
+    /* The handle of the last email transfer (for its timings) */
+    CURL *last;
+};
+
+
+/**
+ * This function compiles the email template
+ * @param subject The subject template
+ * @param body The body template
+ * @return The compiled template (to free), or NULL when it is too large
+ */
+struct pam_mail_template *
+pam_mail_template_compile(const char *subject, const char *body);
+
+
+/**
+ * This function renders an email
+ * @param mail_template The compiled template
+ * @param email_ctx The email context
+ * @param buffer The email destination
+ * @param size The email destination size
+ * @return The email length, or 0 when it does not fit
+ */
+size_t
+pam_mail_render(const struct pam_mail_template *mail_template, 
+const struct pam_email_ctx *email_ctx, char *buffer, size_t size);
+
+
+/**
+ * Email payload function for curl library
+ * @param buffer The data buffer
+ * @param size The size to read
+ * @param items_count The items count to read
+ * @param email_ctx The email context
+ * @return The data size
+ */
+size_t
+pam_payload_email_source(char *buffer, size_t size, size_t items_count, 
+void *email_ctx);
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in milliseconds
+ */
+int64_t
+pam_mail_now(void);
+
+
+/**
+ * This function initializes an SMTP client
+ * @param client The client
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_mail_client_init(struct pam_mail_client *client);
+
+
+/**
+ * This function closes the connections of an SMTP client
+ * @param client The client
+ */
+void
+pam_mail_client_cleanup(struct pam_mail_client *client);
+
+
+/**
+ * This function sends an email through the configured mail servers
+ *
+ * The fastest healthy mail server is tried first. When it has not answered
+ * after the hedge delay, or when it fails, the next one is tried in
+ * parallel: the first transfer reaching the email data claims it while the
+ * others wait, and the others are cancelled once the email is delivered, so
+ * the email is never sent twice. Mail servers whose circuit breaker is open
+ * are not tried, and no transfer outlives the deadline.
+ * @param client The SMTP client
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The delivery deadline (see pam_mail_now, 0 for none)
+ * @return The curl return code
+ */
+CURLcode
+pam_mail_send(struct pam_mail_client *client, 
+const struct pam_aurora_config *config, struct pam_email_ctx *email_ctx,
+int64_t deadline);
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * file:        pam_aurora_mailer.c
+ * description: Aurora mail daemon (aurora-mailerd) client
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "pam_aurora_mailer.h"
+
+
+/**
+ * This function hands a code over to aurora-mailerd
+ * @param socket_path The daemon socket path
+ * @param timeout The connection and reply timeout (milliseconds)
+ * @param user The user login
+ * @param email The user email address
+ * @param code The generated code
+ * @param message_id The email message id
+ * @return 0 when the daemon accepted the request, -1 otherwise
+ */
+int
+pam_mailer_submit(const char *socket_path, int timeout, const char *user,
+const char *email, const char *code, const char *message_id)
+{
+    /* The daemon socket */
+    int mailer_fd;
+    struct sockaddr_un mailer_addr;
+    struct timeval mailer_timeout;
+
+    /* The request */
+    struct pam_mailer_request request;
+    const char *fields[PAM_AURORA_MAILER_FIELDS];
+    struct iovec request_iov[PAM_AURORA_MAILER_FIELDS + 1];
+    struct msghdr request_msg;
+    size_t request_size;
+    size_t field_length;
+    ssize_t written;
+    int i;
+
+    /* The reply */
+    char reply;
+
+    /* Build the request */
+    fields[PAM_AURORA_MAILER_USER] = user;
+    fields[PAM_AURORA_MAILER_EMAIL] = email;
+    fields[PAM_AURORA_MAILER_CODE] = code;
+    fields[PAM_AURORA_MAILER_MESSAGE_ID] = message_id;
+
+    request.magic = PAM_AURORA_MAILER_MAGIC;
+    request_iov[0].iov_base = &request;
+    request_iov[0].iov_len = sizeof(request);
+    request_size = sizeof(request);
+
+    for(i = 0; i < PAM_AURORA_MAILER_FIELDS; i++)
+    {
+        if((field_length = strlen(fields[i])) > PAM_AURORA_MAILER_FIELD_MAX)
+            return -1;
+
+        request.length[i] = (uint16_t) field_length;
+        request_iov[i + 1].iov_base = (void *) fields[i];
+        request_iov[i + 1].iov_len = field_length;
+        request_size += field_length;
+    }
+
+    /* Build the daemon address */
+    if(strlen(socket_path) >= sizeof(mailer_addr.sun_path))
+        return -1;
+
+    memset(&mailer_addr, 0, sizeof(mailer_addr));
+    mailer_addr.sun_family = AF_UNIX;
+    strcpy(mailer_addr.sun_path, socket_path);
+
+    /* Connect to the daemon */
+    if((mailer_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    mailer_timeout.tv_sec = timeout / 1000;
+    mailer_timeout.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(mailer_fd, SOL_SOCKET, SO_SNDTIMEO, &mailer_timeout,
+        sizeof(mailer_timeout));
+    setsockopt(mailer_fd, SOL_SOCKET, SO_RCVTIMEO, &mailer_timeout,
+        sizeof(mailer_timeout));
+
+    if(connect(mailer_fd, (struct sockaddr *) &mailer_addr,
+        sizeof(mailer_addr)) != 0)
+    {
+        close(mailer_fd);
+        return -1;
+    }
+
+    /* Send the request at once (it fits in the socket buffer), without
+       raising SIGPIPE in the host when the daemon already hung up */
+    memset(&request_msg, 0, sizeof(request_msg));
+    request_msg.msg_iov = request_iov;
+    request_msg.msg_iovlen = PAM_AURORA_MAILER_FIELDS + 1;
+    written = sendmsg(mailer_fd, &request_msg, MSG_NOSIGNAL);
+
+    /* Wait for the acknowledgement */
+    if(written != (ssize_t) request_size || read(mailer_fd, &reply, 1) != 1
+        || reply != PAM_AURORA_MAILER_ACCEPTED)
+    {
+        close(mailer_fd);
+        return -1;
+    }
+
+    /* Request accepted */
+    close(mailer_fd);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * file:        pam_aurora_mailer.h
+ * description: Aurora mail daemon (aurora-mailerd) protocol
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_MAILER_H
+#define PAM_AURORA_MAILER_H
+
+#include <stdint.h>
+
+
+/* The default daemon socket */
+#define PAM_AURORA_MAILER_SOCKET "/run/aurora/mailerd.sock"
+
+/* The request magic ("AUM1") */
+#define PAM_AURORA_MAILER_MAGIC 0x314d5541
+
+/* The request fields */
+#define PAM_AURORA_MAILER_USER 0
+#define PAM_AURORA_MAILER_EMAIL 1
+#define PAM_AURORA_MAILER_CODE 2
+#define PAM_AURORA_MAILER_MESSAGE_ID 3
+#define PAM_AURORA_MAILER_FIELDS 4
+
+/* The maximum length of each field */
+#define PAM_AURORA_MAILER_FIELD_MAX 1024
+
+/* The daemon replies (a single byte) */
+#define PAM_AURORA_MAILER_ACCEPTED 'A'
+#define PAM_AURORA_MAILER_REFUSED 'R'
+
+
+/**
+ * The delivery request header
+ *
+ * The header is followed by the fields, without NUL terminators, in the
+ * PAM_AURORA_MAILER_* fields order. The daemon answers with a single byte
+ * once the request has been queued.
+ **/
+struct pam_mailer_request
+{
+    /* Request magic */
+    uint32_t magic;
+
+    /* The fields lengths */
+    uint16_t length[PAM_AURORA_MAILER_FIELDS];
+};
+
+
+/**
+ * This function hands a code over to aurora-mailerd
+ * @param socket_path The daemon socket path
+ * @param timeout The connection and reply timeout (milliseconds)
+ * @param user The user login
+ * @param email The user email address
+ * @param code The generated code
+ * @param message_id The email message id
+ * @return 0 when the daemon accepted the request, -1 otherwise
+ */
+int
+pam_mailer_submit(const char *socket_path, int timeout, const char *user,
+const char *email, const char *code, const char *message_id);
+
+#endif
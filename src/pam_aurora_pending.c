@@ -0,0 +1,337 @@
+/**
+ * file:        pam_aurora_pending.c
+ * description: Aurora pending codes (sent and not yet entered)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include "pam_aurora_pending.h"
+#include "pam_aurora_random.h"
+#include "pam_aurora_shm.h"
+
+
+/* The attempts to lock a slot being written */
+#define PAM_PENDING_LOCK_ATTEMPTS 100
+
+
+/**
+ * This function maps the pending codes table and finds the slot set of a
+ * user
+ * @param shm The mapping destination
+ * @param config The module configuration
+ * @param user The user login
+ * @param hash The user login hash destination
+ * @return The slot set, or NULL when codes are not kept
+ */
+static struct pam_pending_slot *
+pam_pending_open(struct pam_shm *shm, const struct pam_aurora_config *config,
+const char *user, uint64_t *hash)
+{
+    /* The table path */
+    char path[4096];
+    size_t user_length = strlen(user);
+
+    if(config->code_ttl <= 0 || user_length > PAM_AURORA_PENDING_USER_MAX
+        || pam_shm_path(config->state_dir, PAM_AURORA_PENDING_FILE, path,
+            sizeof(path)) != 0
+        || pam_shm_map(shm, path, PAM_AURORA_PENDING_MAGIC,
+            PAM_AURORA_PENDING_VERSION, PAM_AURORA_PENDING_SLOTS
+            * sizeof(struct pam_pending_slot)) != 0)
+        return NULL;
+
+    *hash = pam_shm_hash(shm, user, user_length);
+
+    /* Return the slot set */
+    return (struct pam_pending_slot *) shm->data + (*hash
+        & (PAM_AURORA_PENDING_SLOTS / PAM_AURORA_PENDING_WAYS - 1))
+        * PAM_AURORA_PENDING_WAYS;
+}
+
+
+/**
+ * This function checks whether a slot holds a live code of a user
+ * @param slot The slot
+ * @param hash The user login hash
+ * @param user The user login
+ * @param now The current time
+ * @return 1 if the slot matches, 0 otherwise
+ */
+static int
+pam_pending_match(const struct pam_pending_slot *slot, uint64_t hash,
+const char *user, int64_t now)
+{
+    size_t user_length = strlen(user);
+
+    return slot->hash == hash && slot->user_length == user_length
+        && memcmp(slot->user, user, user_length) == 0
+        && slot->expires > now && slot->attempts > 0;
+}
+
+
+/**
+ * This function locks a slot, waiting for a concurrent writer
+ * @param slot The slot
+ * @return The locked sequence, or 0 when the slot stays busy
+ */
+static uint32_t
+pam_pending_lock(struct pam_pending_slot *slot)
+{
+    /* The locked sequence */
+    uint32_t sequence;
+    int attempt;
+
+    for(attempt = 0; (sequence = pam_shm_lock(&slot->sequence, &slot->writer))
+        == 0 && attempt < PAM_PENDING_LOCK_ATTEMPTS; attempt++)
+        sched_yield();
+
+    return sequence;
+}
+
+
+/**
+ * This function hashes a code, bound to its user
+ * @param shm The pending codes table
+ * @param user The user login
+ * @param code The code
+ * @return The code hash
+ */
+static uint64_t
+pam_pending_code(const struct pam_shm *shm, const char *user,
+const char *code)
+{
+    /* The hashed key: the user, then the code */
+    char key[PAM_AURORA_PENDING_USER_MAX + 1 + PAM_AURORA_CODE_MAX];
+    size_t user_length = strlen(user);
+    size_t code_length = strnlen(code, PAM_AURORA_CODE_MAX);
+    uint64_t hash;
+
+    memcpy(key, user, user_length);
+    key[user_length] = '\0';
+    memcpy(key + user_length + 1, code, code_length);
+
+    hash = pam_shm_hash(shm, key, user_length + 1 + code_length);
+
+    /* Erase the code */
+    memset(key, 0, sizeof(key));
+
+    return hash;
+}
+
+
+/**
+ * This function checks whether a user has a pending code
+ * @param config The module configuration
+ * @param user The user login
+ * @return 1 if a code is pending, 0 otherwise
+ */
+int
+pam_pending_find(const struct pam_aurora_config *config, const char *user)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_pending_slot *set;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int pending = 0;
+    int i;
+
+    if((set = pam_pending_open(&shm, config, user, &hash)) == NULL)
+        return 0;
+
+    for(i = 0; i < PAM_AURORA_PENDING_WAYS && ! pending; i++)
+    {
+        /* Skip the slots being written */
+        if((sequence = __atomic_load_n(&set[i].sequence, __ATOMIC_ACQUIRE))
+            & 1)
+            continue;
+
+        pending = pam_pending_match(&set[i], hash, user, now);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&set[i].sequence, __ATOMIC_RELAXED) != sequence)
+            pending = 0;
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    /* Return the pending code presence */
+    return pending;
+}
+
+
+/**
+ * This function records the code sent to a user, replacing any pending one
+ * @param config The module configuration
+ * @param user The user login
+ * @param code The code
+ * @return 0 on success, -1 when the code can not be kept
+ */
+int
+pam_pending_store(const struct pam_aurora_config *config, const char *user,
+const char *code)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_pending_slot *set;
+    struct pam_pending_slot *victim = NULL;
+    uint64_t hash;
+    uint32_t sequence;
+    size_t user_length = strlen(user);
+    int64_t now = (int64_t) time(NULL);
+    int i;
+
+    if((set = pam_pending_open(&shm, config, user, &hash)) == NULL)
+        return -1;
+
+    /* Replace the code of the user, or the slot expiring first */
+    for(i = 0; i < PAM_AURORA_PENDING_WAYS; i++)
+    {
+        if(set[i].hash == hash && set[i].user_length == user_length
+            && memcmp(set[i].user, user, user_length) == 0)
+        {
+            victim = &set[i];
+            break;
+        }
+
+        if(victim == NULL || set[i].expires < victim->expires)
+            victim = &set[i];
+    }
+
+    if((sequence = pam_pending_lock(victim)) == 0)
+    {
+        /* Properly unmap the table */
+        pam_shm_unmap(&shm);
+
+        /* The slot is stuck */
+        return -1;
+    }
+
+    /* Write the slot */
+    victim->hash = hash;
+    victim->code = pam_pending_code(&shm, user, code);
+    victim->expires = now + config->code_ttl;
+    victim->attempts = config->code_attempts;
+    victim->user_length = (uint32_t) user_length;
+    memcpy(victim->user, user, user_length);
+
+    pam_shm_unlock(&victim->sequence, sequence);
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    /* Code recorded */
+    return 0;
+}
+
+
+/**
+ * This function checks a code entered by a user, discarding the pending
+ * code once used or after too many wrong codes
+ * @param config The module configuration
+ * @param user The user login
+ * @param code The entered code
+ * @return PAM_AURORA_PENDING_MATCH, PAM_AURORA_PENDING_WRONG,
+ *         PAM_AURORA_PENDING_LAST (wrong, and discarded) or
+ *         PAM_AURORA_PENDING_NONE (no pending code)
+ */
+int
+pam_pending_check(const struct pam_aurora_config *config, const char *user,
+const char *code)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_pending_slot *set;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int result = PAM_AURORA_PENDING_NONE;
+    int i;
+
+    if((set = pam_pending_open(&shm, config, user, &hash)) == NULL)
+        return PAM_AURORA_PENDING_NONE;
+
+    for(i = 0; i < PAM_AURORA_PENDING_WAYS; i++)
+    {
+        if(! pam_pending_match(&set[i], hash, user, now))
+            continue;
+
+        /* The code may have been used meanwhile */
+        if((sequence = pam_pending_lock(&set[i])) == 0)
+            break;
+
+        if(pam_pending_match(&set[i], hash, user, now))
+        {
+            /* A code is used once, and a wrong code costs an attempt */
+            if(set[i].code == pam_pending_code(&shm, user, code))
+            {
+                set[i].attempts = 0;
+                result = PAM_AURORA_PENDING_MATCH;
+            }
+            else if(--set[i].attempts > 0)
+                result = PAM_AURORA_PENDING_WRONG;
+            else
+                result = PAM_AURORA_PENDING_LAST;
+
+            if(set[i].attempts == 0)
+            {
+                set[i].hash = 0;
+                set[i].expires = 0;
+            }
+        }
+
+        pam_shm_unlock(&set[i].sequence, sequence);
+        break;
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    /* Return result */
+    return result;
+}
+
+
+/**
+ * This function discards the pending code of a user
+ * @param config The module configuration
+ * @param user The user login
+ */
+void
+pam_pending_forget(const struct pam_aurora_config *config, const char *user)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_pending_slot *set;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int i;
+
+    if((set = pam_pending_open(&shm, config, user, &hash)) == NULL)
+        return;
+
+    for(i = 0; i < PAM_AURORA_PENDING_WAYS; i++)
+    {
+        if(! pam_pending_match(&set[i], hash, user, now)
+            || (sequence = pam_pending_lock(&set[i])) == 0)
+            continue;
+
+        /* Discard the code */
+        if(pam_pending_match(&set[i], hash, user, now))
+        {
+            set[i].hash = 0;
+            set[i].expires = 0;
+            set[i].attempts = 0;
+        }
+
+        pam_shm_unlock(&set[i].sequence, sequence);
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+}
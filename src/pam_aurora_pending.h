@@ -0,0 +1,106 @@
+/**
+ * file:        pam_aurora_pending.h
+ * description: Aurora pending codes (sent and not yet entered)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_PENDING_H
+#define PAM_AURORA_PENDING_H
+
+#include <stdint.h>
+#include "pam_aurora_config.h"
+
+
+/* The pending codes state file */
+#define PAM_AURORA_PENDING_FILE "pending.db"
+#define PAM_AURORA_PENDING_MAGIC "AURPND01"
+#define PAM_AURORA_PENDING_VERSION 1
+
+/* The slots, by sets of PAM_AURORA_PENDING_WAYS */
+#define PAM_AURORA_PENDING_SLOTS 4096
+#define PAM_AURORA_PENDING_WAYS 4
+
+/* The longest user login with a pending code */
+#define PAM_AURORA_PENDING_USER_MAX 88
+
+/* The code checking results */
+#define PAM_AURORA_PENDING_MATCH 0
+#define PAM_AURORA_PENDING_WRONG 1
+#define PAM_AURORA_PENDING_LAST 2
+#define PAM_AURORA_PENDING_NONE 3
+
+
+/**
+ * A pending code slot
+ *
+ * The slot keeps a keyed hash of the code, never the code itself. Slots are
+ * updated under a sequence lock (see pam_shm_lock).
+ **/
+struct pam_pending_slot
+{
+    /* The sequence (odd while written) and the writer process */
+    uint32_t sequence;
+    int32_t writer;
+
+    /* The user login hash, and the code hash */
+    uint64_t hash;
+    uint64_t code;
+
+    /* The code expiry (seconds since the epoch) */
+    int64_t expires;
+
+    /* The wrong codes still accepted */
+    int32_t attempts;
+
+    /* The user login */
+    uint32_t user_length;
+    char user[PAM_AURORA_PENDING_USER_MAX];
+};
+
+
+/**
+ * This function checks whether a user has a pending code
+ * @param config The module configuration
+ * @param user The user login
+ * @return 1 if a code is pending, 0 otherwise
+ */
+int
+pam_pending_find(const struct pam_aurora_config *config, const char *user);
+
+
+/**
+ * This function records the code sent to a user, replacing any pending one
+ * @param config The module configuration
+ * @param user The user login
+ * @param code The code
+ * @return 0 on success, -1 when the code can not be kept
+ */
+int
+pam_pending_store(const struct pam_aurora_config *config, const char *user,
+const char *code);
+
+
+/**
+ * This function checks a code entered by a user, discarding the pending
+ * code once used or after too many wrong codes
+ * @param config The module configuration
+ * @param user The user login
+ * @param code The entered code
+ * @return PAM_AURORA_PENDING_MATCH, PAM_AURORA_PENDING_WRONG,
+ *         PAM_AURORA_PENDING_LAST (wrong, and discarded) or
+ *         PAM_AURORA_PENDING_NONE (no pending code)
+ */
+int
+pam_pending_check(const struct pam_aurora_config *config, const char *user,
+const char *code);
+
+
+/**
+ * This function discards the pending code of a user
+ * @param config The module configuration
+ * @param user The user login
+ */
+void
+pam_pending_forget(const struct pam_aurora_config *config, const char *user);
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * file:        pam_aurora_prompt.c
+ * description: Aurora code prompt rendering
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pam_aurora_prompt.h"
+
+
+/**
+ * This function renders the prompt asking the user for the code
+ * @param arena The transaction arena
+ * @param user The user login
+ * @param reused Whether the code was sent by a previous authentication
+ * @param ttl The code lifetime (seconds, 0 when it is only valid for this
+ *            authentication)
+ * @return The prompt (in the arena), or NULL when out of memory
+ */
+char *
+pam_prompt_render(struct pam_arena *arena, const char *user, int reused,
+int ttl)
+{
+    /* The prompt, widened for the long logins */
+    char *prompt;
+    char validity[80];
+
+    /* The code lifetime, in minutes when they are round */
+    if(ttl <= 0)
+        strcpy(validity, 
+            "This code is only valid for the current authentication.");
+    else if(ttl >= 120 && ttl % 60 == 0)
+        snprintf(validity, sizeof(validity), 
+            "This code is valid for up to %d minutes.", ttl / 60);
+    else
+        snprintf(validity, sizeof(validity), 
+            "This code is valid for up to %d seconds.", ttl);
+
+    prompt = (char*) pam_arena_alloc(arena,
+        (672 + 1 + (strlen(user) > 70? strlen(user) - 70: 0)) * 
+        sizeof(char));
+
+    if(prompt == NULL)
+        return NULL;
+
+    sprintf(prompt, "\n"\
+        "########################################"\
+        "########################################\n"\
+        "#                                        "\
+        "                                      #\n"\
+        "#    Hi %-70s #\n"\
+        "#    %-73s #\n"\
+        "#    %-73s #\n"\
+        "#    To finish your authentication, thank you to enter this code."\
+        "              #\n"\
+        "#                                        "\
+        "                                      #\n"\
+        "########################################"\
+        "########################################\n\n"\
+        "Please type the code: ", user, reused? 
+        "A code has already been sent to you by email.": 
+        "You've just received by email a generated code.", validity);
+
+    return prompt;
+}
@@ -0,0 +1,26 @@
+/**
+ * file:        pam_aurora_prompt.h
+ * description: Aurora code prompt rendering
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_PROMPT_H
+#define PAM_AURORA_PROMPT_H
+
+#include "pam_aurora_arena.h"
+
+
+/**
+ * This function renders the prompt asking the user for the code
+ * @param arena The transaction arena
+ * @param user The user login
+ * @param reused Whether the code was sent by a previous authentication
+ * @param ttl The code lifetime (seconds, 0 when it is only valid for this
+ *            authentication)
+ * @return The prompt (in the arena), or NULL when out of memory
+ */
+char *
+pam_prompt_render(struct pam_arena *arena, const char *user, int reused,
+int ttl);
+
+#endif
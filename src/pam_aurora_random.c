@@ -0,0 +1,431 @@
+/**
+ * file:        pam_aurora_random.c
+ * description: Aurora code generator (buffered ChaCha20 DRBG)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include "pam_aurora_random.h"
+
+
+/* The ChaCha20 blocks generated per refill */
+#define PAM_RANDOM_BLOCKS 8
+#define PAM_RANDOM_BUFFER (PAM_RANDOM_BLOCKS * 64)
+
+/* The key size */
+#define PAM_RANDOM_KEY 32
+
+
+/**
+ * The generator state
+ *
+ * The state lives in its own page, which is wiped in forked children (so a
+ * child never replays the parent output) and kept out of core dumps. Each
+ * refill replaces the key with the first output bytes, and the output is
+ * erased as it is consumed, so a leaked state does not reveal past codes.
+ **/
+struct pam_random_state
+{
+    /* Set once seeded from the kernel (cleared by a fork) */
+    int seeded;
+
+    /* The process seeded, when the page can not be wiped on fork */
+    pid_t pid;
+
+    /* The ChaCha20 key */
+    uint32_t key[PAM_RANDOM_KEY / 4];
+
+    /* The output buffer and its read position */
+    unsigned char buffer[PAM_RANDOM_BUFFER];
+    size_t position;
+
+    /* The output drawn since the last reseed */
+    size_t since_reseed;
+
+    /* The counters */
+    struct pam_random_stats stats;
+};
+
+
+/* The generator state page, and its lock */
+static struct pam_random_state *pam_random_state = NULL;
+static int pam_random_wipe_on_fork = 0;
+static pthread_mutex_t pam_random_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* The ChaCha20 quarter round */
+#define PAM_RANDOM_ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define PAM_RANDOM_QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = PAM_RANDOM_ROTATE(d, 16); \
+    c += d; b ^= c; b = PAM_RANDOM_ROTATE(b, 12); \
+    a += b; d ^= a; d = PAM_RANDOM_ROTATE(d, 8); \
+    c += d; b ^= c; b = PAM_RANDOM_ROTATE(b, 7)
+
+
+/**
+ * This function computes a ChaCha20 block (RFC 8439, zero nonce)
+ * @param key The key
+ * @param counter The block counter
+ * @param output The block destination (64 bytes)
+ */
+static void
+pam_random_block(const uint32_t *key, uint32_t counter, unsigned char *output)
+{
+    /* The block state */
+    uint32_t input[16];
+    uint32_t x[16];
+    int i;
+
+    /* "expand 32-byte k", key, counter and nonce */
+    input[0] = 0x61707865;
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    memcpy(input + 4, key, PAM_RANDOM_KEY);
+    input[12] = counter;
+    input[13] = input[14] = input[15] = 0;
+    memcpy(x, input, sizeof(x));
+
+    /* 20 rounds */
+    for(i = 0; i < 10; i++)
+    {
+        PAM_RANDOM_QUARTER(x[0], x[4], x[8], x[12]);
+        PAM_RANDOM_QUARTER(x[1], x[5], x[9], x[13]);
+        PAM_RANDOM_QUARTER(x[2], x[6], x[10], x[14]);
+        PAM_RANDOM_QUARTER(x[3], x[7], x[11], x[15]);
+        PAM_RANDOM_QUARTER(x[0], x[5], x[10], x[15]);
+        PAM_RANDOM_QUARTER(x[1], x[6], x[11], x[12]);
+        PAM_RANDOM_QUARTER(x[2], x[7], x[8], x[13]);
+        PAM_RANDOM_QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    /* Serialize the block (little endian) */
+    for(i = 0; i < 16; i++)
+    {
+        x[i] += input[i];
+        output[i * 4] = (unsigned char) x[i];
+        output[i * 4 + 1] = (unsigned char) (x[i] >> 8);
+        output[i * 4 + 2] = (unsigned char) (x[i] >> 16);
+        output[i * 4 + 3] = (unsigned char) (x[i] >> 24);
+    }
+}
+
+
+/**
+ * This function reads a seed from the kernel generator
+ * @param seed The seed destination
+ * @param length The seed length (at most 256 bytes)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_random_kernel(void *seed, size_t length)
+{
+    /* The fallback device */
+    int urandom_fd;
+    ssize_t count;
+    size_t done = 0;
+
+    /* A single syscall, which blocks only until the pool is initialized */
+    do
+        count = getrandom(seed, length, 0);
+    while(count < 0 && errno == EINTR);
+
+    if(count == (ssize_t) length)
+        return 0;
+
+    if(count >= 0 || errno != ENOSYS)
+        return -1;
+
+    /* Kernels older than 3.17 */
+    if((urandom_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    while(done < length)
+    {
+        if((count = read(urandom_fd, (char *) seed + done, length - done))
+            <= 0)
+        {
+            if(count < 0 && errno == EINTR)
+                continue;
+
+            close(urandom_fd);
+            return -1;
+        }
+
+        done += (size_t) count;
+    }
+
+    close(urandom_fd);
+    return 0;
+}
+
+
+/**
+ * This function refills the output buffer, reseeding from the kernel when
+ * the generator is new, forked or has produced enough output
+ * @param state The generator state
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_random_refill(struct pam_random_state *state)
+{
+    /* The block counter */
+    uint32_t counter;
+
+    /* Reseed */
+    if(! state->seeded || state->since_reseed >= PAM_AURORA_RANDOM_RESEED)
+    {
+        if(pam_random_kernel(state->key, PAM_RANDOM_KEY) != 0)
+            return -1;
+
+        state->seeded = 1;
+        state->pid = getpid();
+        state->since_reseed = 0;
+        state->stats.reseeds++;
+    }
+
+    /* Generate the blocks */
+    for(counter = 0; counter < PAM_RANDOM_BLOCKS; counter++)
+        pam_random_block(state->key, counter, state->buffer + counter * 64);
+
+    /* The first bytes become the next key (fast key erasure) */
+    memcpy(state->key, state->buffer, PAM_RANDOM_KEY);
+    memset(state->buffer, 0, PAM_RANDOM_KEY);
+    state->position = PAM_RANDOM_KEY;
+
+    return 0;
+}
+
+
+/**
+ * This function gets the generator state, locked
+ * @return The generator state, or NULL on error (unlocked)
+ */
+static struct pam_random_state *
+pam_random_acquire(void)
+{
+    /* The state page */
+    void *page;
+
+    pthread_mutex_lock(&pam_random_lock);
+
+    if(pam_random_state == NULL)
+    {
+        /* Allocate the state page */
+        if((page = mmap(NULL, sizeof(struct pam_random_state),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+            == MAP_FAILED)
+        {
+            pthread_mutex_unlock(&pam_random_lock);
+            return NULL;
+        }
+
+#ifdef MADV_WIPEONFORK
+        pam_random_wipe_on_fork = madvise(page,
+            sizeof(struct pam_random_state), MADV_WIPEONFORK) == 0;
+#endif
+#ifdef MADV_DONTDUMP
+        madvise(page, sizeof(struct pam_random_state), MADV_DONTDUMP);
+#endif
+
+        pam_random_state = page;
+    }
+
+    /* Without a wiped page, detect forks from the process id */
+    if(! pam_random_wipe_on_fork && pam_random_state->seeded
+        && pam_random_state->pid != getpid())
+    {
+        pam_random_state->seeded = 0;
+        pam_random_state->position = PAM_RANDOM_BUFFER;
+    }
+
+    /* A new or wiped state starts with an empty buffer */
+    if(! pam_random_state->seeded)
+        pam_random_state->position = PAM_RANDOM_BUFFER;
+
+    return pam_random_state;
+}
+
+
+/**
+ * This function draws bytes from the locked generator
+ * @param state The generator state
+ * @param output The bytes destination
+ * @param length The bytes count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_random_take(struct pam_random_state *state, unsigned char *output,
+size_t length)
+{
+    /* The bytes copied */
+    size_t count;
+
+    while(length > 0)
+    {
+        /* Refill the empty buffer */
+        if(state->position == PAM_RANDOM_BUFFER
+            && pam_random_refill(state) != 0)
+            return -1;
+
+        /* Copy then erase the output */
+        count = PAM_RANDOM_BUFFER - state->position;
+
+        if(count > length)
+            count = length;
+
+        memcpy(output, state->buffer + state->position, count);
+        memset(state->buffer + state->position, 0, count);
+
+        state->position += count;
+        state->since_reseed += count;
+        state->stats.bytes += count;
+        output += count;
+        length -= count;
+    }
+
+    return 0;
+}
+
+
+/**
+ * This function fills a buffer with random bytes
+ * @param buffer The buffer
+ * @param length The buffer length
+ * @return 0 on success, -1 when the kernel generator is unavailable
+ */
+int
+pam_random_bytes(void *buffer, size_t length)
+{
+    /* The generator */
+    struct pam_random_state *state;
+    int status;
+
+    if((state = pam_random_acquire()) == NULL)
+        return -1;
+
+    status = pam_random_take(state, buffer, length);
+    pthread_mutex_unlock(&pam_random_lock);
+
+    return status;
+}
+
+
+/**
+ * This function draws a code, each character being uniformly chosen in the
+ * alphabet
+ * @param alphabet The code alphabet (2 to 256 characters)
+ * @param length The code length (at most PAM_AURORA_CODE_MAX)
+ * @param code The code destination (length + 1 bytes)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_random_code(const char *alphabet, int length, char *code)
+{
+    /* The generator */
+    struct pam_random_state *state;
+
+    /* The drawn bytes */
+    unsigned char draw[PAM_AURORA_CODE_MAX];
+    size_t alphabet_length = strlen(alphabet);
+    unsigned int limit;
+    int filled = 0;
+    int missing;
+    int i;
+
+    if(alphabet_length < 2 || alphabet_length > 256 || length < 1
+        || length > PAM_AURORA_CODE_MAX)
+        return -1;
+
+    /* The bytes above the largest multiple of the alphabet length are
+       rejected, so that each character is equally likely */
+    limit = 256 - 256 % (unsigned int) alphabet_length;
+
+    if((state = pam_random_acquire()) == NULL)
+        return -1;
+
+    while(filled < length)
+    {
+        /* Draw the missing characters at once */
+        missing = length - filled;
+
+        if(pam_random_take(state, draw, (size_t) missing) != 0)
+        {
+            pthread_mutex_unlock(&pam_random_lock);
+            return -1;
+        }
+
+        for(i = 0; i < missing; i++)
+            if(draw[i] < limit)
+                code[filled++] = alphabet[draw[i] % alphabet_length];
+    }
+
+    pthread_mutex_unlock(&pam_random_lock);
+
+    /* Erase the drawn bytes */
+    memset(draw, 0, sizeof(draw));
+    code[length] = '\0';
+
+    return 0;
+}
+
+
+/**
+ * This function draws a random (version 4) UUID, in its text form
+ * @param uuid The UUID destination (PAM_AURORA_UUID_LENGTH + 1 bytes)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_random_uuid(char *uuid)
+{
+    /* The hexadecimal digits */
+    static const char digits[] = "0123456789abcdef";
+
+    /* The UUID bytes */
+    unsigned char bytes[16];
+    int i;
+
+    if(pam_random_bytes(bytes, sizeof(bytes)) != 0)
+        return -1;
+
+    /* Set the version (4, random) and the variant (RFC 4122) */
+    bytes[6] = (unsigned char) ((bytes[6] & 0x0f) | 0x40);
+    bytes[8] = (unsigned char) ((bytes[8] & 0x3f) | 0x80);
+
+    for(i = 0; i < 16; i++)
+    {
+        /* The groups of 4, 2, 2, 2 and 6 bytes */
+        if(i == 4 || i == 6 || i == 8 || i == 10)
+            *uuid++ = '-';
+
+        *uuid++ = digits[bytes[i] >> 4];
+        *uuid++ = digits[bytes[i] & 0x0f];
+    }
+
+    *uuid = '\0';
+
+    return 0;
+}
+
+/**
+ * This function gets the generator counters of the process
+ * @param stats The counters destination
+ */
+void
+pam_random_stats(struct pam_random_stats *stats)
+{
+    pthread_mutex_lock(&pam_random_lock);
+
+    if(pam_random_state != NULL)
+        *stats = pam_random_state->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_unlock(&pam_random_lock);
+}
@@ -0,0 +1,78 @@
+/**
+ * file:        pam_aurora_random.h
+ * description: Aurora code generator (buffered ChaCha20 DRBG)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_RANDOM_H
+#define PAM_AURORA_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The default code alphabet */
+#define PAM_AURORA_CODE_ALPHABET "0123456789"
+
+/* The largest code */
+#define PAM_AURORA_CODE_MAX 256
+
+/* The text length of a random UUID */
+#define PAM_AURORA_UUID_LENGTH 36
+
+/* The output drawn between two reseeds from the kernel */
+#define PAM_AURORA_RANDOM_RESEED (1024 * 1024)
+
+
+/**
+ * The generator counters
+ **/
+struct pam_random_stats
+{
+    /* The kernel reads (getrandom calls) */
+    uint64_t reseeds;
+
+    /* The bytes produced */
+    uint64_t bytes;
+};
+
+
+/**
+ * This function fills a buffer with random bytes
+ * @param buffer The buffer
+ * @param length The buffer length
+ * @return 0 on success, -1 when the kernel generator is unavailable
+ */
+int
+pam_random_bytes(void *buffer, size_t length);
+
+
+/**
+ * This function draws a code, each character being uniformly chosen in the
+ * alphabet
+ * @param alphabet The code alphabet (2 to 256 characters)
+ * @param length The code length (at most PAM_AURORA_CODE_MAX)
+ * @param code The code destination (length + 1 bytes)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_random_code(const char *alphabet, int length, char *code);
+
+
+/**
+ * This function draws a random (version 4) UUID, in its text form
+ * @param uuid The UUID destination (PAM_AURORA_UUID_LENGTH + 1 bytes)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_random_uuid(char *uuid);
+
+
+/**
+ * This function gets the generator counters of the process
+ * @param stats The counters destination
+ */
+void
+pam_random_stats(struct pam_random_stats *stats);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * file:        pam_aurora_relay.c
+ * description: Aurora mail servers health (latency and circuit breaker)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <time.h>
+#include "pam_aurora_relay.h"
+
+
+/**
+ * This function finds the slot of a mail server
+ * @param shm The mail servers table
+ * @param url The mail server URL
+ * @param create Whether to claim a free slot for a new mail server
+ * @return The slot, or NULL when the mail server is not tracked
+ */
+static struct pam_relay_slot *
+pam_relay_slot(const struct pam_shm *shm, const char *url, int create)
+{
+    /* The slots */
+    struct pam_relay_slot *slots = shm->data;
+    uint64_t hash = pam_shm_hash(shm, url, strlen(url)) | 1;
+    uint64_t current;
+    int slot;
+    int i;
+
+    /* Linear probing from the hash */
+    for(i = 0; i < PAM_AURORA_RELAY_SLOTS; i++)
+    {
+        slot = (int) ((hash + (uint64_t) i) % PAM_AURORA_RELAY_SLOTS);
+        current = __atomic_load_n(&slots[slot].hash, __ATOMIC_ACQUIRE);
+
+        if(current == hash)
+            return &slots[slot];
+
+        if(current != 0)
+            continue;
+
+        /* The mail server is unknown */
+        if(! create)
+            return NULL;
+
+        if(__atomic_compare_exchange_n(&slots[slot].hash, &current, hash, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == hash)
+            return &slots[slot];
+    }
+
+    return NULL;
+}
+
+
+/**
+ * This function maps the mail servers table
+ * @param shm The mapping destination (unmapped on failure)
+ * @param config The module configuration
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_relay_open(struct pam_shm *shm, const struct pam_aurora_config *config)
+{
+    /* The table path */
+    char path[4096];
+
+    shm->header = NULL;
+    shm->data = NULL;
+
+    /* A single mail server needs no ordering, nor breaker when disabled */
+    if((config->mail_server_count < 2 && config->breaker_failures == 0)
+        || pam_shm_path(config->state_dir, PAM_AURORA_RELAY_FILE, path,
+            sizeof(path)) != 0)
+        return -1;
+
+    return pam_shm_map(shm, path, PAM_AURORA_RELAY_MAGIC,
+        PAM_AURORA_RELAY_VERSION,
+        PAM_AURORA_RELAY_SLOTS * sizeof(struct pam_relay_slot));
+}
+
+
+/**
+ * This function checks whether the breaker of a mail server lets a delivery
+ * through, claiming the probe of a cooled down breaker
+ * @param slot The mail server slot
+ * @param config The module configuration
+ * @param now The current time
+ * @param claimed The probe claimed destination (0 when none)
+ * @return 1 if the mail server may be tried, 0 otherwise
+ */
+static int
+pam_relay_closed(struct pam_relay_slot *slot,
+const struct pam_aurora_config *config, int64_t now, int64_t *claimed)
+{
+    /* The probe start */
+    int64_t probe;
+
+    *claimed = 0;
+
+    if(config->breaker_failures == 0
+        || __atomic_load_n(&slot->failures, __ATOMIC_RELAXED)
+        < (uint32_t) config->breaker_failures)
+        return 1;
+
+    /* The breaker is open */
+    if(__atomic_load_n(&slot->failed, __ATOMIC_RELAXED)
+        + config->breaker_cooldown > now)
+        return 0;
+
+    /* A single process probes, unless the probe hung for a cool-down */
+    probe = __atomic_load_n(&slot->probe, __ATOMIC_RELAXED);
+
+    if(probe != 0 && probe + config->breaker_cooldown > now)
+        return 0;
+
+    if(! __atomic_compare_exchange_n(&slot->probe, &probe, now, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+
+    *claimed = now;
+
+    return 1;
+}
+
+
+/**
+ * This function orders the mail servers to try: the healthy ones first, by
+ * increasing latency, then in the configuration order, leaving out those
+ * whose breaker is open (unless this process probes them)
+ * @param shm The mail servers table (may be unmapped)
+ * @param config The module configuration
+ * @param order The mail server indexes destination
+ * @param probes The probes claimed destination, by mail server index (0
+ *        when none): those of the mail servers not tried are released
+ * @return The mail servers count, 0 when every breaker is open
+ */
+int
+pam_relay_order(const struct pam_shm *shm,
+const struct pam_aurora_config *config, int *order, int64_t *probes)
+{
+    /* The mail servers rank: recent failure flag, then latency */
+    uint64_t rank[PAM_AURORA_RELAY_MAX];
+    struct pam_relay_slot *slot;
+    int64_t now = (int64_t) time(NULL);
+    int count = 0;
+    int relay;
+    int i;
+
+    for(relay = 0; relay < config->mail_server_count; relay++)
+    {
+        rank[relay] = 0;
+        probes[relay] = 0;
+
+        if(shm->header != NULL && (slot = pam_relay_slot(shm,
+            config->mail_servers[relay], 0)) != NULL)
+        {
+            /* Fail fast on an open breaker */
+            if(! pam_relay_closed(slot, config, now, &probes[relay]))
+                continue;
+
+            rank[relay] = __atomic_load_n(&slot->latency, __ATOMIC_RELAXED);
+
+            if(__atomic_load_n(&slot->failures, __ATOMIC_RELAXED) > 0
+                && __atomic_load_n(&slot->failed, __ATOMIC_RELAXED)
+                + config->breaker_cooldown > now)
+                rank[relay] |= (uint64_t) 1 << 32;
+        }
+
+        /* Insertion sort (stable, the configuration order breaks ties) */
+        for(i = count; i > 0 && rank[order[i - 1]] > rank[relay]; i--)
+            order[i] = order[i - 1];
+
+        order[i] = relay;
+        count++;
+    }
+
+    return count;
+}
+
+
+/**
+ * This function releases the probe claimed for a mail server which has not
+ * been tried, so that another delivery probes it
+ * @param shm The mail servers table (may be unmapped)
+ * @param url The mail server URL
+ * @param probe The probe claimed (see pam_relay_order, 0 for none)
+ */
+void
+pam_relay_release(const struct pam_shm *shm, const char *url, int64_t probe)
+{
+    /* The mail server slot */
+    struct pam_relay_slot *slot;
+
+    if(probe == 0 || shm->header == NULL
+        || (slot = pam_relay_slot(shm, url, 0)) == NULL)
+        return;
+
+    /* Unless another process took the probe over meanwhile */
+    __atomic_compare_exchange_n(&slot->probe, &probe, 0, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * This function records a delivery through a mail server
+ * @param shm The mail servers table (may be unmapped)
+ * @param url The mail server URL
+ * @param outcome The delivery outcome (PAM_AURORA_RELAY_*): a cancelled
+ *        delivery only measures the latency, and a rejected one (5xx) is
+ *        counted as a delivery
+ * @param latency The delivery duration (microseconds)
+ */
+void
+pam_relay_record(struct pam_shm *shm, const char *url, int outcome,
+uint32_t latency)
+{
+    /* The mail server slot */
+    struct pam_relay_slot *slot;
+    uint32_t current;
+    uint32_t average;
+
+    if(shm->header == NULL || (slot = pam_relay_slot(shm, url, 1)) == NULL)
+        return;
+
+    if(outcome == PAM_AURORA_RELAY_FAILED)
+    {
+        __atomic_add_fetch(&slot->failures, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->failed, (int64_t) time(NULL),
+            __ATOMIC_RELAXED);
+
+        /* A failed probe opens the breaker for another cool-down */
+        __atomic_store_n(&slot->probe, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* Exponentially weighted average (1/8 of each new measure) */
+    current = __atomic_load_n(&slot->latency, __ATOMIC_RELAXED);
+
+    do
+        average = current == 0? (latency > 0? latency: 1):
+            current - current / 8 + latency / 8;
+    while(! __atomic_compare_exchange_n(&slot->latency, &current, average, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    /* A cancelled delivery proves nothing about the mail server: the
+       breaker is left as is */
+    if(outcome == PAM_AURORA_RELAY_CANCELLED)
+        return;
+
+    /* A delivery closes the breaker, and so does a rejection: the mail
+       server answered, only the email was refused */
+    __atomic_store_n(&slot->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->probe, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->samples, 1, __ATOMIC_RELAXED);
+}
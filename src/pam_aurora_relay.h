@@ -0,0 +1,113 @@
+/**
+ * file:        pam_aurora_relay.h
+ * description: Aurora mail servers health (latency and circuit breaker)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_RELAY_H
+#define PAM_AURORA_RELAY_H
+
+#include <stdint.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_shm.h"
+
+
+/* The mail servers state file */
+#define PAM_AURORA_RELAY_FILE "relays.db"
+#define PAM_AURORA_RELAY_MAGIC "AURRLY01"
+#define PAM_AURORA_RELAY_VERSION 2
+
+/* The mail servers tracked */
+#define PAM_AURORA_RELAY_SLOTS 64
+
+/* The delivery outcomes recorded */
+#define PAM_AURORA_RELAY_FAILED 0
+#define PAM_AURORA_RELAY_DELIVERED 1
+#define PAM_AURORA_RELAY_CANCELLED 2
+#define PAM_AURORA_RELAY_REJECTED 3
+
+
+/**
+ * The health of a mail server
+ *
+ * The fields are updated with atomic operations, without a lock: the
+ * statistics only order the mail servers, so a lost update is harmless.
+ * The failures also drive a circuit breaker shared by every process: after
+ * breaker_failures consecutive failures, the mail server is skipped until
+ * breaker_cooldown seconds have elapsed since the last failure, then a
+ * single process probes it (the probe is claimed by a compare and swap).
+ **/
+struct pam_relay_slot
+{
+    /* The mail server URL hash (0 for a free slot) */
+    uint64_t hash;
+
+    /* The smoothed delivery latency (microseconds, 0 when unknown) */
+    uint32_t latency;
+
+    /* The consecutive failures, and the last failure (seconds since the
+       epoch) */
+    uint32_t failures;
+    int64_t failed;
+
+    /* The deliveries measured */
+    uint32_t samples;
+    uint32_t reserved;
+
+    /* The start of the probe of an open breaker (seconds since the epoch,
+       0 when none) */
+    int64_t probe;
+};
+
+
+/**
+ * This function maps the mail servers table
+ * @param shm The mapping destination (unmapped on failure)
+ * @param config The module configuration
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_relay_open(struct pam_shm *shm, const struct pam_aurora_config *config);
+
+
+/**
+ * This function orders the mail servers to try: the healthy ones first, by
+ * increasing latency, then in the configuration order, leaving out those
+ * whose breaker is open (unless this process probes them)
+ * @param shm The mail servers table (may be unmapped)
+ * @param config The module configuration
+ * @param order The mail server indexes destination
+ * @param probes The probes claimed destination, by mail server index (0
+ *        when none): those of the mail servers not tried are released
+ * @return The mail servers count, 0 when every breaker is open
+ */
+int
+pam_relay_order(const struct pam_shm *shm,
+const struct pam_aurora_config *config, int *order, int64_t *probes);
+
+
+/**
+ * This function releases the probe claimed for a mail server which has not
+ * been tried, so that another delivery probes it
+ * @param shm The mail servers table (may be unmapped)
+ * @param url The mail server URL
+ * @param probe The probe claimed (see pam_relay_order, 0 for none)
+ */
+void
+pam_relay_release(const struct pam_shm *shm, const char *url, int64_t probe);
+
+
+/**
+ * This function records a delivery through a mail server
+ * @param shm The mail servers table (may be unmapped)
+ * @param url The mail server URL
+ * @param outcome The delivery outcome (PAM_AURORA_RELAY_*): a cancelled
+ *        delivery only measures the latency, and a rejected one (5xx) is
+ *        counted as a delivery
+ * @param latency The delivery duration (microseconds)
+ */
+void
+pam_relay_record(struct pam_shm *shm, const char *url, int outcome,
+uint32_t latency);
+
+#endif
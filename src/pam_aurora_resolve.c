@@ -0,0 +1,483 @@
+/**
+ * file:        pam_aurora_resolve.c
+ * description: Aurora mail server addresses shared by the processes
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "pam_aurora_curl.h"
+#include "pam_aurora_resolve.h"
+#include "pam_aurora_shm.h"
+
+
+/**
+ * A background refresh of the addresses of a mail server
+ **/
+struct pam_resolve_refresh
+{
+    /* The state directory, and the addresses freshness */
+    char *state_dir;
+    int ttl;
+
+    /* The mail server host, port and name */
+    char *host;
+    char *port;
+    char *name;
+
+    /* The strings storage */
+    char data[];
+};
+
+
+/**
+ * This function extracts the host and port of a mail server URL
+ * @param url The mail server URL
+ * @param host The host destination
+ * @param port The port destination
+ * @return 0 on success, -1 when the host is an address or is too long
+ */
+static int
+pam_resolve_split(const char *url, char *host, char *port)
+{
+    /* The URL parts */
+    const char *authority = strstr(url, "://");
+    const char *end;
+    const char *at;
+    const char *colon;
+    size_t length;
+    struct in_addr address;
+
+    /* The default port of the scheme */
+    strcpy(port, authority != NULL && authority - url == 5
+        && strncmp(url, "smtps", 5) == 0? "465": "25");
+
+    authority = authority != NULL? authority + 3: url;
+    end = authority + strcspn(authority, "/?#");
+
+    /* Skip the user information */
+    if((at = memchr(authority, '@', (size_t) (end - authority))) != NULL)
+        authority = at + 1;
+
+    /* An IPv6 address needs no resolution */
+    if(*authority == '[')
+        return -1;
+
+    if((colon = memchr(authority, ':', (size_t) (end - authority))) != NULL)
+    {
+        if(end - colon - 1 < 1 || end - colon - 1 > 5)
+            return -1;
+
+        memcpy(port, colon + 1, (size_t) (end - colon - 1));
+        port[end - colon - 1] = '\0';
+        end = colon;
+    }
+
+    if((length = (size_t) (end - authority)) == 0
+        || length >= PAM_AURORA_RESOLVE_NAME_MAX - 7)
+        return -1;
+
+    memcpy(host, authority, length);
+    host[length] = '\0';
+
+    /* Neither does an IPv4 address */
+    return inet_pton(AF_INET, host, &address) == 1? -1: 0;
+}
+
+
+/**
+ * This function resolves the addresses of a mail server
+ * @param host The mail server host
+ * @param port The mail server port
+ * @param addresses The addresses destination ("a,b,[c]")
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_resolve_lookup(const char *host, const char *port, char *addresses)
+{
+    /* The resolver answer */
+    struct addrinfo hints;
+    struct addrinfo *answer;
+    struct addrinfo *entry;
+    char address[INET6_ADDRSTRLEN];
+    size_t length = 0;
+    int count = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    if(getaddrinfo(host, port, &hints, &answer) != 0)
+        return -1;
+
+    /* Keep the resolver order */
+    for(entry = answer; entry != NULL && count < PAM_AURORA_RESOLVE_ADDRESSES;
+        entry = entry->ai_next)
+    {
+        if(getnameinfo(entry->ai_addr, entry->ai_addrlen, address,
+            sizeof(address), NULL, 0, NI_NUMERICHOST) != 0)
+            continue;
+
+        length += (size_t) snprintf(addresses + length,
+            PAM_AURORA_RESOLVE_ADDRESSES_MAX - length,
+            entry->ai_family == AF_INET6? "%s[%s]": "%s%s",
+            count > 0? ",": "", address);
+        count++;
+    }
+
+    freeaddrinfo(answer);
+
+    /* Return status */
+    return count > 0 && length < PAM_AURORA_RESOLVE_ADDRESSES_MAX? 0: -1;
+}
+
+
+/**
+ * This function maps the addresses table and finds the slot set of a mail
+ * server
+ * @param shm The mapping destination
+ * @param state_dir The state directory
+ * @param name The mail server name
+ * @param hash The mail server name hash destination
+ * @return The slot set, or NULL on failure
+ */
+static struct pam_resolve_slot *
+pam_resolve_open(struct pam_shm *shm, const char *state_dir, const char *name,
+uint64_t *hash)
+{
+    /* The table path */
+    char path[4096];
+
+    if(pam_shm_path(state_dir, PAM_AURORA_RESOLVE_FILE, path, sizeof(path))
+        != 0 || pam_shm_map(shm, path, PAM_AURORA_RESOLVE_MAGIC,
+            PAM_AURORA_RESOLVE_VERSION,
+            PAM_AURORA_RESOLVE_SLOTS * sizeof(struct pam_resolve_slot)) != 0)
+        return NULL;
+
+    *hash = pam_shm_hash(shm, name, strlen(name));
+
+    /* Return the slot set */
+    return (struct pam_resolve_slot *) shm->data + (*hash
+        & (PAM_AURORA_RESOLVE_SLOTS / PAM_AURORA_RESOLVE_WAYS - 1))
+        * PAM_AURORA_RESOLVE_WAYS;
+}
+
+
+/**
+ * This function records the addresses of a mail server, and ends its
+ * refresh
+ * @param state_dir The state directory
+ * @param name The mail server name
+ * @param addresses The addresses (NULL when the resolver failed)
+ * @param ttl The addresses freshness (seconds)
+ */
+static void
+pam_resolve_store(const char *state_dir, const char *name,
+const char *addresses, int ttl)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_resolve_slot *set;
+    struct pam_resolve_slot *victim = NULL;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int i;
+
+    if((set = pam_resolve_open(&shm, state_dir, name, &hash)) == NULL)
+        return;
+
+    /* Replace the addresses of the mail server, or the slot expiring
+       first */
+    for(i = 0; i < PAM_AURORA_RESOLVE_WAYS; i++)
+    {
+        if(set[i].hash == hash && strcmp(set[i].name, name) == 0)
+        {
+            victim = &set[i];
+            break;
+        }
+
+        if(victim == NULL || set[i].expires < victim->expires)
+            victim = &set[i];
+    }
+
+    if(addresses == NULL)
+    {
+        /* Keep serving the stale addresses, and let a later login retry */
+        if(victim->hash == hash)
+            __atomic_store_n(&victim->refresh, 0, __ATOMIC_RELAXED);
+    }
+
+    /* Write the slot (a busy slot is left to its writer) */
+    else if((sequence = pam_shm_lock(&victim->sequence, &victim->writer))
+        != 0)
+    {
+        victim->hash = hash;
+        victim->expires = now + ttl;
+        strcpy(victim->name, name);
+        strcpy(victim->addresses, addresses);
+        __atomic_store_n(&victim->refresh, 0, __ATOMIC_RELAXED);
+
+        pam_shm_unlock(&victim->sequence, sequence);
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+}
+
+
+/**
+ * This function claims the refresh of the unknown addresses of a mail
+ * server, with a placeholder slot, so that a single login resolves them
+ * @param set The slot set of the mail server
+ * @param hash The mail server name hash
+ * @param name The mail server name
+ * @param now The current time (seconds since the epoch)
+ * @return The placeholder slot, or NULL when another login refreshes them
+ */
+static struct pam_resolve_slot *
+pam_resolve_claim(struct pam_resolve_slot *set, uint64_t hash,
+const char *name, int64_t now)
+{
+    /* The placeholder */
+    struct pam_resolve_slot *victim = NULL;
+    uint32_t sequence;
+    int64_t refresh;
+    int i;
+
+    /* Take the slot of the mail server, or the slot expiring first */
+    for(i = 0; i < PAM_AURORA_RESOLVE_WAYS; i++)
+    {
+        if(set[i].hash == hash && strncmp(set[i].name, name,
+            sizeof(set[i].name)) == 0)
+        {
+            victim = &set[i];
+            break;
+        }
+
+        if(victim == NULL || set[i].expires < victim->expires)
+            victim = &set[i];
+    }
+
+    if((sequence = pam_shm_lock(&victim->sequence, &victim->writer)) == 0)
+        return NULL;
+
+    refresh = victim->hash == hash && strcmp(victim->name, name) == 0?
+        victim->refresh: 0;
+
+    /* Another login already refreshes them */
+    if(refresh != 0 && refresh + PAM_AURORA_RESOLVE_REFRESH > now)
+    {
+        pam_shm_unlock(&victim->sequence, sequence);
+        return NULL;
+    }
+
+    victim->hash = hash;
+    victim->expires = 0;
+    strcpy(victim->name, name);
+    victim->addresses[0] = '\0';
+    victim->refresh = now;
+
+    pam_shm_unlock(&victim->sequence, sequence);
+
+    return victim;
+}
+
+
+/**
+ * The background refresh thread
+ * @param refresh_ptr The refresh
+ * @return NULL
+ */
+static void *
+pam_resolve_run(void *refresh_ptr)
+{
+    /* The refresh */
+    struct pam_resolve_refresh *refresh =
+        (struct pam_resolve_refresh *) refresh_ptr;
+    char addresses[PAM_AURORA_RESOLVE_ADDRESSES_MAX];
+
+    pam_resolve_store(refresh->state_dir, refresh->name,
+        pam_resolve_lookup(refresh->host, refresh->port, addresses) == 0?
+            addresses: NULL, refresh->ttl);
+
+    /* Free memory */
+    free(refresh);
+
+    return NULL;
+}
+
+
+/**
+ * This function refreshes the addresses of a mail server in background
+ * @param config The module configuration
+ * @param host The mail server host
+ * @param port The mail server port
+ * @param name The mail server name
+ * @return 0 when the refresh is started, -1 otherwise
+ */
+static int
+pam_resolve_refresh(const struct pam_aurora_config *config, const char *host,
+const char *port, const char *name)
+{
+    /* The refresh, with a copy of its strings (the thread may outlive the
+       configuration snapshot) */
+    struct pam_resolve_refresh *refresh;
+    size_t state_dir_length = strlen(config->state_dir) + 1;
+    size_t host_length = strlen(host) + 1;
+    size_t port_length = strlen(port) + 1;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int status;
+
+    if((refresh = malloc(sizeof(*refresh) + state_dir_length + host_length
+        + port_length + strlen(name) + 1)) == NULL)
+        return -1;
+
+    refresh->state_dir = refresh->data;
+    refresh->host = refresh->state_dir + state_dir_length;
+    refresh->port = refresh->host + host_length;
+    refresh->name = refresh->port + port_length;
+    strcpy(refresh->state_dir, config->state_dir);
+    strcpy(refresh->host, host);
+    strcpy(refresh->port, port);
+    strcpy(refresh->name, name);
+    refresh->ttl = config->mail_dns_ttl;
+
+    /* Nobody waits for the refresh */
+    if(pthread_attr_init(&attributes) != 0)
+    {
+        free(refresh);
+        return -1;
+    }
+
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    status = pthread_create(&thread, &attributes, pam_resolve_run, refresh);
+    pthread_attr_destroy(&attributes);
+
+    if(status != 0)
+    {
+        free(refresh);
+        return -1;
+    }
+
+    /* Refresh started */
+    return 0;
+}
+
+
+/**
+ * This function sets the known addresses of a mail server on a handle,
+ * resolving them in background when missing or stale
+ *
+ * Missing addresses are left to curl, within its own timeouts: the login
+ * never waits for a resolution of its own.
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ * @return The addresses list, to free once the transfer is over (NULL for
+ *         a mail server given by address)
+ */
+struct curl_slist *
+pam_resolve_hosts(CURL *curl, const struct pam_aurora_config *config,
+const char *url)
+{
+    /* The mail server */
+    char host[PAM_AURORA_RESOLVE_NAME_MAX - 7];
+    char port[6];
+    char name[PAM_AURORA_RESOLVE_NAME_MAX];
+
+    /* The addresses, in the CURLOPT_RESOLVE format */
+    char entry[1 + PAM_AURORA_RESOLVE_NAME_MAX + 1
+        + PAM_AURORA_RESOLVE_ADDRESSES_MAX];
+    struct curl_slist *resolve;
+    int64_t expires = 0;
+
+    /* The table */
+    struct pam_shm shm;
+    struct pam_resolve_slot *set;
+    struct pam_resolve_slot *slot = NULL;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int64_t refresh;
+    int i;
+
+    if(pam_resolve_split(url, host, port) != 0)
+        return NULL;
+
+    snprintf(name, sizeof(name), "%s:%s", host, port);
+    entry[0] = '\0';
+
+    /* Read the known addresses */
+    if(config->mail_dns_ttl > 0
+        && (set = pam_resolve_open(&shm, config->state_dir, name, &hash))
+            != NULL)
+    {
+        for(i = 0; i < PAM_AURORA_RESOLVE_WAYS && slot == NULL; i++)
+        {
+            /* Skip the slots being written */
+            if((sequence = __atomic_load_n(&set[i].sequence,
+                __ATOMIC_ACQUIRE)) & 1)
+                continue;
+
+            if(set[i].hash == hash && strncmp(set[i].name, name,
+                sizeof(set[i].name)) == 0
+                && set[i].expires + config->mail_dns_stale > now)
+            {
+                slot = &set[i];
+                expires = slot->expires;
+                snprintf(entry, sizeof(entry), "%s:%.*s", name,
+                    (int) sizeof(slot->addresses) - 1, slot->addresses);
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if(__atomic_load_n(&set[i].sequence, __ATOMIC_RELAXED) != sequence)
+            {
+                slot = NULL;
+                entry[0] = '\0';
+            }
+        }
+
+        /* Serve stale addresses, while a single process refreshes them */
+        if(slot != NULL && expires <= now)
+        {
+            refresh = __atomic_load_n(&slot->refresh, __ATOMIC_RELAXED);
+
+            if((refresh == 0 || refresh + PAM_AURORA_RESOLVE_REFRESH <= now)
+                && __atomic_compare_exchange_n(&slot->refresh, &refresh, now,
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+                && pam_resolve_refresh(config, host, port, name) != 0)
+                __atomic_store_n(&slot->refresh, 0, __ATOMIC_RELAXED);
+        }
+
+        /* Resolve unknown addresses (or too old to be served) for the next
+           logins, while curl resolves them for this one */
+        else if(slot == NULL
+            && (slot = pam_resolve_claim(set, hash, name, now)) != NULL
+            && pam_resolve_refresh(config, host, port, name) != 0)
+            __atomic_store_n(&slot->refresh, 0, __ATOMIC_RELAXED);
+
+        /* Properly unmap the table */
+        pam_shm_unmap(&shm);
+    }
+
+    /* Without addresses, drop those set on a kept handle (curl resolves
+       the mail server) */
+    if(entry[0] == '\0')
+        snprintf(entry, sizeof(entry), "-%s", name);
+
+    if((resolve = pam_curl.slist_append(NULL, entry)) != NULL)
+        pam_curl.easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+
+    /* Return the addresses list */
+    return resolve;
+}
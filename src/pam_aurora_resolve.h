@@ -0,0 +1,81 @@
+/**
+ * file:        pam_aurora_resolve.h
+ * description: Aurora mail server addresses shared by the processes
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_RESOLVE_H
+#define PAM_AURORA_RESOLVE_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+#include "pam_aurora_config.h"
+
+
+/* The resolved addresses state file */
+#define PAM_AURORA_RESOLVE_FILE "hosts.db"
+#define PAM_AURORA_RESOLVE_MAGIC "AURDNS01"
+#define PAM_AURORA_RESOLVE_VERSION 1
+
+/* The slots, by sets of PAM_AURORA_RESOLVE_WAYS */
+#define PAM_AURORA_RESOLVE_SLOTS 64
+#define PAM_AURORA_RESOLVE_WAYS 4
+
+/* The longest mail server name ("host:port"), and addresses list */
+#define PAM_AURORA_RESOLVE_NAME_MAX 264
+#define PAM_AURORA_RESOLVE_ADDRESSES_MAX 400
+
+/* The addresses kept for a mail server */
+#define PAM_AURORA_RESOLVE_ADDRESSES 8
+
+/* The time after which a refresh that did not end may be retried
+   (seconds) */
+#define PAM_AURORA_RESOLVE_REFRESH 30
+
+
+/**
+ * The addresses of a mail server
+ *
+ * Slots are updated under a sequence lock (see pam_shm_lock). The addresses
+ * are kept in the CURLOPT_RESOLVE format.
+ **/
+struct pam_resolve_slot
+{
+    /* The sequence (odd while written) and the writer process */
+    uint32_t sequence;
+    int32_t writer;
+
+    /* The mail server name hash */
+    uint64_t hash;
+
+    /* The addresses freshness (seconds since the epoch): stale addresses
+       are still served for mail_dns_stale seconds while refreshed */
+    int64_t expires;
+
+    /* The start of the refresh in progress (seconds since the epoch, 0 when
+       none) */
+    int64_t refresh;
+
+    /* The mail server name ("host:port") and its addresses ("a,b,[c]") */
+    char name[PAM_AURORA_RESOLVE_NAME_MAX];
+    char addresses[PAM_AURORA_RESOLVE_ADDRESSES_MAX];
+};
+
+
+/**
+ * This function sets the known addresses of a mail server on a handle,
+ * resolving them in background when missing or stale
+ *
+ * Missing addresses are left to curl, within its own timeouts: the login
+ * never waits for a resolution of its own.
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ * @return The addresses list, to free once the transfer is over (NULL for
+ *         a mail server given by address)
+ */
+struct curl_slist *
+pam_resolve_hosts(CURL *curl, const struct pam_aurora_config *config,
+const char *url);
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * file:        pam_aurora_session.c
+ * description: Aurora trusted sessions (recent successful authentications)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <time.h>
+#include <security/pam_appl.h>
+#include "pam_aurora_session.h"
+#include "pam_aurora_shm.h"
+
+
+/**
+ * This function builds the session key: the service, user, remote host and
+ * tty, separated by NUL characters
+ * @param pam_handle The PAM handle
+ * @param user The user login
+ * @param key The key destination (PAM_AURORA_SESSION_KEY_MAX bytes)
+ * @return The key length, or 0 when the session can not be identified
+ */
+static size_t
+pam_session_key(pam_handle_t *pam_handle, const char *user, char *key)
+{
+    /* The session items */
+    const void *items[4] = { NULL, NULL, NULL, NULL };
+    const char *item;
+    size_t length = 0;
+    size_t item_length;
+    int i;
+
+    pam_get_item(pam_handle, PAM_SERVICE, &items[0]);
+    items[1] = user;
+    pam_get_item(pam_handle, PAM_RHOST, &items[2]);
+    pam_get_item(pam_handle, PAM_TTY, &items[3]);
+
+    /* A session without origin is never trusted */
+    if((items[2] == NULL || *(const char *) items[2] == '\0')
+        && (items[3] == NULL || *(const char *) items[3] == '\0'))
+        return 0;
+
+    for(i = 0; i < 4; i++)
+    {
+        item = items[i] != NULL? items[i]: "";
+        item_length = strlen(item) + 1;
+
+        /* Too long to be cached */
+        if(length + item_length > PAM_AURORA_SESSION_KEY_MAX)
+            return 0;
+
+        memcpy(key + length, item, item_length);
+        length += item_length;
+    }
+
+    return length;
+}
+
+
+/**
+ * This function maps the trusted sessions table
+ * @param shm The mapping destination
+ * @param config The module configuration
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_session_map(struct pam_shm *shm, const struct pam_aurora_config *config)
+{
+    /* The table path */
+    char path[4096];
+
+    if(pam_shm_path(config->state_dir, PAM_AURORA_SESSION_FILE, path,
+        sizeof(path)) != 0)
+        return -1;
+
+    return pam_shm_map(shm, path, PAM_AURORA_SESSION_MAGIC,
+        PAM_AURORA_SESSION_VERSION, (size_t) config->trust_slots
+        * sizeof(struct pam_session_slot));
+}
+
+
+/**
+ * This function checks whether a session has been trusted recently
+ * @param pam_handle The PAM handle
+ * @param config The module configuration
+ * @param user The user login
+ * @return 1 if the session is trusted, 0 otherwise
+ */
+int
+pam_session_trusted(pam_handle_t *pam_handle,
+const struct pam_aurora_config *config, const char *user)
+{
+    /* The session key */
+    char key[PAM_AURORA_SESSION_KEY_MAX];
+    size_t key_length;
+    uint64_t hash;
+
+    /* The table */
+    struct pam_shm shm;
+    struct pam_session_slot *slots;
+    struct pam_session_slot *slot;
+    uint32_t set;
+    uint32_t sequence;
+    int64_t expires;
+    int trusted = 0;
+    int i;
+
+    if(config->trust_window <= 0
+        || (key_length = pam_session_key(pam_handle, user, key)) == 0
+        || pam_session_map(&shm, config) != 0)
+        return 0;
+
+    slots = shm.data;
+    hash = pam_shm_hash(&shm, key, key_length);
+    set = (uint32_t) (hash & (uint64_t) (config->trust_slots
+        / PAM_AURORA_SESSION_WAYS - 1)) * PAM_AURORA_SESSION_WAYS;
+
+    for(i = 0; i < PAM_AURORA_SESSION_WAYS && ! trusted; i++)
+    {
+        slot = &slots[set + i];
+
+        /* Skip the slots being written */
+        if((sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE))
+            & 1)
+            continue;
+
+        /* Compare the whole key, then check the slot was not rewritten */
+        expires = slot->expires;
+        trusted = slot->hash == hash && slot->key_length == key_length
+            && memcmp(slot->key, key, key_length) == 0
+            && expires > (int64_t) time(NULL);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+            trusted = 0;
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    /* Return trust */
+    return trusted;
+}
+
+
+/**
+ * This function trusts a session after a successful authentication
+ * @param pam_handle The PAM handle
+ * @param config The module configuration
+ * @param user The user login
+ */
+void
+pam_session_trust(pam_handle_t *pam_handle,
+const struct pam_aurora_config *config, const char *user)
+{
+    /* The session key */
+    char key[PAM_AURORA_SESSION_KEY_MAX];
+    size_t key_length;
+    uint64_t hash;
+
+    /* The table */
+    struct pam_shm shm;
+    struct pam_session_slot *slots;
+    struct pam_session_slot *slot;
+    struct pam_session_slot *victim = NULL;
+    uint32_t set;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int i;
+
+    if(config->trust_window <= 0
+        || (key_length = pam_session_key(pam_handle, user, key)) == 0
+        || pam_session_map(&shm, config) != 0)
+        return;
+
+    slots = shm.data;
+    hash = pam_shm_hash(&shm, key, key_length);
+    set = (uint32_t) (hash & (uint64_t) (config->trust_slots
+        / PAM_AURORA_SESSION_WAYS - 1)) * PAM_AURORA_SESSION_WAYS;
+
+    /* Replace the same session, or the slot expiring first */
+    for(i = 0; i < PAM_AURORA_SESSION_WAYS; i++)
+    {
+        slot = &slots[set + i];
+
+        if(slot->hash == hash && slot->key_length == key_length
+            && memcmp(slot->key, key, key_length) == 0)
+        {
+            victim = slot;
+            break;
+        }
+
+        if(victim == NULL || slot->expires < victim->expires)
+            victim = slot;
+    }
+
+    /* Write the slot (a busy slot is left to its writer) */
+    if((sequence = pam_shm_lock(&victim->sequence, &victim->writer)) != 0)
+    {
+        victim->hash = hash;
+        victim->key_length = (uint32_t) key_length;
+        memcpy(victim->key, key, key_length);
+        victim->expires = now + config->trust_window;
+
+        pam_shm_unlock(&victim->sequence, sequence);
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+}
@@ -0,0 +1,75 @@
+/**
+ * file:        pam_aurora_session.h
+ * description: Aurora trusted sessions (recent successful authentications)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_SESSION_H
+#define PAM_AURORA_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <security/pam_appl.h>
+#include "pam_aurora_config.h"
+
+
+/* The trusted sessions state file */
+#define PAM_AURORA_SESSION_FILE "sessions.db"
+#define PAM_AURORA_SESSION_MAGIC "AURSES01"
+#define PAM_AURORA_SESSION_VERSION 1
+
+/* The largest session key (service, user, remote host and tty) */
+#define PAM_AURORA_SESSION_KEY_MAX 480
+
+/* The slots per hash set */
+#define PAM_AURORA_SESSION_WAYS 4
+
+
+/**
+ * A trusted session slot
+ *
+ * Slots are updated under a sequence lock (see pam_shm_lock): a lookup
+ * skips a slot being written rather than waiting for it.
+ **/
+struct pam_session_slot
+{
+    /* The sequence (odd while written) and the writer process */
+    uint32_t sequence;
+    int32_t writer;
+
+    /* The session key hash and length */
+    uint64_t hash;
+    uint32_t key_length;
+    uint32_t reserved;
+
+    /* The trust expiry (seconds since the epoch) */
+    int64_t expires;
+
+    /* The session key */
+    char key[PAM_AURORA_SESSION_KEY_MAX];
+};
+
+
+/**
+ * This function checks whether a session has been trusted recently
+ * @param pam_handle The PAM handle
+ * @param config The module configuration
+ * @param user The user login
+ * @return 1 if the session is trusted, 0 otherwise
+ */
+int
+pam_session_trusted(pam_handle_t *pam_handle,
+const struct pam_aurora_config *config, const char *user);
+
+
+/**
+ * This function trusts a session after a successful authentication
+ * @param pam_handle The PAM handle
+ * @param config The module configuration
+ * @param user The user login
+ */
+void
+pam_session_trust(pam_handle_t *pam_handle,
+const struct pam_aurora_config *config, const char *user);
+
+#endif
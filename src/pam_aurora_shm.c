@@ -0,0 +1,284 @@
+/**
+ * file:        pam_aurora_shm.c
+ * description: Aurora shared-memory state files
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pam_aurora_random.h"
+#include "pam_aurora_shm.h"
+
+
+/**
+ * This function checks a mapped state file header
+ * @param header The header
+ * @param magic The expected magic
+ * @param version The expected version
+ * @param data_size The expected data size
+ * @return 1 if the layout matches, 0 otherwise
+ */
+static int
+pam_shm_valid(const struct pam_shm_header *header, const char *magic,
+uint32_t version, size_t data_size)
+{
+    return memcmp(header->magic, magic, sizeof(header->magic)) == 0
+        && header->version == version
+        && header->data_size == (uint64_t) data_size;
+}
+
+
+/**
+ * This function creates a state file and publishes it
+ * @param path The state file path
+ * @param magic The file magic
+ * @param version The file layout version
+ * @param size The file size
+ * @return The file descriptor, or -1 on error
+ */
+static int
+pam_shm_create(const char *path, const char *magic, uint32_t version,
+size_t size)
+{
+    /* The temporary file */
+    char *tmp_path;
+    char *separator;
+    int tmp_fd;
+
+    /* The header */
+    struct pam_shm_header header;
+
+    if((tmp_path = malloc(strlen(path) + 8)) == NULL)
+        return -1;
+
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    /* Create the state directory on first use (it may be a tmpfs) */
+    if((tmp_fd = mkstemp(tmp_path)) < 0 && errno == ENOENT
+        && (separator = strrchr(tmp_path, '/')) != NULL
+        && separator != tmp_path)
+    {
+        *separator = '\0';
+        mkdir(tmp_path, 0700);
+        sprintf(tmp_path, "%s.XXXXXX", path);
+        tmp_fd = mkstemp(tmp_path);
+    }
+
+    if(tmp_fd < 0)
+    {
+        free(tmp_path);
+        return -1;
+    }
+
+    fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
+
+    /* A zeroed file, with its header */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = version;
+    header.data_size = size - sizeof(header);
+
+    if(pam_random_bytes(header.secret, sizeof(header.secret)) != 0
+        || ftruncate(tmp_fd, (off_t) size) != 0
+        || pwrite(tmp_fd, &header, sizeof(header), 0)
+            != (ssize_t) sizeof(header)
+        || rename(tmp_path, path) != 0)
+    {
+        close(tmp_fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    /* Free memory */
+    free(tmp_path);
+
+    /* State file published */
+    return tmp_fd;
+}
+
+
+/**
+ * This function maps a state file, creating it when missing or when its
+ * layout differs
+ * @param shm The mapping destination
+ * @param path The state file path
+ * @param magic The file magic (8 characters)
+ * @param version The file layout version
+ * @param data_size The data size
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_shm_map(struct pam_shm *shm, const char *path, const char *magic,
+uint32_t version, size_t data_size)
+{
+    /* The state file */
+    int shm_fd;
+    struct stat shm_stat;
+    size_t size = sizeof(struct pam_shm_header) + data_size;
+    void *map;
+    int attempt;
+
+    for(attempt = 0; attempt < 2; attempt++)
+    {
+        /* Open the published file, or create it */
+        if((shm_fd = open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW)) < 0
+            && (shm_fd = pam_shm_create(path, magic, version, size)) < 0)
+            return -1;
+
+        /* Map it, once its layout is checked */
+        if(fstat(shm_fd, &shm_stat) == 0 && shm_stat.st_size == (off_t) size
+            && (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                shm_fd, 0)) != MAP_FAILED)
+        {
+            if(pam_shm_valid(map, magic, version, data_size))
+            {
+                close(shm_fd);
+
+                shm->header = map;
+                shm->data = (struct pam_shm_header *) map + 1;
+                shm->size = size;
+                return 0;
+            }
+
+            munmap(map, size);
+        }
+
+        close(shm_fd);
+
+        /* Replace a file with another layout (its users keep the old one) */
+        if((shm_fd = pam_shm_create(path, magic, version, size)) >= 0)
+            close(shm_fd);
+    }
+
+    return -1;
+}
+
+
+/**
+ * This function unmaps a state file
+ * @param shm The mapping
+ */
+void
+pam_shm_unmap(struct pam_shm *shm)
+{
+    if(shm->header != NULL)
+        munmap(shm->header, shm->size);
+
+    shm->header = NULL;
+    shm->data = NULL;
+}
+
+
+/**
+ * This function builds the path of a state file
+ * @param state_dir The state directory
+ * @param name The state file name
+ * @param path The path destination
+ * @param size The path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_shm_path(const char *state_dir, const char *name, char *path,
+size_t size)
+{
+    return (size_t) snprintf(path, size, "%s/%s", state_dir, name) < size?
+        0: -1;
+}
+
+
+/**
+ * This function hashes a key with the secret of a state file (FNV-1a)
+ * @param shm The state file mapping
+ * @param key The key
+ * @param length The key length
+ * @return The 64 bits hash
+ */
+uint64_t
+pam_shm_hash(const struct pam_shm *shm, const void *key, size_t length)
+{
+    /* The hash state */
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes;
+    size_t i;
+
+    /* Mix the secret, then the key */
+    for(i = 0, bytes = shm->header->secret; i < sizeof(shm->header->secret);
+        i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    for(i = 0, bytes = key; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    /* Final avalanche (the slot index uses the low bits) */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    /* Return hash */
+    return hash;
+}
+
+
+/**
+ * This function locks a record of a state file for writing
+ * @param sequence The record sequence
+ * @param writer The record writer process
+ * @return The locked (odd) sequence, or 0 when another process writes
+ */
+uint32_t
+pam_shm_lock(uint32_t *sequence, int32_t *writer)
+{
+    /* The record sequence and writer */
+    uint32_t current = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+    uint32_t locked;
+    int32_t owner;
+
+    /* A writer is busy, unless it died while writing */
+    if(current & 1)
+    {
+        owner = __atomic_load_n(writer, __ATOMIC_RELAXED);
+
+        if(owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH)
+            return 0;
+
+        locked = current + 2;
+    }
+    else
+        locked = current + 1;
+
+    /* Take the record */
+    if(! __atomic_compare_exchange_n(sequence, &current, locked, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return 0;
+
+    __atomic_store_n(writer, (int32_t) getpid(), __ATOMIC_RELAXED);
+
+    /* Return the locked sequence */
+    return locked;
+}
+
+
+/**
+ * This function unlocks a record locked by pam_shm_lock
+ * @param sequence The record sequence
+ * @param locked The locked sequence
+ */
+void
+pam_shm_unlock(uint32_t *sequence, uint32_t locked)
+{
+    __atomic_store_n(sequence, locked + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,129 @@
+/**
+ * file:        pam_aurora_shm.h
+ * description: Aurora shared-memory state files
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_SHM_H
+#define PAM_AURORA_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The default state directory */
+#define PAM_AURORA_STATE_DIR "/run/aurora"
+
+
+/**
+ * The state file header
+ *
+ * A state file is shared by every process using the module through a
+ * MAP_SHARED mapping. It is created in a temporary file then published by a
+ * rename, so a process never sees a partially initialized file, and a file
+ * with another layout is replaced the same way rather than resized under
+ * the processes still mapping it.
+ **/
+struct pam_shm_header
+{
+    /* The file identification */
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    /* The data size, after the header */
+    uint64_t data_size;
+
+    /* A random secret, to key the hashes of the file */
+    unsigned char secret[16];
+
+    /* Padding to a cache line */
+    unsigned char padding[24];
+};
+
+
+/**
+ * A state file mapping
+ **/
+struct pam_shm
+{
+    /* The mapped header, followed by the data */
+    struct pam_shm_header *header;
+    void *data;
+
+    /* The mapping size */
+    size_t size;
+};
+
+
+/**
+ * This function maps a state file, creating it when missing or when its
+ * layout differs
+ * @param shm The mapping destination
+ * @param path The state file path
+ * @param magic The file magic (8 characters)
+ * @param version The file layout version
+ * @param data_size The data size
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_shm_map(struct pam_shm *shm, const char *path, const char *magic,
+uint32_t version, size_t data_size);
+
+
+/**
+ * This function unmaps a state file
+ * @param shm The mapping
+ */
+void
+pam_shm_unmap(struct pam_shm *shm);
+
+
+/**
+ * This function builds the path of a state file
+ * @param state_dir The state directory
+ * @param name The state file name
+ * @param path The path destination
+ * @param size The path destination size
+ * @return 0 on success, -1 if the path is too long
+ */
+int
+pam_shm_path(const char *state_dir, const char *name, char *path,
+size_t size);
+
+
+/**
+ * This function hashes a key with the secret of a state file (FNV-1a)
+ * @param shm The state file mapping
+ * @param key The key
+ * @param length The key length
+ * @return The 64 bits hash
+ */
+uint64_t
+pam_shm_hash(const struct pam_shm *shm, const void *key, size_t length);
+
+
+/**
+ * This function locks a record of a state file for writing
+ *
+ * A record starts with a sequence, odd while the record is written, and the
+ * id of its writer process: readers skip a record whose sequence is odd or
+ * changed while they read it, and a record left odd by a writer that died
+ * is taken over.
+ * @param sequence The record sequence
+ * @param writer The record writer process
+ * @return The locked (odd) sequence, or 0 when another process writes
+ */
+uint32_t
+pam_shm_lock(uint32_t *sequence, int32_t *writer);
+
+
+/**
+ * This function unlocks a record locked by pam_shm_lock
+ * @param sequence The record sequence
+ * @param locked The locked sequence
+ */
+void
+pam_shm_unlock(uint32_t *sequence, uint32_t locked);
+
+#endif
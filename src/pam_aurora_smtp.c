@@ -0,0 +1,755 @@
+/**
+ * file:        pam_aurora_smtp.c
+ * description: Aurora SMTP client sending several emails per session
+ *              (aurora-flusher)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+#include "pam_aurora_smtp.h"
+
+
+/* The replies expected from the server */
+#define PAM_AURORA_SMTP_REPLY_RSET 0
+#define PAM_AURORA_SMTP_REPLY_MAIL 1
+#define PAM_AURORA_SMTP_REPLY_RCPT 2
+#define PAM_AURORA_SMTP_REPLY_DATA 3
+#define PAM_AURORA_SMTP_REPLY_END 4
+#define PAM_AURORA_SMTP_REPLY_DISCARD 5
+
+/* The longest address sent */
+#define PAM_AURORA_SMTP_ADDRESS_MAX 512
+
+
+/**
+ * This function extracts the host and port of a mail server URL
+ * @param url The mail server URL
+ * @param host The host destination
+ * @param size The host destination size
+ * @param port The port destination (6 bytes)
+ * @param implicit_tls Whether the session starts with TLS (smtps)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_split(const char *url, char *host, size_t size, char *port,
+int *implicit_tls)
+{
+    /* The URL parts */
+    const char *authority = strstr(url, "://");
+    const char *end;
+    const char *at;
+    const char *colon;
+    size_t length;
+
+    *implicit_tls = authority != NULL && authority - url == 5
+        && strncmp(url, "smtps", 5) == 0;
+    strcpy(port, *implicit_tls? "465": "25");
+
+    authority = authority != NULL? authority + 3: url;
+    end = authority + strcspn(authority, "/?#");
+
+    /* Skip the user information */
+    if((at = memchr(authority, '@', (size_t) (end - authority))) != NULL)
+        authority = at + 1;
+
+    /* An IPv6 address is bracketed */
+    if(*authority == '[')
+    {
+        if((colon = memchr(authority, ']', (size_t) (end - authority)))
+            == NULL)
+            return -1;
+
+        authority++;
+        colon++;
+
+        if(colon != end && *colon != ':')
+            return -1;
+    }
+    else
+        colon = memchr(authority, ':', (size_t) (end - authority));
+
+    if(colon != NULL && colon != end && *colon == ':')
+    {
+        if(end - colon - 1 < 1 || end - colon - 1 > 5)
+            return -1;
+
+        memcpy(port, colon + 1, (size_t) (end - colon - 1));
+        port[end - colon - 1] = '\0';
+        end = colon;
+    }
+
+    if(end > authority && end[-1] == ']')
+        end--;
+
+    if((length = (size_t) (end - authority)) == 0 || length >= size)
+        return -1;
+
+    memcpy(host, authority, length);
+    host[length] = '\0';
+
+    return 0;
+}
+
+
+/**
+ * This function connects to a mail server, trying its addresses in turn
+ * @param host The mail server host
+ * @param port The mail server port
+ * @param timeout The connection and IO timeout (milliseconds)
+ * @return The connected socket, or -1 on error
+ */
+static int
+pam_smtp_connect(const char *host, const char *port, int timeout)
+{
+    /* The resolver answer */
+    struct addrinfo hints;
+    struct addrinfo *answer;
+    struct addrinfo *entry;
+
+    /* The connection */
+    struct pollfd connection;
+    struct timeval io_timeout;
+    socklen_t error_length;
+    int error;
+    int fd = -1;
+    int on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    if(getaddrinfo(host, port, &hints, &answer) != 0)
+        return -1;
+
+    for(entry = answer; entry != NULL; entry = entry->ai_next)
+    {
+        if((fd = socket(entry->ai_family, entry->ai_socktype | SOCK_NONBLOCK
+            | SOCK_CLOEXEC, entry->ai_protocol)) < 0)
+            continue;
+
+        /* Connect within the timeout */
+        connection.fd = fd;
+        connection.events = POLLOUT;
+        error = 0;
+        error_length = sizeof(error);
+
+        if((connect(fd, entry->ai_addr, entry->ai_addrlen) == 0
+            || (errno == EINPROGRESS && poll(&connection, 1, timeout) == 1
+                && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error,
+                    &error_length) == 0 && error == 0))
+            && fcntl(fd, F_SETFL, 0) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(answer);
+
+    if(fd < 0)
+        return -1;
+
+    /* Bound every read and write, and send the pipelined commands at once */
+    io_timeout.tv_sec = timeout / 1000;
+    io_timeout.tv_usec = (timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+
+/**
+ * This function secures the session, verifying the server certificate
+ * @param smtp The session
+ * @param config The module configuration
+ * @param host The mail server host
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_tls(struct pam_smtp *smtp, const struct pam_aurora_config *config,
+const char *host)
+{
+    /* An address is not a server name */
+    struct in6_addr address;
+    int literal = inet_pton(AF_INET, host, &address) == 1
+        || inet_pton(AF_INET6, host, &address) == 1;
+
+    if((smtp->ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+        return -1;
+
+    SSL_CTX_set_verify(smtp->ssl_ctx, SSL_VERIFY_PEER, NULL);
+
+    if((config->mail_server_cainfo != NULL? SSL_CTX_load_verify_locations(
+        smtp->ssl_ctx, config->mail_server_cainfo, NULL):
+        SSL_CTX_set_default_verify_paths(smtp->ssl_ctx)) != 1
+        || (smtp->ssl = SSL_new(smtp->ssl_ctx)) == NULL
+        || SSL_set_fd(smtp->ssl, smtp->fd) != 1)
+        return -1;
+
+    if(literal)
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(smtp->ssl), host);
+    else if(SSL_set_tlsext_host_name(smtp->ssl, host) != 1
+        || SSL_set1_host(smtp->ssl, host) != 1)
+        return -1;
+
+    return SSL_connect(smtp->ssl) == 1? 0: -1;
+}
+
+
+/**
+ * This function sends the output buffer
+ * @param smtp The session
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_flush(struct pam_smtp *smtp)
+{
+    /* The bytes sent */
+    size_t offset = 0;
+    ssize_t written;
+
+    while(offset < smtp->output_length)
+    {
+        if(smtp->ssl != NULL)
+            written = SSL_write(smtp->ssl, smtp->output + offset,
+                (int) (smtp->output_length - offset));
+        else
+            written = send(smtp->fd, smtp->output + offset,
+                smtp->output_length - offset, MSG_NOSIGNAL);
+
+        if(written <= 0)
+            return -1;
+
+        offset += (size_t) written;
+    }
+
+    smtp->output_length = 0;
+
+    return 0;
+}
+
+
+/**
+ * This function reads a reply line
+ * @param smtp The session
+ * @param line The line destination (CRLF removed, truncated)
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_line(struct pam_smtp *smtp, char *line)
+{
+    /* The line end */
+    char *end;
+    size_t length;
+    ssize_t received;
+
+    while((end = memchr(smtp->input + smtp->input_start, '\n',
+        smtp->input_end - smtp->input_start)) == NULL)
+    {
+        /* A line longer than the buffer is cut */
+        if(smtp->input_start == 0 && smtp->input_end == sizeof(smtp->input))
+            smtp->input_end = 0;
+
+        /* Make room */
+        memmove(smtp->input, smtp->input + smtp->input_start,
+            smtp->input_end - smtp->input_start);
+        smtp->input_end -= smtp->input_start;
+        smtp->input_start = 0;
+
+        if(smtp->ssl != NULL)
+            received = SSL_read(smtp->ssl, smtp->input + smtp->input_end,
+                (int) (sizeof(smtp->input) - smtp->input_end));
+        else
+            received = recv(smtp->fd, smtp->input + smtp->input_end,
+                sizeof(smtp->input) - smtp->input_end, 0);
+
+        if(received <= 0)
+            return -1;
+
+        smtp->input_end += (size_t) received;
+    }
+
+    length = (size_t) (end - smtp->input - smtp->input_start);
+
+    if(length > 0 && end[-1] == '\r')
+        length--;
+
+    if(length >= PAM_AURORA_SMTP_LINE_MAX)
+        length = PAM_AURORA_SMTP_LINE_MAX - 1;
+
+    memcpy(line, smtp->input + smtp->input_start, length);
+    line[length] = '\0';
+    smtp->input_start = (size_t) (end - smtp->input) + 1;
+
+    return 0;
+}
+
+
+/**
+ * This function reads a reply, possibly multiline
+ * @param smtp The session
+ * @param ehlo Whether the reply lists the server extensions
+ * @return The reply code, or -1 on error
+ */
+static int
+pam_smtp_reply(struct pam_smtp *smtp, int ehlo)
+{
+    /* The reply line */
+    char line[PAM_AURORA_SMTP_LINE_MAX];
+    const char *extension;
+    int code;
+
+    while(1)
+    {
+        if(pam_smtp_line(smtp, line) != 0 || strlen(line) < 3
+            || (code = atoi(line)) < 200 || code > 599)
+            return -1;
+
+        /* The extensions follow the greeting line */
+        extension = line + 4;
+
+        if(ehlo && line[3] != '\0' && code == 250)
+        {
+            if(strcasecmp(extension, "PIPELINING") == 0)
+                smtp->pipelining = 1;
+            else if(strcasecmp(extension, "STARTTLS") == 0)
+                smtp->starttls = 1;
+            else if((strncasecmp(extension, "AUTH ", 5) == 0
+                || strncasecmp(extension, "AUTH=", 5) == 0)
+                && strcasestr(extension + 4, "PLAIN") != NULL)
+                smtp->auth_plain = 1;
+        }
+
+        /* The last line */
+        if(line[3] != '-')
+            return code;
+    }
+}
+
+
+/**
+ * This function queues bytes to send
+ * @param smtp The session
+ * @param data The bytes
+ * @param length The bytes count
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_queue(struct pam_smtp *smtp, const char *data, size_t length)
+{
+    if(length > sizeof(smtp->output) - smtp->output_length
+        && pam_smtp_flush(smtp) != 0)
+        return -1;
+
+    if(length > sizeof(smtp->output))
+        return -1;
+
+    memcpy(smtp->output + smtp->output_length, data, length);
+    smtp->output_length += length;
+
+    return 0;
+}
+
+
+/**
+ * This function sends a command and reads its reply (session setup)
+ * @param smtp The session
+ * @param ehlo Whether the reply lists the server extensions
+ * @param format The command format
+ * @return The reply code, or -1 on error
+ */
+static int
+pam_smtp_exchange(struct pam_smtp *smtp, int ehlo, const char *format, ...)
+{
+    /* The command */
+    char command[PAM_AURORA_SMTP_LINE_MAX];
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(command, sizeof(command), format, arguments);
+    va_end(arguments);
+
+    if(length < 0 || length >= (int) sizeof(command)
+        || pam_smtp_queue(smtp, command, (size_t) length) != 0
+        || pam_smtp_flush(smtp) != 0)
+        return -1;
+
+    return pam_smtp_reply(smtp, ehlo);
+}
+
+
+/**
+ * This function greets the server and reads its extensions
+ * @param smtp The session
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_ehlo(struct pam_smtp *smtp)
+{
+    /* The client name */
+    char name[256];
+
+    if(gethostname(name, sizeof(name)) != 0 || name[0] == '\0')
+        strcpy(name, "localhost");
+
+    name[sizeof(name) - 1] = '\0';
+
+    smtp->pipelining = 0;
+    smtp->starttls = 0;
+    smtp->auth_plain = 0;
+
+    return pam_smtp_exchange(smtp, 1, "EHLO %s\r\n", name) == 250? 0: -1;
+}
+
+
+/**
+ * This function authenticates the session (AUTH PLAIN)
+ * @param smtp The session
+ * @param user The mail server user
+ * @param pass The mail server password
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_auth(struct pam_smtp *smtp, const char *user, const char *pass)
+{
+    /* The credentials, and their encoding */
+    unsigned char credentials[PAM_AURORA_SMTP_ADDRESS_MAX];
+    unsigned char encoded[PAM_AURORA_SMTP_ADDRESS_MAX / 3 * 4 + 4];
+    size_t user_length = strlen(user);
+    size_t pass_length = strlen(pass);
+    int status;
+
+    if(user_length + pass_length + 2 > sizeof(credentials))
+        return -1;
+
+    /* Authorization identity (none), user and password */
+    credentials[0] = '\0';
+    memcpy(credentials + 1, user, user_length);
+    credentials[user_length + 1] = '\0';
+    memcpy(credentials + user_length + 2, pass, pass_length);
+
+    EVP_EncodeBlock(encoded, credentials, (int) (user_length + pass_length
+        + 2));
+
+    status = pam_smtp_exchange(smtp, 0, "AUTH PLAIN %s\r\n", encoded) == 235?
+        0: -1;
+
+    /* Erase the password */
+    memset(credentials, 0, sizeof(credentials));
+    memset(encoded, 0, sizeof(encoded));
+
+    return status;
+}
+
+
+/**
+ * This function opens an SMTP session: it connects, secures and
+ * authenticates as the module configuration requires
+ * @param smtp The session destination
+ * @param config The module configuration
+ * @param url The mail server URL
+ * @param timeout The connection and replies timeout (milliseconds)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_smtp_open(struct pam_smtp *smtp, const struct pam_aurora_config *config,
+const char *url, int timeout)
+{
+    /* The mail server */
+    char host[256];
+    char port[6];
+    int implicit_tls;
+
+    memset(smtp, 0, offsetof(struct pam_smtp, input));
+    smtp->output_length = 0;
+    smtp->fd = -1;
+    smtp->accepted = -1;
+
+    if(pam_smtp_split(url, host, sizeof(host), port, &implicit_tls) != 0
+        || (smtp->fd = pam_smtp_connect(host, port, timeout)) < 0)
+        return -1;
+
+    /* Secure the session, from the start or once greeted */
+    if((implicit_tls && pam_smtp_tls(smtp, config, host) != 0)
+        || pam_smtp_reply(smtp, 0) != 220 || pam_smtp_ehlo(smtp) != 0)
+    {
+        pam_smtp_close(smtp, 0);
+        return -1;
+    }
+
+    if(! implicit_tls && config->mail_server_tls
+        && (! smtp->starttls || pam_smtp_exchange(smtp, 0, "STARTTLS\r\n")
+            != 220 || smtp->input_start != smtp->input_end
+            || pam_smtp_tls(smtp, config, host) != 0
+            || pam_smtp_ehlo(smtp) != 0))
+    {
+        pam_smtp_close(smtp, 0);
+        return -1;
+    }
+
+    /* Authenticate */
+    if(config->mail_server_user != NULL && config->mail_server_pass != NULL
+        && (! smtp->auth_plain || pam_smtp_auth(smtp,
+            config->mail_server_user, config->mail_server_pass) != 0))
+    {
+        pam_smtp_close(smtp, 0);
+        return -1;
+    }
+
+    /* Session ready */
+    return 0;
+}
+
+
+/**
+ * This function reads the replies expected, in order
+ * @param smtp The session
+ * @param emails The emails of the session
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_collect(struct pam_smtp *smtp, struct pam_smtp_email *emails)
+{
+    /* The reply */
+    struct pam_smtp_email *email;
+    int code;
+    int i;
+
+    for(i = 0; i < smtp->expected_count; i++)
+    {
+        if((code = pam_smtp_reply(smtp, 0)) < 0)
+            return -1;
+
+        email = &emails[smtp->expected_email[i]];
+
+        switch(smtp->expected[i])
+        {
+            case PAM_AURORA_SMTP_REPLY_MAIL:
+            case PAM_AURORA_SMTP_REPLY_RCPT:
+                /* The first failure of the transaction is kept */
+                if(code / 100 != 2 && email->status == 0)
+                    email->status = code;
+                break;
+
+            case PAM_AURORA_SMTP_REPLY_DATA:
+                if(code == 354)
+                    smtp->accepted = smtp->expected_email[i];
+                else if(email->status == 0)
+                    email->status = code;
+                break;
+
+            case PAM_AURORA_SMTP_REPLY_END:
+                email->status = code;
+                break;
+        }
+    }
+
+    smtp->expected_count = 0;
+
+    return 0;
+}
+
+
+/**
+ * This function queues a command of a transaction, and sends it at once
+ * unless the server supports pipelining
+ * @param smtp The session
+ * @param emails The emails of the session
+ * @param reply The reply expected (PAM_AURORA_SMTP_REPLY_*)
+ * @param email The email of the transaction
+ * @param format The command format
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_command(struct pam_smtp *smtp, struct pam_smtp_email *emails,
+int reply, int email, const char *format, ...)
+{
+    /* The command */
+    char command[PAM_AURORA_SMTP_ADDRESS_MAX + 32];
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(command, sizeof(command), format, arguments);
+    va_end(arguments);
+
+    if(length < 0 || length >= (int) sizeof(command)
+        || pam_smtp_queue(smtp, command, (size_t) length) != 0)
+        return -1;
+
+    smtp->expected[smtp->expected_count] = reply;
+    smtp->expected_email[smtp->expected_count] = email;
+    smtp->expected_count++;
+
+    /* Without pipelining, each command waits for its reply */
+    if(! smtp->pipelining && (pam_smtp_flush(smtp) != 0
+        || pam_smtp_collect(smtp, emails) != 0))
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * This function queues an email data, dot-stuffed
+ * @param smtp The session
+ * @param email The email
+ * @return 0 on success, -1 otherwise
+ */
+static int
+pam_smtp_data(struct pam_smtp *smtp, const struct pam_smtp_email *email)
+{
+    /* The email lines */
+    const char *cursor = email->data;
+    const char *end = email->data + email->length;
+    const char *line_end;
+    size_t length;
+
+    while(cursor < end)
+    {
+        /* A line starting with a dot gets another one */
+        if(*cursor == '.' && pam_smtp_queue(smtp, ".", 1) != 0)
+            return -1;
+
+        line_end = memchr(cursor, '\n', (size_t) (end - cursor));
+        length = line_end != NULL? (size_t) (line_end - cursor) + 1:
+            (size_t) (end - cursor);
+
+        if(pam_smtp_queue(smtp, cursor, length) != 0)
+            return -1;
+
+        cursor += length;
+    }
+
+    /* The data ends with a CRLF */
+    if(email->length > 0 && end[-1] != '\n'
+        && pam_smtp_queue(smtp, "\r\n", 2) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * This function sends emails in a session, one transaction each, pipelined
+ * when the server supports it
+ *
+ * With pipelining, the data of an email leaves in the same packet as the
+ * envelope of the next one, so a transaction costs a single round trip.
+ * @param smtp The session
+ * @param emails The emails (their status is set)
+ * @param count The emails count
+ * @return 0 when the session is still usable, -1 otherwise
+ */
+int
+pam_smtp_send(struct pam_smtp *smtp, struct pam_smtp_email *emails,
+int count)
+{
+    /* The transaction to reset */
+    int reset = 0;
+    int i;
+
+    for(i = 0; i < count; i++)
+        emails[i].status = 0;
+
+    for(i = 0; i < count; i++)
+    {
+        /* An address too long is rejected here */
+        if(strlen(emails[i].from) > PAM_AURORA_SMTP_ADDRESS_MAX - 16
+            || strlen(emails[i].to) > PAM_AURORA_SMTP_ADDRESS_MAX - 16)
+        {
+            emails[i].status = 501;
+            continue;
+        }
+
+        /* The envelope, with the data of the previous email */
+        if((reset && pam_smtp_command(smtp, emails,
+                PAM_AURORA_SMTP_REPLY_RSET, i, "RSET\r\n") != 0)
+            || pam_smtp_command(smtp, emails, PAM_AURORA_SMTP_REPLY_MAIL, i,
+                "MAIL FROM:<%s>\r\n", emails[i].from) != 0
+            || pam_smtp_command(smtp, emails, PAM_AURORA_SMTP_REPLY_RCPT, i,
+                "RCPT TO:<%s>\r\n", emails[i].to) != 0
+            || pam_smtp_command(smtp, emails, PAM_AURORA_SMTP_REPLY_DATA, i,
+                "DATA\r\n") != 0
+            || pam_smtp_flush(smtp) != 0
+            || pam_smtp_collect(smtp, emails) != 0)
+            return -1;
+
+        reset = 0;
+
+        /* The envelope has been refused */
+        if(smtp->accepted != i)
+        {
+            reset = 1;
+            continue;
+        }
+
+        smtp->accepted = -1;
+
+        /* The data, ended by a dot; a server accepting the data of a
+           refused envelope gets an empty email */
+        if(emails[i].status == 0)
+        {
+            if(pam_smtp_data(smtp, &emails[i]) != 0
+                || pam_smtp_command(smtp, emails, PAM_AURORA_SMTP_REPLY_END,
+                    i, ".\r\n") != 0)
+                return -1;
+        }
+        else if(pam_smtp_command(smtp, emails, PAM_AURORA_SMTP_REPLY_DISCARD,
+            i, ".\r\n") != 0)
+            return -1;
+    }
+
+    /* The data of the last email */
+    if(pam_smtp_flush(smtp) != 0 || pam_smtp_collect(smtp, emails) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * This function closes an SMTP session
+ * @param smtp The session
+ * @param quit Whether to say goodbye to the server
+ */
+void
+pam_smtp_close(struct pam_smtp *smtp, int quit)
+{
+    if(quit && smtp->fd >= 0)
+        pam_smtp_exchange(smtp, 0, "QUIT\r\n");
+
+    /* Free memory */
+    if(smtp->ssl != NULL)
+        SSL_free(smtp->ssl);
+    if(smtp->ssl_ctx != NULL)
+        SSL_CTX_free(smtp->ssl_ctx);
+    if(smtp->fd >= 0)
+        close(smtp->fd);
+
+    smtp->ssl = NULL;
+    smtp->ssl_ctx = NULL;
+    smtp->fd = -1;
+}
@@ -0,0 +1,113 @@
+/**
+ * file:        pam_aurora_smtp.h
+ * description: Aurora SMTP client sending several emails per session
+ *              (aurora-flusher)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_SMTP_H
+#define PAM_AURORA_SMTP_H
+
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_mail.h"
+
+
+/* The largest reply line kept */
+#define PAM_AURORA_SMTP_LINE_MAX 1024
+
+/* The replies expected at once: a whole transaction, the end of the
+   previous one and a reset */
+#define PAM_AURORA_SMTP_EXPECTED 8
+
+
+/**
+ * An email to send in a session
+ **/
+struct pam_smtp_email
+{
+    /* The envelope */
+    const char *from;
+    const char *to;
+
+    /* The email (CRLF lines) */
+    const char *data;
+    size_t length;
+
+    /* The final reply code (2xx delivered, 4xx to retry, 5xx rejected, 0
+       when unknown) */
+    int status;
+};
+
+
+/**
+ * An SMTP session
+ **/
+struct pam_smtp
+{
+    /* The connection, and its TLS layer (NULL when clear) */
+    int fd;
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+
+    /* The server extensions */
+    int pipelining;
+    int starttls;
+    int auth_plain;
+
+    /* The replies expected, in order, and the email each one is for */
+    int expected[PAM_AURORA_SMTP_EXPECTED];
+    int expected_email[PAM_AURORA_SMTP_EXPECTED];
+    int expected_count;
+
+    /* The email whose DATA command has been accepted (-1 when none) */
+    int accepted;
+
+    /* The input buffer */
+    size_t input_start;
+    size_t input_end;
+    char input[4096];
+
+    /* The output buffer (an email doubles at most when dot-stuffed) */
+    size_t output_length;
+    char output[2 * PAM_AURORA_MESSAGE_MAX + 4096];
+};
+
+
+/**
+ * This function opens an SMTP session: it connects, secures and
+ * authenticates as the module configuration requires
+ * @param smtp The session destination
+ * @param config The module configuration
+ * @param url The mail server URL
+ * @param timeout The connection and replies timeout (milliseconds)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_smtp_open(struct pam_smtp *smtp, const struct pam_aurora_config *config,
+const char *url, int timeout);
+
+
+/**
+ * This function sends emails in a session, one transaction each, pipelined
+ * when the server supports it
+ * @param smtp The session
+ * @param emails The emails (their status is set)
+ * @param count The emails count
+ * @return 0 when the session is still usable, -1 otherwise
+ */
+int
+pam_smtp_send(struct pam_smtp *smtp, struct pam_smtp_email *emails,
+int count);
+
+
+/**
+ * This function closes an SMTP session
+ * @param smtp The session
+ * @param quit Whether to say goodbye to the server
+ */
+void
+pam_smtp_close(struct pam_smtp *smtp, int quit);
+
+#endif
@@ -0,0 +1,325 @@
+/**
+ * file:        pam_aurora_spool.c
+ * description: Aurora outbound spool, drained by aurora-flusher
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "pam_aurora_shm.h"
+#include "pam_aurora_spool.h"
+
+
+/**
+ * This function opens a spool subdirectory, creating it on first use
+ * @param spool_fd The spool directory
+ * @param name The subdirectory name
+ * @return The subdirectory descriptor, or -1 on error
+ */
+static int
+pam_spool_subdir(int spool_fd, const char *name)
+{
+    /* The subdirectory */
+    int dir_fd;
+
+    if((dir_fd = openat(spool_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+        < 0 && errno == ENOENT && mkdirat(spool_fd, name, 0700) == 0)
+        dir_fd = openat(spool_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    return dir_fd;
+}
+
+
+/**
+ * This function syncs the spool, once for every message written by the
+ * processes waiting for it (group commit)
+ * @param config The module configuration
+ * @param spool_fd The spool directory
+ * @param deadline The time to give up by (see pam_mail_now, 0 for none)
+ * @return 0 once the message written is durable, -1 otherwise
+ */
+static int
+pam_spool_commit(const struct pam_aurora_config *config, int spool_fd,
+int64_t deadline)
+{
+    /* The group commit state */
+    struct pam_shm shm;
+    struct pam_spool_state *state;
+    char path[4096];
+    uint64_t ticket;
+    uint64_t target;
+    uint32_t generation;
+    int32_t pid = (int32_t) getpid();
+    int32_t leader;
+    int status = -1;
+
+    /* The wait */
+    struct timespec wait;
+    int64_t remaining;
+
+    /* Without the shared state, sync alone */
+    if(pam_shm_path(config->state_dir, PAM_AURORA_SPOOL_FILE, path,
+        sizeof(path)) != 0
+        || pam_shm_map(&shm, path, PAM_AURORA_SPOOL_STATE_MAGIC,
+            PAM_AURORA_SPOOL_VERSION, sizeof(struct pam_spool_state)) != 0)
+        return syncfs(spool_fd);
+
+    state = shm.data;
+
+    /* The message is written: any sync started from now covers it */
+    ticket = __atomic_add_fetch(&state->written, 1, __ATOMIC_SEQ_CST);
+
+    while(1)
+    {
+        if(__atomic_load_n(&state->synced, __ATOMIC_ACQUIRE) >= ticket)
+        {
+            status = 0;
+            break;
+        }
+
+        remaining = PAM_AURORA_SPOOL_WAIT;
+
+        if(deadline != 0 && (remaining = deadline - pam_mail_now()) <= 0)
+            break;
+
+        /* Lead the next sync, or take over a leader that died */
+        leader = __atomic_load_n(&state->leader, __ATOMIC_ACQUIRE);
+
+        if((leader == 0 || (leader != pid && kill(leader, 0) != 0
+            && errno == ESRCH))
+            && __atomic_compare_exchange_n(&state->leader, &leader, pid, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            target = __atomic_load_n(&state->written, __ATOMIC_ACQUIRE);
+
+            if(syncfs(spool_fd) == 0
+                && __atomic_load_n(&state->synced, __ATOMIC_RELAXED) < target)
+                __atomic_store_n(&state->synced, target, __ATOMIC_RELEASE);
+
+            /* Wake the followers */
+            __atomic_store_n(&state->leader, 0, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&state->generation, 1, __ATOMIC_RELEASE);
+            syscall(SYS_futex, &state->generation, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+
+            /* A failed sync fails the whole group */
+            if(__atomic_load_n(&state->synced, __ATOMIC_ACQUIRE) < ticket)
+                break;
+
+            continue;
+        }
+
+        /* Follow: sleep until the next sync ends */
+        generation = __atomic_load_n(&state->generation, __ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&state->synced, __ATOMIC_ACQUIRE) >= ticket)
+            continue;
+
+        if(remaining > PAM_AURORA_SPOOL_WAIT)
+            remaining = PAM_AURORA_SPOOL_WAIT;
+
+        wait.tv_sec = 0;
+        wait.tv_nsec = (long) remaining * 1000000;
+        syscall(SYS_futex, &state->generation, FUTEX_WAIT, generation, &wait,
+            NULL, 0);
+    }
+
+    /* Properly unmap the state */
+    pam_shm_unmap(&shm);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function renders an email into the spool, durably, for aurora-flusher
+ * to deliver it
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the message must be durable by (see
+ *        pam_mail_now, 0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_spool_submit(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline)
+{
+    /* The message file */
+    char header[PAM_AURORA_SPOOL_MESSAGE_MAX - PAM_AURORA_MESSAGE_MAX];
+    char email[PAM_AURORA_MESSAGE_MAX];
+    size_t email_length;
+    struct iovec message[2];
+    int header_length;
+    struct timespec now;
+    char name[PAM_AURORA_SPOOL_NAME_MAX];
+
+    /* The spool */
+    int spool_fd;
+    int tmp_fd = -1;
+    int new_fd = -1;
+    int message_fd;
+    int status = -1;
+
+    /* The envelope is one line each */
+    if(strpbrk(email_ctx->from, "\r\n") != NULL
+        || strpbrk(email_ctx->to, "\r\n") != NULL)
+        return -1;
+
+    /* Render the email */
+    if((email_length = pam_mail_render(config->mail_template, email_ctx,
+        email, sizeof(email))) == 0)
+        return -1;
+
+    /* The header holds the length of the rest, so a torn file is detected */
+    header_length = snprintf(header, sizeof(header), "%s %zu\n%s\n%s\n",
+        PAM_AURORA_SPOOL_MAGIC, strlen(email_ctx->from)
+            + strlen(email_ctx->to) + 2 + email_length, email_ctx->from,
+        email_ctx->to);
+
+    if(header_length < 0 || header_length >= (int) sizeof(header))
+        return -1;
+
+    message[0].iov_base = header;
+    message[0].iov_len = (size_t) header_length;
+    message[1].iov_base = email;
+    message[1].iov_len = email_length;
+
+    /* Names sort by queuing time */
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(name, sizeof(name), "%010lld.%06ld.%d.%s",
+        (long long) now.tv_sec, now.tv_nsec / 1000, (int) getpid(),
+        email_ctx->uuid);
+
+    /* Open the spool, creating it on first use */
+    if((spool_fd = open(config->spool_dir, O_RDONLY | O_DIRECTORY
+        | O_CLOEXEC)) < 0 && errno == ENOENT
+        && mkdir(config->spool_dir, 0700) == 0)
+        spool_fd = open(config->spool_dir, O_RDONLY | O_DIRECTORY
+            | O_CLOEXEC);
+
+    if(spool_fd < 0)
+        return -1;
+
+    if((tmp_fd = pam_spool_subdir(spool_fd, PAM_AURORA_SPOOL_TMP)) < 0
+        || (new_fd = pam_spool_subdir(spool_fd, PAM_AURORA_SPOOL_NEW)) < 0)
+        goto pam_spool_submit_close;
+
+    /* Write the message aside, then publish it at once */
+    if((message_fd = openat(tmp_fd, name, O_WRONLY | O_CREAT | O_EXCL
+        | O_CLOEXEC | O_NOFOLLOW, 0600)) < 0)
+        goto pam_spool_submit_close;
+
+    if(writev(message_fd, message, 2) != (ssize_t) (header_length
+        + email_length))
+    {
+        close(message_fd);
+        unlinkat(tmp_fd, name, 0);
+        goto pam_spool_submit_close;
+    }
+
+    close(message_fd);
+
+    if(renameat(tmp_fd, name, new_fd, name) != 0)
+    {
+        unlinkat(tmp_fd, name, 0);
+        goto pam_spool_submit_close;
+    }
+
+    /* Wait for the message to be durable */
+    if((status = pam_spool_commit(config, spool_fd, deadline)) != 0)
+        unlinkat(new_fd, name, 0);
+
+pam_spool_submit_close:
+    /* Properly close the spool */
+    if(tmp_fd >= 0)
+        close(tmp_fd);
+    if(new_fd >= 0)
+        close(new_fd);
+    close(spool_fd);
+
+    /* Return status */
+    return status;
+}
+
+
+/**
+ * This function loads a spooled message
+ * @param new_fd The spool new directory
+ * @param name The message name
+ * @param message The message destination
+ * @return 0 on success, -1 when the message is missing or torn
+ */
+int
+pam_spool_load(int new_fd, const char *name,
+struct pam_spool_message *message)
+{
+    /* The message file */
+    int message_fd;
+    ssize_t length;
+    char *cursor;
+    char *end;
+    char *separator;
+    unsigned long long rest;
+
+    if(strlen(name) >= sizeof(message->name))
+        return -1;
+
+    strcpy(message->name, name);
+    message->queued = (int64_t) strtoll(name, NULL, 10);
+
+    if((message_fd = openat(new_fd, name, O_RDONLY | O_CLOEXEC
+        | O_NOFOLLOW)) < 0)
+        return -1;
+
+    length = read(message_fd, message->data, sizeof(message->data) - 1);
+    close(message_fd);
+
+    if(length <= (ssize_t) sizeof(PAM_AURORA_SPOOL_MAGIC)
+        || memcmp(message->data, PAM_AURORA_SPOOL_MAGIC " ",
+            sizeof(PAM_AURORA_SPOOL_MAGIC)) != 0)
+        return -1;
+
+    message->length = (size_t) length;
+    message->data[length] = '\0';
+    end = message->data + length;
+
+    /* Check the length of the rest */
+    rest = strtoull(message->data + sizeof(PAM_AURORA_SPOOL_MAGIC), &cursor,
+        10);
+
+    if(*cursor != '\n' || rest != (unsigned long long) (end - cursor - 1))
+        return -1;
+
+    /* Split the envelope */
+    message->from = ++cursor;
+
+    if((separator = memchr(cursor, '\n', (size_t) (end - cursor))) == NULL)
+        return -1;
+
+    *separator = '\0';
+    message->to = cursor = separator + 1;
+
+    if((separator = memchr(cursor, '\n', (size_t) (end - cursor))) == NULL)
+        return -1;
+
+    *separator = '\0';
+    message->email = separator + 1;
+    message->email_length = (size_t) (end - separator - 1);
+
+    /* Message loaded */
+    return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * file:        pam_aurora_spool.h
+ * description: Aurora outbound spool, drained by aurora-flusher
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_SPOOL_H
+#define PAM_AURORA_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pam_aurora_config.h"
+#include "pam_aurora_mail.h"
+
+
+/* The default spool directory */
+#define PAM_AURORA_SPOOL_DIR "/var/spool/aurora"
+
+/* The spool subdirectories: messages being written, and queued messages */
+#define PAM_AURORA_SPOOL_TMP "tmp"
+#define PAM_AURORA_SPOOL_NEW "new"
+
+/* The spooled message magic, heading the file */
+#define PAM_AURORA_SPOOL_MAGIC "AURSPL01"
+
+/* The longest spooled message name */
+#define PAM_AURORA_SPOOL_NAME_MAX 96
+
+/* The largest spooled message file (header, addresses and email) */
+#define PAM_AURORA_SPOOL_MESSAGE_MAX (PAM_AURORA_MESSAGE_MAX + 1024)
+
+/* The group commit state file */
+#define PAM_AURORA_SPOOL_FILE "spool.db"
+#define PAM_AURORA_SPOOL_STATE_MAGIC "AURSPQ01"
+#define PAM_AURORA_SPOOL_VERSION 1
+
+/* The longest wait for the group commit before checking its leader
+   (milliseconds) */
+#define PAM_AURORA_SPOOL_WAIT 100
+
+
+/**
+ * The group commit of the spool
+ *
+ * Each process writes its message then takes a ticket. One of them, the
+ * leader, syncs the spool file system once for every ticket taken so far,
+ * while the others sleep on the generation (a futex shared through the
+ * mapping) until a sync covers their ticket: a login storm costs a few
+ * syncs rather than one per code.
+ **/
+struct pam_spool_state
+{
+    /* The sync generation, bumped and woken after each sync */
+    uint32_t generation;
+
+    /* The process syncing the spool (0 when none) */
+    int32_t leader;
+
+    /* The tickets taken, and the last ticket covered by a sync */
+    uint64_t written;
+    uint64_t synced;
+};
+
+
+/**
+ * A spooled message
+ **/
+struct pam_spool_message
+{
+    /* The message name, in the spool new directory */
+    char name[PAM_AURORA_SPOOL_NAME_MAX];
+
+    /* The envelope and the email, in the message data */
+    const char *from;
+    const char *to;
+    const char *email;
+    size_t email_length;
+
+    /* The queuing time (seconds since the epoch) */
+    int64_t queued;
+
+    /* The message file */
+    size_t length;
+    char data[PAM_AURORA_SPOOL_MESSAGE_MAX];
+};
+
+
+/**
+ * This function renders an email into the spool, durably, for aurora-flusher
+ * to deliver it
+ * @param config The module configuration
+ * @param email_ctx The email context
+ * @param deadline The time the message must be durable by (see
+ *        pam_mail_now, 0 for none)
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_spool_submit(const struct pam_aurora_config *config,
+const struct pam_email_ctx *email_ctx, int64_t deadline);
+
+
+/**
+ * This function loads a spooled message
+ * @param new_fd The spool new directory
+ * @param name The message name
+ * @param message The message destination
+ * @return 0 on success, -1 when the message is missing or torn
+ */
+int
+pam_spool_load(int new_fd, const char *name,
+struct pam_spool_message *message);
+
+#endif
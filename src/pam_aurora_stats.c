@@ -0,0 +1,165 @@
+/**
+ * file:        pam_aurora_stats.c
+ * description: Aurora shared counters and latency histograms (aurora-stat)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <time.h>
+#include "pam_aurora_stats.h"
+
+
+/**
+ * This function returns the monotonic time of the statistics
+ * @return The time in microseconds
+ */
+uint64_t
+pam_stats_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/**
+ * This function starts the statistics of an authentication
+ * @param stats The statistics
+ */
+void
+pam_stats_start(struct pam_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->start = pam_stats_now();
+}
+
+
+/**
+ * This function records a code delivery
+ * @param stats The statistics
+ * @param delivered Whether the code has been delivered
+ * @param start The delivery start (see pam_stats_now)
+ */
+void
+pam_stats_delivered(struct pam_stats *stats, int delivered, uint64_t start)
+{
+    /* A delivery lasts 1 microsecond at least: 0 is not measured */
+    uint64_t latency = pam_stats_now() - start;
+
+    stats->counters[delivered? PAM_AURORA_STAT_DELIVERIES: 
+        PAM_AURORA_STAT_DELIVERY_FAILURES]++;
+    stats->latencies[PAM_AURORA_HISTOGRAM_DELIVERY] = latency > 0? latency: 1;
+}
+
+
+/**
+ * This function maps the shared table
+ * @param shm The mapping destination
+ * @param state_dir The state directory
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_stats_open(struct pam_shm *shm, const char *state_dir)
+{
+    /* The table path */
+    char path[4096];
+    struct pam_stats_table *table;
+    int64_t created = 0;
+
+    if(pam_shm_path(state_dir, PAM_AURORA_STATS_FILE, path, sizeof(path))
+        != 0 || pam_shm_map(shm, path, PAM_AURORA_STATS_MAGIC,
+            PAM_AURORA_STATS_VERSION, sizeof(struct pam_stats_table)) != 0)
+        return -1;
+
+    /* Date a new table (the first process to see it does) */
+    table = shm->data;
+    __atomic_compare_exchange_n(&table->created, &created,
+        (int64_t) time(NULL), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+
+/**
+ * This function adds a latency to a histogram
+ * @param histogram The shared histogram
+ * @param latency The latency (microseconds)
+ */
+static void
+pam_stats_histogram_add(struct pam_stats_histogram *histogram,
+uint64_t latency)
+{
+    /* The bucket: the latencies below the next power of two */
+    int bucket = latency > 0? 64 - __builtin_clzll(latency): 0;
+
+    if(bucket >= PAM_AURORA_HISTOGRAM_BUCKETS)
+        bucket = PAM_AURORA_HISTOGRAM_BUCKETS - 1;
+
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, latency, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * This function adds the statistics of an authentication to the shared
+ * table
+ * @param stats The statistics
+ * @param state_dir The state directory
+ */
+void
+pam_stats_commit(const struct pam_stats *stats, const char *state_dir)
+{
+    /* The shared table */
+    struct pam_shm shm;
+    struct pam_stats_table *table;
+    int error = stats->smtp_error;
+    int i;
+
+    if(pam_stats_open(&shm, state_dir) != 0)
+        return;
+
+    table = shm.data;
+
+    for(i = 0; i < PAM_AURORA_STAT_COUNT; i++)
+        if(stats->counters[i] != 0)
+            __atomic_add_fetch(&table->counters[i], stats->counters[i],
+                __ATOMIC_RELAXED);
+
+    if(error != 0)
+    {
+        if(error < 0 || error >= PAM_AURORA_STATS_CURL_CODES)
+            error = PAM_AURORA_STATS_CURL_CODES - 1;
+
+        __atomic_add_fetch(&table->smtp_errors[error], 1, __ATOMIC_RELAXED);
+    }
+
+    for(i = 0; i < PAM_AURORA_HISTOGRAM_COUNT; i++)
+        if(stats->latencies[i] != 0)
+            pam_stats_histogram_add(&table->histograms[i],
+                stats->latencies[i]);
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+}
+
+
+/**
+ * This function reads the shared table
+ * @param shm The table mapping
+ * @param table The table copy destination
+ */
+void
+pam_stats_read(const struct pam_shm *shm, struct pam_stats_table *table)
+{
+    /* The shared fields, read one by one */
+    const uint64_t *source = shm->data;
+    uint64_t *copy = (uint64_t *) table;
+    size_t i;
+
+    for(i = 0; i < sizeof(*table) / sizeof(uint64_t); i++)
+        copy[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,159 @@
+/**
+ * file:        pam_aurora_stats.h
+ * description: Aurora shared counters and latency histograms (aurora-stat)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_STATS_H
+#define PAM_AURORA_STATS_H
+
+#include <stdint.h>
+#include "pam_aurora_shm.h"
+
+
+/* The statistics state file */
+#define PAM_AURORA_STATS_FILE "stats.db"
+#define PAM_AURORA_STATS_MAGIC "AURSTA01"
+#define PAM_AURORA_STATS_VERSION 2
+
+/* The counters */
+#define PAM_AURORA_STAT_ATTEMPTS 0
+#define PAM_AURORA_STAT_SUCCESSES 1
+#define PAM_AURORA_STAT_FAILURES 2
+#define PAM_AURORA_STAT_TRUSTED 3
+#define PAM_AURORA_STAT_WRONG_CODES 4
+#define PAM_AURORA_STAT_EXPIRED_CODES 5
+#define PAM_AURORA_STAT_BYPASSES 6
+#define PAM_AURORA_STAT_DIRECTORY_MISSES 7
+#define PAM_AURORA_STAT_THROTTLED 8
+#define PAM_AURORA_STAT_DELIVERIES 9
+#define PAM_AURORA_STAT_DELIVERY_FAILURES 10
+#define PAM_AURORA_STAT_ADMIT_WAITS 11
+#define PAM_AURORA_STAT_ADMIT_OVERFLOWS 12
+#define PAM_AURORA_STAT_COUNT 13
+
+/* The latency histograms */
+#define PAM_AURORA_HISTOGRAM_LOGIN 0
+#define PAM_AURORA_HISTOGRAM_DELIVERY 1
+#define PAM_AURORA_HISTOGRAM_COUNT 2
+
+/* The histogram buckets: the bucket i counts the latencies below 2^i
+   microseconds, the last one every larger latency */
+#define PAM_AURORA_HISTOGRAM_BUCKETS 32
+
+/* The curl codes counted one by one (the larger ones share the last) */
+#define PAM_AURORA_STATS_CURL_CODES 128
+
+
+/**
+ * A latency histogram
+ **/
+struct pam_stats_histogram
+{
+    /* The latencies count and sum (microseconds) */
+    uint64_t count;
+    uint64_t sum;
+
+    /* The latencies by bucket */
+    uint64_t buckets[PAM_AURORA_HISTOGRAM_BUCKETS];
+};
+
+
+/**
+ * The statistics shared by every process
+ *
+ * The fields only grow, by atomic additions without a lock: a reader sees
+ * each one consistent, and computes rates from two readings.
+ **/
+struct pam_stats_table
+{
+    /* The table creation (seconds since the epoch) */
+    int64_t created;
+    int64_t reserved;
+
+    /* The counters */
+    uint64_t counters[PAM_AURORA_STAT_COUNT];
+
+    /* The failed SMTP deliveries, by curl code */
+    uint64_t smtp_errors[PAM_AURORA_STATS_CURL_CODES];
+
+    /* The latencies */
+    struct pam_stats_histogram histograms[PAM_AURORA_HISTOGRAM_COUNT];
+};
+
+
+/**
+ * The statistics of one authentication, gathered without touching the
+ * shared table, then committed at once
+ **/
+struct pam_stats
+{
+    /* The counters increments */
+    uint32_t counters[PAM_AURORA_STAT_COUNT];
+
+    /* The curl code of the failed SMTP delivery (0 when none) */
+    int smtp_error;
+
+    /* The latencies (microseconds, 0 when not measured) */
+    uint64_t latencies[PAM_AURORA_HISTOGRAM_COUNT];
+
+    /* The authentication start (microseconds) */
+    uint64_t start;
+};
+
+
+/**
+ * This function returns the monotonic time of the statistics
+ * @return The time in microseconds
+ */
+uint64_t
+pam_stats_now(void);
+
+
+/**
+ * This function starts the statistics of an authentication
+ * @param stats The statistics
+ */
+void
+pam_stats_start(struct pam_stats *stats);
+
+
+/**
+ * This function records a code delivery
+ * @param stats The statistics
+ * @param delivered Whether the code has been delivered
+ * @param start The delivery start (see pam_stats_now)
+ */
+void
+pam_stats_delivered(struct pam_stats *stats, int delivered, uint64_t start);
+
+
+/**
+ * This function adds the statistics of an authentication to the shared
+ * table
+ * @param stats The statistics
+ * @param state_dir The state directory
+ */
+void
+pam_stats_commit(const struct pam_stats *stats, const char *state_dir);
+
+
+/**
+ * This function maps the shared table
+ * @param shm The mapping destination
+ * @param state_dir The state directory
+ * @return 0 on success, -1 otherwise
+ */
+int
+pam_stats_open(struct pam_shm *shm, const char *state_dir);
+
+
+/**
+ * This function reads the shared table
+ * @param shm The table mapping
+ * @param table The table copy destination
+ */
+void
+pam_stats_read(const struct pam_shm *shm, struct pam_stats_table *table);
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * file:        pam_aurora_throttle.c
+ * description: Aurora code sending throttling (shared token buckets)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include "pam_aurora_shm.h"
+#include "pam_aurora_throttle.h"
+
+
+/* The bucket word layout */
+#define PAM_THROTTLE_TOKEN_BITS 20
+#define PAM_THROTTLE_TOKEN_MASK ((1ULL << PAM_THROTTLE_TOKEN_BITS) - 1)
+
+/* One token, in thousandths */
+#define PAM_THROTTLE_TOKEN 1000ULL
+
+
+/**
+ * This function returns the monotonic time
+ * @return The time in milliseconds
+ */
+static uint64_t
+pam_throttle_now(void)
+{
+    /* The current time */
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
+/**
+ * This function computes the tokens of a bucket word at a given time
+ * @param word The bucket word
+ * @param now The current time (milliseconds)
+ * @param rate The refill rate (tokens per hour)
+ * @param burst The bucket capacity (tokens)
+ * @return The available tokens (thousandths)
+ */
+static uint64_t
+pam_throttle_tokens(uint64_t word, uint64_t now, int rate, int burst)
+{
+    /* The bucket state */
+    uint64_t last = word >> PAM_THROTTLE_TOKEN_BITS;
+    uint64_t tokens = word & PAM_THROTTLE_TOKEN_MASK;
+    uint64_t capacity = (uint64_t) burst * PAM_THROTTLE_TOKEN;
+    uint64_t elapsed;
+
+    /* A new bucket, or a clock restart (the state survived a reboot) */
+    if(word == 0 || now < last)
+        return capacity;
+
+    /* Refill (rate tokens per 3600000 ms, in thousandths) */
+    elapsed = now - last;
+
+    if(elapsed >= 3600000ULL * (uint64_t) burst)
+        return capacity;
+
+    tokens += elapsed * (uint64_t) rate / 3600;
+
+    return tokens < capacity? tokens: capacity;
+}
+
+
+/**
+ * This function takes a token from a bucket
+ * @param bucket The bucket
+ * @param now The current time (milliseconds)
+ * @param rate The refill rate (tokens per hour, 0 for no limit)
+ * @param burst The bucket capacity (tokens)
+ * @return 0 when a token was taken, the time until the next token
+ *         (milliseconds) otherwise
+ */
+static uint64_t
+pam_throttle_take(uint64_t *bucket, uint64_t now, int rate, int burst)
+{
+    /* The bucket words */
+    uint64_t word;
+    uint64_t tokens;
+
+    if(rate == 0)
+        return 0;
+
+    word = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+
+    do
+    {
+        /* Not enough tokens: tell when the next one comes */
+        if((tokens = pam_throttle_tokens(word, now, rate, burst))
+            < PAM_THROTTLE_TOKEN)
+            return (PAM_THROTTLE_TOKEN - tokens) * 3600 / (uint64_t) rate + 1;
+    }
+    while(! __atomic_compare_exchange_n(bucket, &word,
+        (now << PAM_THROTTLE_TOKEN_BITS) | (tokens - PAM_THROTTLE_TOKEN), 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return 0;
+}
+
+
+/**
+ * This function gives a token back to a bucket
+ * @param bucket The bucket
+ * @param now The current time (milliseconds)
+ * @param rate The refill rate (tokens per hour, 0 for no limit)
+ * @param burst The bucket capacity (tokens)
+ */
+static void
+pam_throttle_refund(uint64_t *bucket, uint64_t now, int rate, int burst)
+{
+    /* The bucket words */
+    uint64_t word;
+    uint64_t tokens;
+
+    if(rate == 0)
+        return;
+
+    word = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+
+    do
+    {
+        tokens = pam_throttle_tokens(word, now, rate, burst)
+            + PAM_THROTTLE_TOKEN;
+
+        if(tokens > (uint64_t) burst * PAM_THROTTLE_TOKEN)
+            tokens = (uint64_t) burst * PAM_THROTTLE_TOKEN;
+    }
+    while(! __atomic_compare_exchange_n(bucket, &word,
+        (now << PAM_THROTTLE_TOKEN_BITS) | tokens, 0, __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE));
+}
+
+
+/**
+ * This function takes a token from the user bucket and from the global
+ * bucket before a code is sent
+ * @param config The module configuration
+ * @param user The user login
+ * @return A PAM_AURORA_THROTTLE_* code
+ */
+int
+pam_throttle_acquire(const struct pam_aurora_config *config,
+const char *user)
+{
+    /* The throttling table */
+    char path[4096];
+    struct pam_shm shm;
+    struct pam_throttle_table *table;
+    uint64_t *user_bucket;
+
+    /* The throttling state */
+    uint64_t now;
+    uint64_t wait;
+    uint64_t waited = 0;
+    struct timespec pause;
+    int status;
+
+    if(! config->throttle)
+        return PAM_AURORA_THROTTLE_OK;
+
+    /* Map the table */
+    if(pam_shm_path(config->state_dir, PAM_AURORA_THROTTLE_FILE, path,
+        sizeof(path)) != 0 || pam_shm_map(&shm, path,
+        PAM_AURORA_THROTTLE_MAGIC, PAM_AURORA_THROTTLE_VERSION,
+        sizeof(*table) + (size_t) config->throttle_slots * sizeof(uint64_t))
+        != 0)
+    {
+        syslog(LOG_AUTHPRIV | LOG_WARNING, "unable to map %s, codes are "
+            "not throttled", path);
+        return PAM_AURORA_THROTTLE_UNAVAILABLE;
+    }
+
+    table = shm.data;
+    user_bucket = &table->users[pam_shm_hash(&shm, user, strlen(user))
+        & (uint64_t) (config->throttle_slots - 1)];
+
+    for(;;)
+    {
+        /* Take a user token, then a global one */
+        now = pam_throttle_now();
+
+        if((wait = pam_throttle_take(user_bucket, now,
+            config->throttle_user_rate, config->throttle_user_burst)) == 0
+            && (wait = pam_throttle_take(&table->global, now,
+            config->throttle_global_rate, config->throttle_global_burst))
+            != 0)
+            pam_throttle_refund(user_bucket, now, config->throttle_user_rate,
+                config->throttle_user_burst);
+
+        if(wait == 0)
+        {
+            status = PAM_AURORA_THROTTLE_OK;
+            break;
+        }
+
+        /* Over the limit: reject, or wait for a token when allowed */
+        if(config->throttle_policy != PAM_AURORA_THROTTLE_WAIT
+            || waited + wait > (uint64_t) config->throttle_wait)
+        {
+            syslog(LOG_AUTHPRIV | LOG_NOTICE, "code for %s throttled", user);
+            status = PAM_AURORA_THROTTLE_LIMITED;
+            break;
+        }
+
+        pause.tv_sec = (time_t) (wait / 1000);
+        pause.tv_nsec = (long) (wait % 1000) * 1000000L;
+        nanosleep(&pause, NULL);
+        waited += wait;
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    /* Return status */
+    return status;
+}
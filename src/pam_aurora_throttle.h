@@ -0,0 +1,63 @@
+/**
+ * file:        pam_aurora_throttle.h
+ * description: Aurora code sending throttling (shared token buckets)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_THROTTLE_H
+#define PAM_AURORA_THROTTLE_H
+
+#include <stdint.h>
+#include "pam_aurora_config.h"
+
+
+/* The throttling state file */
+#define PAM_AURORA_THROTTLE_FILE "throttle.db"
+#define PAM_AURORA_THROTTLE_MAGIC "AURTHR01"
+#define PAM_AURORA_THROTTLE_VERSION 1
+
+/* The largest bucket burst (the buckets count tokens in thousandths) */
+#define PAM_AURORA_THROTTLE_BURST_MAX 1000
+
+/* The throttling results */
+#define PAM_AURORA_THROTTLE_OK 0
+#define PAM_AURORA_THROTTLE_LIMITED 1
+#define PAM_AURORA_THROTTLE_UNAVAILABLE 2
+
+/* The policies over the limit */
+#define PAM_AURORA_THROTTLE_REJECT 0
+#define PAM_AURORA_THROTTLE_WAIT 1
+
+
+/**
+ * The throttling table (the state file data)
+ *
+ * Each bucket is a single 64 bits word, updated with compare-and-swap by
+ * every process: the last refill time (milliseconds, 44 bits) and the
+ * available tokens (thousandths, 20 bits). A zeroed bucket is full. Logins
+ * are hashed into the user buckets with the file secret, logins sharing a
+ * bucket share its rate.
+ **/
+struct pam_throttle_table
+{
+    /* The global bucket, alone on its cache line */
+    uint64_t global;
+    uint64_t padding[7];
+
+    /* The user buckets */
+    uint64_t users[];
+};
+
+
+/**
+ * This function takes a token from the user bucket and from the global
+ * bucket before a code is sent
+ * @param config The module configuration
+ * @param user The user login
+ * @return A PAM_AURORA_THROTTLE_* code
+ */
+int
+pam_throttle_acquire(const struct pam_aurora_config *config,
+const char *user);
+
+#endif
@@ -0,0 +1,415 @@
+/**
+ * file:        pam_aurora_tls.c
+ * description: Aurora TLS sessions shared by the processes (resumption)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <string.h>
+#include <time.h>
+#include "pam_aurora_tls.h"
+
+#ifdef PAM_AURORA_TLS_CACHE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <openssl/ssl.h>
+#include "pam_aurora_curl.h"
+#include "pam_aurora_shm.h"
+
+
+/**
+ * The OpenSSL functions used to share the sessions
+ *
+ * They are resolved from the libcurl dependencies, once libcurl is loaded:
+ * the module is not linked with OpenSSL.
+ **/
+struct pam_tls_ssl
+{
+    int (*get_ex_new_index)(int, long, void *, CRYPTO_EX_new *,
+        CRYPTO_EX_dup *, CRYPTO_EX_free *);
+    void *(*ctx_get_ex_data)(const SSL_CTX *, int);
+    int (*ctx_set_ex_data)(SSL_CTX *, int, void *);
+    void (*ctx_set_info_callback)(SSL_CTX *, void (*)(const SSL *, int, int));
+    SSL_CTX *(*get_ssl_ctx)(const SSL *);
+    int (*in_before)(const SSL *);
+    SSL_SESSION *(*get_session)(const SSL *);
+    SSL_SESSION *(*get1_session)(SSL *);
+    int (*set_session)(SSL *, SSL_SESSION *);
+    int (*session_is_resumable)(const SSL_SESSION *);
+    long (*session_get_time)(const SSL_SESSION *);
+    long (*session_get_timeout)(const SSL_SESSION *);
+    void (*session_free)(SSL_SESSION *);
+    SSL_SESSION *(*d2i_session)(SSL_SESSION **, const unsigned char **, long);
+    int (*i2d_session)(const SSL_SESSION *, unsigned char **);
+};
+
+
+/* The OpenSSL functions, by symbol */
+static const struct
+{
+    const char *name;
+    size_t offset;
+} pam_tls_symbols[] = {
+    { "CRYPTO_get_ex_new_index",
+        offsetof(struct pam_tls_ssl, get_ex_new_index) },
+    { "SSL_CTX_get_ex_data", offsetof(struct pam_tls_ssl, ctx_get_ex_data) },
+    { "SSL_CTX_set_ex_data", offsetof(struct pam_tls_ssl, ctx_set_ex_data) },
+    { "SSL_CTX_set_info_callback",
+        offsetof(struct pam_tls_ssl, ctx_set_info_callback) },
+    { "SSL_get_SSL_CTX", offsetof(struct pam_tls_ssl, get_ssl_ctx) },
+    { "SSL_in_before", offsetof(struct pam_tls_ssl, in_before) },
+    { "SSL_get_session", offsetof(struct pam_tls_ssl, get_session) },
+    { "SSL_get1_session", offsetof(struct pam_tls_ssl, get1_session) },
+    { "SSL_set_session", offsetof(struct pam_tls_ssl, set_session) },
+    { "SSL_SESSION_is_resumable",
+        offsetof(struct pam_tls_ssl, session_is_resumable) },
+    { "SSL_SESSION_get_time", offsetof(struct pam_tls_ssl, session_get_time) },
+    { "SSL_SESSION_get_timeout",
+        offsetof(struct pam_tls_ssl, session_get_timeout) },
+    { "SSL_SESSION_free", offsetof(struct pam_tls_ssl, session_free) },
+    { "d2i_SSL_SESSION", offsetof(struct pam_tls_ssl, d2i_session) },
+    { "i2d_SSL_SESSION", offsetof(struct pam_tls_ssl, i2d_session) }
+};
+
+/* The OpenSSL functions, and the TLS context data index of the peers (-1
+   when curl does not use OpenSSL) */
+static struct pam_tls_ssl pam_tls_ssl;
+static int pam_tls_index = -1;
+static pthread_once_t pam_tls_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * This function checks the curl TLS backend and resolves the OpenSSL
+ * functions, once per process (libcurl is loaded)
+ */
+static void
+pam_tls_init(void)
+{
+    /* The curl build */
+    const curl_version_info_data *version =
+        pam_curl.version_info(CURLVERSION_NOW);
+    void *symbol;
+    size_t i;
+
+    /* The sessions are only shared with the OpenSSL backend */
+    if(version->ssl_version == NULL
+        || strncmp(version->ssl_version, "OpenSSL/", 8) != 0)
+        return;
+
+    for(i = 0; i < sizeof(pam_tls_symbols) / sizeof(pam_tls_symbols[0]); i++)
+    {
+        if((symbol = dlsym(pam_curl.library, pam_tls_symbols[i].name))
+            == NULL)
+            return;
+
+        *(void **) ((char *) &pam_tls_ssl + pam_tls_symbols[i].offset) =
+            symbol;
+    }
+
+    pam_tls_index = pam_tls_ssl.get_ex_new_index(CRYPTO_EX_INDEX_SSL_CTX, 0,
+        NULL, NULL, NULL, NULL);
+}
+
+
+/**
+ * This function checks whether the TLS sessions are shared
+ * @param config The module configuration
+ * @return Non-zero when they are
+ */
+static int
+pam_tls_enabled(const struct pam_aurora_config *config)
+{
+    return config->mail_tls_cache
+        && pthread_once(&pam_tls_once, pam_tls_init) == 0
+        && pam_tls_index >= 0;
+}
+
+
+/**
+ * This function maps the TLS sessions table and finds the slot set of a
+ * mail server
+ * @param shm The mapping destination
+ * @param config The module configuration
+ * @param url The mail server URL
+ * @param hash The mail server URL hash destination
+ * @return The slot set, or NULL when the sessions are not shared
+ */
+static struct pam_tls_slot *
+pam_tls_open(struct pam_shm *shm, const struct pam_aurora_config *config,
+const char *url, uint64_t *hash)
+{
+    /* The table path */
+    char path[4096];
+
+    if(! pam_tls_enabled(config)
+        || pam_shm_path(config->state_dir, PAM_AURORA_TLS_FILE, path,
+            sizeof(path)) != 0
+        || pam_shm_map(shm, path, PAM_AURORA_TLS_MAGIC,
+            PAM_AURORA_TLS_VERSION,
+            PAM_AURORA_TLS_SLOTS * sizeof(struct pam_tls_slot)) != 0)
+        return NULL;
+
+    *hash = pam_shm_hash(shm, url, strlen(url));
+
+    /* Return the slot set */
+    return (struct pam_tls_slot *) shm->data + (*hash
+        & (PAM_AURORA_TLS_SLOTS / PAM_AURORA_TLS_WAYS - 1))
+        * PAM_AURORA_TLS_WAYS;
+}
+
+
+/**
+ * Handshake callback, resuming the session of the peer
+ * @param ssl The connection
+ * @param where The handshake event
+ * @param ret The event value
+ */
+static void
+pam_tls_resume(const SSL *ssl, int where, int ret)
+{
+    /* The peer */
+    struct pam_tls_peer *peer;
+
+    /* Only before the client hello, unless curl resumes a session itself */
+    if(! (where & SSL_CB_HANDSHAKE_START) || ! pam_tls_ssl.in_before(ssl)
+        || pam_tls_ssl.get_session(ssl) != NULL)
+        return;
+
+    peer = pam_tls_ssl.ctx_get_ex_data(pam_tls_ssl.get_ssl_ctx(ssl),
+        pam_tls_index);
+
+    if(peer != NULL && peer->session != NULL)
+        pam_tls_ssl.set_session((SSL *) ssl, peer->session);
+}
+
+
+/**
+ * TLS context function, attaching the peer to a new connection
+ * @param curl The mail server handle
+ * @param ssl_ctx The connection TLS context
+ * @param peer The TLS session of the handle
+ * @return The curl return code
+ */
+static CURLcode
+pam_tls_context(CURL *curl, void *ssl_ctx, void *peer)
+{
+    /* A connection without resumption still works */
+    if(pam_tls_ssl.ctx_set_ex_data(ssl_ctx, pam_tls_index, peer) == 1)
+        pam_tls_ssl.ctx_set_info_callback(ssl_ctx, pam_tls_resume);
+
+    return CURLE_OK;
+}
+
+
+/**
+ * This function prepares a mail server transfer to resume the TLS session
+ * shared by the other processes
+ * @param peer The TLS session of the handle
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_prepare(struct pam_tls_peer *peer, CURL *curl,
+const struct pam_aurora_config *config, const char *url)
+{
+    /* The table */
+    struct pam_shm shm;
+    struct pam_tls_slot *set;
+    uint64_t hash;
+    uint32_t sequence;
+    int64_t now = (int64_t) time(NULL);
+    int i;
+
+    /* The serialized session */
+    unsigned char session[PAM_AURORA_TLS_SESSION_MAX];
+    const unsigned char *cursor = session;
+    uint32_t length = 0;
+
+    pam_tls_release(peer);
+
+    if((set = pam_tls_open(&shm, config, url, &hash)) == NULL)
+    {
+        pam_curl.easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, NULL);
+        return;
+    }
+
+    for(i = 0; i < PAM_AURORA_TLS_WAYS && length == 0; i++)
+    {
+        /* Skip the slots being written */
+        if((sequence = __atomic_load_n(&set[i].sequence, __ATOMIC_ACQUIRE))
+            & 1)
+            continue;
+
+        if(set[i].hash == hash && set[i].expires > now
+            && (length = set[i].length) <= sizeof(session))
+            memcpy(session, set[i].session, length);
+        else
+            length = 0;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&set[i].sequence, __ATOMIC_RELAXED) != sequence)
+            length = 0;
+    }
+
+    /* Properly unmap the table */
+    pam_shm_unmap(&shm);
+
+    if(length > 0)
+        peer->session = pam_tls_ssl.d2i_session(NULL, &cursor,
+            (long) length);
+
+    /* Erase the session secrets */
+    memset(session, 0, length);
+
+    /* Attach the peer to the next connection of the handle */
+    pam_curl.easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, pam_tls_context);
+    pam_curl.easy_setopt(curl, CURLOPT_SSL_CTX_DATA, peer);
+}
+
+
+/**
+ * This function shares the TLS session of a transfer, once the mail server
+ * accepted the email
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_keep(CURL *curl, const struct pam_aurora_config *config,
+const char *url)
+{
+    /* The connection */
+    struct curl_tlssessioninfo *info = NULL;
+    SSL_SESSION *ssl_session;
+
+    /* The table */
+    struct pam_shm shm;
+    struct pam_tls_slot *set;
+    struct pam_tls_slot *victim = NULL;
+    uint64_t hash;
+    uint32_t sequence;
+    int i;
+
+    /* The serialized session */
+    unsigned char session[PAM_AURORA_TLS_SESSION_MAX];
+    unsigned char *cursor = session;
+    int64_t expires;
+    int length;
+
+    if(! pam_tls_enabled(config)
+        || pam_curl.easy_getinfo(curl, CURLINFO_TLS_SSL_PTR, &info) != CURLE_OK
+        || info == NULL || info->backend != CURLSSLBACKEND_OPENSSL
+        || info->internals == NULL
+        || (ssl_session = pam_tls_ssl.get1_session(info->internals)) == NULL)
+        return;
+
+    /* Serialize the session (a session too large is not shared) */
+    if(! pam_tls_ssl.session_is_resumable(ssl_session)
+        || (length = pam_tls_ssl.i2d_session(ssl_session, NULL)) <= 0
+        || length > (int) sizeof(session)
+        || pam_tls_ssl.i2d_session(ssl_session, &cursor) != length)
+    {
+        pam_tls_ssl.session_free(ssl_session);
+        return;
+    }
+
+    expires = (int64_t) pam_tls_ssl.session_get_time(ssl_session)
+        + pam_tls_ssl.session_get_timeout(ssl_session);
+    pam_tls_ssl.session_free(ssl_session);
+
+    if((set = pam_tls_open(&shm, config, url, &hash)) != NULL)
+    {
+        /* Replace the session of the mail server, or the one expiring
+           first */
+        for(i = 0; i < PAM_AURORA_TLS_WAYS; i++)
+        {
+            if(set[i].hash == hash)
+            {
+                victim = &set[i];
+                break;
+            }
+
+            if(victim == NULL || set[i].expires < victim->expires)
+                victim = &set[i];
+        }
+
+        /* Write the slot (a busy slot is left to its writer) */
+        if((sequence = pam_shm_lock(&victim->sequence, &victim->writer)) != 0)
+        {
+            victim->hash = hash;
+            victim->expires = expires;
+            victim->length = (uint32_t) length;
+            memcpy(victim->session, session, (size_t) length);
+
+            pam_shm_unlock(&victim->sequence, sequence);
+        }
+
+        /* Properly unmap the table */
+        pam_shm_unmap(&shm);
+    }
+
+    /* Erase the session secrets */
+    memset(session, 0, (size_t) length);
+}
+
+
+/**
+ * This function frees the TLS session of a handle
+ * @param peer The TLS session of the handle
+ */
+void
+pam_tls_release(struct pam_tls_peer *peer)
+{
+    if(peer->session != NULL)
+        pam_tls_ssl.session_free(peer->session);
+
+    peer->session = NULL;
+}
+
+#else
+
+
+/**
+ * This function prepares a mail server transfer to resume the TLS session
+ * shared by the other processes (built without PAM_AURORA_TLS_CACHE)
+ * @param peer The TLS session of the handle
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_prepare(struct pam_tls_peer *peer, CURL *curl,
+const struct pam_aurora_config *config, const char *url)
+{
+}
+
+
+/**
+ * This function shares the TLS session of a transfer, once the mail server
+ * accepted the email (built without PAM_AURORA_TLS_CACHE)
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_keep(CURL *curl, const struct pam_aurora_config *config,
+const char *url)
+{
+}
+
+
+/**
+ * This function frees the TLS session of a handle (built without
+ * PAM_AURORA_TLS_CACHE)
+ * @param peer The TLS session of the handle
+ */
+void
+pam_tls_release(struct pam_tls_peer *peer)
+{
+    peer->session = NULL;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * file:        pam_aurora_tls.h
+ * description: Aurora TLS sessions shared by the processes (resumption)
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_TLS_H
+#define PAM_AURORA_TLS_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+#include "pam_aurora_config.h"
+
+
+/* The TLS sessions state file */
+#define PAM_AURORA_TLS_FILE "tls.db"
+#define PAM_AURORA_TLS_MAGIC "AURTLS01"
+#define PAM_AURORA_TLS_VERSION 1
+
+/* The slots, by sets of PAM_AURORA_TLS_WAYS */
+#define PAM_AURORA_TLS_SLOTS 64
+#define PAM_AURORA_TLS_WAYS 4
+
+/* The largest serialized session (with the server certificate) */
+#define PAM_AURORA_TLS_SESSION_MAX 4064
+
+
+/**
+ * A TLS session slot
+ *
+ * The slot holds the last resumable session of a mail server, serialized.
+ * Slots are updated under a sequence lock (see pam_shm_lock). The file
+ * holds session secrets: like every state file, it is only readable by its
+ * owner.
+ **/
+struct pam_tls_slot
+{
+    /* The sequence (odd while written) and the writer process */
+    uint32_t sequence;
+    int32_t writer;
+
+    /* The mail server URL hash */
+    uint64_t hash;
+
+    /* The session expiry (seconds since the epoch) */
+    int64_t expires;
+
+    /* The serialized session */
+    uint32_t length;
+    uint32_t reserved;
+    unsigned char session[PAM_AURORA_TLS_SESSION_MAX];
+};
+
+
+/**
+ * The TLS session of a mail server handle
+ *
+ * The peer must outlive the connections of the handle, as it is reached
+ * from their TLS context.
+ **/
+struct pam_tls_peer
+{
+    /* The session to resume (SSL_SESSION, NULL when none) */
+    void *session;
+};
+
+
+/**
+ * This function prepares a mail server transfer to resume the TLS session
+ * shared by the other processes
+ * @param peer The TLS session of the handle
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_prepare(struct pam_tls_peer *peer, CURL *curl,
+const struct pam_aurora_config *config, const char *url);
+
+
+/**
+ * This function shares the TLS session of a transfer, once the mail server
+ * accepted the email
+ * @param curl The mail server handle
+ * @param config The module configuration
+ * @param url The mail server URL
+ */
+void
+pam_tls_keep(CURL *curl, const struct pam_aurora_config *config,
+const char *url);
+
+
+/**
+ * This function frees the TLS session of a handle
+ * @param peer The TLS session of the handle
+ */
+void
+pam_tls_release(struct pam_tls_peer *peer);
+
+#endif
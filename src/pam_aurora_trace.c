@@ -0,0 +1,242 @@
+/**
+ * file:        pam_aurora_trace.c
+ * description: Aurora per-authentication latency traces
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "pam_aurora_curl.h"
+#include "pam_aurora_trace.h"
+
+
+/* The phase names, in the record */
+static const char *pam_trace_phases[PAM_AURORA_PHASE_COUNT] = {
+    "get_user", "directory_index", "directory_text", "config", "random",
+    "delivery", "prompt", "wait", "verify", "throttle", "trust",
+    "directory_log"
+};
+
+/* The curl timings, and their names in the record */
+static const CURLINFO pam_trace_curl_infos[PAM_AURORA_SMTP_COUNT] = {
+    CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T,
+    CURLINFO_APPCONNECT_TIME_T, CURLINFO_PRETRANSFER_TIME_T,
+    CURLINFO_STARTTRANSFER_TIME_T, CURLINFO_TOTAL_TIME_T
+};
+static const char *pam_trace_curl_names[PAM_AURORA_SMTP_COUNT] = {
+    "smtp_dns", "smtp_connect", "smtp_tls", "smtp_pretransfer",
+    "smtp_starttransfer", "smtp_total"
+};
+
+
+/**
+ * This function returns the monotonic time of a trace
+ * @param trace The trace
+ * @return The time in microseconds, 0 when tracing is disabled
+ */
+uint64_t
+pam_trace_now(const struct pam_aurora_trace *trace)
+{
+    /* The current time */
+    struct timespec now;
+
+    if(trace == NULL || trace->sink == NULL)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/**
+ * This function starts the trace of an authentication
+ * @param trace The trace
+ * @param sink The trace sink: a file path, "syslog", or NULL to disable
+ *             tracing
+ */
+void
+pam_trace_start(struct pam_aurora_trace *trace, const char *sink)
+{
+    trace->sink = sink;
+
+    /* The statistics are gathered anyway */
+    pam_stats_start(&trace->stats);
+
+    /* Nothing else is recorded when disabled */
+    if(sink == NULL)
+        return;
+
+    memset(trace->phase, 0, sizeof(trace->phase));
+    memset(trace->smtp, 0, sizeof(trace->smtp));
+    trace->phases = 0;
+    trace->send = 0;
+    trace->smtp_traced = 0;
+    trace->start = trace->last = pam_trace_now(trace);
+}
+
+
+/**
+ * This function records the end of a phase
+ * @param trace The trace
+ * @param phase The phase (PAM_AURORA_PHASE_*)
+ */
+void
+pam_trace_mark(struct pam_aurora_trace *trace, int phase)
+{
+    /* The phase end */
+    uint64_t now;
+
+    if(trace->sink == NULL)
+        return;
+
+    now = pam_trace_now(trace);
+    trace->phase[phase] += (uint32_t) (now - trace->last);
+    trace->phases |= 1U << phase;
+    trace->last = now;
+}
+
+
+/**
+ * This function records the curl timings of the SMTP transfer
+ * @param trace The trace
+ * @param curl The curl handle, after the transfer
+ */
+void
+pam_trace_curl(struct pam_aurora_trace *trace, CURL *curl)
+{
+    /* The curl timing */
+    curl_off_t timing;
+    int i;
+
+    if(trace == NULL || trace->sink == NULL)
+        return;
+
+    for(i = 0; i < PAM_AURORA_SMTP_COUNT; i++)
+    {
+        if(pam_curl.easy_getinfo(curl, pam_trace_curl_infos[i], &timing)
+            == CURLE_OK)
+            trace->smtp[i] = (uint32_t) timing;
+    }
+
+    trace->smtp_traced = 1;
+}
+
+
+/**
+ * This function appends a field to a trace record, which is truncated once
+ * full
+ * @param record The record
+ * @param size The record size
+ * @param length The record length, updated
+ * @param format The field format
+ */
+static void
+pam_trace_append(char *record, size_t size, size_t *length,
+const char *format, ...)
+{
+    /* The field */
+    va_list arguments;
+    int written;
+
+    /* The record is full */
+    if(*length >= size - 1)
+        return;
+
+    va_start(arguments, format);
+    written = vsnprintf(record + *length, size - *length, format, arguments);
+    va_end(arguments);
+
+    if(written < 0)
+        return;
+
+    *length += (size_t) written;
+
+    if(*length >= size)
+        *length = size - 1;
+}
+
+
+/**
+ * This function writes the trace record to its sink
+ * @param trace The trace
+ * @param user The user login (may be NULL)
+ * @param status The authentication PAM return code
+ */
+void
+pam_trace_emit(struct pam_aurora_trace *trace, const char *user, int status)
+{
+    /* The record */
+    char record[1024];
+    char safe_user[64];
+    size_t length;
+    int i;
+
+    /* The file sink */
+    char line[sizeof(record) + 64];
+    int sink_fd;
+    struct timespec now;
+
+    if(trace->sink == NULL)
+        return;
+
+    /* Keep the record on one line, whatever the login */
+    for(i = 0; user != NULL && user[i] != '\0'
+        && i < (int) sizeof(safe_user) - 1; i++)
+        safe_user[i] = (user[i] > ' ' && user[i] < 127 && user[i] != '"')?
+            user[i]: '?';
+
+    safe_user[i] = '\0';
+
+    /* Format the record (logfmt, microseconds) */
+    length = 0;
+    record[0] = '\0';
+    pam_trace_append(record, sizeof(record), &length,
+        "user=%s status=%d total=%u", safe_user, status,
+        (uint32_t) (pam_trace_now(trace) - trace->start));
+
+    for(i = 0; i < PAM_AURORA_PHASE_COUNT; i++)
+        if(trace->phases & (1U << i))
+            pam_trace_append(record, sizeof(record), &length, " %s=%u",
+                pam_trace_phases[i], trace->phase[i]);
+
+    if(trace->send > 0)
+        pam_trace_append(record, sizeof(record), &length, " send=%u",
+            trace->send);
+
+    for(i = 0; trace->smtp_traced && i < PAM_AURORA_SMTP_COUNT; i++)
+        pam_trace_append(record, sizeof(record), &length, " %s=%u",
+            pam_trace_curl_names[i], trace->smtp[i]);
+
+    /* Log to syslog */
+    if(strcmp(trace->sink, PAM_AURORA_TRACE_SYSLOG) == 0)
+    {
+        syslog(LOG_AUTHPRIV | LOG_INFO, "aurora-trace %s", record);
+        return;
+    }
+
+    /* Or append the timestamped record to the sink file, at once */
+    if((sink_fd = open(trace->sink, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+        0600)) < 0)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    length = (size_t) snprintf(line, sizeof(line), "ts=%ld.%06ld pid=%d %s\n",
+        (long) now.tv_sec, now.tv_nsec / 1000, (int) getpid(), record);
+
+    if(length >= sizeof(line))
+        length = sizeof(line) - 1;
+
+    if(write(sink_fd, line, length) < 0)
+        syslog(LOG_AUTHPRIV | LOG_WARNING, "unable to write trace to %s",
+            trace->sink);
+
+    close(sink_fd);
+}
@@ -0,0 +1,121 @@
+/**
+ * file:        pam_aurora_trace.h
+ * description: Aurora per-authentication latency traces
+ * authors:     Cyrille TOULET <cyrille.toulet@linux.com>
+ */
+
+#ifndef PAM_AURORA_TRACE_H
+#define PAM_AURORA_TRACE_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+#include "pam_aurora_stats.h"
+
+
+/* The syslog trace sink (trace= module argument) */
+#define PAM_AURORA_TRACE_SYSLOG "syslog"
+
+/* The authentication phases */
+#define PAM_AURORA_PHASE_USER 0
+#define PAM_AURORA_PHASE_DIRECTORY_INDEX 1
+#define PAM_AURORA_PHASE_DIRECTORY_TEXT 2
+#define PAM_AURORA_PHASE_CONFIG 3
+#define PAM_AURORA_PHASE_RANDOM 4
+#define PAM_AURORA_PHASE_DELIVERY 5
+#define PAM_AURORA_PHASE_PROMPT 6
+#define PAM_AURORA_PHASE_WAIT 7
+#define PAM_AURORA_PHASE_VERIFY 8
+#define PAM_AURORA_PHASE_THROTTLE 9
+#define PAM_AURORA_PHASE_TRUST 10
+#define PAM_AURORA_PHASE_DIRECTORY_LOG 11
+#define PAM_AURORA_PHASE_COUNT 12
+
+/* The SMTP timings reported by curl */
+#define PAM_AURORA_SMTP_DNS 0
+#define PAM_AURORA_SMTP_CONNECT 1
+#define PAM_AURORA_SMTP_TLS 2
+#define PAM_AURORA_SMTP_PRETRANSFER 3
+#define PAM_AURORA_SMTP_STARTTRANSFER 4
+#define PAM_AURORA_SMTP_TOTAL 5
+#define PAM_AURORA_SMTP_COUNT 6
+
+
+/**
+ * The trace of one authentication
+ *
+ * Each phase duration is the time elapsed since the previous phase ended,
+ * in microseconds. A disabled trace records nothing, but the statistics of
+ * the authentication, which are always gathered.
+ **/
+struct pam_aurora_trace
+{
+    /* The trace sink (NULL when tracing is disabled) */
+    const char *sink;
+
+    /* The authentication start and the last phase end (microseconds) */
+    uint64_t start;
+    uint64_t last;
+
+    /* The phase durations, and the phases reached (bit mask) */
+    uint32_t phase[PAM_AURORA_PHASE_COUNT];
+    uint32_t phases;
+
+    /* The code delivery duration (the delivery may run in background) */
+    uint32_t send;
+
+    /* The curl timings, from the transfer start (microseconds) */
+    uint32_t smtp[PAM_AURORA_SMTP_COUNT];
+    int smtp_traced;
+
+    /* The authentication statistics (see pam_stats_commit) */
+    struct pam_stats stats;
+};
+
+
+/**
+ * This function starts the trace of an authentication
+ * @param trace The trace
+ * @param sink The trace sink: a file path, "syslog", or NULL to disable
+ *             tracing
+ */
+void
+pam_trace_start(struct pam_aurora_trace *trace, const char *sink);
+
+
+/**
+ * This function records the end of a phase
+ * @param trace The trace
+ * @param phase The phase (PAM_AURORA_PHASE_*)
+ */
+void
+pam_trace_mark(struct pam_aurora_trace *trace, int phase);
+
+
+/**
+ * This function returns the monotonic time of a trace
+ * @param trace The trace
+ * @return The time in microseconds, 0 when tracing is disabled
+ */
+uint64_t
+pam_trace_now(const struct pam_aurora_trace *trace);
+
+
+/**
+ * This function records the curl timings of the SMTP transfer
+ * @param trace The trace
+ * @param curl The curl handle, after the transfer
+ */
+void
+pam_trace_curl(struct pam_aurora_trace *trace, CURL *curl);
+
+
+/**
+ * This function writes the trace record to its sink
+ * @param trace The trace
+ * @param user The user login (may be NULL)
+ * @param status The authentication PAM return code
+ */
+void
+pam_trace_emit(struct pam_aurora_trace *trace, const char *user, int status);
+
+#endif